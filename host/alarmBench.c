@@ -0,0 +1,436 @@
+/* MQTT Alarm Controller host build: input chatter replay benchmark
+
+   Replays input edge traces through the real debounce (updateInputs)
+   and publish (processInputChanges, sendInputState) path, with the
+   simulated broker standing in for the MQTT client, and reports:
+
+     - edges replayed per second of wall time and CPU time per edge
+     - false transitions: published changes to a level held for less
+       than DEBOUNCE_TIME_US
+     - missed transitions: levels held for at least the hold time that
+       were never published. By default the hold time is the longest a
+       level can take to be seen by the poll then debounce scheme: up
+       to one poll for the edge to be noticed, then the first settling
+       poll (DEBOUNCE_POLL_MS) after DEBOUNCE_TIME_US.
+     - coalesced: transitions not published because the input changed
+       again within the configured minimum publish interval, or because
+       the last published state already showed them
+     - tolerated: other publishes of a level held for at least
+       DEBOUNCE_TIME_US, e.g. the return to idle after a false
+       transition
+     - edge to publish latency in virtual time, mean, p99 and worst,
+       to the controller's publish, queued or sent, so it's the input
+       path's and not the broker connection's
+
+   Each trace is replayed twice, quietly and then in a reconnect storm:
+   the broker connection is dropped every --storm-ms, 1 s by default,
+   and restored BENCH_STORM_DOWN_US later, the way the diagnostics
+   stress_reconnect command does on the device. Virtual time has no
+   CPU contention, so this checks the controller's own handling of the
+   drops and reconnects, e.g. the states and discovery it publishes
+   again, doesn't hold up the inputs. --storm-ms 0 skips it.
+
+   Trace files (.trace) are text, one edge per line:
+
+     # comment
+     # max_false <n>
+     <time us> <input 1-6> <level 0|1>
+
+   Times are from the start of the replay and must not go backwards.
+   Inputs start at level 0 (sensor loop closed) unless the trace sets
+   them at time 0. bench/makeTraces.py generates the standard
+   scenarios into the build directory. Exits non-zero if a trace
+   can't be read, has missed transitions, has more false transitions
+   than its max_false line allows, or has a higher latency p99 in the
+   storm than in the quiet replay.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "hostController.h"
+
+#define BENCH_TAIL_US S_TO_uS(1)        // Run on after the last edge so everything settles
+#define BENCH_MAX_PUBLISHES 200000
+#define BENCH_STORM_DOWN_US 100000      // Each drop's reconnect, TCP, TLS and CONNECT
+
+typedef struct {
+    int64_t timeUs;
+    int input;
+    int level;
+} Edge;
+
+typedef struct {
+    int64_t timeUs;
+    int level;
+} Transition;
+
+typedef struct {
+    int edges;
+    int references;
+    int published;
+    int matched;
+    int falseTransitions;
+    int missed;
+    int coalesced;
+    int tolerated;
+    int maxFalse;                       // From the trace's max_false line, -1 for no limit
+    int drops;                          // Broker connections dropped in the storm
+    double wallS;
+    double cpuS;
+    int64_t loops;
+    int64_t* latencies;
+    int numLatencies;
+} BenchResult;
+
+static Transition published[NUM_INPUTS][BENCH_MAX_PUBLISHES / NUM_INPUTS];
+static int numPublished[NUM_INPUTS];
+
+static int64_t pollUs = HOST_LOOP_PERIOD_MS * 1000;
+static int64_t settleUs = DEBOUNCE_POLL_MS * 1000;     // The poll while an input is settling
+static int64_t holdUs = 0;
+static int64_t stormEveryUs = S_TO_uS(1);
+
+static double cpuSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double wallSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/******************************************************************
+ *
+ * Stand in publisher. Records input state publishes as levels, as
+ * the controller makes them. One of the level already recorded
+ * carries no transition, e.g. the states sent again after a
+ * reconnect, so it's left out.
+ *
+*******************************************************************/
+static void recordPublish(const char* topic, const char* payload, int len, int qos, int retain)
+{
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        char stateTopic[160];
+        snprintf(stateTopic, sizeof(stateTopic), "homeassistant/binary_sensor/%s/%s/state", config.Name, config.inputs[i].inputName);
+        if (!config.inputs[i].active || strcmp(topic, stateTopic) != 0) { continue; }
+        bool on = len == 2 && strncmp(payload, "ON", 2) == 0;
+        int level = on == config.inputs[i].normallyClosed ? 1 : 0;
+        if (numPublished[i] > 0 && published[i][numPublished[i] - 1].level == level) { return; }
+        if (numPublished[i] < BENCH_MAX_PUBLISHES / NUM_INPUTS) {
+            published[i][numPublished[i]++] = (Transition){ Hal_TimeUs(), level };
+        }
+        return;
+    }
+}
+
+static Edge* loadTrace(const char* path, int* count, int* maxFalse)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { perror(path); return NULL; }
+    int capacity = 1024;
+    Edge* edges = malloc(capacity * sizeof(Edge));
+    char line[256];
+    int lineNumber = 0;
+    *count = 0;
+    *maxFalse = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNumber++;
+        long long t;
+        int input, level;
+        char* p = line + strspn(line, " \t");
+        if (sscanf(p, "# max_false %d", maxFalse) == 1) { continue; }
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') { continue; }
+        if (sscanf(p, "%lld %d %d", &t, &input, &level) != 3 || input < 1 || input > NUM_INPUTS || t < 0
+            || (*count > 0 && t < edges[*count - 1].timeUs)) {
+            fprintf(stderr, "%s:%d: bad edge \"%s\"\n", path, lineNumber, strtok(p, "\r\n"));
+            fclose(f);
+            free(edges);
+            return NULL;
+        }
+        if (*count == capacity) { capacity *= 2; edges = realloc(edges, capacity * sizeof(Edge)); }
+        edges[(*count)++] = (Edge){ t, input - 1, level ? 1 : 0 };
+    }
+    fclose(f);
+    return edges;
+}
+
+/******************************************************************
+ *
+ * The level of an input over time, as (start, level) segments
+ *
+*******************************************************************/
+static int segmentsFor(const Edge* edges, int count, int input, Transition* segments)
+{
+    int n = 0;
+    segments[n++] = (Transition){ 0, 0 };
+    for (int i = 0; i < count; i++) {
+        if (edges[i].input != input) { continue; }
+        if (edges[i].timeUs == 0) { segments[0].level = edges[i].level; continue; }
+        if (edges[i].level == segments[n - 1].level) { continue; }
+        segments[n++] = (Transition){ edges[i].timeUs, edges[i].level };
+    }
+    return n;
+}
+
+static int64_t segmentLength(const Transition* segments, int n, int i, int64_t endUs)
+{
+    return (i + 1 < n ? segments[i + 1].timeUs : endUs) - segments[i].timeUs;
+}
+
+/******************************************************************
+ *
+ * Compare what was published for one input with the trace
+ *
+*******************************************************************/
+static void score(const Edge* edges, int count, int input, int64_t endUs, BenchResult* r)
+{
+    Transition* segments = malloc((count + 1) * sizeof(Transition));
+    Transition* refs = malloc((count + 1) * sizeof(Transition));
+    int numSegments = segmentsFor(edges, count, input, segments);
+
+    // Reference transitions: a new level held for at least the hold time
+    int numRefs = 0;
+    int refLevel = segments[0].level;
+    for (int i = 1; i < numSegments; i++) {
+        if (segments[i].level != refLevel && segmentLength(segments, numSegments, i, endUs) >= holdUs) {
+            refs[numRefs++] = segments[i];
+            refLevel = segments[i].level;
+        }
+    }
+    r->references += numRefs;
+
+    // Match each publish to the latest unmatched reference of the same level before it
+    bool* matched = calloc(numRefs + 1, sizeof(bool));
+    int next = 0;
+    int seg = 0;
+    for (int p = 0; p < numPublished[input]; p++) {
+        Transition* o = &published[input][p];
+        int best = -1;
+        while (next < numRefs && refs[next].timeUs <= o->timeUs) {
+            if (refs[next].level == o->level) { best = next; }
+            next++;
+        }
+        r->published++;
+        if (best >= 0) {
+            matched[best] = true;
+            r->matched++;
+            r->latencies[r->numLatencies++] = o->timeUs - refs[best].timeUs;
+            continue;
+        }
+
+        // Not a reference transition. Fine if the level was held for at least the debounce time.
+        while (seg + 1 < numSegments && segments[seg + 1].timeUs <= o->timeUs) { seg++; }
+        if (segments[seg].level == o->level && segmentLength(segments, numSegments, seg, endUs) >= DEBOUNCE_TIME_US) {
+            r->tolerated++;
+        } else {
+            r->falseTransitions++;
+        }
+    }
+
+    // Unpublished references were coalesced if they were overtaken within the minimum
+    // publish interval, or if the last state published already showed them
+    int64_t coalesceUs = (int64_t)config.minPublishIntervalMs * 1000 + holdUs;
+    int shown = -1;
+    for (int i = 0; i < numRefs; i++) {
+        while (shown + 1 < numPublished[input] && published[input][shown + 1].timeUs <= refs[i].timeUs) { shown++; }
+        if (matched[i]) { continue; }
+        if (config.minPublishIntervalMs > 0 &&
+            ((i + 1 < numRefs && refs[i + 1].timeUs - refs[i].timeUs < coalesceUs) ||
+             (shown >= 0 && published[input][shown].level == refs[i].level))) {
+            r->coalesced++;
+        } else {
+            r->missed++;
+        }
+    }
+    free(matched);
+    free(segments);
+    free(refs);
+}
+
+static int compareLatency(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/******************************************************************
+ *
+ * Replay one trace from a fresh start of the controller, dropping
+ * the broker connection every stormEveryUs if it's a storm
+ *
+*******************************************************************/
+static bool runTrace(const char* path, const char* storage, bool storm, BenchResult* r)
+{
+    int count, maxFalse;
+    Edge* edges = loadTrace(path, &count, &maxFalse);
+    if (edges == NULL) { return false; }
+
+    HostHal_Reset();
+    HostMqtt_Reset();
+    HostMqtt_SetSendCallback(NULL);
+    memset(numPublished, 0, sizeof(numPublished));
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetPin(hostInputPins[i], 0); }
+    int e = 0;
+    while (e < count && edges[e].timeUs == 0) { HostHal_SetPin(hostInputPins[edges[e].input], edges[e].level); e++; }
+    HostController_Start(storage);
+    HostMqtt_Connect();
+    HostMqtt_Poll();
+    HostMqtt_SetSendCallback(recordPublish);
+
+    int64_t endUs = (count > 0 ? edges[count - 1].timeUs : 0) + BENCH_TAIL_US;
+    memset(r, 0, sizeof(*r));
+    r->edges = count;
+    r->maxFalse = maxFalse;
+    int64_t dropAt = storm ? Hal_TimeUs() + stormEveryUs : INT64_MAX;
+    int64_t restoreAt = INT64_MAX;
+    double wallStart = wallSeconds();
+    double cpuStart = cpuSeconds();
+    while (Hal_TimeUs() <= endUs) {
+        while (e < count && edges[e].timeUs <= Hal_TimeUs()) {
+            HostHal_SetPin(hostInputPins[edges[e].input], edges[e].level);
+            e++;
+        }
+        if (Hal_TimeUs() >= dropAt) {
+            HostMqtt_Disconnect();
+            r->drops++;
+            restoreAt = Hal_TimeUs() + BENCH_STORM_DOWN_US;
+            dropAt += stormEveryUs;
+        }
+        if (Hal_TimeUs() >= restoreAt) {
+            HostMqtt_Connect();
+            restoreAt = INT64_MAX;
+        }
+        HostController_Loop();
+        r->loops++;
+        HostHal_Advance(InputOutput_Settling(hostInputs, NUM_INPUTS) ? settleUs : pollUs);
+    }
+    r->cpuS = cpuSeconds() - cpuStart;
+    r->wallS = wallSeconds() - wallStart;
+
+    int totalPublished = 0;
+    for (int i = 0; i < NUM_INPUTS; i++) { totalPublished += numPublished[i]; }
+    r->latencies = malloc((totalPublished + 1) * sizeof(int64_t));
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        if (config.inputs[i].active) { score(edges, count, i, endUs, r); }
+    }
+    qsort(r->latencies, r->numLatencies, sizeof(int64_t), compareLatency);
+    free(edges);
+    return true;
+}
+
+static int64_t latencyP99(const BenchResult* r)
+{
+    return r->numLatencies > 0 ? r->latencies[(r->numLatencies * 99) / 100] : 0;
+}
+
+static void report(const char* path, const BenchResult* r, bool json)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path, r->drops > 0 ? " storm" : "");
+    double mean = 0;
+    for (int i = 0; i < r->numLatencies; i++) { mean += r->latencies[i]; }
+    if (r->numLatencies > 0) { mean /= r->numLatencies; }
+    int64_t p99 = latencyP99(r);
+    int64_t worst = r->numLatencies > 0 ? r->latencies[r->numLatencies - 1] : 0;
+    double edgesPerS = r->wallS > 0 ? r->edges / r->wallS : 0;
+    double cpuPerEdgeUs = r->edges > 0 ? r->cpuS * 1e6 / r->edges : 0;
+    double cpuPerLoopUs = r->loops > 0 ? r->cpuS * 1e6 / r->loops : 0;
+
+    if (json) {
+        printf("{\"trace\": \"%s\", \"drops\": %d, \"edges\": %d, \"reference_transitions\": %d, \"published\": %d, "
+            "\"false\": %d, \"missed\": %d, \"coalesced\": %d, \"tolerated\": %d, \"edges_per_s\": %.0f, \"cpu_per_edge_us\": %.3f, "
+            "\"cpu_per_loop_us\": %.3f, \"latency_mean_us\": %.0f, \"latency_p99_us\": %lld, \"latency_max_us\": %lld}\n",
+            name, r->drops, r->edges, r->references, r->published, r->falseTransitions, r->missed, r->coalesced, r->tolerated,
+            edgesPerS, cpuPerEdgeUs, cpuPerLoopUs, mean, (long long)p99, (long long)worst);
+    } else {
+        printf("%-30s %7d %6d %6d %6d %6d %6d %6d %11.0f %9.3f %9.3f %9.1f %9.1f %9.1f\n",
+            name, r->edges, r->references, r->published, r->falseTransitions, r->missed, r->coalesced, r->tolerated,
+            edgesPerS, cpuPerEdgeUs, cpuPerLoopUs, mean / 1000.0, p99 / 1000.0, worst / 1000.0);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* storage = "host_storage";
+    bool json = false;
+    bool failed = false;
+    int first = argc;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) { json = true; }
+        else if (strcmp(argv[i], "--poll-us") == 0 && i + 1 < argc) { pollUs = atoll(argv[++i]); }
+        else if (strcmp(argv[i], "--settle-us") == 0 && i + 1 < argc) { settleUs = atoll(argv[++i]); }
+        else if (strcmp(argv[i], "--hold-us") == 0 && i + 1 < argc) { holdUs = atoll(argv[++i]); }
+        else if (strcmp(argv[i], "--storm-ms") == 0 && i + 1 < argc) { stormEveryUs = atoll(argv[++i]) * 1000; }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { storage = argv[++i]; }
+        else if (argv[i][0] == '-') { first = argc; break; }
+        else { first = i; break; }
+    }
+    if (first == argc || pollUs <= 0 || settleUs <= 0 || stormEveryUs < 0) {
+        fprintf(stderr, "Usage: %s [--json] [--poll-us us] [--settle-us us] [--hold-us us] [--storm-ms ms] [-s storage_dir] trace...\n", argv[0]);
+        return 2;
+    }
+    if (holdUs == 0) { holdUs = pollUs + settleUs * (DEBOUNCE_TIME_US / settleUs + 1); }
+    hostLogLevel = stormEveryUs > 0 ? ESP_LOG_NONE : ESP_LOG_ERROR;     // The storm logs the disconnects as errors
+
+    if (!json) {
+        printf("poll %lld us, settling %lld us, debounce %d us, hold %lld us, storm drops every %lld ms for %d ms\n",
+            (long long)pollUs, (long long)settleUs, DEBOUNCE_TIME_US, (long long)holdUs, (long long)(stormEveryUs / 1000),
+            BENCH_STORM_DOWN_US / 1000);
+        printf("%-30s %7s %6s %6s %6s %6s %6s %6s %11s %9s %9s %9s %9s %9s\n", "trace", "edges", "refs", "pubs",
+            "false", "missed", "coal", "tol", "edges/s", "cpu/edge", "cpu/loop", "lat mean", "lat p99", "lat max");
+        printf("%-30s %7s %6s %6s %6s %6s %6s %6s %11s %9s %9s %9s %9s %9s\n", "", "", "", "", "", "", "", "", "", "us", "us", "ms", "ms", "ms");
+    }
+    for (int i = first; i < argc; i++) {
+        BenchResult quiet, storm;
+        if (!runTrace(argv[i], storage, false, &quiet)) { failed = true; continue; }
+        report(argv[i], &quiet, json);
+        if (quiet.missed > 0 || (quiet.maxFalse >= 0 && quiet.falseTransitions > quiet.maxFalse)) {
+            fprintf(stderr, "FAIL: %s: %d missed, %d false\n", argv[i], quiet.missed, quiet.falseTransitions);
+            failed = true;
+        }
+        if (stormEveryUs > 0 && runTrace(argv[i], storage, true, &storm)) {
+            report(argv[i], &storm, json);
+            if (storm.missed > 0 || (storm.maxFalse >= 0 && storm.falseTransitions > storm.maxFalse)) {
+                fprintf(stderr, "FAIL: %s in the storm: %d missed, %d false\n", argv[i], storm.missed, storm.falseTransitions);
+                failed = true;
+            }
+            if (latencyP99(&storm) > latencyP99(&quiet)) {
+                fprintf(stderr, "FAIL: %s: latency p99 %lld us in the storm, %lld us quiet\n", argv[i],
+                    (long long)latencyP99(&storm), (long long)latencyP99(&quiet));
+                failed = true;
+            }
+            free(storm.latencies);
+        }
+        free(quiet.latencies);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,162 @@
+/* MQTT Alarm Controller host build: scenario runner
+
+   Runs the controller core on Linux against simulated pins, a virtual
+   clock and a simulated broker. A scenario is read from a file or stdin,
+   one command per line:
+
+     wait <ms>                   run the main loop for this long
+     input <1-6> <level>         set an alarm input pin level
+     mqtt <topic> <payload>      publish a message from another client
+     connect / disconnect        broker connection up or down
+     token <token>               set the local API token
+     control <token|-> <body>    a local API control request with that
+                                 bearer token, or none
+     status                      print the local API status
+
+   Everything the controller publishes, every output pin it drives and
+   every local API event is printed on stdout with the virtual time, so
+   runs can be diffed.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "localApi.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "hostController.h"
+
+static void printPublish(const char* topic, const char* payload, int len, int qos, int retain)
+{
+    printf("%10.3f PUB %s q%d%s %.*s\n", Hal_TimeUs() / 1000.0, topic, qos, retain ? " r" : "", len, payload);
+}
+
+static void printOutput(gpio_num_t pin, int level)
+{
+    printf("%10.3f GPIO %d %d\n", Hal_TimeUs() / 1000.0, pin, level);
+}
+
+static void printEvents(void)
+{
+    char event[LOCAL_API_EVENT_LEN];
+    int len;
+    while ((len = LocalApi_NextEvent(event, sizeof(event))) != 0) {
+        printf("%10.3f API %.*s\n", Hal_TimeUs() / 1000.0, len, event);
+    }
+}
+
+static void runFor(int64_t ms)
+{
+    int64_t end = Hal_TimeUs() + ms * 1000;
+    while (Hal_TimeUs() < end) {
+        HostController_Loop();
+        Hal_DelayMs(HOST_LOOP_PERIOD_MS);
+    }
+}
+
+static void runScenario(FILE* f)
+{
+    char line[512];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char* command = strtok(line, " \t");
+        if (command == NULL || command[0] == '#') { continue; }
+
+        if (strcmp(command, "wait") == 0) {
+            char* ms = strtok(NULL, " \t");
+            runFor(ms != NULL ? atoll(ms) : HOST_LOOP_PERIOD_MS);
+        } else if (strcmp(command, "input") == 0) {
+            char* input = strtok(NULL, " \t");
+            char* level = strtok(NULL, " \t");
+            int n = input != NULL ? atoi(input) : 0;
+            if (n < 1 || n > NUM_INPUTS || level == NULL) {
+                fprintf(stderr, "Line %d: input <1-%d> <level>\n", lineNumber, NUM_INPUTS);
+                exit(2);
+            }
+            HostHal_SetPin(hostInputPins[n - 1], atoi(level));
+        } else if (strcmp(command, "mqtt") == 0) {
+            char* topic = strtok(NULL, " \t");
+            char* payload = strtok(NULL, "");
+            if (topic == NULL) { fprintf(stderr, "Line %d: mqtt <topic> <payload>\n", lineNumber); exit(2); }
+            HostMqtt_Inject(topic, payload != NULL ? payload : "", false);
+        } else if (strcmp(command, "connect") == 0) {
+            HostMqtt_Connect();
+        } else if (strcmp(command, "disconnect") == 0) {
+            HostMqtt_Disconnect();
+        } else if (strcmp(command, "token") == 0) {
+            char* token = strtok(NULL, " \t");
+            snprintf(config.httpApiToken, sizeof(config.httpApiToken), "%s", token != NULL ? token : "");
+        } else if (strcmp(command, "control") == 0) {
+            char* token = strtok(NULL, " \t");
+            char* body = strtok(NULL, "");
+            if (token == NULL || body == NULL) { fprintf(stderr, "Line %d: control <token|-> <body>\n", lineNumber); exit(2); }
+            char authorization[100];
+            snprintf(authorization, sizeof(authorization), "Bearer %s", token);
+            static const char* results[] = { "ok", "bad request", "unauthorised", "disabled" };
+            LocalApiResult result = LocalApi_Control(strcmp(token, "-") == 0 ? NULL : authorization, body, strlen(body));
+            printf("%10.3f API control %s\n", Hal_TimeUs() / 1000.0, results[result]);
+        } else if (strcmp(command, "status") == 0) {
+            char status[4096];
+            int len = LocalApi_FormatStatus(status, sizeof(status));
+            printf("%10.3f API status %.*s\n", Hal_TimeUs() / 1000.0, len > 0 ? len : 0, status);
+        } else {
+            fprintf(stderr, "Line %d: unknown command %s\n", lineNumber, command);
+            exit(2);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* storage = "host_storage";
+    const char* scenario = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) { hostLogLevel = ESP_LOG_DEBUG; }
+        else if (strcmp(argv[i], "-q") == 0) { hostLogLevel = ESP_LOG_ERROR; }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { storage = argv[++i]; }
+        else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-v|-q] [-s storage_dir] [scenario]\n", argv[0]);
+            return 2;
+        }
+        else { scenario = argv[i]; }
+    }
+
+    HostHal_Reset();
+    HostHal_SetOutputCallback(printOutput);
+    HostMqtt_Reset();
+    HostMqtt_SetPublishCallback(printPublish);
+    HostController_Start(storage);
+    LocalApi_SetEventListener(printEvents);
+    LocalApi_WantEvents(true);
+
+    FILE* f = stdin;
+    if (scenario != NULL && (f = fopen(scenario, "r")) == NULL) {
+        perror(scenario);
+        return 1;
+    }
+    runScenario(f);
+    if (f != stdin) { fclose(f); }
+    return 0;
+}
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Generate the standard input edge traces for alarmBench.
+
+The host build runs this into its bench/ directory. Each scenario has a
+fixed seed, so every build replays the same traces and results compare
+between firmware versions; give any new scenario its own seed so the
+existing traces don't change.
+
+    host/bench/makeTraces.py [output_dir]
+
+Format: "<time us> <input 1-6> <level>" per line, see host/alarmBench.c.
+A "# max_false <n>" line makes alarmBench fail on more false transitions.
+"""
+
+import os
+import random
+import sys
+
+ACTIVE = [1, 2, 3, 4]
+ALL = [1, 2, 3, 4, 5, 6]
+
+
+def write(out_dir, name, description, max_false, edges):
+    edges.sort(key=lambda e: (e[0], e[1]))
+    with open(os.path.join(out_dir, name + ".trace"), "w") as f:
+        f.write("# %s\n" % description)
+        if max_false is not None:
+            f.write("# max_false %d\n" % max_false)
+        f.write("# time_us input level\n")
+        for t, i, level in edges:
+            f.write("%d %d %d\n" % (t, i, level))
+
+
+def clean_trips(rng):
+    """Zones trip every 2-10 s for 1-5 s with clean edges, 5 minutes."""
+    edges = []
+    for zone in ACTIVE:
+        t = rng.randint(0, 2000000)
+        while t < 300000000:
+            t += rng.randint(2000000, 10000000)
+            edges.append((t, zone, 1))
+            t += rng.randint(1000000, 5000000)
+            edges.append((t, zone, 0))
+    return edges
+
+
+def sub_debounce_glitches(rng):
+    """Pulses of 0.1-15 ms on every input, about 20 a second each, 60 s. Nothing should be published."""
+    edges = []
+    for zone in ALL:
+        t = rng.randint(1000, 50000)
+        while t < 60000000:
+            width = rng.randint(100, 15000)
+            edges.append((t, zone, 1))
+            edges.append((t + width, zone, 0))
+            t += width + rng.randint(20000, 80000)
+    return edges
+
+
+def storm_chatter(rng):
+    """Every 2 s each zone chatters 20-80 edges 0.2-8 ms apart, then settles at the opposite level, 60 s."""
+    edges = []
+    for zone in ACTIVE:
+        level = 0
+        t = rng.randint(100000, 500000)
+        while t < 60000000:
+            for _ in range(rng.randint(10, 40)):
+                edges.append((t, zone, 1 - level))
+                t += rng.randint(200, 8000)
+                edges.append((t, zone, level))
+                t += rng.randint(200, 8000)
+            level = 1 - level
+            edges.append((t, zone, level))
+            t += 2000000
+    return edges
+
+
+def simultaneous_all(rng):
+    """All six inputs change at the same instant every 500 ms, 60 s."""
+    edges = []
+    level = 0
+    for n in range(1, 120):
+        level = 1 - level
+        for zone in ALL:
+            edges.append((n * 500000, zone, level))
+    return edges
+
+
+def insect_landing(rng):
+    """20-60 ms pulses on zone 2, between debounce and hold time, mixed with real trips on zones 1 and 2, 60 s."""
+    intervals = {1: [], 2: []}
+    t = 200000
+    while t < 60000000:
+        width = rng.randint(20000, 60000)
+        intervals[2].append((t, t + width))
+        t += width + rng.randint(300000, 1500000)
+    for zone in (1, 2):
+        t = rng.randint(1000000, 3000000)
+        while t < 58000000:
+            intervals[zone].append((t, t + 1500000))
+            t += rng.randint(5000000, 9000000)
+
+    # Drop pulses that would overlap a trip, leaving at least 100 ms between them
+    edges = []
+    for zone, spans in intervals.items():
+        end = -1
+        for start, stop in sorted(spans):
+            if start > end + 100000:
+                edges += [(start, zone, 1), (stop, zone, 0)]
+                end = stop
+    return edges
+
+
+def sustained_flood(rng):
+    """Every zone toggles every 50-80 ms, all real transitions, 60 s. Throughput."""
+    edges = []
+    for zone in ALL:
+        level = 0
+        t = rng.randint(0, 50000)
+        while t < 60000000:
+            t += rng.randint(50000, 80000)
+            level = 1 - level
+            edges.append((t, zone, level))
+    return edges
+
+
+# Name, seed, the false transitions allowed and the generator. Chatter with edges closer than
+# the settling poll can read the same level on every poll through the debounce window, so
+# storm_chatter's false transitions are reported but not limited.
+SCENARIOS = [
+    ("clean_trips", 1, 0, clean_trips),
+    ("sub_debounce_glitches", 2, 0, sub_debounce_glitches),
+    ("storm_chatter", 3, None, storm_chatter),
+    ("simultaneous_all", 4, 0, simultaneous_all),
+    ("insect_landing", 5, 0, insect_landing),
+    ("sustained_flood", 6, 0, sustained_flood),
+]
+
+
+def main():
+    out_dir = sys.argv[1] if len(sys.argv) > 1 else "."
+    os.makedirs(out_dir, exist_ok=True)
+    for name, seed, max_false, generate in SCENARIOS:
+        write(out_dir, name, generate.__doc__, max_false, generate(random.Random(seed)))
+
+
+if __name__ == "__main__":
+    main()
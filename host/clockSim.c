@@ -0,0 +1,183 @@
+/* MQTT Alarm Controller host build: time service checks
+
+   The uptime is the virtual clock, and true time runs CLOCK_DRIFT_PPM
+   faster than it, as a crystal that far off would. Three scenarios:
+
+     feed        time feed only, one message a second, each delivered
+                 50 to 90 ms into its second, in UTC+10. After
+                 FEED_HOURS the feed stops and the clock holds over.
+     sntp        an exact SNTP sync every hour, the time feed running
+                 as well but ignored, then a holdover with neither.
+     heartbeat   no time feed at all. The availability heartbeat must
+                 still go out every 10 s.
+
+   For the clock scenarios the worst error over the last hour before
+   the holdover, the drift learned and the error at the end of the
+   holdover are printed, against what an uncompensated clock would
+   have drifted. Exits non-zero if any check fails.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "timeService.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "hostController.h"
+
+#define CLOCK_DRIFT_PPM 40
+#define CLOCK_START_UNIX_S 1729240000LL
+#define FEED_UTC_OFFSET_MIN 600
+#define FEED_HOURS 6
+#define HOLDOVER_HOURS 3
+#define HEARTBEAT_RUN_S 120
+#define STEADY_LIMIT_US 60000           // Worst error allowed once settled
+#define DRIFT_LIMIT_PPB 5000            // Learned drift allowed this far from the truth
+#define HOLDOVER_LIMIT_US 100000        // Error allowed after the holdover
+
+static int availabilityCount;
+
+// True Unix time at an uptime
+static int64_t truthUs(int64_t uptimeUs)
+{
+    return S_TO_uS(CLOCK_START_UNIX_S) + uptimeUs + uptimeUs * CLOCK_DRIFT_PPM / 1000000;
+}
+
+// The uptime when true time reaches unixUs
+static int64_t uptimeAt(int64_t unixUs)
+{
+    return (unixUs - S_TO_uS(CLOCK_START_UNIX_S)) * 1000000 / (1000000 + CLOCK_DRIFT_PPM);
+}
+
+static void onPublish(const char* topic, const char* payload, int len, int qos, int retain)
+{
+    if (strstr(topic, "/availability") != NULL) { availabilityCount++; }
+}
+
+static void start(const char* storage, const char* sntpServer)
+{
+    HostHal_Reset();
+    HostMqtt_Reset();
+    HostController_Start(storage);
+    strcpy(config.sntpServer, sntpServer);
+    config.timeFeedUtcOffsetMin = FEED_UTC_OFFSET_MIN;
+    TimeService_Initialise();
+    HostMqtt_SetPublishCallback(onPublish);
+    HostMqtt_Connect();
+    HostMqtt_Poll();
+}
+
+// Publish a time feed message for the true second that starts at unixS, in local time
+static void sendFeed(int64_t unixS)
+{
+    char payload[40];
+    struct tm t;
+    time_t local = (time_t)(unixS + FEED_UTC_OFFSET_MIN * 60);
+    gmtime_r(&local, &t);
+    snprintf(payload, sizeof(payload), "%04d.%02d.%02d %02d:%02d:%02d",
+             t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+    HostMqtt_Inject("homeassistant/CurrentTime", payload, false);
+    HostMqtt_Poll();
+}
+
+/******************************************************************
+ *
+ * Run the clock for a number of hours, with or without the feed
+ * and hourly SNTP. Returns the worst error in the last hour.
+ *
+*******************************************************************/
+static int64_t run(int hours, bool feed, bool sntp)
+{
+    int64_t worst = 0;
+    int64_t firstS = uS_TO_S(truthUs(Hal_TimeUs())) + 1;
+    int64_t endS = firstS + hours * 3600LL;
+    for (int64_t s = firstS; s < endS; s++) {
+        // Delivered 50 to 90 ms into the second
+        HostHal_Advance(uptimeAt(S_TO_uS(s) + 50000 + rand() % 40000) - Hal_TimeUs());
+        if (sntp && (s - firstS) % 3600 == 0) { HostHal_SntpSync(truthUs(Hal_TimeUs())); }
+        if (feed) { sendFeed(s); }
+        if (s >= endS - 3600) {
+            int64_t error = llabs(TimeService_NowUs() - truthUs(Hal_TimeUs()));
+            if (error > worst) { worst = error; }
+        }
+    }
+    return worst;
+}
+
+static bool clockScenario(const char* name, const char* storage, bool sntp)
+{
+    start(storage, sntp ? "ntp.local" : "");
+    int64_t steady = run(FEED_HOURS, true, sntp);
+    int32_t drift = TimeService_DriftPpb();
+    run(HOLDOVER_HOURS, false, false);
+    int64_t holdover = llabs(TimeService_NowUs() - truthUs(Hal_TimeUs()));
+    int64_t uncompensated = S_TO_uS(HOLDOVER_HOURS * 3600LL) * CLOCK_DRIFT_PPM / 1000000;
+
+    bool ok = TimeService_Source() == (sntp ? TIME_SOURCE_SNTP : TIME_SOURCE_FEED)
+        && steady <= STEADY_LIMIT_US
+        && llabs(drift - CLOCK_DRIFT_PPM * 1000) <= DRIFT_LIMIT_PPB
+        && holdover <= HOLDOVER_LIMIT_US;
+    printf("%-10s %10.1f %10" PRIi32 " %12.1f %16.1f   %s\n", name, steady / 1000.0, drift,
+           holdover / 1000.0, uncompensated / 1000.0, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+static bool heartbeatScenario(const char* storage)
+{
+    start(storage, "");
+    for (int64_t t = 0; t < S_TO_uS((int64_t)HEARTBEAT_RUN_S); t += HOST_LOOP_PERIOD_MS * 1000) {
+        HostHal_Advance(HOST_LOOP_PERIOD_MS * 1000);
+        HostController_Loop();
+        // Not the availability sent on connecting
+        if (t == 0) { availabilityCount = 0; }
+    }
+
+    // Sensors and sirens each heartbeat
+    int expected = 2 * HEARTBEAT_RUN_S / uS_TO_S(HEARTBEAT_INTERVAL_US);
+    bool ok = availabilityCount == expected && !TimeService_IsSet();
+    printf("\nheartbeat: %d availability messages in %d s with no time feed, expected %d   %s\n",
+           availabilityCount, HEARTBEAT_RUN_S, expected, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* storage = "host_storage";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { storage = argv[++i]; }
+        else {
+            fprintf(stderr, "Usage: %s [-s storage_dir]\n", argv[0]);
+            return 2;
+        }
+    }
+    hostLogLevel = ESP_LOG_ERROR;
+    srand(1);
+
+    int failed = 0;
+    printf("%-10s %10s %10s %12s %16s\n", "scenario", "error ms", "drift ppb", "holdover ms", "uncompensated ms");
+    if (!clockScenario("feed", storage, false)) { failed++; }
+    if (!clockScenario("sntp", storage, true)) { failed++; }
+    if (!heartbeatScenario(storage)) { failed++; }
+    return failed ? 1 : 0;
+}
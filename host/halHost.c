@@ -0,0 +1,404 @@
+/* MQTT Alarm Controller host build: simulated hardware
+
+   Host implementation of the HAL. Pins are an array of levels that the
+   test or scenario sets, time is a virtual clock that only moves when
+   the simulation advances it, and storage is files in a directory.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "halHost.h"
+
+#define HOST_MAX_TIMERS 8
+
+struct HalTimer {
+    const char* name;
+    HalTimerCallback callback;
+    void* arg;
+    uint64_t periodUs;
+    int64_t nextUs;
+    bool active;
+};
+
+esp_log_level_t hostLogLevel = ESP_LOG_INFO;
+
+static int pinLevels[GPIO_NUM_MAX];
+static bool pinIsOutput[GPIO_NUM_MAX];
+static HostPinCallback outputCallback = NULL;
+static int adcLevels[GPIO_NUM_MAX];
+static int pulseLevel[GPIO_NUM_MAX];            // Level counted, -1 if the pin isn't counting
+static int32_t pulseCounts[GPIO_NUM_MAX];
+static HostAdcCallback adcCallback = NULL;
+static int64_t nowUs = 0;
+static struct HalTimer timers[HOST_MAX_TIMERS];
+static int numTimers = 0;
+static HalSntpCallback sntpCallback = NULL;
+static char storageRoot[200] = "host_storage";
+static int peerSocket = -1;
+static struct sockaddr_in peerGroupAddr;
+static HalPeerCallback peerCallback = NULL;
+static HostPeerSendCallback peerSendCallback = NULL;
+
+/******************************************************************
+ *
+ * Reset the simulation: time zero, inputs pulled up, ADC inputs at
+ * full scale, no timers, SNTP not started
+ *
+*******************************************************************/
+void HostHal_Reset(void)
+{
+    for (int i = 0; i < GPIO_NUM_MAX; i++) { pinLevels[i] = 1; pinIsOutput[i] = false; adcLevels[i] = 4095; pulseLevel[i] = -1; }
+    adcCallback = NULL;
+    nowUs = 0;
+    numTimers = 0;
+    sntpCallback = NULL;
+    if (peerSocket >= 0) { close(peerSocket); }
+    peerSocket = -1;
+    peerCallback = NULL;
+}
+
+void HostHal_SetPin(gpio_num_t pin, int level)
+{
+    if (pin < 0 || pin >= GPIO_NUM_MAX) { return; }
+    level = level ? 1 : 0;
+    if (pulseLevel[pin] == level && pinLevels[pin] != level) { pulseCounts[pin]++; }
+    pinLevels[pin] = level;
+}
+
+int HostHal_GetPin(gpio_num_t pin)
+{
+    return (pin >= 0 && pin < GPIO_NUM_MAX) ? pinLevels[pin] : 0;
+}
+
+void HostHal_SetOutputCallback(HostPinCallback callback)
+{
+    outputCallback = callback;
+}
+
+void HostHal_SetAdc(gpio_num_t pin, int raw)
+{
+    if (pin >= 0 && pin < GPIO_NUM_MAX) { adcLevels[pin] = raw; }
+}
+
+void HostHal_SetAdcCallback(HostAdcCallback callback)
+{
+    adcCallback = callback;
+}
+
+void HostHal_SetStorageRoot(const char* path)
+{
+    snprintf(storageRoot, sizeof(storageRoot), "%s", path);
+}
+
+/******************************************************************
+ *
+ * Move the virtual clock on, firing any timers that fall due in
+ * time order
+ *
+*******************************************************************/
+void HostHal_Advance(int64_t us)
+{
+    int64_t end = nowUs + us;
+    while (true) {
+        struct HalTimer* next = NULL;
+        for (int i = 0; i < numTimers; i++) {
+            if (timers[i].active && timers[i].nextUs <= end && (next == NULL || timers[i].nextUs < next->nextUs)) {
+                next = &timers[i];
+            }
+        }
+        if (next == NULL) { break; }
+        nowUs = next->nextUs;
+        next->nextUs += next->periodUs;
+        next->callback(next->arg);
+    }
+    nowUs = end;
+}
+
+void HostHal_Log(char level, const char* tag, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%c (%lld) %s: ", level, (long long)(nowUs / 1000), tag);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+/******************************************************************
+ *
+ * GPIO
+ *
+*******************************************************************/
+void Hal_GpioConfigInput(gpio_num_t pin, bool pullUp)
+{
+    if (pin >= 0 && pin < GPIO_NUM_MAX) { pinIsOutput[pin] = false; }
+}
+
+void Hal_GpioConfigOutput(gpio_num_t pin)
+{
+    if (pin >= 0 && pin < GPIO_NUM_MAX) { pinIsOutput[pin] = true; pinLevels[pin] = 0; }
+}
+
+int Hal_GpioRead(gpio_num_t pin)
+{
+    return HostHal_GetPin(pin);
+}
+
+void Hal_GpioWrite(gpio_num_t pin, int level)
+{
+    if (pin < 0 || pin >= GPIO_NUM_MAX) { return; }
+    pinLevels[pin] = level ? 1 : 0;
+    if (outputCallback != NULL) { outputCallback(pin, pinLevels[pin]); }
+}
+
+/******************************************************************
+ *
+ * ADC, on the same pins as the ESP32's ADC1 and ADC2 channels
+ *
+*******************************************************************/
+bool Hal_AdcConfig(gpio_num_t pin)
+{
+    static const gpio_num_t adcPins[] = { 0, 2, 4, 12, 13, 14, 15, 25, 26, 27, 32, 33, 34, 35, 36, 37, 38, 39 };
+    for (int i = 0; i < sizeof(adcPins) / sizeof(adcPins[0]); i++) {
+        if (adcPins[i] == pin) { return true; }
+    }
+    return false;
+}
+
+int Hal_AdcRead(gpio_num_t pin)
+{
+    if (pin < 0 || pin >= GPIO_NUM_MAX) { return -1; }
+    return adcCallback != NULL ? adcCallback(pin) : adcLevels[pin];
+}
+
+/******************************************************************
+ *
+ * Pulse counters, counting the edges HostHal_SetPin() makes
+ *
+*******************************************************************/
+bool Hal_PulseCounterConfig(gpio_num_t pin, int activeLevel)
+{
+    if (pin < 0 || pin >= GPIO_NUM_MAX) { return false; }
+    pulseLevel[pin] = activeLevel ? 1 : 0;
+    pulseCounts[pin] = 0;
+    return true;
+}
+
+int32_t Hal_PulseCounterRead(gpio_num_t pin)
+{
+    return (pin >= 0 && pin < GPIO_NUM_MAX) ? pulseCounts[pin] : 0;
+}
+
+/******************************************************************
+ *
+ * Clock, delays and timers. Delays advance the virtual clock.
+ *
+*******************************************************************/
+int64_t Hal_TimeUs(void)
+{
+    return nowUs;
+}
+
+void Hal_DelayMs(uint32_t ms)
+{
+    HostHal_Advance((int64_t)ms * 1000);
+}
+
+HalTimer Hal_TimerCreate(const char* name, HalTimerCallback callback, void* arg)
+{
+    if (numTimers >= HOST_MAX_TIMERS) {
+        ESP_LOGE("host", "Too many timers, %s not created.", name);
+        return NULL;
+    }
+    struct HalTimer* timer = &timers[numTimers++];
+    memset(timer, 0, sizeof(*timer));
+    timer->name = name;
+    timer->callback = callback;
+    timer->arg = arg;
+    return timer;
+}
+
+void Hal_TimerStartPeriodic(HalTimer timer, uint64_t periodUs)
+{
+    if (timer == NULL || periodUs == 0) { return; }
+    timer->periodUs = periodUs;
+    timer->nextUs = nowUs + periodUs;
+    timer->active = true;
+}
+
+void Hal_TimerStop(HalTimer timer)
+{
+    if (timer != NULL) { timer->active = false; }
+}
+
+/******************************************************************
+ *
+ * Main loop wake ups. The host controller steps the loop itself, so
+ * there's nothing to wake.
+ *
+*******************************************************************/
+void Hal_GpioWakeOnEdge(gpio_num_t pin)
+{
+}
+
+int64_t Hal_LoopWait(uint32_t timeoutMs)
+{
+    Hal_DelayMs(timeoutMs);
+    return 0;
+}
+
+void Hal_LoopWake(void)
+{
+}
+
+/******************************************************************
+ *
+ * Network time. There's no server, HostHal_SntpSync() stands in for
+ * a sync.
+ *
+*******************************************************************/
+bool Hal_SntpStart(const char* server, HalSntpCallback callback)
+{
+    sntpCallback = callback;
+    return true;
+}
+
+// An SNTP sync to the given Unix time now, if SNTP was started
+void HostHal_SntpSync(int64_t unixUs)
+{
+    if (sntpCallback != NULL) { sntpCallback(unixUs); }
+}
+
+/******************************************************************
+ *
+ * LAN peer link, a real UDP multicast group on the loopback
+ * interface, so several host processes can be peers. Our own
+ * datagrams come back and are dropped by the peer link.
+ * HostHal_PeerPoll() passes what's arrived to the callback.
+ *
+*******************************************************************/
+bool Hal_PeerStart(const char* group, int port, HalPeerCallback callback)
+{
+    memset(&peerGroupAddr, 0, sizeof(peerGroupAddr));
+    peerGroupAddr.sin_family = AF_INET;
+    peerGroupAddr.sin_port = htons(port);
+    if (inet_aton(group, &peerGroupAddr.sin_addr) == 0 || !IN_MULTICAST(ntohl(peerGroupAddr.sin_addr.s_addr))) { return false; }
+
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s < 0) { return false; }
+    int on = 1;
+    struct sockaddr_in bindAddr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = peerGroupAddr.sin_addr };
+    struct in_addr loopback = { .s_addr = htonl(INADDR_LOOPBACK) };
+    struct ip_mreq membership = { .imr_multiaddr = peerGroupAddr.sin_addr, .imr_interface = loopback };
+    unsigned char ttl = 0;
+    unsigned char loop = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+        || setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0
+        || bind(s, (struct sockaddr*)&bindAddr, sizeof(bindAddr)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+        || fcntl(s, F_SETFL, O_NONBLOCK) < 0) {
+        perror("peer socket");
+        close(s);
+        return false;
+    }
+    if (peerSocket >= 0) { close(peerSocket); }
+    peerSocket = s;
+    peerCallback = callback;
+    return true;
+}
+
+bool Hal_PeerSend(const uint8_t* data, int len)
+{
+    if (peerSocket < 0) { return false; }
+    if (peerSendCallback != NULL && !peerSendCallback(data, len)) { return true; }
+    return sendto(peerSocket, data, len, 0, (struct sockaddr*)&peerGroupAddr, sizeof(peerGroupAddr)) == len;
+}
+
+// Called before each datagram's sent. Returning false drops it, as the network might.
+void HostHal_SetPeerSendCallback(HostPeerSendCallback callback)
+{
+    peerSendCallback = callback;
+}
+
+// The peer socket, to wait on, -1 if the peer link isn't started
+int HostHal_PeerFd(void)
+{
+    return peerSocket;
+}
+
+// Pass each datagram waiting to the peer link. Returns how many.
+int HostHal_PeerPoll(void)
+{
+    if (peerSocket < 0) { return 0; }
+    uint8_t buf[64];
+    int n = 0;
+    int len;
+    while ((len = recvfrom(peerSocket, buf, sizeof(buf), 0, NULL, NULL)) >= 0) {
+        peerCallback(buf, len);
+        n++;
+    }
+    return n;
+}
+
+uint32_t Hal_Random(void)
+{
+    static bool seeded = false;
+    if (!seeded) { srand((unsigned)time(NULL) ^ (unsigned)getpid() << 16); seeded = true; }
+    return (uint32_t)rand() << 16 ^ (uint32_t)rand();
+}
+
+/******************************************************************
+ *
+ * Persistent storage, files in the storage root directory
+ *
+*******************************************************************/
+int Hal_StorageRead(const char* name, char* buf, size_t len)
+{
+    char path[300];
+    snprintf(path, sizeof(path), "%s/%s", storageRoot, name);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { return -1; }
+    size_t n = fread(buf, 1, len, f);
+    fclose(f);
+    return (int)n;
+}
+
+bool Hal_StorageWrite(const char* name, const char* data, size_t len)
+{
+    char path[300];
+    snprintf(path, sizeof(path), "%s/%s", storageRoot, name);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) { return false; }
+    bool ok = fwrite(data, 1, len, f) == len;
+    if (fclose(f) != 0) { ok = false; }
+    return ok;
+}
@@ -0,0 +1,48 @@
+/* MQTT Alarm Controller host build: simulated hardware
+
+   Host implementation of the HAL. Pins are an array of levels and ADC
+   readings that the test or scenario sets (or a callback that supplies
+   each ADC reading), time is a virtual clock that only moves when
+   the simulation advances it, and storage is files in a directory.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __HALHOST_H__
+#define __HALHOST_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+#include "driver/gpio.h"
+
+typedef void (*HostPinCallback)(gpio_num_t pin, int level);
+typedef int (*HostAdcCallback)(gpio_num_t pin);
+typedef bool (*HostPeerSendCallback)(const uint8_t* data, int len);
+
+void HostHal_Reset(void);
+void HostHal_SetPin(gpio_num_t pin, int level);
+int HostHal_GetPin(gpio_num_t pin);
+void HostHal_SetOutputCallback(HostPinCallback callback);
+void HostHal_SetAdc(gpio_num_t pin, int raw);
+void HostHal_SetAdcCallback(HostAdcCallback callback);
+void HostHal_Advance(int64_t us);
+void HostHal_SetStorageRoot(const char* path);
+void HostHal_SntpSync(int64_t unixUs);
+void HostHal_SetPeerSendCallback(HostPeerSendCallback callback);
+int HostHal_PeerFd(void);
+int HostHal_PeerPoll(void);
+
+#endif // #ifndef __HALHOST_H__
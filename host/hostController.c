@@ -0,0 +1,114 @@
+/* MQTT Alarm Controller host build: controller core set up
+
+   Starts the controller core the way app_main does, without the network
+   waits, and runs one pass of the device main loop. Shared by the host
+   programs.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "config.h"
+#include "AlarmMachine.h"
+#include "flightRecorder.h"
+#include "mqttProcess.h"
+#include "mqttFailover.h"
+#include "sensorHealth.h"
+#include "timeService.h"
+#include "peerLink.h"
+#include "localApi.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "hostController.h"
+
+const char *TAG = "AlarmController";
+
+const gpio_num_t hostInputPins[NUM_INPUTS] = {In1_Pin, In2_Pin, In3_Pin, In4_Pin, In5_Pin, In6_Pin};
+DebouncedInput hostInputs[NUM_INPUTS];
+static AlarmMachine houseAlarm;
+
+/******************************************************************
+ *
+ * Load the configuration from the storage directory, creating a
+ * test configuration there if there isn't one
+ *
+*******************************************************************/
+static void loadConfig(void)
+{
+    SetDefaultConfig();
+    if (LoadConfiguration()) { return; }
+
+    ESP_LOGI(TAG, "No host configuration found, creating a test configuration.");
+    strcpy(config.Name, "HouseAlarm");
+    strcpy(config.DeviceID, "HostAlarm");
+    strcpy(config.UID, "host-alarm");
+    strcpy(config.mqttBrokerUrl, "mqtt://simulated");
+    config.retries = 0;
+    if (!SaveConfiguration() || !LoadConfiguration()) {
+        ESP_LOGE(TAG, "Couldn't create the host configuration.");
+        exit(1);
+    }
+}
+
+/******************************************************************
+ *
+ * Start the core. The input pins are read here, so set their
+ * initial levels with HostHal_SetPin() first. Can be called again
+ * to restart after HostHal_Reset() and HostMqtt_Reset().
+ *
+*******************************************************************/
+void HostController_Start(const char* storage)
+{
+    HostHal_SetStorageRoot(storage);
+    mkdir(storage, 0755);
+
+    // Same start up order as app_main
+    initialSetup();
+    FlightRecorder_Initialise();
+    loadConfig();
+    AlarmMachine_Initialise(&houseAlarm, ExternalSirenPin, DownstairsSirenPin);
+    LocalApi_Initialise(&houseAlarm);
+    TimeService_Initialise();
+    MqttProcess_Initialise();
+    initialiseInputs(hostInputs, hostInputPins, NUM_INPUTS);
+    PeerLink_Start();
+}
+
+/******************************************************************
+ *
+ * One pass of the device main loop, less the delay. The peer
+ * datagrams the device takes on its own task are taken first.
+ *
+*******************************************************************/
+void HostController_Loop(void)
+{
+    HostHal_PeerPoll();
+    MqttFailover_Poll();
+    updateInputs(hostInputs, NUM_INPUTS);
+    processInputChanges(hostInputs, NUM_INPUTS);
+    SensorHealth_Check();
+    LocalApi_Poll();
+    processSirenRequests();
+    PeerLink_Poll();
+    SendHeartbeatIfDue();
+    HostMqtt_Poll();
+}
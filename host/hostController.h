@@ -0,0 +1,38 @@
+/* MQTT Alarm Controller host build: controller core set up
+
+   Starts the controller core the way app_main does, without the network
+   waits, and runs one pass of the device main loop. Shared by the host
+   programs.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __HOSTCONTROLLER_H__
+#define __HOSTCONTROLLER_H__
+
+#include "driver/gpio.h"
+#include "defines.h"
+#include "inputOutput.h"
+
+#define HOST_LOOP_PERIOD_MS 25  // Same as the main loop's delay on the device
+
+extern const gpio_num_t hostInputPins[NUM_INPUTS];
+extern DebouncedInput hostInputs[NUM_INPUTS];
+
+void HostController_Start(const char* storage);
+void HostController_Loop(void);
+
+#endif // #ifndef __HOSTCONTROLLER_H__
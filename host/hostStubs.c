@@ -0,0 +1,97 @@
+/* MQTT Alarm Controller host build: stubs
+
+   Host versions of the device-only services the controller core calls:
+   the timeline trace, the FreeRTOS system health sampler and the
+   console utilities.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "defines.h"
+#include "utilities.h"
+#include "systemHealth.h"
+#include "trace.h"
+#include "ota.h"
+#include "inputLatency.h"
+#include "commandAuth.h"
+
+// Tracing is never enabled on the host, so the TRACE_ macros cost one load
+atomic_bool traceEnabled = false;
+
+void Trace_Start(void) { ESP_LOGI(TAG, "Tracing isn't available in the host build."); }
+void Trace_Stop(void) { }
+void Trace_Record(TraceType type, const char* name, int32_t arg) { }
+size_t Trace_Format(char* buf, size_t len, int* cursor) { return 0; }
+void Trace_DumpToConsole(void) { }
+
+// The host build has no flash to update
+bool Ota_Start(const char* url, const char* sha256Hex)
+{
+    ESP_LOGI(TAG, "Firmware updates aren't available in the host build.");
+    return false;
+}
+
+// Nor the mbedTLS HMAC the signed diagnostics commands need
+bool CommandAuth_Verify(const char* command)
+{
+    ESP_LOGI(TAG, "Signed diagnostics commands aren't available in the host build.");
+    return false;
+}
+
+// Nor a network core to storm
+bool InputLatency_StormTest(int reconnects)
+{
+    ESP_LOGI(TAG, "The reconnect storm test isn't available in the host build.");
+    return false;
+}
+
+int SystemHealth_FormatJson(char* buf, size_t len)
+{
+    int n = snprintf(buf, len, "{}");
+    return n < (int)len ? n : -1;
+}
+
+void log_error_if_nonzero(const char *message, int error_code)
+{
+    if (error_code != 0) {
+        ESP_LOGE(TAG, "Last error %s: 0x%x", message, error_code); 
+    }
+}
+
+int getLineInput(char buf[], size_t len)
+{
+    if (fgets(buf, len, stdin) == NULL) { buf[0] = '\0'; return -1; }
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return (int)strlen(buf);
+}
+
+#ifndef HAVE_STRLCPY
+size_t strlcpy(char* dst, const char* src, size_t size)
+{
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+#endif
@@ -0,0 +1,41 @@
+/* MQTT Alarm Controller host build: esp_log.h
+
+   ESP_LOGx on the host. Messages go to stderr with the virtual time in
+   milliseconds, filtered by hostLogLevel (default info).
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __HOST_ESP_LOG_H__
+#define __HOST_ESP_LOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+typedef enum { ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE } esp_log_level_t;
+
+extern esp_log_level_t hostLogLevel;
+void HostHal_Log(char level, const char* tag, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+#define HOST_LOG(l, c, tag, format, ...) do { if (hostLogLevel >= (l)) { HostHal_Log((c), (tag), format, ##__VA_ARGS__); } } while (0)
+#define ESP_LOGE(tag, format, ...) HOST_LOG(ESP_LOG_ERROR, 'E', tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG(ESP_LOG_WARN, 'W', tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_LOG(ESP_LOG_INFO, 'I', tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG(ESP_LOG_DEBUG, 'D', tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_LOG(ESP_LOG_VERBOSE, 'V', tag, format, ##__VA_ARGS__)
+
+#endif // #ifndef __HOST_ESP_LOG_H__
@@ -0,0 +1,122 @@
+/* MQTT Alarm Controller host build: metrics under concurrent updates
+
+   METRICS_TEST_THREADS threads hammer one counter, one added counter and
+   one histogram at the same time, as the main loop, the MQTT task and the
+   timer callbacks do on the device. The totals, the histogram's buckets
+   and its sum (past 2^31, which a 32 bit sum would wrap) must come out
+   exact, and the Prometheus export must show the same sum. Exits non-zero
+   if any check fails.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "inttypes.h"
+#include "metrics.h"
+
+#define METRICS_TEST_THREADS 8
+#define METRICS_TEST_ITERATIONS 200000
+#define METRICS_TEST_VALUE_SPAN 5000    // Observations cycle through 0 .. span - 1 µs
+
+static const int32_t testBounds[] = {100, 250, 500, 1000, 2500, 4000};
+static Metric counter = METRIC_COUNTER_INIT("test_increments_total", "Concurrent increments");
+static Metric added = METRIC_COUNTER_INIT("test_added_total", "Concurrent adds");
+static Metric histogram = METRIC_HISTOGRAM_INIT("test_latency_us", "Concurrent observations", testBounds);
+
+static pthread_barrier_t startLine;
+
+static int32_t observation(int thread, int i)
+{
+    return (int32_t)((thread * 7919 + i) % METRICS_TEST_VALUE_SPAN);
+}
+
+static void* hammer(void* arg)
+{
+    int thread = (int)(intptr_t)arg;
+    pthread_barrier_wait(&startLine);
+    for (int i = 0; i < METRICS_TEST_ITERATIONS; i++) {
+        Metrics_Increment(&counter);
+        Metrics_Add(&added, 3);
+        Metrics_Observe(&histogram, observation(thread, i));
+    }
+    return NULL;
+}
+
+static int check(const char* what, int64_t got, int64_t expected)
+{
+    bool ok = got == expected;
+    printf("%-22s %14" PRIi64 " %14" PRIi64 "  %s\n", what, got, expected, ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+int main(void)
+{
+    pthread_t threads[METRICS_TEST_THREADS];
+    int64_t expectedSum = 0;
+    uint32_t expectedBuckets[METRICS_MAX_BUCKETS + 1] = { 0 };
+    int numBounds = sizeof(testBounds) / sizeof(testBounds[0]);
+
+    for (int t = 0; t < METRICS_TEST_THREADS; t++) {
+        for (int i = 0; i < METRICS_TEST_ITERATIONS; i++) {
+            int32_t value = observation(t, i);
+            int bucket = 0;
+            while (bucket < numBounds && value > testBounds[bucket]) { bucket++; }
+            expectedBuckets[bucket]++;
+            expectedSum += value;
+        }
+    }
+
+    Metrics_Register(&counter);
+    Metrics_Register(&added);
+    Metrics_Register(&histogram);
+    pthread_barrier_init(&startLine, NULL, METRICS_TEST_THREADS);
+    for (int t = 0; t < METRICS_TEST_THREADS; t++) {
+        pthread_create(&threads[t], NULL, hammer, (void*)(intptr_t)t);
+    }
+    for (int t = 0; t < METRICS_TEST_THREADS; t++) { pthread_join(threads[t], NULL); }
+    pthread_barrier_destroy(&startLine);
+
+    int64_t total = (int64_t)METRICS_TEST_THREADS * METRICS_TEST_ITERATIONS;
+    int failed = 0;
+    printf("%d threads x %d updates\n\n%-22s %14s %14s\n", METRICS_TEST_THREADS, METRICS_TEST_ITERATIONS, "check", "got", "expected");
+    failed += check("counter", (uint32_t)Metrics_Get(&counter), total);
+    failed += check("added", (uint32_t)Metrics_Get(&added), total * 3);
+    failed += check("histogram count", atomic_load(&histogram.count), total);
+    failed += check("histogram sum", atomic_load(&histogram.sum), expectedSum);
+    for (int b = 0; b <= numBounds; b++) {
+        char what[32];
+        snprintf(what, sizeof(what), "bucket %d", b);
+        failed += check(what, atomic_load(&histogram.buckets[b]), expectedBuckets[b]);
+    }
+    if (expectedSum <= INT32_MAX) {
+        printf("The sum doesn't pass 2^31, raise METRICS_TEST_ITERATIONS.\n");
+        failed++;
+    }
+
+    static char text[8192];
+    char line[80];
+    Metrics_FormatPrometheus(text, sizeof(text));
+    snprintf(line, sizeof(line), "\ntest_latency_us_sum %" PRIi64 "\n", expectedSum);
+    bool exported = strstr(text, line) != NULL;
+    printf("%-22s %29s  %s\n", "prometheus sum", "", exported ? "ok" : "FAIL");
+    if (!exported) { failed++; }
+
+    return failed ? 1 : 0;
+}
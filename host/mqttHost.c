@@ -0,0 +1,581 @@
+/* MQTT Alarm Controller host build: simulated MQTT broker
+
+   Host implementation of the HAL MQTT transport. Publishes go to an in
+   process broker that keeps retained messages, loops messages back to
+   our own subscriptions and acknowledges QoS 1. Packets in both
+   directions are queued with the time they arrive, and HostMqtt_Poll()
+   handles the ones that are due, handing broker events to mqttProcess.c
+   in order the way the esp-mqtt task does on the device. The controller
+   has a persistent session, as on the device, so the broker keeps its
+   subscriptions and queues QoS 1 messages for it while it's away. The
+   link can be given latency and packet loss, and the broker can be
+   restarted, to see how the controller copes.
+
+   Each publish is sized as it would go on the wire under MQTT 3.1.1
+   and under MQTT 5 with the device's topic aliases and expiry, for
+   HostMqtt_WireStats(). The broker itself takes topics either way.
+
+   There's a broker for each of the device's failover brokers, each
+   with its own retained messages and session. A broker can be hung,
+   taking packets but never answering, and Hal_MqttSelectBroker()
+   moves to another the way the device does: what the old client had
+   queued is dropped, and the new connection is made after a cold
+   connect's cost, or at once to a warm standby.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "config.h"
+#include "mqttProcess.h"
+#include "topicAlias.h"
+#include "mqttFailover.h"
+#include "mqttHost.h"
+
+#define HOST_MQTT_MAX_SUBSCRIPTIONS 16
+#define HOST_MQTT_MAX_RETAINED 64
+#define HOST_MQTT_MAX_OUTBOX 256
+#define HOST_MQTT_TCP_RTO_US 200000         // Linux minimum TCP retransmission timeout
+#define HOST_MQTT_TCP_RTO_MAX_US 3200000
+
+typedef enum {
+    // Broker to controller, handed to mqttProcess.c
+    HostConnected, HostDisconnected, HostSubscribed, HostPublished, HostData,
+    // Controller to broker
+    HostBrokerPublish, HostBrokerSubscribe,
+    // The controller starts a connection, after a failover
+    HostConnectStart
+} HostEventType;
+
+typedef enum { ToClient, ToBroker } HostDirection;
+
+typedef struct HostEvent {
+    HostEventType type;
+    int64_t due;
+    int msgId;
+    char* topic;
+    char* data;
+    int len;
+    int retain;                         // Or the QoS of a subscribe
+    struct HostEvent* next;
+} HostEvent;
+
+typedef struct {
+    char* topic;
+    char* data;
+    int len;
+    int qos;
+    int retain;
+    int msgId;
+} HostMessage;
+
+typedef struct {
+    bool session;                       // The broker has a session for the controller
+    char* subscriptions[HOST_MQTT_MAX_SUBSCRIPTIONS];
+    int subscriptionQos[HOST_MQTT_MAX_SUBSCRIPTIONS];
+    int numSubscriptions;
+    HostMessage sessionQueue[HOST_MQTT_MAX_OUTBOX];  // QoS 1 messages for the session while disconnected
+    int numSessionQueue;
+    HostMessage retained[HOST_MQTT_MAX_RETAINED];
+    int numRetained;
+    bool hung;                          // Takes packets and never answers
+} HostBroker;
+
+static HostBroker brokers[MQTT_MAX_BROKERS];
+static HostBroker* broker = &brokers[0];  // The one the controller's using
+static int activeBroker = 0;
+static int64_t connectUs = 0;           // A new connection's TCP, TLS and CONNECT time, for a failover
+static bool connected = false;
+static int nextMsgId = 1;
+static HostMessage outbox[HOST_MQTT_MAX_OUTBOX];      // QoS 1 publishes to send after connecting
+static int numOutbox = 0;
+static HostMessage inflight[HOST_MQTT_MAX_OUTBOX];    // QoS 1 publishes sent but not yet acknowledged
+static int numInflight = 0;
+static HostEvent* eventHead = NULL;
+static HostPublishCallback publishCallback = NULL;
+static HostPublishCallback sendCallback = NULL;
+static int64_t linkLatencyUs = 0;
+static double linkLoss = 0.0;
+static unsigned linkSeed = 1;
+static int64_t lastDue[2] = {0, 0};
+static HostWireStats wire;
+
+static char* copyData(const char* data, int len)
+{
+    char* copy = malloc(len + 1);
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static void freeMessage(HostMessage* m)
+{
+    free(m->topic);
+    free(m->data);
+}
+
+/******************************************************************
+ *
+ * When a packet sent now in the given direction arrives. Each lost
+ * transmission costs a TCP retransmission timeout, and TCP keeps
+ * the packets in order, so a delayed packet holds up the ones
+ * behind it.
+ *
+*******************************************************************/
+static int64_t linkDue(HostDirection direction, int64_t sent)
+{
+    int64_t delay = linkLatencyUs;
+    int64_t rto = HOST_MQTT_TCP_RTO_US;
+    while (linkLoss > 0.0 && rand_r(&linkSeed) < linkLoss * ((double)RAND_MAX + 1.0)) {
+        delay += rto;
+        if (rto < HOST_MQTT_TCP_RTO_MAX_US) { rto *= 2; }
+    }
+    int64_t due = sent + delay;
+    if (due < lastDue[direction]) { due = lastDue[direction]; }
+    lastDue[direction] = due;
+    return due;
+}
+
+static void queueEvent(HostEventType type, int64_t due, int msgId, const char* topic, const char* data, int len, int retainFlag)
+{
+    HostEvent* e = calloc(1, sizeof(HostEvent));
+    e->type = type;
+    e->due = due;
+    e->msgId = msgId;
+    if (topic != NULL) { e->topic = copyData(topic, strlen(topic)); }
+    if (data != NULL) { e->data = copyData(data, len); e->len = len; }
+    e->retain = retainFlag;
+
+    // Keep the queue in due order, first in first out for the same time
+    HostEvent** p = &eventHead;
+    while (*p != NULL && (*p)->due <= due) { p = &(*p)->next; }
+    e->next = *p;
+    *p = e;
+}
+
+static void freeEvents(void)
+{
+    while (eventHead != NULL) {
+        HostEvent* e = eventHead;
+        eventHead = e->next;
+        free(e->topic);
+        free(e->data);
+        free(e);
+    }
+}
+
+// The QoS of the subscription to the topic, -1 if there isn't one
+static int subscribedQos(const char* topic)
+{
+    for (int i = 0; i < broker->numSubscriptions; i++) {
+        if (strcmp(broker->subscriptions[i], topic) == 0) { return broker->subscriptionQos[i]; }
+    }
+    return -1;
+}
+
+// The broker forgets the controller's session
+static void endSession(void)
+{
+    for (int i = 0; i < broker->numSubscriptions; i++) { free(broker->subscriptions[i]); }
+    broker->numSubscriptions = 0;
+    for (int i = 0; i < broker->numSessionQueue; i++) { freeMessage(&broker->sessionQueue[i]); }
+    broker->numSessionQueue = 0;
+    broker->session = false;
+}
+
+static void retain(const char* topic, const char* data, int len)
+{
+    int i;
+    for (i = 0; i < broker->numRetained; i++) {
+        if (strcmp(broker->retained[i].topic, topic) == 0) { break; }
+    }
+    if (i == broker->numRetained) {
+        if (len == 0) { return; }
+        if (broker->numRetained >= HOST_MQTT_MAX_RETAINED) { ESP_LOGE("host", "Retained message store full, %s dropped.", topic); return; }
+        broker->retained[broker->numRetained++].topic = copyData(topic, strlen(topic));
+    } else {
+        free(broker->retained[i].data);
+    }
+    broker->retained[i].data = copyData(data, len);
+    broker->retained[i].len = len;
+}
+
+static void clearRetained(void)
+{
+    for (int i = 0; i < broker->numRetained; i++) { freeMessage(&broker->retained[i]); }
+    broker->numRetained = 0;
+}
+
+/******************************************************************
+ *
+ * Broker side handling of a message from any client
+ *
+*******************************************************************/
+static void brokerReceive(const char* topic, const char* data, int len, int retainFlag)
+{
+    if (retainFlag) { retain(topic, data, len); }
+    int qos = subscribedQos(topic);
+    if (connected && qos >= 0) {
+        queueEvent(HostData, linkDue(ToClient, Hal_TimeUs()), 0, topic, data, len, 0);
+    } else if (!connected && qos > 0) {
+        if (broker->numSessionQueue < HOST_MQTT_MAX_OUTBOX) {
+            broker->sessionQueue[broker->numSessionQueue++] = (HostMessage){ copyData(topic, strlen(topic)), copyData(data, len), len, qos, 0, 0 };
+        } else {
+            ESP_LOGE("host", "Session queue full, %s dropped.", topic);
+        }
+    }
+}
+
+static void brokerSubscribe(const char* topic, int qos)
+{
+    int i;
+    for (i = 0; i < broker->numSubscriptions; i++) {
+        if (strcmp(broker->subscriptions[i], topic) == 0) { break; }
+    }
+    if (i == broker->numSubscriptions) {
+        if (broker->numSubscriptions >= HOST_MQTT_MAX_SUBSCRIPTIONS) { return; }
+        broker->subscriptions[broker->numSubscriptions++] = copyData(topic, strlen(topic));
+    }
+    broker->subscriptionQos[i] = qos;
+    for (int i = 0; i < broker->numRetained; i++) {
+        if (strcmp(broker->retained[i].topic, topic) == 0) {
+            queueEvent(HostData, linkDue(ToClient, Hal_TimeUs()), 0, topic, broker->retained[i].data, broker->retained[i].len, 0);
+        }
+    }
+}
+
+/******************************************************************
+ *
+ * Send a publish to the broker, keeping QoS 1 messages until
+ * they're acknowledged
+ *
+*******************************************************************/
+static void sendPublish(const char* topic, const char* data, int len, int qos, int retainFlag, int msgId)
+{
+    if (qos > 0) {
+        if (numInflight < HOST_MQTT_MAX_OUTBOX) {
+            inflight[numInflight++] = (HostMessage){ copyData(topic, strlen(topic)), copyData(data, len), len, qos, retainFlag, msgId };
+        } else {
+            ESP_LOGE("host", "In flight store full, msg_id=%d won't be resent.", msgId);
+        }
+    }
+    queueEvent(HostBrokerPublish, linkDue(ToBroker, Hal_TimeUs()), msgId, topic, data, len, retainFlag);
+}
+
+static void acknowledged(int msgId)
+{
+    TopicAlias_Acknowledged(msgId);
+    for (int i = 0; i < numInflight; i++) {
+        if (inflight[i].msgId == msgId) {
+            freeMessage(&inflight[i]);
+            memmove(&inflight[i], &inflight[i + 1], (numInflight - i - 1) * sizeof(HostMessage));
+            numInflight--;
+            return;
+        }
+    }
+}
+
+/******************************************************************
+ *
+ * Wire sizes. A republish of an alias on a new connection is only
+ * sent under MQTT 5.
+ *
+*******************************************************************/
+static void countWire(int bytes311, int bytes5, bool aliasOnly)
+{
+    if (bytes311 > 0) { wire.publishes++; }
+    if (aliasOnly) { wire.aliasOnly++; }
+    wire.bytes311 += bytes311;
+    wire.bytes5 += bytes5;
+}
+
+static int republishAlias(const char* topic, int alias, const char* data, int len, int qos, int retainFlag)
+{
+    int msgId = qos > 0 ? nextMsgId++ : 0;
+    sendPublish(topic, data, len, qos, retainFlag, msgId);
+    countWire(0, TopicAlias_PublishSize(true, strlen(topic), alias, 0, len, qos), false);
+    wire.republishes++;
+    return msgId;
+}
+
+void HostMqtt_WireStats(HostWireStats* stats)
+{
+    *stats = wire;
+}
+
+void HostMqtt_Reset(void)
+{
+    freeEvents();
+    for (int i = 0; i < MQTT_MAX_BROKERS; i++) {
+        broker = &brokers[i];
+        endSession();
+        clearRetained();
+        broker->hung = false;
+    }
+    activeBroker = 0;
+    broker = &brokers[0];
+    connectUs = 0;
+    for (int i = 0; i < numOutbox; i++) { freeMessage(&outbox[i]); }
+    for (int i = 0; i < numInflight; i++) { freeMessage(&inflight[i]); }
+    numOutbox = numInflight = 0;
+    connected = false;
+    nextMsgId = 1;
+    linkLatencyUs = 0;
+    linkLoss = 0.0;
+    lastDue[ToClient] = lastDue[ToBroker] = 0;
+    memset(&wire, 0, sizeof(wire));
+    TopicAlias_Initialise();
+}
+
+void HostMqtt_SetPublishCallback(HostPublishCallback callback)
+{
+    publishCallback = callback;
+}
+
+void HostMqtt_SetSendCallback(HostPublishCallback callback)
+{
+    sendCallback = callback;
+}
+
+/******************************************************************
+ *
+ * Set the one way latency of the link to the broker and the chance
+ * of each transmission being lost. The default is an instant,
+ * lossless link.
+ *
+*******************************************************************/
+void HostMqtt_SetLink(int64_t latencyUs, double loss, unsigned seed)
+{
+    linkLatencyUs = latencyUs;
+    linkLoss = loss;
+    linkSeed = seed;
+}
+
+/******************************************************************
+ *
+ * Connect to the simulated broker with a persistent session. If the
+ * broker still has the session it's resumed: the subscriptions are
+ * kept and the messages queued for them are delivered after the
+ * connection is acknowledged. Then any QoS 1 messages that weren't
+ * acknowledged before, or were published while disconnected, are
+ * sent.
+ *
+*******************************************************************/
+void HostMqtt_Connect(void)
+{
+    if (connected) { return; }
+    connected = true;
+    bool sessionPresent = broker->session;
+    broker->session = true;
+    int64_t brokerAccepts = linkDue(ToBroker, Hal_TimeUs());
+    if (!broker->hung) { queueEvent(HostConnected, linkDue(ToClient, brokerAccepts), sessionPresent, NULL, NULL, 0, 0); }
+    for (int i = 0; i < broker->numSessionQueue; i++) {
+        HostMessage* m = &broker->sessionQueue[i];
+        queueEvent(HostData, linkDue(ToClient, brokerAccepts), 0, m->topic, m->data, m->len, 0);
+        freeMessage(m);
+    }
+    broker->numSessionQueue = 0;
+    int count = numOutbox;
+    numOutbox = 0;
+    for (int i = 0; i < count; i++) {
+        HostMessage* m = &outbox[i];
+        sendPublish(m->topic, m->data, m->len, m->qos, m->retain, m->msgId);
+        freeMessage(m);
+    }
+}
+
+/******************************************************************
+ *
+ * Drop the connection. Everything in transit is lost, and the QoS 1
+ * messages that weren't acknowledged go back in the outbox ahead of
+ * the ones published while disconnected.
+ *
+*******************************************************************/
+void HostMqtt_Disconnect(void)
+{
+    if (!connected) { return; }
+    connected = false;
+    freeEvents();
+    int64_t now = Hal_TimeUs();
+    lastDue[ToClient] = lastDue[ToBroker] = now;
+    if (numInflight > 0) {
+        int keep = numOutbox;
+        if (keep + numInflight > HOST_MQTT_MAX_OUTBOX) { keep = HOST_MQTT_MAX_OUTBOX - numInflight; }
+        for (int i = keep; i < numOutbox; i++) { freeMessage(&outbox[i]); }
+        memmove(&outbox[numInflight], &outbox[0], keep * sizeof(HostMessage));
+        memcpy(&outbox[0], inflight, numInflight * sizeof(HostMessage));
+        numOutbox = keep + numInflight;
+        numInflight = 0;
+    }
+    queueEvent(HostDisconnected, now, 0, NULL, NULL, 0, 0);
+}
+
+/******************************************************************
+ *
+ * Restart the broker: the connection drops, and a broker without
+ * persistence loses its retained messages and sessions. Reconnect
+ * with HostMqtt_Connect() once it's meant to be back up.
+ *
+*******************************************************************/
+void HostMqtt_RestartBroker(bool persistent)
+{
+    HostMqtt_Disconnect();
+    if (!persistent) {
+        clearRetained();
+        endSession();
+    }
+}
+
+/******************************************************************
+ *
+ * Failover. A hung broker keeps the connection but drops every
+ * packet, so nothing is acknowledged or delivered. A failover's new
+ * connection takes connectUs to make, unless it's to a warm standby.
+ *
+*******************************************************************/
+void HostMqtt_HangBroker(int index, bool hung)
+{
+    brokers[index].hung = hung;
+}
+
+void HostMqtt_SetConnectUs(int64_t us)
+{
+    connectUs = us;
+}
+
+int HostMqtt_ActiveBroker(void)
+{
+    return activeBroker;
+}
+
+/******************************************************************
+ *
+ * A message from another client, e.g. a command from Home Assistant
+ *
+*******************************************************************/
+void HostMqtt_Inject(const char* topic, const char* payload, bool retainFlag)
+{
+    brokerReceive(topic, payload, strlen(payload), retainFlag);
+}
+
+// When the next event is due, INT64_MAX if there's none
+int64_t HostMqtt_NextDue(void)
+{
+    return eventHead != NULL ? eventHead->due : INT64_MAX;
+}
+
+/******************************************************************
+ *
+ * Deliver the events that are due by now. Returns the number
+ * handled.
+ *
+*******************************************************************/
+int HostMqtt_Poll(void)
+{
+    int count = 0;
+    while (eventHead != NULL && eventHead->due <= Hal_TimeUs()) {
+        HostEvent* e = eventHead;
+        eventHead = e->next;
+        switch (e->type) {
+            case HostConnected: TopicAlias_Connected(republishAlias); MqttProcess_Connected(e->msgId != 0); break;
+            case HostDisconnected: MqttProcess_Disconnected(); break;
+            case HostSubscribed: MqttProcess_Subscribed(e->msgId); break;
+            case HostPublished: acknowledged(e->msgId); MqttProcess_Published(e->msgId); break;
+            case HostData: MqttProcess_Data(e->topic, strlen(e->topic), e->data, e->len); break;
+            case HostBrokerPublish:
+                if (broker->hung) { break; }
+                if (publishCallback != NULL) { publishCallback(e->topic, e->data, e->len, e->msgId > 0 ? 1 : 0, e->retain); }
+                brokerReceive(e->topic, e->data, e->len, e->retain);
+                if (e->msgId > 0) { queueEvent(HostPublished, linkDue(ToClient, Hal_TimeUs()), e->msgId, NULL, NULL, 0, 0); }
+                break;
+            case HostBrokerSubscribe:
+                if (broker->hung) { break; }
+                queueEvent(HostSubscribed, linkDue(ToClient, Hal_TimeUs()), e->msgId, NULL, NULL, 0, 0);
+                brokerSubscribe(e->topic, e->retain);
+                break;
+            case HostConnectStart: HostMqtt_Connect(); break;
+        }
+        free(e->topic);
+        free(e->data);
+        free(e);
+        count++;
+    }
+    return count;
+}
+
+/******************************************************************
+ *
+ * HAL MQTT transport
+ *
+*******************************************************************/
+int Hal_MqttPublish(const char* topic, const char* data, int len, int qos, int retainFlag)
+{
+    return Hal_MqttPublishExpiring(topic, data, len, qos, retainFlag, 0);
+}
+
+int Hal_MqttPublishExpiring(const char* topic, const char* data, int len, int qos, int retainFlag, uint32_t expiryS)
+{
+    if (len == 0) { len = strlen(data); }
+    if (sendCallback != NULL) { sendCallback(topic, data, len, qos, retainFlag); }
+    int msgId = qos > 0 ? nextMsgId++ : 0;
+    int topicLen = strlen(topic);
+    if (!connected) {
+        if (qos == 0 || numOutbox >= HOST_MQTT_MAX_OUTBOX) { return -1; }
+        outbox[numOutbox++] = (HostMessage){ copyData(topic, topicLen), copyData(data, len), len, qos, retainFlag, msgId };
+        countWire(TopicAlias_PublishSize(false, topicLen, 0, 0, len, qos), TopicAlias_PublishSize(true, topicLen, 0, expiryS, len, qos), false);
+        return msgId;
+    }
+    TopicAliasUse use = TopicAlias_Use(topic, len);
+    sendPublish(topic, data, len, qos, retainFlag, msgId);
+    TopicAlias_Sent(topic, use, data, len, qos, retainFlag, expiryS, msgId);
+    countWire(TopicAlias_PublishSize(false, topicLen, 0, 0, len, qos),
+              TopicAlias_PublishSize(true, use.aliasOnly ? 0 : topicLen, use.alias, expiryS, len, qos), use.aliasOnly);
+    return msgId;
+}
+
+int Hal_MqttSubscribe(const char* topic, int qos)
+{
+    if (!connected) { return -1; }
+    int msgId = nextMsgId++;
+    queueEvent(HostBrokerSubscribe, linkDue(ToBroker, Hal_TimeUs()), msgId, topic, NULL, 0, qos);
+    return msgId;
+}
+
+// Like the device's: the old client goes, with everything it had queued or in flight
+void Hal_MqttSelectBroker(int index)
+{
+    if (index == activeBroker) { return; }
+    freeEvents();
+    for (int i = 0; i < numOutbox; i++) { freeMessage(&outbox[i]); }
+    for (int i = 0; i < numInflight; i++) { freeMessage(&inflight[i]); }
+    numOutbox = numInflight = 0;
+    int64_t now = Hal_TimeUs();
+    lastDue[ToClient] = lastDue[ToBroker] = now;
+    if (connected) {
+        connected = false;
+        queueEvent(HostDisconnected, now, 0, NULL, NULL, 0, 0);
+    }
+    TopicAlias_Initialise();
+
+    activeBroker = index;
+    broker = &brokers[index];
+    queueEvent(HostConnectStart, now + (config.mqttWarmStandby ? 0 : connectUs), 0, NULL, NULL, 0, 0);
+}
@@ -0,0 +1,62 @@
+/* MQTT Alarm Controller host build: simulated MQTT broker
+
+   Host implementation of the HAL MQTT transport. Publishes go to an in
+   process broker that keeps retained messages, loops messages back to
+   our own subscriptions and acknowledges QoS 1. Packets in both
+   directions are queued with the time they arrive, and HostMqtt_Poll()
+   handles the ones that are due, handing broker events to mqttProcess.c
+   in order the way the esp-mqtt task does on the device. The link can be
+   given latency and packet loss, and the broker can be restarted, to see
+   how the controller copes.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __MQTTHOST_H__
+#define __MQTTHOST_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+
+// Called when the broker receives a publish from the controller, or for a send callback, as the
+// controller publishes, connected or not
+typedef void (*HostPublishCallback)(const char* topic, const char* payload, int len, int qos, int retain);
+
+// Bytes the controller's publishes would take on the wire under each protocol
+typedef struct {
+    int publishes;
+    int aliasOnly;                      // Sent by topic alias alone under MQTT 5
+    int republishes;                    // Aliases republished on a new connection, MQTT 5 only
+    int64_t bytes311;
+    int64_t bytes5;
+} HostWireStats;
+
+void HostMqtt_Reset(void);
+void HostMqtt_SetPublishCallback(HostPublishCallback callback);
+void HostMqtt_SetSendCallback(HostPublishCallback callback);
+void HostMqtt_SetLink(int64_t latencyUs, double loss, unsigned seed);
+void HostMqtt_Connect(void);
+void HostMqtt_Disconnect(void);
+void HostMqtt_RestartBroker(bool persistent);
+void HostMqtt_Inject(const char* topic, const char* payload, bool retain);
+int HostMqtt_Poll(void);
+int64_t HostMqtt_NextDue(void);
+void HostMqtt_WireStats(HostWireStats* stats);
+void HostMqtt_HangBroker(int broker, bool hung);
+void HostMqtt_SetConnectUs(int64_t us);
+int HostMqtt_ActiveBroker(void);
+
+#endif // #ifndef __MQTTHOST_H__
@@ -0,0 +1,551 @@
+/* MQTT Alarm Controller host build: MQTT path latency and throughput rig
+
+   Drives the controller core against the simulated broker at stepped
+   event rates and measures, in virtual time:
+
+     - zone trip latency: an input pin changing to the input state
+       publish reaching a subscriber on the broker
+     - siren command latency: a command published to the siren's
+       .../command topic to the siren output pin changing
+
+   Each rate is run in each phase: a clean link, 1% and 5% packet loss
+   (each lost packet costs a TCP retransmission timeout and holds up the
+   packets behind it), and broker restarts. Zone trips run at the step
+   rate, round robin over the active inputs, and siren commands at a
+   quarter of it, alternating sirens and ON/OFF. Commands are published
+   retained, the way Home Assistant does, and aren't sent while the
+   broker is down.
+
+   Lost events are trips or commands that never reached the subscriber
+   or the pin, including ones overtaken by a later change. Duplicates are
+   input state publishes that didn't match a trip, e.g. QoS 1 resends and
+   the states sent on reconnect. Wire is the average size of the
+   controller's publishes while measuring, under MQTT 3.1.1 and under
+   MQTT 5 with topic aliases, see topicAlias.c.
+
+   The failover phases add a second broker (see mqttFailover.c) and hang
+   the first halfway through, so it stops acknowledging. Failover is the
+   time from the hang to the first publish reaching the second broker:
+   a new connection costs --connect-ms, a warm standby's is already
+   made. The events the first broker didn't acknowledge are resent in
+   order, so a zone that changed twice to the same state during the
+   hang shows the earlier change as lost, overtaken by the later one.
+   The report is a table, or one JSON object per step with --json
+   for tracking regressions.
+
+   Before the phases, each siren is sent OFF then ON, and ON then OFF,
+   both arriving before the main loop's next pass, which must leave it
+   in the later state.
+
+   The run fails, with a non-zero exit, if a siren doesn't end up in
+   the later of two quick commands, a clean link loses a siren command
+   or duplicates a publish, loses a trip at RIG_LOSSLESS_RATE or below,
+   or a failover phase never reaches the second broker.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "mqttFailover.h"
+#include "hostController.h"
+
+#define RIG_WARMUP_US S_TO_uS(1)           // Connect and subscribe before measuring
+#define RIG_TAIL_US S_TO_uS(5)             // Run on after the last event so late deliveries count
+#define RIG_RECONNECT_US 250000             // The client's reconnect_timeout_ms
+#define RIG_MAX_PENDING 4096
+#define RIG_MAX_RATES 16
+#define RIG_NUM_SIRENS 2
+#define RIG_LOSSLESS_RATE 5                 // Trips per second a clean link must deliver every one of
+
+typedef struct {
+    const char* name;
+    double loss;
+    bool restarts;
+    bool failover;                      // Hang the first of two brokers halfway through
+    bool warmStandby;
+} RigPhase;
+
+static const RigPhase phases[] = {
+    {"clean", 0.0, false, false, false},
+    {"loss1", 0.01, false, false, false},
+    {"loss5", 0.05, false, false, false},
+    {"restarts", 0.0, true, false, false},
+    {"failover", 0.0, false, true, false},
+    {"failover_warm", 0.0, false, true, true},
+};
+
+typedef struct {
+    int64_t timeUs;
+    int level;
+} Pending;
+
+// Events sent but not yet seen, oldest first
+typedef struct {
+    Pending items[RIG_MAX_PENDING];
+    int head;
+    int count;
+} PendingQueue;
+
+typedef struct {
+    int sent;
+    int lost;
+    int duplicates;
+    int64_t* latencies;
+    int numLatencies;
+} Stream;
+
+typedef struct {
+    Stream trips;
+    Stream commands;
+    double cpuS;
+    int64_t loops;
+    HostWireStats wire;
+    int64_t failoverUs;                 // Hang to the first publish on the second broker, -1 if none
+} StepResult;
+
+static const char* sirenNames[RIG_NUM_SIRENS] = {"ExternalSiren", "DownstairsSiren"};
+static const gpio_num_t sirenPins[RIG_NUM_SIRENS] = {ExternalSirenPin, DownstairsSirenPin};
+
+static PendingQueue zonePending[NUM_INPUTS];
+static PendingQueue sirenPending[RIG_NUM_SIRENS];
+static StepResult* current = NULL;
+static bool measuring = false;
+static int64_t nextLoopUs = 0;
+
+static int64_t durationUs = S_TO_uS(10);
+static int64_t latencyUs = 1000;
+static int64_t downUs = S_TO_uS(1);
+static int64_t restartEveryUs = S_TO_uS(5);
+static int64_t connectUs = S_TO_uS(1);
+static int64_t hungAtUs = 0;
+static unsigned seed = 1;
+
+static double cpuSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pendingAdd(PendingQueue* q, Stream* s, int level)
+{
+    s->sent++;
+    if (q->count == RIG_MAX_PENDING) {
+        // Give up on the oldest rather than stall the rig
+        q->head = (q->head + 1) % RIG_MAX_PENDING;
+        q->count--;
+        s->lost++;
+    }
+    q->items[(q->head + q->count) % RIG_MAX_PENDING] = (Pending){ Hal_TimeUs(), level };
+    q->count++;
+}
+
+/******************************************************************
+ *
+ * Match a level seen at seenUs against the latest pending event
+ * with that level, since a publish carries the latest state. Earlier
+ * pending events were overtaken and are lost. Returns false if
+ * nothing matched.
+ *
+*******************************************************************/
+static bool pendingMatch(PendingQueue* q, Stream* s, int level, int64_t seenUs)
+{
+    for (int i = q->count - 1; i >= 0; i--) {
+        Pending* p = &q->items[(q->head + i) % RIG_MAX_PENDING];
+        if (p->level != level) { continue; }
+        s->latencies[s->numLatencies++] = seenUs - p->timeUs;
+        s->lost += i;
+        q->head = (q->head + i + 1) % RIG_MAX_PENDING;
+        q->count -= i + 1;
+        return true;
+    }
+    return false;
+}
+
+/******************************************************************
+ *
+ * A subscriber on the broker, one link latency away
+ *
+*******************************************************************/
+static void onPublish(const char* topic, const char* payload, int len, int qos, int retain)
+{
+    if (!measuring) { return; }
+    if (current->failoverUs < 0 && hungAtUs > 0 && HostMqtt_ActiveBroker() != 0) {
+        current->failoverUs = Hal_TimeUs() + latencyUs - hungAtUs;
+    }
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        char stateTopic[160];
+        snprintf(stateTopic, sizeof(stateTopic), "homeassistant/binary_sensor/%s/%s/state", config.Name, config.inputs[i].inputName);
+        if (!config.inputs[i].active || strcmp(topic, stateTopic) != 0) { continue; }
+        bool on = len == 2 && strncmp(payload, "ON", 2) == 0;
+        if (!pendingMatch(&zonePending[i], &current->trips, on, Hal_TimeUs() + latencyUs)) { current->trips.duplicates++; }
+        return;
+    }
+}
+
+static void onOutput(gpio_num_t pin, int level)
+{
+    if (!measuring) { return; }
+    for (int i = 0; i < RIG_NUM_SIRENS; i++) {
+        if (pin == sirenPins[i]) { pendingMatch(&sirenPending[i], &current->commands, level, Hal_TimeUs()); }
+    }
+}
+
+static void sendCommand(int siren, int level)
+{
+    char topic[160];
+    snprintf(topic, sizeof(topic), "homeassistant/siren/%s/%s/command", config.Name, sirenNames[siren]);
+    pendingAdd(&sirenPending[siren], &current->commands, level);
+    HostMqtt_Inject(topic, level ? "{\"state\":\"ON\"}" : "{\"state\":\"OFF\"}", true);
+}
+
+/******************************************************************
+ *
+ * Run the simulation up to untilUs. The main loop runs every loop
+ * period, and the MQTT client handles packets as they arrive, the
+ * way the esp-mqtt task does.
+ *
+*******************************************************************/
+static void runUntil(int64_t untilUs)
+{
+    while (true) {
+        int64_t now = Hal_TimeUs();
+        int64_t mqttDue = HostMqtt_NextDue();
+        int64_t next = untilUs;
+        if (nextLoopUs < next) { next = nextLoopUs; }
+        if (mqttDue < next) { next = mqttDue; }
+        if (next > now) { HostHal_Advance(next - now); now = next; }
+        if (now >= nextLoopUs) {
+            HostController_Loop();
+            current->loops++;
+            nextLoopUs += HOST_LOOP_PERIOD_MS * 1000;
+        } else if (mqttDue <= now) {
+            HostMqtt_Poll();
+        } else {
+            return;
+        }
+    }
+}
+
+/******************************************************************
+ *
+ * Run one rate in one phase from a fresh start of the controller
+ *
+*******************************************************************/
+static void runStep(const RigPhase* phase, double rate, const char* storage, StepResult* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->failoverUs = -1;
+    hungAtUs = 0;
+    current = r;
+    int maxEvents = (int)(rate * durationUs / 1e6) + 2;
+    r->trips.latencies = malloc(maxEvents * sizeof(int64_t));
+    r->commands.latencies = malloc(maxEvents * sizeof(int64_t));
+    memset(zonePending, 0, sizeof(zonePending));
+    memset(sirenPending, 0, sizeof(sirenPending));
+
+    HostHal_Reset();
+    HostMqtt_Reset();
+    HostHal_SetOutputCallback(onOutput);
+    HostMqtt_SetPublishCallback(onPublish);
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetPin(hostInputPins[i], 0); }
+    HostController_Start(storage);
+    strcpy(config.mqttFailoverUrls[0], phase->failover ? "mqtt://standby.local" : "");
+    config.mqttWarmStandby = phase->warmStandby;
+    MqttFailover_Initialise();
+    HostMqtt_SetConnectUs(connectUs);
+    HostMqtt_SetLink(latencyUs, phase->loss, seed);
+    HostMqtt_Connect();
+    nextLoopUs = Hal_TimeUs();
+
+    int zones[NUM_INPUTS];
+    int numZones = 0;
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        if (config.inputs[i].active) { zones[numZones++] = i; }
+    }
+    int levels[NUM_INPUTS] = {0};
+    int sirenLevels[RIG_NUM_SIRENS] = {0};
+
+    runUntil(RIG_WARMUP_US);
+    measuring = true;
+    r->loops = 0;
+    HostWireStats wireStart;
+    HostMqtt_WireStats(&wireStart);
+    double cpuStart = cpuSeconds();
+
+    int64_t start = Hal_TimeUs();
+    int64_t end = start + durationUs;
+    int64_t tripInterval = (int64_t)(1e6 / rate);
+    int64_t commandInterval = tripInterval * 4;
+    int64_t nextTrip = start, nextCommand = start + tripInterval / 2;
+    int64_t nextRestart = phase->restarts ? start + restartEveryUs : INT64_MAX;
+    int64_t brokerUpAt = 0, reconnectAt = INT64_MAX;
+    int64_t hangAt = phase->failover ? start + durationUs / 2 : INT64_MAX;
+    int trip = 0, command = 0;
+    while (true) {
+        int64_t now = Hal_TimeUs();
+        if (now >= nextRestart && now < end) {
+            HostMqtt_RestartBroker(true);
+            brokerUpAt = now + downUs;
+            reconnectAt = brokerUpAt + RIG_RECONNECT_US;
+            nextRestart += restartEveryUs;
+        }
+        if (now >= hangAt) {
+            HostMqtt_HangBroker(0, true);
+            hungAtUs = now;
+            hangAt = INT64_MAX;
+        }
+        if (now >= reconnectAt) {
+            HostMqtt_Connect();
+            reconnectAt = INT64_MAX;
+        }
+        while (nextTrip <= now && nextTrip < end && numZones > 0) {
+            int input = zones[trip++ % numZones];
+            levels[input] = !levels[input];
+            HostHal_SetPin(hostInputPins[input], levels[input]);
+            pendingAdd(&zonePending[input], &r->trips, levels[input] == config.inputs[input].normallyClosed);
+            nextTrip += tripInterval;
+        }
+        while (nextCommand <= now && nextCommand < end) {
+            int siren = command++ % RIG_NUM_SIRENS;
+            if (now >= brokerUpAt) {
+                sirenLevels[siren] = !sirenLevels[siren];
+                sendCommand(siren, sirenLevels[siren]);
+            }
+            nextCommand += commandInterval;
+        }
+        if (now >= end && reconnectAt == INT64_MAX) { break; }
+
+        // Run to the next thing to do, or after the end, to the reconnect after a restart
+        int64_t next = INT64_MAX;
+        if (now < end) {
+            next = nextTrip < nextCommand ? nextTrip : nextCommand;
+            if (nextRestart < next) { next = nextRestart; }
+            if (hangAt < next) { next = hangAt; }
+            if (end < next) { next = end; }
+        }
+        if (reconnectAt < next) { next = reconnectAt; }
+        runUntil(next);
+    }
+    runUntil(end + RIG_TAIL_US);
+    measuring = false;
+    r->cpuS = cpuSeconds() - cpuStart;
+    HostMqtt_WireStats(&r->wire);
+    r->wire.publishes -= wireStart.publishes;
+    r->wire.aliasOnly -= wireStart.aliasOnly;
+    r->wire.republishes -= wireStart.republishes;
+    r->wire.bytes311 -= wireStart.bytes311;
+    r->wire.bytes5 -= wireStart.bytes5;
+
+    for (int i = 0; i < NUM_INPUTS; i++) { r->trips.lost += zonePending[i].count; }
+    for (int i = 0; i < RIG_NUM_SIRENS; i++) { r->commands.lost += sirenPending[i].count; }
+}
+
+static int compareLatency(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const Stream* s, int pc)
+{
+    if (s->numLatencies == 0) { return 0; }
+    return s->latencies[(s->numLatencies * pc) / 100 - (pc == 100 ? 1 : 0)];
+}
+
+static void report(const RigPhase* phase, double rate, StepResult* r, bool json)
+{
+    qsort(r->trips.latencies, r->trips.numLatencies, sizeof(int64_t), compareLatency);
+    qsort(r->commands.latencies, r->commands.numLatencies, sizeof(int64_t), compareLatency);
+    double delivered = (r->trips.numLatencies + r->commands.numLatencies) / (durationUs / 1e6);
+    double cpuPerLoopUs = r->loops > 0 ? r->cpuS * 1e6 / r->loops : 0;
+    double wire311 = r->wire.publishes > 0 ? (double)r->wire.bytes311 / r->wire.publishes : 0;
+    double wire5 = r->wire.publishes > 0 ? (double)r->wire.bytes5 / r->wire.publishes : 0;
+    char failover[16] = "-";
+    char failoverJson[16] = "null";
+    if (r->failoverUs >= 0) {
+        snprintf(failover, sizeof(failover), "%.1f", r->failoverUs / 1000.0);
+        snprintf(failoverJson, sizeof(failoverJson), "%.1f", r->failoverUs / 1000.0);
+    }
+
+    if (json) {
+        printf("{\"phase\": \"%s\", \"rate\": %g, \"trips\": %d, \"trip_p50_us\": %lld, \"trip_p99_us\": %lld, "
+            "\"trip_max_us\": %lld, \"trips_lost\": %d, \"duplicates\": %d, \"commands\": %d, \"command_p50_us\": %lld, "
+            "\"command_p99_us\": %lld, \"command_max_us\": %lld, \"commands_lost\": %d, \"delivered_per_s\": %.1f, "
+            "\"cpu_per_loop_us\": %.3f, \"publishes\": %d, \"alias_only\": %d, \"alias_republishes\": %d, "
+            "\"wire_311_bytes\": %.1f, \"wire_5_bytes\": %.1f, \"failover_ms\": %s}\n",
+            phase->name, rate, r->trips.sent, (long long)percentile(&r->trips, 50), (long long)percentile(&r->trips, 99),
+            (long long)percentile(&r->trips, 100), r->trips.lost, r->trips.duplicates, r->commands.sent,
+            (long long)percentile(&r->commands, 50), (long long)percentile(&r->commands, 99),
+            (long long)percentile(&r->commands, 100), r->commands.lost, delivered, cpuPerLoopUs, r->wire.publishes,
+            r->wire.aliasOnly, r->wire.republishes, wire311, wire5, failoverJson);
+    } else {
+        printf("%-13s %6g %6d %8.1f %8.1f %8.1f %5d %5d %6d %8.1f %8.1f %8.1f %5d %10.1f %9.3f %6.1f %6.1f %8s\n",
+            phase->name, rate, r->trips.sent, percentile(&r->trips, 50) / 1000.0, percentile(&r->trips, 99) / 1000.0,
+            percentile(&r->trips, 100) / 1000.0, r->trips.lost, r->trips.duplicates, r->commands.sent,
+            percentile(&r->commands, 50) / 1000.0, percentile(&r->commands, 99) / 1000.0,
+            percentile(&r->commands, 100) / 1000.0, r->commands.lost, delivered, cpuPerLoopUs, wire311, wire5, failover);
+    }
+}
+
+/******************************************************************
+ *
+ * The pass criteria for a step, see the top of the file. Reasons go
+ * to stderr, out of the way of the JSON. Returns the failures.
+ *
+*******************************************************************/
+static int checkStep(const RigPhase* phase, double rate, const StepResult* r)
+{
+    int failed = 0;
+    bool clean = phase->loss == 0 && !phase->restarts && !phase->failover;
+    if (clean && r->commands.lost > 0) {
+        fprintf(stderr, "FAIL: %s at %g/s lost %d siren commands\n", phase->name, rate, r->commands.lost);
+        failed++;
+    }
+    if (clean && r->trips.duplicates > 0) {
+        fprintf(stderr, "FAIL: %s at %g/s duplicated %d publishes\n", phase->name, rate, r->trips.duplicates);
+        failed++;
+    }
+    if (clean && rate <= RIG_LOSSLESS_RATE && r->trips.lost > 0) {
+        fprintf(stderr, "FAIL: %s at %g/s lost %d trips\n", phase->name, rate, r->trips.lost);
+        failed++;
+    }
+    if (phase->failover && r->failoverUs < 0) {
+        fprintf(stderr, "FAIL: %s at %g/s never reached the second broker\n", phase->name, rate);
+        failed++;
+    }
+    return failed;
+}
+
+/******************************************************************
+ *
+ * Two commands to one siren delivered between main loop passes.
+ * Returns the failures.
+ *
+*******************************************************************/
+static int checkCommandOrder(const char* storage)
+{
+    HostHal_Reset();
+    HostMqtt_Reset();
+    HostHal_SetOutputCallback(NULL);
+    HostMqtt_SetPublishCallback(NULL);
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetPin(hostInputPins[i], 0); }
+    HostController_Start(storage);
+    HostMqtt_SetLink(latencyUs, 0, seed);
+    HostMqtt_Connect();
+    for (int64_t t = 0; t < RIG_WARMUP_US; t += HOST_LOOP_PERIOD_MS * 1000) {
+        HostMqtt_Poll();
+        HostController_Loop();
+        HostHal_Advance(HOST_LOOP_PERIOD_MS * 1000);
+    }
+
+    int failed = 0;
+    for (int siren = 0; siren < RIG_NUM_SIRENS; siren++) {
+        for (int last = 1; last >= 0; last--) {
+            char topic[160];
+            snprintf(topic, sizeof(topic), "homeassistant/siren/%s/%s/command", config.Name, sirenNames[siren]);
+            HostMqtt_Inject(topic, last ? "{\"state\":\"OFF\"}" : "{\"state\":\"ON\"}", true);
+            HostMqtt_Inject(topic, last ? "{\"state\":\"ON\"}" : "{\"state\":\"OFF\"}", true);
+            while (HostMqtt_NextDue() <= Hal_TimeUs() + latencyUs) {
+                if (HostMqtt_NextDue() > Hal_TimeUs()) { HostHal_Advance(HostMqtt_NextDue() - Hal_TimeUs()); }
+                HostMqtt_Poll();
+            }
+            HostController_Loop();
+            HostHal_Advance(HOST_LOOP_PERIOD_MS * 1000);
+            if (HostHal_GetPin(sirenPins[siren]) != last) {
+                fprintf(stderr, "FAIL: %s %s then %s left it %s\n", sirenNames[siren], last ? "OFF" : "ON", last ? "ON" : "OFF",
+                    last ? "OFF" : "ON");
+                failed++;
+            }
+        }
+    }
+    return failed;
+}
+
+static int parseRates(char* list, double* rates)
+{
+    int n = 0;
+    for (char* t = strtok(list, ","); t != NULL && n < RIG_MAX_RATES; t = strtok(NULL, ",")) {
+        rates[n] = atof(t);
+        if (rates[n] <= 0) { return 0; }
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* storage = "host_storage";
+    const char* onlyPhase = NULL;
+    bool json = false;
+    double rates[RIG_MAX_RATES] = {2, 5, 10, 20, 50};
+    int numRates = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) { json = true; }
+        else if (strcmp(argv[i], "--rates") == 0 && i + 1 < argc) { numRates = parseRates(argv[++i], rates); }
+        else if (strcmp(argv[i], "--phase") == 0 && i + 1 < argc) { onlyPhase = argv[++i]; }
+        else if (strcmp(argv[i], "--duration-s") == 0 && i + 1 < argc) { durationUs = S_TO_uS(atoll(argv[++i])); }
+        else if (strcmp(argv[i], "--latency-us") == 0 && i + 1 < argc) { latencyUs = atoll(argv[++i]); }
+        else if (strcmp(argv[i], "--down-ms") == 0 && i + 1 < argc) { downUs = atoll(argv[++i]) * 1000; }
+        else if (strcmp(argv[i], "--restart-s") == 0 && i + 1 < argc) { restartEveryUs = S_TO_uS(atoll(argv[++i])); }
+        else if (strcmp(argv[i], "--connect-ms") == 0 && i + 1 < argc) { connectUs = atoll(argv[++i]) * 1000; }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) { seed = strtoul(argv[++i], NULL, 10); }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { storage = argv[++i]; }
+        else { numRates = 0; break; }
+    }
+    if (numRates == 0 || durationUs <= 0 || restartEveryUs <= 0) {
+        fprintf(stderr, "Usage: %s [--json] [--rates r,r,...] [--phase clean|loss1|loss5|restarts|failover|failover_warm]\n"
+            "       [--duration-s s] [--latency-us us] [--down-ms ms] [--restart-s s] [--connect-ms ms] [--seed n] [-s storage_dir]\n", argv[0]);
+        return 2;
+    }
+    hostLogLevel = ESP_LOG_NONE;     // Restarts log the disconnects as errors
+
+    if (!json) {
+        printf("%lld s per step, link latency %lld us, broker down %lld ms every %lld s, new connection %lld ms\n",
+            (long long)(durationUs / 1000000), (long long)latencyUs, (long long)(downUs / 1000), (long long)(restartEveryUs / 1000000),
+            (long long)(connectUs / 1000));
+        printf("%-13s %6s %6s %8s %8s %8s %5s %5s %6s %8s %8s %8s %5s %10s %9s %6s %6s %8s\n", "phase", "rate", "trips", "p50", "p99",
+            "max", "lost", "dup", "cmds", "p50", "p99", "max", "lost", "deliv/s", "cpu/loop", "wire", "wire", "failover");
+        printf("%-13s %6s %6s %8s %8s %8s %5s %5s %6s %8s %8s %8s %5s %10s %9s %6s %6s %8s\n", "", "/s", "", "ms", "ms", "ms", "", "",
+            "", "ms", "ms", "ms", "", "", "us", "3.1.1", "5", "ms");
+    }
+    bool ran = false;
+    int failed = checkCommandOrder(storage);
+    for (size_t p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+        if (onlyPhase != NULL && strcmp(onlyPhase, phases[p].name) != 0) { continue; }
+        for (int i = 0; i < numRates; i++) {
+            StepResult r;
+            runStep(&phases[p], rates[i], storage, &r);
+            report(&phases[p], rates[i], &r, json);
+            failed += checkStep(&phases[p], rates[i], &r);
+            free(r.trips.latencies);
+            free(r.commands.latencies);
+            ran = true;
+        }
+    }
+    if (!ran) { fprintf(stderr, "No phase called %s\n", onlyPhase); return 2; }
+    return failed ? 1 : 0;
+}
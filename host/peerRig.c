@@ -0,0 +1,379 @@
+/* MQTT Alarm Controller host build: LAN peer link rig
+
+   Several controller processes on one Linux host, peers in a real UDP
+   multicast group on the loopback interface, each running its main
+   loop in real time. Controller 0, this process, trips zone 0 and
+   then silences its external siren, over and over; the others have
+   config.peerTripSirens and config.peerFollowSirens, so each trip
+   should sound their external sirens and each silence stop them.
+
+   Every controller reports the moment its siren pin changes, and the
+   propagation is that less the moment controller 0 sent the event's
+   first copy, both on CLOCK_MONOTONIC. Before the events a packet
+   with the wrong key is sent, which every peer must drop.
+
+     peerRig [-s storage_dir] [-n controllers] [-e events] [-p port] [--loss fraction]
+
+   --loss drops that fraction of the datagrams each controller sends,
+   to show the copies getting events through and the duplicates
+   dropped; an event then only goes missing if all PEER_COPIES are
+   dropped, and one that gets through on a later copy is a main loop
+   pass or two late. Prints the propagation percentiles, the siren
+   changes lost and the duplicates dropped. Exits non-zero if the SipHash test vector
+   fails, a forged packet or a duplicate is acted on, or without --loss,
+   an event is lost. A 99th percentile propagation over PEER_TARGET_US
+   is only reported, it's wall clock time on a shared host.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "metrics.h"
+#include "peerLink.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "hostController.h"
+
+#define PEER_RIG_GROUP "239.255.71.1"
+#define PEER_RIG_KEY "000102030405060708090a0b0c0d0e0f"
+#define PEER_TARGET_US 10000            // 99th percentile propagation wanted, reported if it's missed
+#define EVENT_TIMEOUT_US 500000         // An event not seen by then is lost
+#define EVENT_GAP_US 60000              // Between one event being seen and the next
+#define MAX_CONTROLLERS 16
+
+// A controller's report to controller 0, small enough to be written atomically
+typedef struct {
+    int controller;
+    char kind;                          // 'S' siren pin changed, 'M' metrics at exit
+    int level;
+    int64_t atNs;
+    int32_t received, duplicates, rejected, actions;
+} Report;
+
+static int controllerId = 0;
+static int reportFd = -1;
+static int lastSirenLevel = 0;
+static double loss = 0;
+static int64_t firstCopyNs = 0;         // Controller 0: when the event's first copy went
+static uint32_t lastSeqSent = 0;
+
+static int64_t monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sirenChanged(gpio_num_t pin, int level)
+{
+    if (pin != ExternalSirenPin || level == lastSirenLevel) { return; }
+    lastSirenLevel = level;
+    Report r = { controllerId, 'S', level, monotonicNs() };
+    if (reportFd >= 0 && write(reportFd, &r, sizeof(r)) != sizeof(r)) { perror("report"); }
+}
+
+static bool peerSend(const uint8_t* data, int len)
+{
+    uint32_t seq = (uint32_t)data[12] | (uint32_t)data[13] << 8 | (uint32_t)data[14] << 16 | (uint32_t)data[15] << 24;
+    if (seq != lastSeqSent) {
+        lastSeqSent = seq;
+        firstCopyNs = monotonicNs();
+    }
+    return loss <= 0 || (double)rand() / RAND_MAX >= loss;
+}
+
+static int32_t metricValue(const char* json, const char* name)
+{
+    const char* p = strstr(json, name);
+    return p == NULL ? -1 : atoi(p + strlen(name) + 1);
+}
+
+/******************************************************************
+ *
+ * Start a controller in its own storage directory, as a peer
+ *
+*******************************************************************/
+static void startController(const char* storage, int id, int port)
+{
+    char dir[300];
+    snprintf(dir, sizeof(dir), "%s/peer%d", storage, id);
+    controllerId = id;
+    srand((unsigned)getpid());
+    HostHal_Reset();
+    HostMqtt_Reset();
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetPin(hostInputPins[i], !config.inputs[i].normallyClosed); }
+    HostController_Start(dir);
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetPin(hostInputPins[i], !config.inputs[i].normallyClosed); }
+
+    snprintf(config.UID, sizeof(config.UID), "peer-rig-%d", id);
+    strcpy(config.peerGroup, PEER_RIG_GROUP);
+    strcpy(config.peerKey, PEER_RIG_KEY);
+    config.peerPort = port;
+    config.peerTripSirens = id != 0;
+    config.peerFollowSirens = id != 0;
+    if (!PeerLink_Start()) {
+        fprintf(stderr, "Controller %d couldn't join the peer group.\n", id);
+        exit(2);
+    }
+    HostHal_SetOutputCallback(sirenChanged);
+    HostHal_SetPeerSendCallback(peerSend);
+    HostMqtt_Connect();
+}
+
+/******************************************************************
+ *
+ * Run the controller in real time for up to us, or until done()
+ * says stop. Wakes for each datagram, each main loop pass and
+ * anything to read on wakeFd.
+ *
+*******************************************************************/
+static int64_t lastNs = 0;
+static int64_t nextLoopNs = 0;
+
+static bool runFor(int64_t us, int wakeFd, bool (*done)(void))
+{
+    int64_t endNs = monotonicNs() + us * 1000;
+    while (true) {
+        int64_t now = monotonicNs();
+        HostHal_Advance((now - lastNs) / 1000);
+        lastNs = now;
+        HostHal_PeerPoll();
+        if (now >= nextLoopNs) {
+            HostController_Loop();
+            nextLoopNs = now + HOST_LOOP_PERIOD_MS * 1000000LL;
+        }
+        if (done != NULL && done()) { return true; }
+        if (now >= endNs) { return false; }
+
+        int64_t waitNs = (nextLoopNs < endNs ? nextLoopNs : endNs) - now;
+        struct pollfd fds[2] = { { HostHal_PeerFd(), POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+        poll(fds, wakeFd >= 0 ? 2 : 1, (int)(waitNs / 1000000) + 1);
+    }
+}
+
+// A peer: runs until controller 0 closes its end of the pipe, then sends its metrics
+static int quitFd = -1;
+
+static bool quitRequested(void)
+{
+    struct pollfd fd = { quitFd, POLLIN, 0 };
+    return poll(&fd, 1, 0) > 0;
+}
+
+static void runPeer(void)
+{
+    lastNs = monotonicNs();
+    while (!runFor(1000000, quitFd, quitRequested)) { }
+    char json[16384];
+    Metrics_FormatJson(json, sizeof(json));
+    Report r = { controllerId, 'M', 0, monotonicNs(),
+        metricValue(json, "\"alarm_peer_received_total\""), metricValue(json, "\"alarm_peer_duplicates_total\""),
+        metricValue(json, "\"alarm_peer_rejected_total\""), metricValue(json, "\"alarm_peer_actions_total\"") };
+    if (write(reportFd, &r, sizeof(r)) != sizeof(r)) { perror("report"); }
+    exit(0);
+}
+
+/******************************************************************
+ *
+ * Controller 0's side: collect the reports for an event
+ *
+*******************************************************************/
+static int readFd = -1;
+static int numControllers = 3;
+static int expectLevel = 0;
+static int expected = 0;                // Peers whose sirens should change
+static int seen = 0;
+static bool seenBy[MAX_CONTROLLERS];
+static int sirenLevel[MAX_CONTROLLERS];
+static int64_t* propagationNs = NULL;
+static int numPropagation = 0;
+static int wrongLevel = 0;
+static Report finals[MAX_CONTROLLERS];
+
+static void takeReports(void)
+{
+    Report r;
+    struct pollfd fd = { readFd, POLLIN, 0 };
+    while (poll(&fd, 1, 0) > 0 && read(readFd, &r, sizeof(r)) == sizeof(r)) {
+        if (r.kind == 'M') {
+            finals[r.controller] = r;
+            continue;
+        }
+        sirenLevel[r.controller] = r.level;
+        if (r.level != expectLevel || seenBy[r.controller]) {
+            wrongLevel++;
+        } else {
+            seenBy[r.controller] = true;
+            seen++;
+            propagationNs[numPropagation++] = r.atNs - firstCopyNs;
+        }
+    }
+}
+
+static bool allSeen(void)
+{
+    takeReports();
+    return seen == expected;
+}
+
+// Send an event and wait for the peers' sirens to follow. Returns the peers that didn't.
+static int event(bool trip)
+{
+    expectLevel = trip;
+    seen = 0;
+    memset(seenBy, 0, sizeof(seenBy));
+    expected = 0;
+    for (int id = 1; id < numControllers; id++) {
+        if (sirenLevel[id] != trip) { expected++; }
+    }
+    if (trip) {
+        HostHal_SetPin(hostInputPins[0], config.inputs[0].normallyClosed);
+    } else {
+        HostHal_SetPin(hostInputPins[0], !config.inputs[0].normallyClosed);
+        InputOutput_CommandSiren(0, false);
+    }
+    runFor(EVENT_TIMEOUT_US, readFd, allSeen);
+    int missed = expected - seen;
+    runFor(EVENT_GAP_US, readFd, NULL);
+    takeReports();
+    return missed;
+}
+
+static int compareNs(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// SipHash-2-4 reference vector: key 00..0f, message 00..0e
+static bool sipHashOk(void)
+{
+    uint8_t key[PEER_KEY_LEN], msg[15];
+    for (int i = 0; i < PEER_KEY_LEN; i++) { key[i] = i; }
+    for (int i = 0; i < 15; i++) { msg[i] = i; }
+    return PeerLink_SipHash(key, msg, sizeof(msg)) == 0xa129ca6149be45e5ULL;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* storage = "host_storage";
+    int events = 200;
+    int port = PEER_PORT_DEFAULT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { storage = argv[++i]; }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) { numControllers = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) { events = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) { port = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) { loss = atof(argv[++i]); }
+        else {
+            fprintf(stderr, "Usage: %s [-s storage_dir] [-n controllers] [-e events] [-p port] [--loss fraction]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (numControllers < 2 || numControllers > MAX_CONTROLLERS || events < 1) {
+        fprintf(stderr, "2 to %d controllers and at least one event.\n", MAX_CONTROLLERS);
+        return 2;
+    }
+    if (!sipHashOk()) {
+        fprintf(stderr, "SipHash-2-4 doesn't match the reference vector.\n");
+        return 1;
+    }
+    hostLogLevel = ESP_LOG_ERROR;
+    mkdir(storage, 0755);
+
+    int reports[2], quit[2];
+    if (pipe(reports) < 0 || pipe(quit) < 0) { perror("pipe"); return 2; }
+    reportFd = reports[1];
+    pid_t children[MAX_CONTROLLERS];
+    for (int id = 1; id < numControllers; id++) {
+        children[id] = fork();
+        if (children[id] == 0) {
+            close(reports[0]);
+            close(quit[1]);
+            quitFd = quit[0];
+            startController(storage, id, port);
+            runPeer();
+        }
+    }
+    close(quit[0]);
+    close(reports[1]);
+    reportFd = -1;
+    readFd = reports[0];
+    startController(storage, 0, port);
+    propagationNs = calloc(2 * events * (numControllers - 1), sizeof(int64_t));
+
+    // Let the peers start, then a zone trip under another key
+    lastNs = monotonicNs();
+    runFor(300000, -1, NULL);
+    uint8_t forged[PEER_PACKET_LEN] = { 'A', 'P', 1, PEER_ZONE, 1, 2, 3, 4, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    uint8_t otherKey[PEER_KEY_LEN] = { 0xff };
+    uint64_t mac = PeerLink_SipHash(otherKey, forged, 20);
+    for (int i = 0; i < 8; i++) { forged[20 + i] = (uint8_t)(mac >> (8 * i)); }
+    expectLevel = -1;
+    double configuredLoss = loss;
+    loss = 0;
+    Hal_PeerSend(forged, sizeof(forged));
+    loss = configuredLoss;
+    lastSeqSent = 0;
+    runFor(200000, -1, NULL);
+    takeReports();
+    int forgedActedOn = wrongLevel;
+
+    int lost = 0;
+    for (int e = 0; e < events; e++) {
+        lost += event(true);
+        lost += event(false);
+    }
+
+    close(quit[1]);
+    for (int id = 1; id < numControllers; id++) { waitpid(children[id], NULL, 0); }
+    takeReports();
+
+    qsort(propagationNs, numPropagation, sizeof(int64_t), compareNs);
+    int64_t p50 = numPropagation ? propagationNs[numPropagation / 2] : 0;
+    int64_t p99 = numPropagation ? propagationNs[(numPropagation * 99) / 100] : 0;
+    int64_t worst = numPropagation ? propagationNs[numPropagation - 1] : 0;
+    int32_t duplicates = 0, rejected = 0;
+    for (int id = 1; id < numControllers; id++) {
+        duplicates += finals[id].duplicates;
+        rejected += finals[id].rejected;
+    }
+
+    printf("%d controllers, %d events each way, %.0f%% of datagrams dropped\n", numControllers, events, loss * 100);
+    printf("propagation   p50 %.3f ms   p99 %.3f ms   max %.3f ms   (%d siren changes)\n",
+        p50 / 1e6, p99 / 1e6, worst / 1e6, numPropagation);
+    printf("lost %d   duplicates dropped %d   rejected %d   unexpected siren changes %d\n",
+        lost, (int)duplicates, (int)rejected, wrongLevel - forgedActedOn);
+
+    if (p99 > PEER_TARGET_US * 1000LL) { printf("p99 over the %d ms target\n", PEER_TARGET_US / 1000); }
+
+    bool ok = forgedActedOn == 0 && wrongLevel == forgedActedOn && rejected == numControllers - 1;
+    if (loss <= 0) { ok = ok && lost == 0; }
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
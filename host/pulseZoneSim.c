@@ -0,0 +1,224 @@
+/* MQTT Alarm Controller host build: pulse counting zone checks
+
+   Two parts. First the pulse window on its own (pulseZone.c) against a
+   table of pulse times with known answers. Then PIR pulse patterns run
+   through the controller core on the virtual clock, on a level zone
+   (HallwayMotion, 20 ms debounce) and a pulse zone (RumpusMotion, 2
+   pulses in 5 s) at the same time, to compare:
+
+     short   lone 10 ms pulse, noise        level may miss it, pulse ignores it
+     flick   lone 50 ms pulse, noise        level alarms, pulse ignores it
+     pair    two 10 ms pulses 1 s apart     level misses both, pulse trips
+     slow    two 50 ms pulses 6 s apart     pulse ignores them, outside the window
+     edge    two 50 ms pulses 4.9 s apart   pulse trips
+     burst   five 5 ms pulses 200 ms apart  pulse trips on the second
+     latch   output held for 6 s            pulse trips when held a window
+
+   The pulse zone's trip must come within two loop periods of the pulse
+   that completes its count (or of the end of the window for a latch).
+   Exits non-zero if any check fails.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "pulseZone.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "hostController.h"
+
+#define LEVEL_ZONE 0
+#define PULSE_ZONE 1
+#define SIM_PULSES 2
+#define SIM_WINDOW_MS 5000
+#define SIM_SETTLE_US 8000000           // Run on this long after the last pulse
+#define MAX_PULSES 8
+
+/******************************************************************
+ *
+ * Pulse window checks: pulses added at the given times (ms), and
+ * whether the last add should trip
+ *
+*******************************************************************/
+typedef struct {
+    const char* name;
+    int count;
+    int windowMs;
+    int pulses;
+    int64_t timesMs[MAX_PULSES];
+    bool trips;
+} WindowCheck;
+
+static const WindowCheck windowChecks[] = {
+    { "one pulse of one", 1, 1000, 1, {0}, true },
+    { "one pulse of two", 2, 1000, 1, {0}, false },
+    { "two inside", 2, 1000, 2, {0, 999}, true },
+    { "two on the edge", 2, 1000, 2, {0, 1000}, true },
+    { "two just outside", 2, 1000, 2, {0, 1001}, false },
+    { "third brings two close", 2, 1000, 3, {0, 2000, 2500}, true },
+    { "three spread", 3, 1000, 3, {0, 600, 1200}, false },
+    { "three with one old", 3, 1000, 4, {0, 600, 1200, 1500}, true },
+    { "two in one read", 2, 1000, 2, {500, 500}, true },
+    { "max count", PULSE_ZONE_MAX_COUNT, 1000, 8, {0, 1, 2, 3, 4, 5, 6, 7}, true },
+    { "over max is clamped", PULSE_ZONE_MAX_COUNT + 4, 1000, 8, {0, 1, 2, 3, 4, 5, 6, 7}, true },
+};
+
+static int runWindowChecks(void)
+{
+    int failed = 0;
+    int n = sizeof(windowChecks) / sizeof(windowChecks[0]);
+    for (int c = 0; c < n; c++) {
+        const WindowCheck* check = &windowChecks[c];
+        PulseWindow window;
+        PulseWindow_Initialise(&window, check->count, check->windowMs);
+        bool trip = false;
+        for (int k = 0; k < check->pulses; k++) { trip = PulseWindow_Add(&window, check->timesMs[k] * 1000, 1); }
+        if (trip != check->trips) {
+            printf("window check \"%s\": tripped %d, expected %d\n", check->name, trip, check->trips);
+            failed++;
+        }
+    }
+
+    // Several pulses in one read count as several
+    PulseWindow window;
+    PulseWindow_Initialise(&window, 3, 1000);
+    if (!PulseWindow_Add(&window, 0, 3) || PulseWindow_LastUs(&window) != 0) {
+        printf("window check \"three in one read\" failed\n");
+        failed++;
+    }
+    printf("pulse window: %d of %d checks passed\n", n + 1 - failed, n + 1);
+    return failed;
+}
+
+/******************************************************************
+ *
+ * Pattern scenarios through the controller
+ *
+*******************************************************************/
+typedef struct {
+    const char* name;
+    int pulses;
+    int64_t startMs[MAX_PULSES];
+    int64_t widthMs;
+    int64_t tripMs;                     // When the pulse zone should trip, -1 never
+} Pattern;
+
+static const Pattern patterns[] = {
+    { "short", 1, {0}, 10, -1 },
+    { "flick", 1, {0}, 50, -1 },
+    { "pair", 2, {0, 1000}, 10, 1000 },
+    { "slow", 2, {0, 6000}, 50, -1 },
+    { "edge", 2, {0, 4900}, 50, 4900 },
+    { "burst", 5, {0, 200, 400, 600, 800}, 5, 200 },
+    { "latch", 1, {0}, 6000, SIM_WINDOW_MS },
+};
+
+static int64_t onUs[NUM_INPUTS];
+static int onCount[NUM_INPUTS];
+static int64_t patternStartUs;
+
+static void onPublish(const char* topic, const char* payload, int len, int qos, int retain)
+{
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        char stateTopic[160];
+        snprintf(stateTopic, sizeof(stateTopic), "homeassistant/binary_sensor/%s/%s/state", config.Name, config.inputs[i].inputName);
+        if (strcmp(topic, stateTopic) != 0 || len != 2 || strncmp(payload, "ON", 2) != 0) { continue; }
+        if (onCount[i]++ == 0) { onUs[i] = Hal_TimeUs() - patternStartUs; }
+    }
+}
+
+// Run the loop every loop period until untilUs, setting pins at the exact edge times
+static void runUntil(int64_t untilUs, int64_t* nextLoopUs, int64_t edgeUs, int level)
+{
+    while (*nextLoopUs <= untilUs) {
+        if (edgeUs >= 0 && edgeUs < *nextLoopUs) { break; }
+        HostHal_Advance(*nextLoopUs - Hal_TimeUs());
+        HostController_Loop();
+        *nextLoopUs += HOST_LOOP_PERIOD_MS * 1000;
+    }
+    if (edgeUs >= 0) {
+        HostHal_Advance(edgeUs - Hal_TimeUs());
+        HostHal_SetPin(hostInputPins[LEVEL_ZONE], level);
+        HostHal_SetPin(hostInputPins[PULSE_ZONE], level);
+    }
+}
+
+static bool runPattern(const Pattern* p, const char* storage)
+{
+    HostHal_Reset();
+    HostMqtt_Reset();
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetPin(hostInputPins[i], 0); }
+    HostController_Start(storage);
+    config.inputs[PULSE_ZONE].pulseCount = SIM_PULSES;
+    config.inputs[PULSE_ZONE].pulseWindowMs = SIM_WINDOW_MS;
+    initialiseInputs(hostInputs, hostInputPins, NUM_INPUTS);
+    HostMqtt_SetPublishCallback(onPublish);
+    HostMqtt_Connect();
+
+    int64_t nextLoopUs = 0;
+    runUntil(1000000, &nextLoopUs, -1, 0);
+    patternStartUs = Hal_TimeUs();
+    memset(onCount, 0, sizeof(onCount));
+    for (int k = 0; k < p->pulses; k++) {
+        // NC zones, so a pulse is the loop opening (high)
+        int64_t start = patternStartUs + p->startMs[k] * 1000;
+        runUntil(start, &nextLoopUs, start, 1);
+        runUntil(start + p->widthMs * 1000, &nextLoopUs, start + p->widthMs * 1000, 0);
+    }
+    runUntil(Hal_TimeUs() + SIM_SETTLE_US, &nextLoopUs, -1, 0);
+
+    bool ok;
+    if (p->tripMs < 0) {
+        ok = onCount[PULSE_ZONE] == 0;
+    } else {
+        int64_t late = onCount[PULSE_ZONE] ? onUs[PULSE_ZONE] - p->tripMs * 1000 : -1;
+        ok = late >= 0 && late <= 2 * HOST_LOOP_PERIOD_MS * 1000;
+    }
+    char level[24], pulse[24], expected[24];
+    snprintf(level, sizeof(level), onCount[LEVEL_ZONE] ? "%d, %lld ms" : "none", onCount[LEVEL_ZONE], (long long)(onUs[LEVEL_ZONE] / 1000));
+    snprintf(pulse, sizeof(pulse), onCount[PULSE_ZONE] ? "%d, %lld ms" : "none", onCount[PULSE_ZONE], (long long)(onUs[PULSE_ZONE] / 1000));
+    snprintf(expected, sizeof(expected), p->tripMs < 0 ? "none" : "%lld ms", (long long)p->tripMs);
+    printf("%-8s %-14s %-14s %-10s %s\n", p->name, level, pulse, expected, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* storage = "host_storage";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { storage = argv[++i]; }
+        else {
+            fprintf(stderr, "Usage: %s [-s storage_dir]\n", argv[0]);
+            return 2;
+        }
+    }
+    hostLogLevel = ESP_LOG_ERROR;
+
+    int failed = runWindowChecks();
+
+    printf("\n%-8s %-14s %-14s %-10s\n", "pattern", "level ON", "pulse ON", "expected");
+    for (int k = 0; k < sizeof(patterns) / sizeof(patterns[0]); k++) {
+        if (!runPattern(&patterns[k], storage)) { failed++; }
+    }
+    return failed ? 1 : 0;
+}
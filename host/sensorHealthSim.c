@@ -0,0 +1,279 @@
+/* MQTT Alarm Controller host build: sensor health week simulation
+
+   Runs a simulated week of motion sensor traffic through the controller
+   core and prints when each zone's health problem sensor changes, so the
+   stuck, chattering and dead zone detection (sensorHealth.c) can be
+   checked against sensors that fail in known ways:
+
+     HallwayMotion  busy all week, 07:00 to 23:00
+     RumpusMotion   quieter, then stuck closed (never trips) from day 3 12:00
+     EntryMotion    stuck active on day 4 from 14:00 to 17:00
+     LoungeMotion   chatters on day 5 from 19:00 to 21:00
+
+   Traffic is random but seeded, so every run is the same. Time is
+   virtual; the main loop runs every loop period around input changes
+   and the clock skips ahead in between. Exits non-zero if a fault
+   isn't flagged inside its window with the right reason, a fault
+   that ends isn't cleared, or any other problem is flagged.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "sensorHealth.h"
+#include "halHost.h"
+#include "mqttHost.h"
+#include "hostController.h"
+
+#define SIM_HOUR_US ((int64_t)3600 * 1000000)
+#define SIM_DAY_US (SIM_HOUR_US * 24)
+#define SIM_DAYS 7
+#define SIM_MAX_EDGES 200000
+#define SIM_SETTLE_US 200000        // Run the loop at full rate this long after an edge
+#define SIM_SKIP_US 1000000         // Longest clock skip between loop passes
+#define SIM_DEAD_FROM_US (SIM_DAY_US * 3 + SIM_HOUR_US * 12)
+#define SIM_STUCK_FROM_US (SIM_DAY_US * 4 + SIM_HOUR_US * 14)
+#define SIM_STUCK_TO_US (SIM_STUCK_FROM_US + SIM_HOUR_US * 3)
+#define SIM_CHATTER_FROM_US (SIM_DAY_US * 5 + SIM_HOUR_US * 19)
+#define SIM_CHATTER_TO_US (SIM_CHATTER_FROM_US + SIM_HOUR_US * 2)
+
+typedef struct {
+    int64_t timeUs;
+    int input;
+    int level;
+} Edge;
+
+// A fault buildWeek() injects: its input, the reason it should be flagged with, the window it
+// should be flagged in and whether it's still flagged at the end of the week
+typedef struct {
+    int input;
+    const char* reason;
+    int64_t fromUs;
+    int64_t toUs;
+    bool lasts;
+    bool flagged;
+} Fault;
+
+static Fault faults[] = {
+    { 1, "dead", SIM_DEAD_FROM_US, SIM_DAY_US * SIM_DAYS, true, false },
+    { 2, "stuck", SIM_STUCK_FROM_US, SIM_STUCK_TO_US, false, false },
+    { 3, "chattering", SIM_CHATTER_FROM_US, SIM_CHATTER_TO_US, false, false },
+};
+#define SIM_FAULTS ((int)(sizeof(faults) / sizeof(faults[0])))
+
+static bool problem[NUM_INPUTS];
+static char reasons[NUM_INPUTS][40];
+static int unexpected = 0;
+
+static Edge edges[SIM_MAX_EDGES];
+static int numEdges = 0;
+static unsigned seed = 1;
+
+static double uniform(void)
+{
+    return rand_r(&seed) / ((double)RAND_MAX + 1.0);
+}
+
+static void addEdge(int64_t timeUs, int input, int level)
+{
+    if (numEdges < SIM_MAX_EDGES) { edges[numEdges++] = (Edge){ timeUs, input, level }; }
+}
+
+static int compareEdges(const void* a, const void* b)
+{
+    const Edge* x = a;
+    const Edge* y = b;
+    return (x->timeUs > y->timeUs) - (x->timeUs < y->timeUs);
+}
+
+/******************************************************************
+ *
+ * Motion trips of 5 to 30 s at random, perHour on average, between
+ * the from and to hours of each day in [startUs, endUs), skipping
+ * [gapStartUs, gapEndUs)
+ *
+*******************************************************************/
+static void addTraffic(int input, double perHour, int fromHour, int toHour, int64_t startUs, int64_t endUs,
+    int64_t gapStartUs, int64_t gapEndUs)
+{
+    int64_t t = startUs;
+    while (true) {
+        // Exponential gaps between trips
+        double u = uniform();
+        t += (int64_t)(-SIM_HOUR_US / perHour * log(1.0 - u));
+        if (t >= endUs) { return; }
+        int hour = (int)((t % SIM_DAY_US) / SIM_HOUR_US);
+        if (hour < fromHour || hour >= toHour) { continue; }
+        if (t >= gapStartUs && t < gapEndUs) { continue; }
+        int64_t length = 5000000 + (int64_t)(uniform() * 25000000);
+        addEdge(t, input, 1);
+        addEdge(t + length, input, 0);
+        t += length;
+    }
+}
+
+static void buildWeek(void)
+{
+    int64_t week = SIM_DAY_US * SIM_DAYS;
+    int64_t stuckStart = SIM_STUCK_FROM_US;
+    int64_t stuckEnd = SIM_STUCK_TO_US;
+    int64_t chatterStart = SIM_CHATTER_FROM_US;
+    int64_t chatterEnd = SIM_CHATTER_TO_US;
+
+    addTraffic(0, 8, 7, 23, 0, week, 0, 0);
+    addTraffic(1, 2, 8, 22, 0, SIM_DEAD_FROM_US, 0, 0);
+    addTraffic(2, 3, 7, 22, 0, week, stuckStart - SIM_HOUR_US, stuckEnd + SIM_HOUR_US);
+    addEdge(stuckStart, 2, 1);
+    addEdge(stuckEnd, 2, 0);
+    addTraffic(3, 4, 7, 23, 0, week, chatterStart - SIM_HOUR_US, chatterEnd + SIM_HOUR_US);
+    for (int64_t t = chatterStart; t < chatterEnd; ) {
+        addEdge(t, 3, 1);
+        t += 500000 + (int64_t)(uniform() * 1500000);
+        addEdge(t, 3, 0);
+        t += 500000 + (int64_t)(uniform() * 1500000);
+    }
+    qsort(edges, numEdges, sizeof(Edge), compareEdges);
+}
+
+static void printTime(int64_t us)
+{
+    int64_t s = us / 1000000;
+    printf("day %d %02d:%02d:%02d", (int)(s / 86400), (int)(s % 86400 / 3600), (int)(s % 3600 / 60), (int)(s % 60));
+}
+
+/******************************************************************
+ *
+ * Matches a zone flagged for a reason against the injected faults
+ *
+*******************************************************************/
+static void checkFlagged(int input, const char* now)
+{
+    bool expected = false;
+    for (int f = 0; f < SIM_FAULTS; f++) {
+        Fault* fault = &faults[f];
+        if (fault->input != input || strstr(now, fault->reason) == NULL) { continue; }
+        if (Hal_TimeUs() < fault->fromUs || Hal_TimeUs() >= fault->toUs) { continue; }
+        fault->flagged = true;
+        expected = true;
+    }
+    if (!expected) {
+        printf("  ^ unexpected\n");
+        unexpected++;
+    }
+}
+
+/******************************************************************
+ *
+ * Stand in Home Assistant. Prints the problem sensor changes.
+ *
+*******************************************************************/
+static void onPublish(const char* topic, const char* payload, int len, int qos, int retain)
+{
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        char healthTopic[160];
+        snprintf(healthTopic, sizeof(healthTopic), "homeassistant/binary_sensor/%s/%sHealth/state", config.Name, config.inputs[i].inputName);
+        if (!config.inputs[i].active || strcmp(topic, healthTopic) != 0) { continue; }
+
+        char state[400];
+        snprintf(state, sizeof(state), "%.*s", len, payload);
+        char now[40];
+        snprintf(now, sizeof(now), "%s%s%s", strstr(state, "\"stuck\":true") ? " stuck" : "",
+            strstr(state, "\"chattering\":true") ? " chattering" : "", strstr(state, "\"dead\":true") ? " dead" : "");
+        bool isProblem = strstr(state, "\"problem\":true") != NULL;
+        if (isProblem != problem[i] || strcmp(now, reasons[i]) != 0) {
+            printTime(Hal_TimeUs());
+            printf("  %-14s %s%s\n", config.inputs[i].inputName, isProblem ? "PROBLEM" : "ok", now);
+            if (isProblem) { checkFlagged(i, now); }
+            problem[i] = isProblem;
+            strcpy(reasons[i], now);
+        }
+        return;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* storage = "host_storage";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { storage = argv[++i]; }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) { seed = strtoul(argv[++i], NULL, 10); }
+        else {
+            fprintf(stderr, "Usage: %s [--seed n] [-s storage_dir]\n", argv[0]);
+            return 2;
+        }
+    }
+    hostLogLevel = ESP_LOG_ERROR;
+    buildWeek();
+
+    HostHal_Reset();
+    HostMqtt_Reset();
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetPin(hostInputPins[i], 0); }
+    HostController_Start(storage);
+    HostMqtt_SetPublishCallback(onPublish);
+    HostMqtt_Connect();
+
+    printf("%d input changes over %d days\n", numEdges, SIM_DAYS);
+    int64_t end = SIM_DAY_US * SIM_DAYS;
+    int64_t lastEdgeUs = -SIM_SETTLE_US;
+    int e = 0;
+    while (Hal_TimeUs() < end) {
+        while (e < numEdges && edges[e].timeUs <= Hal_TimeUs()) {
+            HostHal_SetPin(hostInputPins[edges[e].input], edges[e].level);
+            lastEdgeUs = edges[e].timeUs;
+            e++;
+        }
+        HostController_Loop();
+
+        int64_t step = HOST_LOOP_PERIOD_MS * 1000;
+        if (Hal_TimeUs() - lastEdgeUs > SIM_SETTLE_US) {
+            step = SIM_SKIP_US;
+            if (e < numEdges && edges[e].timeUs - Hal_TimeUs() < step) { step = edges[e].timeUs - Hal_TimeUs(); }
+            if (step < HOST_LOOP_PERIOD_MS * 1000) { step = HOST_LOOP_PERIOD_MS * 1000; }
+        }
+        HostHal_Advance(step);
+    }
+
+    printf("\nAfter %d days:\n", SIM_DAYS);
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        if (!config.inputs[i].active) { continue; }
+        char json[400];
+        if (SensorHealth_FormatJson(i, json, sizeof(json)) > 0) { printf("  %-14s %s\n", config.inputs[i].inputName, json); }
+    }
+
+    int failed = unexpected;
+    for (int f = 0; f < SIM_FAULTS; f++) {
+        Fault* fault = &faults[f];
+        const char* name = config.inputs[fault->input].inputName;
+        if (!fault->flagged) {
+            printf("FAIL: %s wasn't flagged %s in its window\n", name, fault->reason);
+            failed++;
+        }
+        else if (problem[fault->input] != fault->lasts) {
+            printf("FAIL: %s is %s at the end of the week\n", name, problem[fault->input] ? "still flagged" : "no longer flagged");
+            failed++;
+        }
+    }
+    if (unexpected > 0) { printf("FAIL: %d unexpected problems\n", unexpected); }
+    return failed ? 1 : 0;
+}
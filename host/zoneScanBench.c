@@ -0,0 +1,381 @@
+/* MQTT Alarm Controller host build: supervised zone scan benchmark
+
+   Drives the supervised zone scan (zoneScan.c) with synthetic zone
+   voltage traces and checks the accepted conditions against the
+   conditions the traces were generated from:
+
+     clean    alarms of 50 ms to 3 s, little noise
+     noisy    the same with heavy ADC noise and 50 Hz hum
+     glitch   real alarms mixed with 1 to 15 ms spikes to any condition
+     tamper   alarms, cut wires, shorts and a wire flapping open
+     drift    clean alarms with the loop resistance drifting +/-15%
+
+   Each trace runs on every supervised zone with a different seed, the
+   last zone with a normally open contact and the rest closed. The
+   scan runs from its HAL timer on the virtual clock and every ADC read
+   is generated for the time of the read.
+
+     detected  condition changes of 2 scan confirmations or longer that
+               were accepted, with the latency from the change
+     missed    condition changes that long that were never accepted
+     glitches  changes shorter than one confirmation (should be
+               rejected) and how many of them were accepted anyway
+     false     accepted changes to a condition the zone wasn't in
+
+   Changes between one and two confirmations long may go either way and
+   aren't counted. Also times the classifier and a full scan on this
+   machine. Exits non-zero if any trace has a missed change, an
+   accepted glitch or a false change.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "hal.h"
+#include "defines.h"
+#include "config.h"
+#include "zoneScan.h"
+#include "halHost.h"
+
+#define BENCH_DURATION_US ((int64_t)120 * 1000000)
+#define BENCH_MAX_SEGMENTS 4096
+#define BENCH_CONFIRM_US ((int64_t)ZONE_SCAN_CONFIRM * ZONE_SCAN_PERIOD_US)
+#define BENCH_OPEN_OHMS 1e9
+#define BENCH_SHORT_OHMS 10.0
+
+typedef enum { TRACE_CLEAN, TRACE_NOISY, TRACE_GLITCH, TRACE_TAMPER, TRACE_DRIFT, TRACE_COUNT } TraceKind;
+static const char* traceNames[TRACE_COUNT] = { "clean", "noisy", "glitch", "tamper", "drift" };
+
+// The zone's true condition from startUs until the next segment
+typedef struct {
+    int64_t startUs;
+    ZoneCondition condition;
+} Segment;
+
+typedef struct {
+    Segment segments[BENCH_MAX_SEGMENTS];
+    int count;
+    unsigned seed;
+    double noise;               // Standard deviation in counts
+    double hum;                 // 50 Hz amplitude in counts
+    double drift;               // Loop resistance drift, fraction either way
+    bool normallyClosed;
+} ZoneTrace;
+
+typedef struct {
+    int events;
+    int detected;
+    int missed;
+    int glitches;
+    int glitchesAccepted;
+    int falseChanges;
+    double latencySumUs;
+    int64_t latencyMaxUs;
+} Result;
+
+static gpio_num_t benchPins[NUM_INPUTS] = {In1_Pin, In2_Pin, In3_Pin, In4_Pin, In5_Pin, In6_Pin};
+static ZoneTrace traces[NUM_INPUTS];
+
+static double uniform(unsigned* seed)
+{
+    return rand_r(seed) / ((double)RAND_MAX + 1.0);
+}
+
+static double gaussian(unsigned* seed)
+{
+    double u = uniform(seed) + 1e-12;
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * uniform(seed));
+}
+
+static void addSegment(ZoneTrace* t, int64_t startUs, ZoneCondition condition)
+{
+    if (t->count < BENCH_MAX_SEGMENTS) { t->segments[t->count++] = (Segment){ startUs, condition }; }
+}
+
+/******************************************************************
+ *
+ * Generate a zone's conditions: normal, with an event after each
+ * random gap that lasts a random time and goes back to normal
+ *
+*******************************************************************/
+static void generate(ZoneTrace* t, TraceKind kind, unsigned seed, bool normallyClosed)
+{
+    memset(t, 0, sizeof(*t));
+    t->seed = seed;
+    t->normallyClosed = normallyClosed;
+    t->noise = kind == TRACE_NOISY ? 40 : 8;
+    t->hum = kind == TRACE_NOISY ? 60 : 0;
+    t->drift = kind == TRACE_DRIFT ? 0.15 : 0;
+
+    addSegment(t, 0, ZONE_NORMAL);
+    int64_t now = 500000;
+    while (now < BENCH_DURATION_US - 5000000) {
+        ZoneCondition condition = ZONE_ALARM;
+        // Log uniform 50 ms to 3 s
+        int64_t lengthUs = (int64_t)(50000 * pow(60.0, uniform(&seed)));
+        double pick = uniform(&seed);
+        if (kind == TRACE_GLITCH && pick < 0.5) {
+            condition = (ZoneCondition)(1 + rand_r(&seed) % 3);
+            lengthUs = 1000 + (int64_t)(uniform(&seed) * 14000);
+        } else if (kind == TRACE_TAMPER) {
+            if (pick < 0.2) { condition = ZONE_TAMPER_OPEN; }
+            else if (pick < 0.4) { condition = ZONE_TAMPER_SHORT; }
+            else if (pick < 0.5) {
+                condition = ZONE_TAMPER_OPEN;
+                lengthUs = 25000 + (int64_t)(uniform(&seed) * 10000);
+            }
+        }
+        addSegment(t, now, condition);
+        now += lengthUs;
+        addSegment(t, now, ZONE_NORMAL);
+        now += 200000 + (int64_t)(-800000 * log(1.0 - uniform(&seed)));
+    }
+}
+
+static ZoneCondition conditionAt(const ZoneTrace* t, int64_t timeUs)
+{
+    int lo = 0, hi = t->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (t->segments[mid].startUs <= timeUs) { lo = mid; } else { hi = mid - 1; }
+    }
+    return t->segments[lo].condition;
+}
+
+/******************************************************************
+ *
+ * The ADC: the loop resistance for the zone's condition against the
+ * pull-up, plus drift, hum and noise
+ *
+*******************************************************************/
+static int readAdc(gpio_num_t pin)
+{
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        if (benchPins[i] != pin) { continue; }
+        ZoneTrace* t = &traces[i];
+        double now = Hal_TimeUs() / 1e6;
+        double scale = 1.0 + t->drift * sin(2.0 * M_PI * now / 60.0);
+        double loopOhms;
+        switch (conditionAt(t, Hal_TimeUs())) {
+            case ZONE_TAMPER_OPEN: loopOhms = BENCH_OPEN_OHMS; break;
+            case ZONE_TAMPER_SHORT: loopOhms = BENCH_SHORT_OHMS; break;
+            case ZONE_ALARM: loopOhms = (t->normallyClosed ? config.eolOhms + config.eolAlarmOhms : config.eolOhms) * scale; break;
+            default: loopOhms = (t->normallyClosed ? config.eolOhms : config.eolOhms + config.eolAlarmOhms) * scale; break;
+        }
+        double raw = ZONE_ADC_FULL_SCALE * loopOhms / (loopOhms + config.eolPullUpOhms);
+        raw += t->hum * sin(2.0 * M_PI * 50.0 * now) + t->noise * gaussian(&t->seed);
+        if (raw < 0) { raw = 0; }
+        if (raw > ZONE_ADC_FULL_SCALE) { raw = ZONE_ADC_FULL_SCALE; }
+        return (int)raw;
+    }
+    return -1;
+}
+
+static void setUpConfig(void)
+{
+    SetDefaultConfig();
+    config.supervisedZones = true;
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        config.inputs[i].active = true;
+        snprintf(config.inputs[i].inputName, sizeof(config.inputs[i].inputName), "Zone%d", i + 1);
+        snprintf(config.inputs[i].descriptiveName, sizeof(config.inputs[i].descriptiveName), "Zone %d", i + 1);
+        config.inputs[i].normallyClosed = i != NUM_INPUTS - 1;   // The last one normally open
+    }
+}
+
+/******************************************************************
+ *
+ * Run a trace on every zone and score the accepted conditions
+ *
+*******************************************************************/
+static Result runTrace(TraceKind kind, unsigned seed, int* supervised)
+{
+    Result r = {0};
+    static int64_t acceptedUs[NUM_INPUTS][BENCH_MAX_SEGMENTS];
+    static ZoneCondition acceptedCondition[NUM_INPUTS][BENCH_MAX_SEGMENTS];
+    int accepted[NUM_INPUTS] = {0};
+
+    for (int i = 0; i < NUM_INPUTS; i++) { generate(&traces[i], kind, seed * 7919 + i, config.inputs[i].normallyClosed); }
+    HostHal_Reset();
+    HostHal_SetAdcCallback(readAdc);
+    ZoneScan_Initialise(benchPins, NUM_INPUTS);
+
+    ZoneCondition last[NUM_INPUTS];
+    *supervised = 0;
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        last[i] = ZoneScan_Condition(i);
+        if (ZoneScan_IsSupervised(i)) { (*supervised)++; }
+    }
+    while (Hal_TimeUs() < BENCH_DURATION_US) {
+        HostHal_Advance(ZONE_SCAN_PERIOD_US);
+        for (int i = 0; i < NUM_INPUTS; i++) {
+            ZoneCondition c = ZoneScan_Condition(i);
+            if (c != last[i] && accepted[i] < BENCH_MAX_SEGMENTS) {
+                acceptedUs[i][accepted[i]] = Hal_TimeUs();
+                acceptedCondition[i][accepted[i]++] = c;
+            }
+            last[i] = c;
+        }
+    }
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        if (!ZoneScan_IsSupervised(i)) { continue; }
+        const ZoneTrace* t = &traces[i];
+        ZoneCondition settled = t->segments[0].condition;  // Last condition held long enough to be accepted
+        bool unsure = false;                                // The last change may or may not have been accepted
+        for (int s = 1; s < t->count; s++) {
+            int64_t start = t->segments[s].startUs;
+            int64_t end = s + 1 < t->count ? t->segments[s + 1].startUs : BENCH_DURATION_US;
+            int64_t length = end - start;
+            bool seen = false;
+            int64_t latency = 0;
+            for (int a = 0; a < accepted[i]; a++) {
+                if (acceptedCondition[i][a] == t->segments[s].condition && acceptedUs[i][a] >= start &&
+                    acceptedUs[i][a] <= end + ZONE_SCAN_PERIOD_US) {
+                    seen = true;
+                    latency = acceptedUs[i][a] - start;
+                    break;
+                }
+            }
+            if (length < BENCH_CONFIRM_US) {
+                r.glitches++;
+                if (seen) { r.glitchesAccepted++; }
+                continue;
+            }
+            if (length < 2 * BENCH_CONFIRM_US) {
+                unsure = true;
+                continue;
+            }
+            // Going back to the settled condition after a rejected glitch isn't a change
+            bool change = !unsure && t->segments[s].condition != settled;
+            settled = t->segments[s].condition;
+            unsure = false;
+            if (change) {
+                r.events++;
+                if (seen) {
+                    r.detected++;
+                    r.latencySumUs += latency;
+                    if (latency > r.latencyMaxUs) { r.latencyMaxUs = latency; }
+                } else {
+                    r.missed++;
+                }
+            }
+        }
+
+        // An accepted change is false if the zone wasn't in that condition within a confirmation before
+        for (int a = 0; a < accepted[i]; a++) {
+            bool real = false;
+            for (int64_t back = 0; back <= BENCH_CONFIRM_US + ZONE_SCAN_PERIOD_US && !real; back += 1000) {
+                real = conditionAt(t, acceptedUs[i][a] - back) == acceptedCondition[i][a];
+            }
+            if (!real) { r.falseChanges++; }
+        }
+    }
+    return r;
+}
+
+static double nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/******************************************************************
+ *
+ * Time the classifier, and a full scan with a fixed ADC reading
+ *
+*******************************************************************/
+static void timeClassifier(double* classifyNs, double* scanNs)
+{
+    EolTable table;
+    ZoneScan_BuildTable(&table, config.eolPullUpOhms, config.eolOhms, config.eolAlarmOhms, true);
+    static uint16_t raws[4096];
+    unsigned seed = 1;
+    for (int i = 0; i < 4096; i++) { raws[i] = rand_r(&seed) % (ZONE_ADC_FULL_SCALE + 1); }
+
+    const int rounds = 4000;
+    volatile int sink = 0;
+    double start = nowNs();
+    for (int k = 0; k < rounds; k++) {
+        for (int i = 0; i < 4096; i++) { sink += ZoneScan_Classify(&table, raws[i]); }
+    }
+    *classifyNs = (nowNs() - start) / (rounds * 4096.0);
+
+    HostHal_Reset();
+    for (int i = 0; i < NUM_INPUTS; i++) { HostHal_SetAdc(benchPins[i], 2048); }
+    ZoneScan_Initialise(benchPins, NUM_INPUTS);
+    const int scans = 1000000;
+    start = nowNs();
+    for (int k = 0; k < scans; k++) { ZoneScan_Scan(); }
+    *scanNs = (nowNs() - start) / scans;
+    (void)sink;
+}
+
+int main(int argc, char* argv[])
+{
+    bool json = false;
+    unsigned seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) { json = true; }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) { seed = strtoul(argv[++i], NULL, 10); }
+        else {
+            fprintf(stderr, "Usage: %s [--json] [--seed n]\n", argv[0]);
+            return 2;
+        }
+    }
+    hostLogLevel = ESP_LOG_NONE;
+    setUpConfig();
+
+    if (!json) {
+        printf("%-8s %6s %8s %6s %8s %8s %5s %8s %8s\n", "trace", "events", "detected", "missed", "glitches", "accepted", "false", "mean_ms", "max_ms");
+    }
+    int supervised = 0;
+    int failed = 0;
+    for (int k = 0; k < TRACE_COUNT; k++) {
+        Result r = runTrace((TraceKind)k, seed, &supervised);
+        if (r.missed > 0 || r.glitchesAccepted > 0 || r.falseChanges > 0) { failed++; }
+        double mean = r.detected ? r.latencySumUs / r.detected / 1000.0 : 0;
+        if (json) {
+            printf("{\"trace\":\"%s\",\"zones\":%d,\"events\":%d,\"detected\":%d,\"missed\":%d,\"glitches\":%d,"
+                "\"glitches_accepted\":%d,\"false\":%d,\"latency_mean_ms\":%.1f,\"latency_max_ms\":%.1f}\n",
+                traceNames[k], supervised, r.events, r.detected, r.missed, r.glitches, r.glitchesAccepted, r.falseChanges,
+                mean, r.latencyMaxUs / 1000.0);
+        } else {
+            printf("%-8s %6d %8d %6d %8d %8d %5d %8.1f %8.1f\n", traceNames[k], r.events, r.detected, r.missed,
+                r.glitches, r.glitchesAccepted, r.falseChanges, mean, r.latencyMaxUs / 1000.0);
+        }
+    }
+
+    double classifyNs, scanNs;
+    timeClassifier(&classifyNs, &scanNs);
+    double scanHz = 1e6 / ZONE_SCAN_PERIOD_US;
+    if (json) {
+        printf("{\"zones\":%d,\"scan_hz\":%.0f,\"classify_ns\":%.2f,\"scan_ns\":%.1f}\n", supervised, scanHz, classifyNs, scanNs);
+    } else {
+        printf("\n%d supervised zones scanned at %.0f Hz (GPIO %d has no ADC channel and stays digital)\n",
+            supervised, scanHz, In4_Pin);
+        printf("classify %.2f ns per read, full scan %.1f ns on this host, excluding ADC conversions\n", classifyNs, scanNs);
+        if (failed) { printf("FAIL: %d traces with missed, accepted glitch or false changes\n", failed); }
+    }
+    return failed ? 1 : 0;
+}
@@ -22,21 +22,27 @@
 #include "esp_log.h"
 #include "inttypes.h"
 
-#include "utilities.h"
+#include "hal.h"
 #include "config.h"
 #include "mqttProcess.h"
+#include "metrics.h"
 #include "AlarmMachine.h"
 
+static Metric alarmStateChanges = METRIC_COUNTER_INIT("alarm_state_changes_total", "Alarm machine state changes");
+static Metric alarmState = METRIC_GAUGE_INIT("alarm_state", "Alarm machine state (0 armed, 1 disarmed, 2 triggered)");
+static Metric sirenActivations = METRIC_COUNTER_INIT("alarm_siren_activations_total", "Siren activations by the alarm machine");
+
 /* ---------- External Siren State --------------*/
 void SetExternalSirenState(AlarmMachine* instance, SirenStates state)
 {
     switch (state) {
         case Off:
-            gpio_set_level(instance->externalSirenPin, 1); 
+            Hal_GpioWrite(instance->externalSirenPin, 1); 
             SendSirenState("ExternalSiren", true);
             break;
         case On:
-            gpio_set_level(instance->externalSirenPin, 1); 
+            Metrics_Increment(&sirenActivations);
+            Hal_GpioWrite(instance->externalSirenPin, 1); 
             SendSirenState("ExternalSiren", true);
             break;
     }
@@ -47,11 +53,12 @@ void SetInternalSirenState(AlarmMachine* instance, SirenStates state)
 {
     switch (state) {
         case Off:
-            gpio_set_level(instance->internalSirenPin, 1); 
+            Hal_GpioWrite(instance->internalSirenPin, 1); 
             SendSirenState("InternalSiren", true);
             break;
         case On:
-            gpio_set_level(instance->internalSirenPin, 1); 
+            Metrics_Increment(&sirenActivations);
+            Hal_GpioWrite(instance->internalSirenPin, 1); 
             SendSirenState("InternalSiren", true);
             break;
     }
@@ -69,11 +76,18 @@ void AlarmMachine_Initialise(AlarmMachine* instance, gpio_num_t externalSirenPin
     instance->alarmState = Disarmed;
     instance->externalSirenState = Off;
     instance->internalSirenState = Off;
+
+    Metrics_Register(&alarmStateChanges);
+    Metrics_Register(&alarmState);
+    Metrics_Register(&sirenActivations);
+    Metrics_Set(&alarmState, instance->alarmState);
 }
 
 bool AlarmMachine_SetAlarmState(AlarmMachine* instance, AlarmStates state)
 {
+    if (instance->alarmState != state) { Metrics_Increment(&alarmStateChanges); }
     instance->alarmState = state;
+    Metrics_Set(&alarmState, state);
     if (state == Disarmed) {
     }
     return true;
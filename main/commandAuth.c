@@ -0,0 +1,134 @@
+/* MQTT Alarm Controller: Signed diagnostics commands
+
+   Anything that can publish to the diagnostics command topic could
+   otherwise reflash the controller or storm its broker connection, so
+   those commands carry a signature:
+
+     <command> <unix time> <HMAC-SHA256 hex>
+
+   The HMAC is over everything before the last space, the command and
+   the time, keyed with config.httpApiToken, the local API's token, so
+   the token itself never goes through the broker. tools/sign_command.py
+   makes them.
+
+   A command is taken only once, and only while it's fresh: its time
+   must be within COMMAND_AUTH_WINDOW_S of the controller's clock and
+   after the last one taken, which is kept in COMMAND_AUTH_FILENAME so
+   a restart doesn't open the way to replaying an old one, such as an
+   update to an older image. Nothing is taken until the clock is set, or
+   without a token.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inttypes.h"
+#include "esp_log.h"
+#include "mbedtls/md.h"
+
+#include "defines.h"
+#include "config.h"
+#include "hal.h"
+#include "metrics.h"
+#include "timeService.h"
+#include "commandAuth.h"
+
+#define COMMAND_AUTH_MAC_LEN 32
+
+static int64_t lastTimeS = 0;           // The last accepted command's, only used on the MQTT task
+
+static Metric authFailures = METRIC_COUNTER_INIT("alarm_command_auth_failures_total", "Signed diagnostics commands refused");
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+static bool decodeMac(const char* hex, uint8_t* mac)
+{
+    if (strlen(hex) != 2 * COMMAND_AUTH_MAC_LEN) { return false; }
+    for (int i = 0; i < COMMAND_AUTH_MAC_LEN; i++) {
+        int high = hexValue(hex[2 * i]);
+        int low = hexValue(hex[2 * i + 1]);
+        if (high < 0 || low < 0) { return false; }
+        mac[i] = (uint8_t)(high << 4 | low);
+    }
+    return true;
+}
+
+static bool refuse(const char* reason)
+{
+    Metrics_Increment(&authFailures);
+    ESP_LOGW(TAG, "Diagnostics command refused, %s.", reason);
+    return false;
+}
+
+/******************************************************************
+ *
+ * Is the command signed, fresh and not seen before? Call from the
+ * MQTT task. The MAC's compared in constant time.
+ *
+*******************************************************************/
+bool CommandAuth_Verify(const char* command)
+{
+    if (config.httpApiToken[0] == '\0') { return refuse("no API token is configured to check it with"); }
+    const char* macHex = strrchr(command, ' ');
+    uint8_t mac[COMMAND_AUTH_MAC_LEN];
+    if (macHex == NULL || !decodeMac(macHex + 1, mac)) { return refuse("it isn't signed"); }
+    size_t signedLen = macHex - command;
+
+    uint8_t expected[COMMAND_AUTH_MAC_LEN];
+    int err = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                              (const unsigned char*)config.httpApiToken, strlen(config.httpApiToken),
+                              (const unsigned char*)command, signedLen, expected);
+    if (err != 0) { return refuse("the HMAC failed"); }
+    uint8_t diff = 0;
+    for (int i = 0; i < COMMAND_AUTH_MAC_LEN; i++) { diff |= mac[i] ^ expected[i]; }
+    if (diff != 0) { return refuse("bad signature"); }
+
+    // The time's the last word signed
+    const char* timeText = command + signedLen;
+    while (timeText > command && timeText[-1] != ' ') { timeText--; }
+    char* end;
+    int64_t timeS = strtoll(timeText, &end, 10);
+    if (timeText == command || end != command + signedLen) { return refuse("no time"); }
+    if (!TimeService_IsSet()) { return refuse("the clock isn't set"); }
+    int64_t nowS = TimeService_NowUs() / 1000000;
+    if (timeS < nowS - COMMAND_AUTH_WINDOW_S || timeS > nowS + COMMAND_AUTH_WINDOW_S) { return refuse("its time is too far from ours"); }
+    if (timeS <= lastTimeS) { return refuse("it's been used"); }
+
+    lastTimeS = timeS;
+    char text[24];
+    int len = snprintf(text, sizeof(text), "%" PRIi64, timeS);
+    if (!Hal_StorageWrite(COMMAND_AUTH_FILENAME, text, len)) { ESP_LOGE(TAG, "Couldn't save the diagnostics command time."); }
+    return true;
+}
+
+void CommandAuth_Initialise(void)
+{
+    Metrics_Register(&authFailures);
+    char text[24];
+    int len = Hal_StorageRead(COMMAND_AUTH_FILENAME, text, sizeof(text) - 1);
+    if (len > 0) {
+        text[len] = '\0';
+        lastTimeS = strtoll(text, NULL, 10);
+    }
+}
@@ -0,0 +1,34 @@
+/* MQTT Alarm Controller: Signed diagnostics commands
+
+   Diagnostics commands that can change the firmware or disturb the
+   broker connection only run with an HMAC-SHA256 made with
+   config.httpApiToken, see commandAuth.c.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __COMMANDAUTH_H__
+#define __COMMANDAUTH_H__
+
+#include <stdbool.h>
+
+#define COMMAND_AUTH_WINDOW_S 300                   // A command's time must be within this of ours
+#define COMMAND_AUTH_FILENAME "commandTime.txt"     // The last accepted command's time, none older is taken after a restart
+
+void CommandAuth_Initialise(void);
+bool CommandAuth_Verify(const char* command);
+
+#endif // #ifndef __COMMANDAUTH_H__
@@ -20,22 +20,24 @@
 */
 
 #include <string.h>
-#include <sys/unistd.h>
-#include <sys/stat.h>
-#include "esp_err.h"
-#include "esp_spiffs.h"
 #include <cJSON.h>
 
-#include "lwip/sockets.h"
-#include "lwip/dns.h"
-#include "lwip/netdb.h"
-#include "mqtt_client.h"
-
+#include "hal.h"
 #include "config.h"
 #include "utilities.h"
 
 Configuration config;
 
+// An optional string setting, empty if it's missing or too long
+static void loadOptionalString(cJSON* parent, const char* key, char* value, size_t size)
+{
+    cJSON* item = cJSON_GetObjectItemCaseSensitive(parent, key);
+    value[0] = '\0';
+    if (cJSON_IsString(item) && (item->valuestring != NULL) && strlen(item->valuestring) < size) {
+        strcpy(value, item->valuestring);
+    }
+}
+
 void SetDefaultConfig()
 {
     // Create the default config file
@@ -49,31 +51,48 @@ void SetDefaultConfig()
     strcpy(config.mqttUsername, "Not Set!");
     strcpy(config.mqttPassword, "Not Set!");
     config.battVCalFactor = 1.0;
+    config.minPublishIntervalMs = MinPublishIntervalMsDefault;
+    config.chatterPerMinute = ChatterPerMinuteDefault;
+    config.supervisedZones = false;
+    config.eolPullUpOhms = EolPullUpOhmsDefault;
+    config.eolOhms = EolOhmsDefault;
+    config.eolAlarmOhms = EolAlarmOhmsDefault;
+    config.extendedPayloads = false;
+    config.sntpServer[0] = '\0';
+    config.timeFeedUtcOffsetMin = 0;
+    config.staticIp[0] = '\0';
+    config.staticNetmask[0] = '\0';
+    config.staticGateway[0] = '\0';
+    config.staticDns[0] = '\0';
+    config.mqttPskIdentity[0] = '\0';
+    config.mqttPskKey[0] = '\0';
+    config.mqtt5 = false;
+    for (int i = 0; i < MQTT_MAX_FAILOVER; i++) { config.mqttFailoverUrls[i][0] = '\0'; }
+    config.mqttWarmStandby = false;
+    config.peerGroup[0] = '\0';
+    config.peerPort = PEER_PORT_DEFAULT;
+    config.peerKey[0] = '\0';
+    config.peerTripSirens = false;
+    config.peerFollowSirens = false;
+    config.httpApiToken[0] = '\0';
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        config.inputs[i].pulseCount = 0;
+        config.inputs[i].pulseWindowMs = PulseWindowMsDefault;
+    }
 }
 
 // Loads the configuration from a file
 bool LoadConfiguration()
 {
-    // Open file for reading
-    FILE *f = fopen(filename, "r");
-    if (f == NULL)
+    // Read the settings file
+    char doc[2048];
+    int len = Hal_StorageRead(filename, doc, sizeof(doc) - 1);
+    if (len < 0)
     {
         printf("Failed to open file for reading.\r\n");
         return false;
     }
-
-    // Initialise the json document
-    char doc[2048];
-    memset(doc, '\0', sizeof(doc));
-
-    // Read the settings file
-    int p = 0;
-    while(1) {
-      char c = fgetc(f);
-      if( feof(f) || p >= sizeof(doc) - 1) { break; } 
-      doc[p++] = c;
-    }
-    fclose(f);
+    doc[len] = '\0';
 
     // Parse the json config document
     cJSON* settingsJSON = cJSON_Parse(doc);
@@ -142,6 +161,81 @@ bool LoadConfiguration()
         config.retries = item->valueint;
     } else { strcat(errorString, "retries "); } // record which value failed
 
+    // Optional settings, the defaults are used if they're missing
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "minPublishIntervalMs");
+    config.minPublishIntervalMs = cJSON_IsNumber(item) && item->valueint >= 0 ? item->valueint : MinPublishIntervalMsDefault;
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "chatterPerMinute");
+    config.chatterPerMinute = cJSON_IsNumber(item) && item->valueint > 0 ? item->valueint : ChatterPerMinuteDefault;
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "supervisedZones");
+    config.supervisedZones = cJSON_IsBool(item) && cJSON_IsTrue(item);
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "eolPullUpOhms");
+    config.eolPullUpOhms = cJSON_IsNumber(item) && item->valueint > 0 ? item->valueint : EolPullUpOhmsDefault;
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "eolOhms");
+    config.eolOhms = cJSON_IsNumber(item) && item->valueint > 0 ? item->valueint : EolOhmsDefault;
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "eolAlarmOhms");
+    config.eolAlarmOhms = cJSON_IsNumber(item) && item->valueint > 0 ? item->valueint : EolAlarmOhmsDefault;
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "extendedPayloads");
+    config.extendedPayloads = cJSON_IsBool(item) && cJSON_IsTrue(item);
+
+    loadOptionalString(settingsJSON, "sntpServer", config.sntpServer, sizeof(config.sntpServer));
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "timeFeedUtcOffsetMin");
+    config.timeFeedUtcOffsetMin = cJSON_IsNumber(item) ? item->valueint : 0;
+
+    // Fixed address, DHCP if there's none
+    cJSON* staticAddress = cJSON_GetObjectItemCaseSensitive(settingsJSON, "staticAddress");
+    loadOptionalString(staticAddress, "ip", config.staticIp, sizeof(config.staticIp));
+    loadOptionalString(staticAddress, "netmask", config.staticNetmask, sizeof(config.staticNetmask));
+    loadOptionalString(staticAddress, "gateway", config.staticGateway, sizeof(config.staticGateway));
+    loadOptionalString(staticAddress, "dns", config.staticDns, sizeof(config.staticDns));
+
+    loadOptionalString(settingsJSON, "mqttPskIdentity", config.mqttPskIdentity, sizeof(config.mqttPskIdentity));
+    loadOptionalString(settingsJSON, "mqttPskKey", config.mqttPskKey, sizeof(config.mqttPskKey));
+
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "mqtt5");
+    config.mqtt5 = cJSON_IsBool(item) && cJSON_IsTrue(item);
+
+    // Failover brokers, in order
+    cJSON* failover = cJSON_GetObjectItemCaseSensitive(settingsJSON, "mqttFailoverBrokers");
+    for (int i = 0; i < MQTT_MAX_FAILOVER; i++) {
+        item = cJSON_IsArray(failover) ? cJSON_GetArrayItem(failover, i) : NULL;
+        config.mqttFailoverUrls[i][0] = '\0';
+        if (cJSON_IsString(item) && (item->valuestring != NULL) && strlen(item->valuestring) < sizeof(config.mqttFailoverUrls[i])) {
+            strcpy(config.mqttFailoverUrls[i], item->valuestring);
+        }
+    }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "mqttWarmStandby");
+    config.mqttWarmStandby = cJSON_IsBool(item) && cJSON_IsTrue(item);
+
+    // LAN peer link, off if there's no group
+    cJSON* peerLink = cJSON_GetObjectItemCaseSensitive(settingsJSON, "peerLink");
+    loadOptionalString(peerLink, "group", config.peerGroup, sizeof(config.peerGroup));
+    loadOptionalString(peerLink, "key", config.peerKey, sizeof(config.peerKey));
+    item = cJSON_GetObjectItemCaseSensitive(peerLink, "port");
+    config.peerPort = cJSON_IsNumber(item) && item->valueint > 0 && item->valueint < 65536 ? item->valueint : PEER_PORT_DEFAULT;
+    item = cJSON_GetObjectItemCaseSensitive(peerLink, "tripSirens");
+    config.peerTripSirens = cJSON_IsBool(item) && cJSON_IsTrue(item);
+    item = cJSON_GetObjectItemCaseSensitive(peerLink, "followSirens");
+    config.peerFollowSirens = cJSON_IsBool(item) && cJSON_IsTrue(item);
+
+    loadOptionalString(settingsJSON, "httpApiToken", config.httpApiToken, sizeof(config.httpApiToken));
+
+    // Pulse counting zones, arrays by input
+    cJSON* counts = cJSON_GetObjectItemCaseSensitive(settingsJSON, "pulseCount");
+    cJSON* windows = cJSON_GetObjectItemCaseSensitive(settingsJSON, "pulseWindowMs");
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        item = cJSON_IsArray(counts) ? cJSON_GetArrayItem(counts, i) : NULL;
+        config.inputs[i].pulseCount = cJSON_IsNumber(item) && item->valueint > 0 ? item->valueint : 0;
+        item = cJSON_IsArray(windows) ? cJSON_GetArrayItem(windows, i) : NULL;
+        config.inputs[i].pulseWindowMs = cJSON_IsNumber(item) && item->valueint > 0 ? item->valueint : PulseWindowMsDefault;
+    }
+
     // Report any decoding errors
     if (strlen(errorString) != 1) {
         printf("Error decoding these configuration elements: %s\r\n", errorString);
@@ -205,6 +299,50 @@ bool SaveConfiguration()
     cJSON_AddItemToObject(root, "mqttUsername", cJSON_CreateString(config.mqttUsername));
     cJSON_AddItemToObject(root, "mqttPassword", cJSON_CreateString(config.mqttPassword));
     cJSON_AddItemToObject(root, "retries", cJSON_CreateNumber(config.retries));
+    cJSON_AddItemToObject(root, "minPublishIntervalMs", cJSON_CreateNumber(config.minPublishIntervalMs));
+    cJSON_AddItemToObject(root, "chatterPerMinute", cJSON_CreateNumber(config.chatterPerMinute));
+    cJSON* counts = cJSON_CreateArray();
+    cJSON* windows = cJSON_CreateArray();
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        cJSON_AddItemToArray(counts, cJSON_CreateNumber(config.inputs[i].pulseCount));
+        cJSON_AddItemToArray(windows, cJSON_CreateNumber(config.inputs[i].pulseWindowMs));
+    }
+    cJSON_AddItemToObject(root, "pulseCount", counts);
+    cJSON_AddItemToObject(root, "pulseWindowMs", windows);
+    cJSON_AddItemToObject(root, "supervisedZones", cJSON_CreateBool(config.supervisedZones));
+    cJSON_AddItemToObject(root, "eolPullUpOhms", cJSON_CreateNumber(config.eolPullUpOhms));
+    cJSON_AddItemToObject(root, "eolOhms", cJSON_CreateNumber(config.eolOhms));
+    cJSON_AddItemToObject(root, "eolAlarmOhms", cJSON_CreateNumber(config.eolAlarmOhms));
+    cJSON_AddItemToObject(root, "extendedPayloads", cJSON_CreateBool(config.extendedPayloads));
+    cJSON_AddItemToObject(root, "sntpServer", cJSON_CreateString(config.sntpServer));
+    cJSON_AddItemToObject(root, "timeFeedUtcOffsetMin", cJSON_CreateNumber(config.timeFeedUtcOffsetMin));
+    if (config.staticIp[0] != '\0') {
+        cJSON* staticAddress = cJSON_CreateObject();
+        cJSON_AddItemToObject(staticAddress, "ip", cJSON_CreateString(config.staticIp));
+        cJSON_AddItemToObject(staticAddress, "netmask", cJSON_CreateString(config.staticNetmask));
+        cJSON_AddItemToObject(staticAddress, "gateway", cJSON_CreateString(config.staticGateway));
+        cJSON_AddItemToObject(staticAddress, "dns", cJSON_CreateString(config.staticDns));
+        cJSON_AddItemToObject(root, "staticAddress", staticAddress);
+    }
+    cJSON_AddItemToObject(root, "mqttPskIdentity", cJSON_CreateString(config.mqttPskIdentity));
+    cJSON_AddItemToObject(root, "mqttPskKey", cJSON_CreateString(config.mqttPskKey));
+    cJSON_AddItemToObject(root, "mqtt5", cJSON_CreateBool(config.mqtt5));
+    cJSON* failover = cJSON_CreateArray();
+    for (int i = 0; i < MQTT_MAX_FAILOVER && config.mqttFailoverUrls[i][0] != '\0'; i++) {
+        cJSON_AddItemToArray(failover, cJSON_CreateString(config.mqttFailoverUrls[i]));
+    }
+    cJSON_AddItemToObject(root, "mqttFailoverBrokers", failover);
+    cJSON_AddItemToObject(root, "mqttWarmStandby", cJSON_CreateBool(config.mqttWarmStandby));
+    if (config.peerGroup[0] != '\0') {
+        cJSON* peerLink = cJSON_CreateObject();
+        cJSON_AddItemToObject(peerLink, "group", cJSON_CreateString(config.peerGroup));
+        cJSON_AddItemToObject(peerLink, "port", cJSON_CreateNumber(config.peerPort));
+        cJSON_AddItemToObject(peerLink, "key", cJSON_CreateString(config.peerKey));
+        cJSON_AddItemToObject(peerLink, "tripSirens", cJSON_CreateBool(config.peerTripSirens));
+        cJSON_AddItemToObject(peerLink, "followSirens", cJSON_CreateBool(config.peerFollowSirens));
+        cJSON_AddItemToObject(root, "peerLink", peerLink);
+    }
+    cJSON_AddItemToObject(root, "httpApiToken", cJSON_CreateString(config.httpApiToken));
 
     // Write the values to the file
     char* rendered = cJSON_Print(root);
@@ -212,22 +350,18 @@ bool SaveConfiguration()
 
     // Remove the cJSON documents to recover memory
     cJSON_Delete(root);
-
-    // Open file for writing, overwite if exists
-    FILE *f = fopen(filename, "w");
-    if (f == NULL)
+    if (rendered == NULL)
     {
-        printf("Failed to create file.\r\n");
+        printf("Failed to render the configuration.\r\n");
         return false;
     }
-    fprintf(f, "%s", rendered);
-    fclose(f);
 
-    // Open file for reading
-    f = fopen(filename, "r");
-    if (f == NULL)
+    // Overwite the file if it exists
+    bool ok = Hal_StorageWrite(filename, rendered, strlen(rendered));
+    cJSON_free(rendered);
+    if (!ok)
     {
-        printf("Failed to open file to read it back.\r\n");
+        printf("Failed to write the configuration file.\r\n");
         return false;
     }
 
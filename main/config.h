@@ -26,15 +26,23 @@
 
 #include "defines.h"
 
-#define filename "/spiffs/config.txt"
+#define filename "config.txt"     // In the HAL persistent storage
 #define VinPerBitDefault (3.30/2.0)/4095.0   // ADC FS split in two / resolution
 #define USER_INPUT_TIMEOUT_MS 60000
+#define MinPublishIntervalMsDefault 1000     // Input state changes closer than this are coalesced, 0 to publish all
+#define ChatterPerMinuteDefault 30           // Input state changes per minute that raise a chatter diagnostic
+#define PulseWindowMsDefault 5000            // Pulse counting zones: window the pulses must fall in
+#define EolPullUpOhmsDefault 4700            // Supervised zones: external pull-up to 3.3V
+#define EolOhmsDefault 4700                  // Supervised zones: end of line resistor
+#define EolAlarmOhmsDefault 4700             // Supervised zones: alarm resistor across the sensor contact
 
 typedef struct AlarmInput {
   bool active;
   char inputName[40];
   char descriptiveName[40];
   bool normallyClosed;
+  int pulseCount;                 // Pulses within pulseWindowMs to trip, 0 to use the level, see pulseZone.c
+  int pulseWindowMs;
 } Alarm_Input;
 
 typedef struct Configuration {
@@ -51,6 +59,30 @@ typedef struct Configuration {
   Alarm_Input inputs[NUM_INPUTS];
   float battVCalFactor;
   int retries;
+  int minPublishIntervalMs;
+  int chatterPerMinute;
+  bool supervisedZones;           // Read the zones by ADC and classify against EOL resistors, see zoneScan.c
+  int eolPullUpOhms;
+  int eolOhms;
+  int eolAlarmOhms;
+  bool extendedPayloads;          // Publish states as JSON with sequence numbers and event times, see eventPayload.c
+  char sntpServer[64];            // Empty for no SNTP, the clock is set by the time feed, see timeService.c
+  int timeFeedUtcOffsetMin;       // Home Assistant's local time less UTC
+  char staticIp[16];              // Empty for DHCP, otherwise the fixed address, see netAddress.c
+  char staticNetmask[16];
+  char staticGateway[16];
+  char staticDns[16];
+  char mqttPskIdentity[64];       // TLS PSK instead of certificates for an mqtts broker, see mqttClient.c
+  char mqttPskKey[65];            // Hex, up to 32 bytes
+  bool mqtt5;                     // MQTT 5 with topic aliases, falls back to 3.1.1, see mqttClient.c
+  char mqttFailoverUrls[MQTT_MAX_FAILOVER][160];  // Brokers to fail over to in order, empty for none, see mqttFailover.c
+  bool mqttWarmStandby;           // Keep the next broker connected, for a faster failover
+  char peerGroup[16];             // Multicast group for the LAN peer link, empty for none, see peerLink.c
+  int peerPort;
+  char peerKey[33];               // Hex, the 16 byte key every peer shares
+  bool peerTripSirens;            // A peer's zone tripping sounds the external siren
+  bool peerFollowSirens;          // Sound and silence the sirens with the peers' sirens
+  char httpApiToken[65];          // Bearer token for the local control API, empty to turn control off
 } Configuration;
 
 extern Configuration config;
@@ -16,11 +16,21 @@ extern bool ethernetGotIp;
 #define In6_Pin GPIO_NUM_33
 #define ExternalSirenPin GPIO_NUM_4
 #define DownstairsSirenPin GPIO_NUM_5
-#define BATT_ADC_CHANNEL ADC_CHANNEL_7
-#define VIN_ADC_CHANNEL ADC_CHANNEL_3
+#define BATT_ADC_PIN GPIO_NUM_35       // ADC1 channel 7
+#define VIN_ADC_PIN GPIO_NUM_39        // ADC1 channel 3
 
 #define S_TO_uS(s) (s * 1000000)
 #define uS_TO_S(s) (s / 1000000)
 #define DEBOUNCE_TIME_US 20000
+#define DEBOUNCE_POLL_MS 10             // Main loop period while an input is settling, one tick
+#define DIAGNOSTICS_INTERVAL_S 60
+#define CONSOLE_CHECK_INTERVAL_US 500000
+#define CONSOLE_RX_BUFFER_SIZE 256 // Console UART driver receive buffer, more than the 128 byte FIFO
+#define HEARTBEAT_INTERVAL_US 10000000
+#define HEARTBEAT_EXPIRY_S 30           // MQTT 5 message expiry on the heartbeat, three intervals
+#define HEARTBEAT_BATTERY_INTERVAL_US 60000000
+#define HEARTBEAT_BATTERY_EXPIRY_S 180
+#define MQTT_MAX_FAILOVER 2             // Failover brokers after mqttBrokerUrl, see mqttFailover.c
+#define PEER_PORT_DEFAULT 47100
 
 #endif // #ifndef __DEFINES_H__
\ No newline at end of file
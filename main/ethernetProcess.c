@@ -31,11 +31,17 @@
 #include "ethernet_init.h"
 
 #include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "netSupervisor.h"
+#include "netAddress.h"
 #include "ethernetProcess.h"
 
-bool MyEthernetIsConnected = false;
-bool MyEthernetGotIp = false;
-bool MyEthernetHasDHCP = false;
+static Metric ethLinkUps = METRIC_COUNTER_INIT("alarm_eth_link_up_total", "Ethernet link up events");
+static Metric ethLinkDowns = METRIC_COUNTER_INIT("alarm_eth_link_down_total", "Ethernet link down events");
+static Metric ethGotIps = METRIC_COUNTER_INIT("alarm_eth_got_ip_total", "Ethernet IP address acquisitions");
+static Metric ethLostIps = METRIC_COUNTER_INIT("alarm_eth_lost_ip_total", "Ethernet IP address losses");
+static Metric ethLinkState = METRIC_GAUGE_INIT("alarm_eth_link_up", "Ethernet link state");
 
 /** Event handler for Ethernet events */
 void eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
@@ -50,11 +56,18 @@ void eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id,
         ESP_LOGI(TAG, "Ethernet Link Up");
         ESP_LOGI(TAG, "Ethernet HW Addr %02x:%02x:%02x:%02x:%02x:%02x",
                  mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
-        MyEthernetIsConnected = true;
+        FlightRecorder_Record(FR_ETH_LINK_UP, 0, 0);
+        Metrics_Increment(&ethLinkUps);
+        Metrics_Set(&ethLinkState, 1);
+        NetAddress_LinkUp();
+        NetSupervisor_LinkUp();
         break;
     case ETHERNET_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "Ethernet Link Down");
-        MyEthernetIsConnected = false;
+        FlightRecorder_Record(FR_ETH_LINK_DOWN, 0, 0);
+        Metrics_Increment(&ethLinkDowns);
+        Metrics_Set(&ethLinkState, 0);
+        NetSupervisor_LinkDown();
         break;
     case ETHERNET_EVENT_START:
         ESP_LOGI(TAG, "Ethernet Started");
@@ -73,7 +86,10 @@ void got_ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_
     ip_event_got_ip_t *event = (ip_event_got_ip_t *) event_data;
     const esp_netif_ip_info_t *ip_info = &event->ip_info;
 
-    MyEthernetGotIp = true;
+    FlightRecorder_Record(FR_ETH_GOT_IP, ip_info->ip.addr, 0);
+    Metrics_Increment(&ethGotIps);
+    NetAddress_GotIp(ip_info);
+    NetSupervisor_GotIp();
 
     ESP_LOGI(TAG, "Ethernet Got IP Address");
     ESP_LOGI(TAG, "~~~~~~~~~~~");
@@ -83,8 +99,23 @@ void got_ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_
     ESP_LOGI(TAG, "~~~~~~~~~~~");
 }
 
+/** Event handler for IP_EVENT_ETH_LOST_IP */
+void lost_ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    ESP_LOGW(TAG, "Ethernet Lost IP Address");
+    FlightRecorder_Record(FR_ETH_LOST_IP, 0, 0);
+    Metrics_Increment(&ethLostIps);
+    NetSupervisor_LostIp();
+}
+
 void ethernetInitialise(void)
 {
+    Metrics_Register(&ethLinkUps);
+    Metrics_Register(&ethLinkDowns);
+    Metrics_Register(&ethGotIps);
+    Metrics_Register(&ethLostIps);
+    Metrics_Register(&ethLinkState);
+
     // Initialize Ethernet driver
     uint8_t eth_port_cnt = 0;
     esp_eth_handle_t *eth_handles;
@@ -103,6 +134,8 @@ void ethernetInitialise(void)
         esp_netif_t *eth_netif = esp_netif_new(&cfg);
         // Attach Ethernet driver to TCP/IP stack
         ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handles[0])));
+        // Static address or cached lease, set before the link comes up
+        NetAddress_Configure(eth_netif);
     } else {
         // Use ESP_NETIF_INHERENT_DEFAULT_ETH when multiple Ethernet interfaces are used and so you need to modify
         // esp-netif configuration parameters for each interface (name, priority, etc.).
@@ -125,12 +158,14 @@ void ethernetInitialise(void)
 
             // Attach Ethernet driver to TCP/IP stack
             ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handles[i])));
+            if (i == 0) { NetAddress_Configure(eth_netif); }
         }
     }
 
     // Register user defined event handers
     ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &got_ip_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_LOST_IP, &lost_ip_event_handler, NULL));
 
     // Start Ethernet driver state machine
     for (int i = 0; i < eth_port_cnt; i++) {
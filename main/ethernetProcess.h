@@ -26,6 +26,7 @@
 
 void eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
 void got_ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
+void lost_ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
 void ethernetInitialise(void);
 
 #endif // #ifndef __ETHERNETPROCESS_H__
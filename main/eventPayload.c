@@ -0,0 +1,190 @@
+/* MQTT Alarm Controller: Extended state payloads
+
+   With config.extendedPayloads set, zone and siren states are published
+   as a small JSON object instead of a bare ON/OFF:
+
+     {"state":"ON","prev":"OFF","seq":1234,"ts":1729240000123,"clock":"wall"}
+
+   state    the state, for Home Assistant's value_template
+   prev     the state before this event
+   seq      per device sequence number, one per publish, so a repeat is a
+            QoS 1 resend or replay and a jump is a missed message
+   ts       when the event happened, in ms. The input edge for a zone,
+            not when the debounce finished or the publish went out.
+   clock    "wall" if ts is Unix time, from the time service, "uptime"
+            if the clock wasn't set yet and ts is ms since boot
+
+   Sequence numbers carry on across restarts. They're reserved in storage
+   EVENT_SEQUENCE_BLOCK at a time, so there's one flash write per block
+   rather than one per event, and a restart skips the rest of the block.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "timeService.h"
+#include "eventPayload.h"
+
+#define SEQUENCE_FILENAME "sequence.txt"    // Start of the next block of sequence numbers
+
+static uint32_t nextSequence = 0;
+static uint32_t reservedUntil = 0;
+
+/******************************************************************
+ *
+ * Fixed buffer JSON writer
+ *
+*******************************************************************/
+static void put(PayloadWriter* w, char c)
+{
+    // Always leave room for the terminator
+    if (w->len + 1 >= w->size) {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->len++] = c;
+}
+
+static void putString(PayloadWriter* w, const char* s)
+{
+    put(w, '"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') { put(w, '\\'); }
+        if ((unsigned char)*s >= 0x20) { put(w, *s); }
+    }
+    put(w, '"');
+}
+
+static void putKey(PayloadWriter* w, const char* key)
+{
+    if (w->len > 1) { put(w, ','); }
+    putString(w, key);
+    put(w, ':');
+}
+
+void PayloadWriter_Begin(PayloadWriter* w, char* buf, size_t size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->overflow = size == 0;
+    put(w, '{');
+}
+
+void PayloadWriter_String(PayloadWriter* w, const char* key, const char* value)
+{
+    putKey(w, key);
+    putString(w, value);
+}
+
+void PayloadWriter_Int(PayloadWriter* w, const char* key, int64_t value)
+{
+    char digits[20];
+    int n = 0;
+    uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+    putKey(w, key);
+    if (value < 0) { put(w, '-'); }
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    while (n > 0) { put(w, digits[--n]); }
+}
+
+void PayloadWriter_Bool(PayloadWriter* w, const char* key, bool value)
+{
+    putKey(w, key);
+    for (const char* s = value ? "true" : "false"; *s != '\0'; s++) { put(w, *s); }
+}
+
+// Close the object. Returns its length, or -1 if it didn't fit.
+int PayloadWriter_End(PayloadWriter* w)
+{
+    put(w, '}');
+    if (w->size > 0) { w->buf[w->len] = '\0'; }
+    return w->overflow ? -1 : (int)w->len;
+}
+
+/******************************************************************
+ *
+ * Sequence numbers
+ *
+*******************************************************************/
+static void reserveSequenceBlock(void)
+{
+    char text[12];
+
+    reservedUntil = nextSequence + EVENT_SEQUENCE_BLOCK;
+    int len = sprintf(text, "%" PRIu32, reservedUntil);
+    if (!Hal_StorageWrite(SEQUENCE_FILENAME, text, len)) {
+        ESP_LOGE(TAG, "Couldn't reserve event sequence numbers, they may repeat after a restart.");
+    }
+}
+
+// The next sequence number. Called from the main loop.
+uint32_t EventPayload_NextSequence(void)
+{
+    if (nextSequence >= reservedUntil) { reserveSequenceBlock(); }
+    return nextSequence++;
+}
+
+/******************************************************************
+ *
+ * Format a state event. Returns the payload length, or -1 if it
+ * didn't fit.
+ *
+*******************************************************************/
+int EventPayload_FormatState(char* buf, size_t size, const char* state, const char* previous, int64_t eventUs)
+{
+    PayloadWriter w;
+    int64_t unixUs = TimeService_ToUnixUs(eventUs);
+
+    PayloadWriter_Begin(&w, buf, size);
+    PayloadWriter_String(&w, "state", state);
+    PayloadWriter_String(&w, "prev", previous);
+    PayloadWriter_Int(&w, "seq", EventPayload_NextSequence());
+    PayloadWriter_Int(&w, "ts", (unixUs != 0 ? unixUs : eventUs) / 1000);
+    PayloadWriter_String(&w, "clock", unixUs != 0 ? "wall" : "uptime");
+    return PayloadWriter_End(&w);
+}
+
+/******************************************************************
+ *
+ * Pick up the sequence where the last run's reservation ended.
+ * Nothing is written unless extended payloads are on.
+ *
+*******************************************************************/
+void EventPayload_Initialise(void)
+{
+    if (!config.extendedPayloads) { return; }
+
+    char text[12];
+    int len = Hal_StorageRead(SEQUENCE_FILENAME, text, sizeof(text) - 1);
+    nextSequence = 0;
+    if (len > 0) {
+        text[len] = '\0';
+        nextSequence = (uint32_t)strtoul(text, NULL, 10);
+    }
+    reserveSequenceBlock();
+    ESP_LOGI(TAG, "Extended state payloads, sequence starting at %" PRIu32 ".", nextSequence);
+}
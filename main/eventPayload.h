@@ -0,0 +1,52 @@
+/* MQTT Alarm Controller: Extended state payloads
+
+   Zone and siren states as JSON with a per device sequence number, the
+   time of the event and the state before it, so consumers can spot
+   duplicates, reordering and gaps. Written by a small fixed buffer
+   writer rather than sprintf.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __EVENTPAYLOAD_H__
+#define __EVENTPAYLOAD_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "inttypes.h"
+
+#define EVENT_PAYLOAD_MAX_LEN 128
+#define EVENT_SEQUENCE_BLOCK 1024       // Sequence numbers reserved in storage at a time
+
+// A JSON object written into a fixed buffer. Anything that doesn't fit sets overflow.
+typedef struct {
+    char* buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} PayloadWriter;
+
+void PayloadWriter_Begin(PayloadWriter* w, char* buf, size_t size);
+void PayloadWriter_String(PayloadWriter* w, const char* key, const char* value);
+void PayloadWriter_Int(PayloadWriter* w, const char* key, int64_t value);
+void PayloadWriter_Bool(PayloadWriter* w, const char* key, bool value);
+int PayloadWriter_End(PayloadWriter* w);
+
+void EventPayload_Initialise(void);
+uint32_t EventPayload_NextSequence(void);
+int EventPayload_FormatState(char* buf, size_t size, const char* state, const char* previous, int64_t eventUs);
+
+#endif // #ifndef __EVENTPAYLOAD_H__
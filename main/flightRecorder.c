@@ -0,0 +1,105 @@
+/* MQTT Alarm Controller: Flight recorder
+
+   Binary event recorder. Writes fixed size records (event id, timestamp
+   and two arguments) into a ring buffer in RTC slow memory so that it
+   survives soft resets. There's no formatting on the device, records are
+   decoded on the host by tools/flight_recorder_decode.py which reads the
+   event names from the FlightRecorderEvent enum.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+
+#include "defines.h"
+#include "flightRecorder.h"
+
+// The records and their bookkeeping live in RTC slow memory and survive soft resets
+RTC_NOINIT_ATTR FlightRecord flightRecords[FLIGHT_RECORDER_RECORDS];
+RTC_NOINIT_ATTR uint32_t flightRecorderSavedHead;
+static RTC_NOINIT_ATTR uint32_t flightRecorderMagic;
+static RTC_NOINIT_ATTR uint32_t flightRecorderBootCount;
+
+// The live head is in normal RAM as atomics aren't available on RTC memory
+atomic_uint flightRecorderHead = 0;
+uint8_t flightRecorderBoot = 0;
+
+/******************************************************************
+ *
+ * Initialise the recorder. After a soft reset the existing records
+ * are kept and recording carries on from where it stopped; after a
+ * power on or brownout the RTC memory is garbage, so it's cleared.
+ *
+*******************************************************************/
+void FlightRecorder_Initialise(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool keep = flightRecorderMagic == FLIGHT_RECORDER_MAGIC && reason != ESP_RST_POWERON && reason != ESP_RST_BROWNOUT;
+
+    if (keep) {
+        flightRecorderBootCount++;
+        atomic_store(&flightRecorderHead, flightRecorderSavedHead);
+        ESP_LOGI(TAG, "Flight recorder resumed, boot %" PRIu32 ", %" PRIu32 " records written so far.",
+            flightRecorderBootCount, flightRecorderSavedHead);
+    } else {
+        memset(flightRecords, 0, sizeof(flightRecords));
+        flightRecorderSavedHead = 0;
+        flightRecorderBootCount = 1;
+        flightRecorderMagic = FLIGHT_RECORDER_MAGIC;
+        atomic_store(&flightRecorderHead, 0);
+    }
+    flightRecorderBoot = (uint8_t)flightRecorderBootCount;
+
+    FlightRecorder_Record(FR_BOOT, reason, flightRecorderBootCount);
+}
+
+/******************************************************************
+ *
+ * Copy the recorder into a buffer as a dump header followed by the
+ * records, oldest first. Returns the number of bytes written, or 0
+ * if the buffer is too small for the header.
+ *
+*******************************************************************/
+size_t FlightRecorder_Dump(uint8_t* buf, size_t len)
+{
+    if (len < sizeof(FlightRecorderDumpHeader)) { return 0; }
+
+    unsigned head = atomic_load(&flightRecorderHead);
+    uint32_t count = head < FLIGHT_RECORDER_RECORDS ? head : FLIGHT_RECORDER_RECORDS;
+    size_t space = (len - sizeof(FlightRecorderDumpHeader)) / sizeof(FlightRecord);
+    if (count > space) { count = space; }
+
+    FlightRecorderDumpHeader header = {
+        .magic = FLIGHT_RECORDER_MAGIC,
+        .version = FLIGHT_RECORDER_VERSION,
+        .recordSize = sizeof(FlightRecord),
+        .recordCount = count,
+        .bootCount = flightRecorderBootCount,
+    };
+    memcpy(buf, &header, sizeof(header));
+
+    // Records still being written while we copy may be torn, which is fine for forensics
+    uint8_t* out = buf + sizeof(header);
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned slot = (head - count + i) & (FLIGHT_RECORDER_RECORDS - 1);
+        memcpy(out, &flightRecords[slot], sizeof(FlightRecord));
+        out += sizeof(FlightRecord);
+    }
+    return out - buf;
+}
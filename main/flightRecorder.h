@@ -0,0 +1,110 @@
+/* MQTT Alarm Controller: Flight recorder
+
+   Binary event recorder. Writes fixed size records (event id, timestamp
+   and two arguments) into a ring buffer in RTC slow memory so that it
+   survives soft resets. There's no formatting on the device, records are
+   decoded on the host by tools/flight_recorder_decode.py which reads the
+   event names from the FlightRecorderEvent enum below.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __FLIGHTRECORDER_H__
+#define __FLIGHTRECORDER_H__
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "inttypes.h"
+#include "hal.h"
+
+#define FLIGHT_RECORDER_RECORDS 256     // Must be a power of two
+#define FLIGHT_RECORDER_MAGIC 0x46524543 // "FREC"
+#define FLIGHT_RECORDER_VERSION 1
+
+// Event ids. Append only, the ids are part of the dump format.
+typedef enum {
+    FR_NONE = 0,
+    FR_BOOT = 1,                // arg0: reset reason, arg1: boot count
+    FR_INPUT_EDGE = 2,          // arg0: input, arg1: level
+    FR_INPUT_DEBOUNCED = 3,     // arg0: input, arg1: level
+    FR_INPUT_GLITCH = 4,        // arg0: input, arg1: level
+    FR_INPUT_PUBLISH = 5,       // arg0: input, arg1: active
+    FR_SIREN_COMMAND = 6,       // arg0: siren (0 external, 1 downstairs), arg1: on
+    FR_SIREN_SET = 7,           // arg0: siren (0 external, 1 downstairs), arg1: on
+    FR_MQTT_CONNECTED = 8,
+    FR_MQTT_DISCONNECTED = 9,
+    FR_MQTT_ERROR = 10,         // arg0: error type, arg1: socket errno
+    FR_ETH_LINK_UP = 11,
+    FR_ETH_LINK_DOWN = 12,
+    FR_ETH_GOT_IP = 13,         // arg0: IP address
+    FR_LOOP_OVERRUN = 14,       // arg0: execution time in us, arg1: budget in us
+    FR_ZONE_CONDITION = 15,     // arg0: input, arg1: supervised zone condition (ZoneCondition)
+    FR_INPUT_PULSES = 16,       // arg0: input, arg1: pulses counted since the last read
+    FR_ETH_LOST_IP = 17,
+    FR_MQTT_RECONNECT = 18,     // arg0: failed attempts before this one
+    FR_MQTT_FAILOVER = 19,      // arg0: broker left, arg1: broker failed over to
+    FR_PEER_SIREN = 20,         // arg0: siren, arg1: on, for a peer's event
+    FR_LOCAL_COMMAND = 21,      // arg0: local API command, 0 arm, 1 disarm, 2 silence
+    FR_OTA = 22,                // arg0: firmware update stage, arg1: bytes written or timeout
+    FR_POWER_MODE = 23,         // arg0: 1 on the battery, 0 on the mains, arg1: VIN raw ADC
+} FlightRecorderEvent;
+
+typedef struct {
+    uint32_t timestampUs;       // Low 32 bits of Hal_TimeUs()
+    uint16_t event;
+    uint8_t boot;               // Low 8 bits of the boot count, separates records from different boots
+    uint8_t reserved;
+    int32_t arg0;
+    int32_t arg1;
+} FlightRecord;
+
+// Header of a dump. Records follow, oldest first.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t recordCount;
+    uint32_t bootCount;
+} FlightRecorderDumpHeader;
+
+extern FlightRecord flightRecords[FLIGHT_RECORDER_RECORDS];
+extern atomic_uint flightRecorderHead;
+extern uint32_t flightRecorderSavedHead;
+extern uint8_t flightRecorderBoot;
+
+void FlightRecorder_Initialise(void);
+size_t FlightRecorder_Dump(uint8_t* buf, size_t len);
+
+/******************************************************************
+ *
+ * Record an event. Claims a slot with a single atomic add and fills
+ * it in, so it's safe from any task. The head is mirrored into RTC
+ * memory with a plain store so the ring can be resumed after reset.
+ *
+*******************************************************************/
+static inline void FlightRecorder_Record(FlightRecorderEvent event, int32_t arg0, int32_t arg1)
+{
+    unsigned head = atomic_fetch_add_explicit(&flightRecorderHead, 1, memory_order_relaxed);
+    FlightRecord* r = &flightRecords[head & (FLIGHT_RECORDER_RECORDS - 1)];
+    r->timestampUs = (uint32_t)Hal_TimeUs();
+    r->event = (uint16_t)event;
+    r->boot = flightRecorderBoot;
+    r->arg0 = arg0;
+    r->arg1 = arg1;
+    flightRecorderSavedHead = head + 1;
+}
+
+#endif // #ifndef __FLIGHTRECORDER_H__
@@ -0,0 +1,99 @@
+/* MQTT Alarm Controller: Hardware abstraction layer
+
+   The small set of platform services the controller core needs: GPIO,
+   the ADC, pulse counters, the microsecond clock, delays, timers, the MQTT transport and
+   persistent storage. halEsp.c implements them on ESP-IDF; the host
+   build (host/) implements them with simulated pins, a virtual clock and
+   a simulated broker so the core can be run and tested on Linux.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __HAL_H__
+#define __HAL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "inttypes.h"
+#include "driver/gpio.h"
+
+typedef struct HalTimer* HalTimer;
+typedef void (*HalTimerCallback)(void* arg);
+
+// GPIO
+void Hal_GpioConfigInput(gpio_num_t pin, bool pullUp);
+void Hal_GpioConfigOutput(gpio_num_t pin);
+int Hal_GpioRead(gpio_num_t pin);
+void Hal_GpioWrite(gpio_num_t pin, int level);
+
+// ADC. Configure returns false if the pin has no ADC channel. Reads are
+// raw 12 bit counts at 11 dB attenuation, or -1 on error.
+bool Hal_AdcConfig(gpio_num_t pin);
+int Hal_AdcRead(gpio_num_t pin);
+
+// Pulse counting. Edges to activeLevel are counted in hardware with no CPU per
+// edge. Read returns the running count, which wraps.
+bool Hal_PulseCounterConfig(gpio_num_t pin, int activeLevel);
+int32_t Hal_PulseCounterRead(gpio_num_t pin);
+
+// Clock, delays and timers. Timer callbacks must be short and must not block.
+int64_t Hal_TimeUs(void);
+void Hal_DelayMs(uint32_t ms);
+HalTimer Hal_TimerCreate(const char* name, HalTimerCallback callback, void* arg);
+void Hal_TimerStartPeriodic(HalTimer timer, uint64_t periodUs);
+void Hal_TimerStop(HalTimer timer);
+
+// Main loop wake ups. Wait blocks the main loop for up to timeoutMs, or until an edge
+// on a pin set up with Hal_GpioWakeOnEdge or a Hal_LoopWake from another task or a
+// timer callback. It returns the time of the first edge since the last wait, or 0.
+void Hal_GpioWakeOnEdge(gpio_num_t pin);
+int64_t Hal_LoopWait(uint32_t timeoutMs);
+void Hal_LoopWake(void);
+
+// MQTT transport. A len of 0 publishes the string length of data. All return
+// the message id, or -1 on error. Events from the broker are passed to the
+// MqttProcess_ functions in mqttProcess.h. With MQTT 5 the broker drops an
+// expiring message not delivered within expiryS, 0 for never; 3.1.1 ignores it.
+int Hal_MqttPublish(const char* topic, const char* data, int len, int qos, int retain);
+int Hal_MqttPublishExpiring(const char* topic, const char* data, int len, int qos, int retain, uint32_t expiryS);
+int Hal_MqttSubscribe(const char* topic, int qos);
+
+// Move to another broker, an index into MqttFailover_BrokerUrl(). Drops the
+// current connection and anything queued on it; the new connection is reported
+// through MqttProcess_Connected() as usual.
+void Hal_MqttSelectBroker(int broker);
+
+// Network time. Start returns false if SNTP couldn't be started. The callback is
+// called with the Unix time in us each time it syncs.
+typedef void (*HalSntpCallback)(int64_t unixUs);
+bool Hal_SntpStart(const char* server, HalSntpCallback callback);
+
+// LAN peer link over UDP multicast. Start joins the group and calls the
+// callback with each datagram that arrives, on the device from a task of its
+// own so it isn't held up by the main loop. Send returns false if the datagram
+// couldn't be sent.
+typedef void (*HalPeerCallback)(const uint8_t* data, int len);
+bool Hal_PeerStart(const char* group, int port, HalPeerCallback callback);
+bool Hal_PeerSend(const uint8_t* data, int len);
+
+// A random number, not for keys
+uint32_t Hal_Random(void);
+
+// Persistent storage of small named files. Read returns the length read, or -1.
+int Hal_StorageRead(const char* name, char* buf, size_t len);
+bool Hal_StorageWrite(const char* name, const char* data, size_t len);
+
+#endif // #ifndef __HAL_H__
@@ -0,0 +1,396 @@
+/* MQTT Alarm Controller: Hardware abstraction layer, ESP-IDF implementation
+
+   GPIO, ADC, pulse counters, clock, timers and storage on ESP-IDF. The MQTT transport is in
+   mqttClient.c alongside the esp-mqtt client it wraps.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "esp_adc/adc_oneshot.h"
+#include "driver/pulse_cnt.h"
+#include "esp_netif_sntp.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+
+#include "defines.h"
+#include "hal.h"
+#include "taskPlan.h"
+
+#define STORAGE_ROOT "/spiffs/"
+
+/******************************************************************
+ *
+ * GPIO
+ *
+*******************************************************************/
+void Hal_GpioConfigInput(gpio_num_t pin, bool pullUp)
+{
+    gpio_config_t conf = {0};
+    conf.intr_type = GPIO_INTR_DISABLE;
+    conf.mode = GPIO_MODE_INPUT;
+    conf.pin_bit_mask = (1ULL << pin);
+    conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
+    conf.pull_up_en = pullUp ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE;
+    ESP_ERROR_CHECK(gpio_config(&conf));
+}
+
+void Hal_GpioConfigOutput(gpio_num_t pin)
+{
+    gpio_config_t conf = {0};
+    conf.mode = GPIO_MODE_OUTPUT;
+    conf.pin_bit_mask = (1ULL << pin);
+    ESP_ERROR_CHECK(gpio_config(&conf));
+}
+
+int Hal_GpioRead(gpio_num_t pin)
+{
+    return gpio_get_level(pin);
+}
+
+void Hal_GpioWrite(gpio_num_t pin, int level)
+{
+    gpio_set_level(pin, level);
+}
+
+/******************************************************************
+ *
+ * Main loop wake ups. The wake pins' interrupts are level triggered,
+ * armed for the level the pin isn't at, as only level interrupts can
+ * wake the chip from light sleep. Each one disables itself and the
+ * loop rearms it before it waits again.
+ *
+*******************************************************************/
+static TaskHandle_t loopTask = NULL;
+static gpio_num_t wakePins[NUM_INPUTS];
+static int numWakePins = 0;
+static atomic_int_least64_t edgeUs = 0;
+
+static void wakeIsr(void* arg)
+{
+    gpio_intr_disable((gpio_num_t)(intptr_t)arg);
+    int64_t none = 0;
+    atomic_compare_exchange_strong(&edgeUs, &none, esp_timer_get_time());
+    BaseType_t woken = pdFALSE;
+    if (loopTask != NULL) { vTaskNotifyGiveFromISR(loopTask, &woken); }
+    portYIELD_FROM_ISR(woken);
+}
+
+void Hal_GpioWakeOnEdge(gpio_num_t pin)
+{
+    if (numWakePins >= NUM_INPUTS) { return; }
+    if (numWakePins == 0) {
+        ESP_ERROR_CHECK(gpio_install_isr_service(0));
+        ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+    }
+    gpio_intr_disable(pin);
+    ESP_ERROR_CHECK(gpio_isr_handler_add(pin, wakeIsr, (void*)(intptr_t)pin));
+    wakePins[numWakePins++] = pin;
+}
+
+int64_t Hal_LoopWait(uint32_t timeoutMs)
+{
+    loopTask = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < numWakePins; i++) {
+        // If the pin's moved on since it was read this fires straight away
+        gpio_wakeup_enable(wakePins[i], gpio_get_level(wakePins[i]) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+        gpio_intr_enable(wakePins[i]);
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs));
+    return atomic_exchange(&edgeUs, 0);
+}
+
+void Hal_LoopWake(void)
+{
+    if (loopTask != NULL) { xTaskNotifyGive(loopTask); }
+}
+
+/******************************************************************
+ *
+ * ADC. The oneshot units are shared by the main loop and the zone
+ * scan timer, so reads are serialised.
+ *
+*******************************************************************/
+static adc_oneshot_unit_handle_t adcUnits[2] = { NULL, NULL };
+static SemaphoreHandle_t adcMutex = NULL;
+
+bool Hal_AdcConfig(gpio_num_t pin)
+{
+    adc_unit_t unit;
+    adc_channel_t channel;
+    if (adc_oneshot_io_to_channel(pin, &unit, &channel) != ESP_OK) { return false; }
+    if (adcMutex == NULL) { adcMutex = xSemaphoreCreateMutex(); }
+    if (adcUnits[unit] == NULL) {
+        adc_oneshot_unit_init_cfg_t unitConfig = { .unit_id = unit, };
+        esp_err_t err = adc_oneshot_new_unit(&unitConfig, &adcUnits[unit]);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "ADC unit %d init error: %s", unit + 1, esp_err_to_name(err));
+            return false;
+        }
+    }
+    adc_oneshot_chan_cfg_t channelConfig = {
+        .bitwidth = ADC_BITWIDTH_12,
+        .atten = ADC_ATTEN_DB_11,
+    };
+    return adc_oneshot_config_channel(adcUnits[unit], channel, &channelConfig) == ESP_OK;
+}
+
+int Hal_AdcRead(gpio_num_t pin)
+{
+    adc_unit_t unit;
+    adc_channel_t channel;
+    if (adc_oneshot_io_to_channel(pin, &unit, &channel) != ESP_OK || adcUnits[unit] == NULL) { return -1; }
+    int raw = -1;
+    xSemaphoreTake(adcMutex, portMAX_DELAY);
+    if (adc_oneshot_read(adcUnits[unit], channel, &raw) != ESP_OK) { raw = -1; }
+    xSemaphoreGive(adcMutex);
+    return raw;
+}
+
+/******************************************************************
+ *
+ * Pulse counters, one PCNT unit per pin. The driver accumulates the
+ * count across the unit's limit so reads keep running.
+ *
+*******************************************************************/
+#define PCNT_MAX_UNITS 8
+#define PCNT_HIGH_LIMIT 32767
+#define PCNT_GLITCH_NS 10000    // Ignore spikes shorter than this
+
+static struct {
+    gpio_num_t pin;
+    pcnt_unit_handle_t unit;
+} pulseCounters[PCNT_MAX_UNITS];
+static int numPulseCounters = 0;
+
+bool Hal_PulseCounterConfig(gpio_num_t pin, int activeLevel)
+{
+    if (numPulseCounters >= PCNT_MAX_UNITS) { return false; }
+    pcnt_unit_config_t unitConfig = {
+        .low_limit = -PCNT_HIGH_LIMIT,
+        .high_limit = PCNT_HIGH_LIMIT,
+        .flags.accum_count = 1,
+    };
+    pcnt_unit_handle_t unit = NULL;
+    esp_err_t err = pcnt_new_unit(&unitConfig, &unit);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Pulse counter unit error for GPIO %d: %s", pin, esp_err_to_name(err));
+        return false;
+    }
+
+    pcnt_chan_config_t channelConfig = { .edge_gpio_num = pin, .level_gpio_num = -1, };
+    pcnt_channel_handle_t channel = NULL;
+    pcnt_glitch_filter_config_t filterConfig = { .max_glitch_ns = PCNT_GLITCH_NS, };
+    if ((err = pcnt_new_channel(unit, &channelConfig, &channel)) != ESP_OK ||
+        (err = pcnt_channel_set_edge_action(channel,
+            activeLevel ? PCNT_CHANNEL_EDGE_ACTION_INCREASE : PCNT_CHANNEL_EDGE_ACTION_HOLD,
+            activeLevel ? PCNT_CHANNEL_EDGE_ACTION_HOLD : PCNT_CHANNEL_EDGE_ACTION_INCREASE)) != ESP_OK ||
+        (err = pcnt_unit_set_glitch_filter(unit, &filterConfig)) != ESP_OK ||
+        (err = pcnt_unit_add_watch_point(unit, PCNT_HIGH_LIMIT)) != ESP_OK ||
+        (err = pcnt_unit_enable(unit)) != ESP_OK ||
+        (err = pcnt_unit_clear_count(unit)) != ESP_OK ||
+        (err = pcnt_unit_start(unit)) != ESP_OK) {
+        ESP_LOGE(TAG, "Pulse counter setup error for GPIO %d: %s", pin, esp_err_to_name(err));
+        return false;
+    }
+    pulseCounters[numPulseCounters].pin = pin;
+    pulseCounters[numPulseCounters].unit = unit;
+    numPulseCounters++;
+    return true;
+}
+
+int32_t Hal_PulseCounterRead(gpio_num_t pin)
+{
+    for (int i = 0; i < numPulseCounters; i++) {
+        if (pulseCounters[i].pin != pin) { continue; }
+        int count = 0;
+        pcnt_unit_get_count(pulseCounters[i].unit, &count);
+        return count;
+    }
+    return 0;
+}
+
+/******************************************************************
+ *
+ * Clock, delays and timers
+ *
+*******************************************************************/
+int64_t Hal_TimeUs(void)
+{
+    return esp_timer_get_time();
+}
+
+void Hal_DelayMs(uint32_t ms)
+{
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+HalTimer Hal_TimerCreate(const char* name, HalTimerCallback callback, void* arg)
+{
+    esp_timer_create_args_t args = {
+        .callback = callback,
+        .arg = arg,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = name,
+    };
+    esp_timer_handle_t timer = NULL;
+    esp_err_t err = esp_timer_create(&args, &timer);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Timer %s create error: %s", name, esp_err_to_name(err)); }
+    return (HalTimer)timer;
+}
+
+void Hal_TimerStartPeriodic(HalTimer timer, uint64_t periodUs)
+{
+    esp_timer_handle_t t = (esp_timer_handle_t)timer;
+    if (esp_timer_is_active(t)) { esp_timer_stop(t); }
+    ESP_ERROR_CHECK(esp_timer_start_periodic(t, periodUs));
+}
+
+void Hal_TimerStop(HalTimer timer)
+{
+    esp_timer_handle_t t = (esp_timer_handle_t)timer;
+    if (esp_timer_is_active(t)) { esp_timer_stop(t); }
+}
+
+/******************************************************************
+ *
+ * Network time. The sync callback comes from the SNTP task just after
+ * the system time is set, normally once an hour.
+ *
+*******************************************************************/
+static HalSntpCallback sntpCallback = NULL;
+
+static void sntpSynced(struct timeval* tv)
+{
+    if (sntpCallback != NULL) { sntpCallback((int64_t)tv->tv_sec * 1000000 + tv->tv_usec); }
+}
+
+bool Hal_SntpStart(const char* server, HalSntpCallback callback)
+{
+    esp_sntp_config_t sntpConfig = ESP_NETIF_SNTP_DEFAULT_CONFIG(server);
+    sntpConfig.sync_cb = sntpSynced;
+    sntpCallback = callback;
+    esp_err_t err = esp_netif_sntp_init(&sntpConfig);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "SNTP start failed: %s", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+/******************************************************************
+ *
+ * LAN peer link, a UDP multicast group. Datagrams are passed to the
+ * callback from a task of their own, above the main loop, as they
+ * arrive. Our own aren't looped back and don't leave the subnet.
+ *
+*******************************************************************/
+static int peerSocket = -1;
+static struct sockaddr_in peerGroupAddr;
+static HalPeerCallback peerCallback = NULL;
+
+static void peerTask(void* arg)
+{
+    uint8_t buf[64];
+    while (true) {
+        int len = recvfrom(peerSocket, buf, sizeof(buf), 0, NULL, NULL);
+        if (len < 0) {
+            ESP_LOGE(TAG, "Peer receive error %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            continue;
+        }
+        peerCallback(buf, len);
+    }
+}
+
+bool Hal_PeerStart(const char* group, int port, HalPeerCallback callback)
+{
+    memset(&peerGroupAddr, 0, sizeof(peerGroupAddr));
+    peerGroupAddr.sin_family = AF_INET;
+    peerGroupAddr.sin_port = htons(port);
+    if (inet_aton(group, &peerGroupAddr.sin_addr) == 0 || !IN_MULTICAST(ntohl(peerGroupAddr.sin_addr.s_addr))) {
+        ESP_LOGE(TAG, "Peer group %s isn't a multicast address", group);
+        return false;
+    }
+
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s < 0) { return false; }
+    struct sockaddr_in bindAddr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    struct ip_mreq membership = { .imr_multiaddr = peerGroupAddr.sin_addr, .imr_interface.s_addr = htonl(INADDR_ANY) };
+    uint8_t ttl = 1;
+    uint8_t loop = 0;
+    if (bind(s, (struct sockaddr*)&bindAddr, sizeof(bindAddr)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+        || setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+        ESP_LOGE(TAG, "Peer socket setup error %d", errno);
+        close(s);
+        return false;
+    }
+    peerSocket = s;
+    peerCallback = callback;
+    xTaskCreatePinnedToCore(peerTask, "peerLink", 3072, NULL, PEER_TASK_PRIORITY, NULL, NETWORK_CORE);
+    return true;
+}
+
+bool Hal_PeerSend(const uint8_t* data, int len)
+{
+    if (peerSocket < 0) { return false; }
+    return sendto(peerSocket, data, len, 0, (struct sockaddr*)&peerGroupAddr, sizeof(peerGroupAddr)) == len;
+}
+
+uint32_t Hal_Random(void)
+{
+    return esp_random();
+}
+
+/******************************************************************
+ *
+ * Persistent storage, files on the SPIFFS partition
+ *
+*******************************************************************/
+int Hal_StorageRead(const char* name, char* buf, size_t len)
+{
+    char path[64];
+    snprintf(path, sizeof(path), STORAGE_ROOT "%s", name);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { return -1; }
+    size_t n = fread(buf, 1, len, f);
+    fclose(f);
+    return (int)n;
+}
+
+bool Hal_StorageWrite(const char* name, const char* data, size_t len)
+{
+    char path[64];
+    snprintf(path, sizeof(path), STORAGE_ROOT "%s", name);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) { return false; }
+    bool ok = fwrite(data, 1, len, f) == len;
+    if (fclose(f) != 0) { ok = false; }
+    return ok;
+}
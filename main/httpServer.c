@@ -0,0 +1,248 @@
+/* MQTT Alarm Controller: Local HTTP server
+
+   Small esp_http_server instance for local diagnostics, and the local
+   status and control API, see localApi.c.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+
+#include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "localApi.h"
+#include "httpServer.h"
+#include "taskPlan.h"
+
+static httpd_handle_t server = NULL;
+
+// Only ever used from the single httpd task, so they don't need locking
+static char responseBuffer[HTTP_RESPONSE_BUFFER_LEN];
+static char eventBuffer[LOCAL_API_EVENT_LEN];
+_Static_assert(HTTP_RESPONSE_BUFFER_LEN >= sizeof(FlightRecorderDumpHeader) + sizeof(FlightRecord) * FLIGHT_RECORDER_RECORDS,
+    "The response buffer must hold a full flight recorder dump");
+
+static atomic_bool flushQueued = false;
+static Metric wsClients = METRIC_GAUGE_INIT("alarm_http_ws_clients", "WebSocket clients on /api/events");
+
+/******************************************************************
+ *
+ * GET /metrics - Prometheus text exposition, sent a metric at a
+ * time, so the number of metrics isn't limited by the buffer
+ *
+*******************************************************************/
+static esp_err_t metricsGetHandler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    int count = Metrics_Count();
+    for (int i = 0; i < count; i++) {
+        int len = Metrics_FormatPrometheusMetric(i, responseBuffer, sizeof(responseBuffer));
+        if (len < 0) {
+            // The headers have gone, so all that's left is to end the response early
+            ESP_LOGE(TAG, "Metric %d too large for the response buffer.", i);
+            break;
+        }
+        if (len > 0 && httpd_resp_send_chunk(req, responseBuffer, len) != ESP_OK) { return ESP_FAIL; }
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static const httpd_uri_t metricsUri = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = metricsGetHandler,
+};
+
+/******************************************************************
+ *
+ * GET /recorder - binary flight recorder dump
+ *
+*******************************************************************/
+static esp_err_t recorderGetHandler(httpd_req_t *req)
+{
+    size_t len = FlightRecorder_Dump((uint8_t*)responseBuffer, sizeof(responseBuffer));
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"recorder.bin\"");
+    return httpd_resp_send(req, responseBuffer, len);
+}
+
+static const httpd_uri_t recorderUri = {
+    .uri = "/recorder",
+    .method = HTTP_GET,
+    .handler = recorderGetHandler,
+};
+
+/******************************************************************
+ *
+ * GET /api/status - the status JSON
+ *
+*******************************************************************/
+static esp_err_t statusGetHandler(httpd_req_t *req)
+{
+    int len = LocalApi_FormatStatus(responseBuffer, sizeof(responseBuffer));
+    if (len < 0) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Status too large for buffer");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, responseBuffer, len);
+}
+
+static const httpd_uri_t statusUri = {
+    .uri = "/api/status",
+    .method = HTTP_GET,
+    .handler = statusGetHandler,
+};
+
+/******************************************************************
+ *
+ * POST /api/control - arm, disarm or silence, with the bearer token
+ *
+*******************************************************************/
+static esp_err_t controlPostHandler(httpd_req_t *req)
+{
+    char authorization[96];
+    char body[LOCAL_API_BODY_LEN];
+    if (httpd_req_get_hdr_value_str(req, "Authorization", authorization, sizeof(authorization)) != ESP_OK) { authorization[0] = '\0'; }
+    int len = 0;
+    if (req->content_len <= sizeof(body)) {
+        while (len < (int)req->content_len) {
+            int n = httpd_req_recv(req, body + len, req->content_len - len);
+            if (n == HTTPD_SOCK_ERR_TIMEOUT) { continue; }
+            if (n <= 0) { return ESP_FAIL; }
+            len += n;
+        }
+    } else {
+        len = -1;
+    }
+
+    switch (LocalApi_Control(authorization[0] != '\0' ? authorization : NULL, body, len)) {
+        case LOCAL_API_OK:
+            httpd_resp_set_type(req, "application/json");
+            return httpd_resp_send(req, "{\"result\":\"ok\"}", HTTPD_RESP_USE_STRLEN);
+        case LOCAL_API_UNAUTHORISED:
+            httpd_resp_set_hdr(req, "WWW-Authenticate", "Bearer");
+            return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Bad or missing token");
+        case LOCAL_API_DISABLED:
+            return httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "No API token configured");
+        default:
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected {\"command\": \"arm\" | \"disarm\" | \"silence\"}");
+    }
+}
+
+static const httpd_uri_t controlUri = {
+    .uri = "/api/control",
+    .method = HTTP_POST,
+    .handler = controlPostHandler,
+};
+
+/******************************************************************
+ *
+ * /api/events - WebSocket of state changes. The main loop queues
+ * the events and asks for a flush, which sends them to every
+ * WebSocket client from the httpd task. Anything a client sends is
+ * ignored.
+ *
+*******************************************************************/
+static void eventsFlush(void* arg)
+{
+    atomic_store(&flushQueued, false);
+    int fds[HTTP_MAX_SOCKETS];
+    size_t numFds = HTTP_MAX_SOCKETS;
+    int clients = 0;
+    if (httpd_get_client_list(server, &numFds, fds) == ESP_OK) {
+        for (size_t i = 0; i < numFds; i++) {
+            if (httpd_ws_get_fd_info(server, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET) { fds[clients++] = fds[i]; }
+        }
+    }
+    Metrics_Set(&wsClients, clients);
+
+    int len;
+    while ((len = LocalApi_NextEvent(eventBuffer, sizeof(eventBuffer))) != 0) {
+        if (len < 0) { continue; }
+        httpd_ws_frame_t frame = { .final = true, .type = HTTPD_WS_TYPE_TEXT, .payload = (uint8_t*)eventBuffer, .len = len };
+        for (int i = 0; i < clients; i++) { httpd_ws_send_frame_async(server, fds[i], &frame); }
+    }
+    if (clients == 0) { LocalApi_WantEvents(false); }
+}
+
+// From the main loop, as each event's queued
+static void eventQueued(void)
+{
+    if (atomic_exchange(&flushQueued, true)) { return; }
+    if (httpd_queue_work(server, eventsFlush, NULL) != ESP_OK) { atomic_store(&flushQueued, false); }
+}
+
+static esp_err_t eventsHandler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET) {
+        // The handshake, this client's a WebSocket from here on
+        LocalApi_WantEvents(true);
+        Metrics_Set(&wsClients, Metrics_Get(&wsClients) + 1);
+        return ESP_OK;
+    }
+    uint8_t ignored[32];
+    httpd_ws_frame_t frame = { .payload = ignored };
+    return httpd_ws_recv_frame(req, &frame, sizeof(ignored));
+}
+
+static const httpd_uri_t eventsUri = {
+    .uri = "/api/events",
+    .method = HTTP_GET,
+    .handler = eventsHandler,
+    .is_websocket = true,
+};
+
+/******************************************************************
+ *
+ * Start the HTTP server. It runs on the network core, see taskPlan.h,
+ * so a busy client can't delay the alarm path, and the least recently
+ * used socket is closed for a new client.
+ *
+*******************************************************************/
+void httpServerStart(void)
+{
+    if (server != NULL) { return; }
+
+    httpd_config_t httpConfig = HTTPD_DEFAULT_CONFIG();
+    httpConfig.server_port = HTTP_SERVER_PORT;
+    httpConfig.task_priority = HTTP_SERVER_PRIORITY;
+    httpConfig.core_id = NETWORK_CORE;
+    httpConfig.max_open_sockets = HTTP_MAX_SOCKETS;
+    httpConfig.lru_purge_enable = true;
+
+    esp_err_t err = httpd_start(&server, &httpConfig);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "HTTP server start error: %s", esp_err_to_name(err));
+        server = NULL;
+        return;
+    }
+    httpd_register_uri_handler(server, &metricsUri);
+    httpd_register_uri_handler(server, &recorderUri);
+    httpd_register_uri_handler(server, &statusUri);
+    httpd_register_uri_handler(server, &controlUri);
+    httpd_register_uri_handler(server, &eventsUri);
+    Metrics_Register(&wsClients);
+    LocalApi_SetEventListener(eventQueued);
+    ESP_LOGI(TAG, "HTTP server started on port %d", HTTP_SERVER_PORT);
+}
@@ -0,0 +1,32 @@
+/* MQTT Alarm Controller: Local HTTP server
+
+   Small esp_http_server instance for local diagnostics.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __HTTPSERVER_H__
+#define __HTTPSERVER_H__
+
+#include "inttypes.h"
+
+#define HTTP_SERVER_PORT 80
+#define HTTP_MAX_SOCKETS 4
+#define HTTP_RESPONSE_BUFFER_LEN 16384  // A Prometheus metric, the status and the flight recorder dump
+
+void httpServerStart(void);
+
+#endif // #ifndef __HTTPSERVER_H__
@@ -0,0 +1,226 @@
+/* MQTT Alarm Controller: Input latency
+
+   The main loop samples the inputs when an edge wakes it, and polls
+   them while any are settling. The latency is from the edge to the
+   sample when an edge woke the loop, and otherwise, while polling, the
+   gap between one pass's sample and the next, the longest a change can
+   wait before it's seen. It's kept as a histogram, always.
+
+   The reconnect storm test measures the gaps for STRESS_BASELINE_S with
+   the controller quiet, then has the network supervisor drop and remake
+   the broker connection a number of times, TCP, TLS and MQTT CONNECT
+   each time, and measures them again until the storm's over. The p99
+   and longest latencies of the two, the busiest each core got, and whether
+   the storm's p99 stayed within STRESS_FLAT_MARGIN_US of the baseline's
+   are published as a diagnostics event.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "inttypes.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "defines.h"
+#include "metrics.h"
+#include "mqttProcess.h"
+#include "netSupervisor.h"
+#include "systemHealth.h"
+#include "inputLatency.h"
+#include "taskPlan.h"
+
+extern const char *TAG;
+
+typedef enum {
+    STRESS_IDLE = -1,
+    STRESS_BASELINE = 0,
+    STRESS_STORM = 1,
+} StressPhase;
+
+typedef struct {
+    atomic_uint_least32_t count;
+    atomic_uint_least32_t maxUs;
+    atomic_uint_least32_t buckets[STRESS_BUCKETS];
+} LatencyWindow;
+
+typedef struct {
+    uint32_t count;
+    uint32_t p99Us;
+    uint32_t maxUs;
+    int32_t coreBusy[portNUM_PROCESSORS];   // Busiest each core got, in 0.1%
+} WindowResult;
+
+static int64_t lastSampleUs = 0;        // Main loop only
+static atomic_int phase = STRESS_IDLE;
+static atomic_bool testing = false;
+static LatencyWindow windows[2];
+
+static const int32_t latencyBounds[] = {1000, 5000, 10000, 20000, 25000, 30000, 50000, 100000};
+static Metric sampleLatency = METRIC_HISTOGRAM_INIT("alarm_input_latency_us", "Time from an input edge, or while polling the previous sample, to the input sample", latencyBounds);
+
+/******************************************************************
+ *
+ * The main loop has just sampled the inputs. edgeUs is the time of
+ * the edge that woke it, or 0, and polling is whether it's been
+ * waking at its polling rate. An idle wake up with no edge has
+ * nothing to measure.
+ *
+*******************************************************************/
+void InputLatency_Sampled(int64_t edgeUs, bool polling)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t latency = edgeUs != 0 ? now - edgeUs : now - lastSampleUs;
+    bool measured = edgeUs != 0 || (polling && lastSampleUs != 0);
+    lastSampleUs = now;
+    if (!measured) { return; }
+
+    Metrics_Observe(&sampleLatency, (int32_t)latency);
+    int p = atomic_load(&phase);
+    if (p == STRESS_IDLE) { return; }
+    LatencyWindow* w = &windows[p];
+    int bucket = (int)(latency / 1000);
+    if (bucket >= STRESS_BUCKETS) { bucket = STRESS_BUCKETS - 1; }
+    atomic_fetch_add(&w->buckets[bucket], 1);
+    atomic_fetch_add(&w->count, 1);
+    if ((uint32_t)latency > atomic_load(&w->maxUs)) { atomic_store(&w->maxUs, (uint32_t)latency); }
+}
+
+/******************************************************************
+ *
+ * The p99 of a window, the top of its 1 ms bucket, or the longest
+ * latency if it's in the last bucket
+ *
+*******************************************************************/
+static void summarise(LatencyWindow* w, WindowResult* r)
+{
+    r->count = atomic_load(&w->count);
+    r->maxUs = atomic_load(&w->maxUs);
+    r->p99Us = 0;
+    uint32_t target = (r->count * 99 + 99) / 100;
+    uint32_t seen = 0;
+    for (int b = 0; b < STRESS_BUCKETS && r->count > 0; b++) {
+        seen += atomic_load(&w->buckets[b]);
+        if (seen >= target) {
+            r->p99Us = b == STRESS_BUCKETS - 1 ? r->maxUs : (uint32_t)(b + 1) * 1000;
+            break;
+        }
+    }
+}
+
+static void trackCores(WindowResult* r)
+{
+    for (int c = 0; c < portNUM_PROCESSORS; c++) {
+        int32_t busy = SystemHealth_CoreBusy(c);
+        if (busy > r->coreBusy[c]) { r->coreBusy[c] = busy; }
+    }
+}
+
+static void publishStorm(int reconnects, int64_t stormMs, WindowResult* base, WindowResult* storm)
+{
+    char payload[384];
+    bool flat = storm->p99Us <= base->p99Us + STRESS_FLAT_MARGIN_US;
+
+    int len = snprintf(payload, sizeof(payload),
+        "{\"event\":\"reconnect_storm\",\"reconnects\":%d,\"storm_ms\":%" PRIi64 ",\"flat\":%s"
+        ",\"baseline\":{\"samples\":%" PRIu32 ",\"p99_us\":%" PRIu32 ",\"max_us\":%" PRIu32 ",\"core0\":%" PRIi32 ",\"core1\":%" PRIi32 "}"
+        ",\"storm\":{\"samples\":%" PRIu32 ",\"p99_us\":%" PRIu32 ",\"max_us\":%" PRIu32 ",\"core0\":%" PRIi32 ",\"core1\":%" PRIi32 "}}",
+        reconnects, stormMs, flat ? "true" : "false",
+        base->count, base->p99Us, base->maxUs, base->coreBusy[0], base->coreBusy[1],
+        storm->count, storm->p99Us, storm->maxUs, storm->coreBusy[0], storm->coreBusy[1]);
+    if (len > 0 && len < sizeof(payload)) { SendDiagnosticEvent(payload, len); }
+    ESP_LOGI(TAG, "Reconnect storm, %d reconnects in %" PRIi64 " ms: input latency p99 %" PRIu32 " us, max %" PRIu32 " us, baseline p99 %" PRIu32 " us, max %" PRIu32 " us, %s",
+             reconnects, stormMs, storm->p99Us, storm->maxUs, base->p99Us, base->maxUs, flat ? "flat" : "NOT flat");
+}
+
+/******************************************************************
+ *
+ * The storm test task, on the network core below everything else
+ * there. Core loads are read from the system health samples.
+ *
+*******************************************************************/
+static void stormTask(void* arg)
+{
+    int reconnects = (int)(intptr_t)arg;
+    WindowResult base = { 0 };
+    WindowResult storm = { 0 };
+
+    memset(windows, 0, sizeof(windows));
+    atomic_store(&phase, STRESS_BASELINE);
+    for (int i = 0; i < STRESS_BASELINE_S * 10; i++) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+        trackCores(&base);
+    }
+
+    atomic_store(&phase, STRESS_STORM);
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + (int64_t)reconnects * NET_ATTEMPT_TIMEOUT_MS * 1000;
+    NetSupervisor_ReconnectStorm(reconnects);
+    while ((NetSupervisor_StormRemaining() > 0 || !NetSupervisor_WaitForMqtt(0)) && esp_timer_get_time() < deadline) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+        trackCores(&storm);
+    }
+    atomic_store(&phase, STRESS_IDLE);
+    int64_t stormMs = (esp_timer_get_time() - start) / 1000;
+    int left = NetSupervisor_StormRemaining();
+    NetSupervisor_ReconnectStorm(0);
+
+    summarise(&windows[STRESS_BASELINE], &base);
+    summarise(&windows[STRESS_STORM], &storm);
+    if (left > 0) { ESP_LOGW(TAG, "Reconnect storm timed out with %d reconnects to go.", left); }
+    NetSupervisor_WaitForMqtt(NET_ATTEMPT_TIMEOUT_MS);
+    publishStorm(reconnects - left, stormMs, &base, &storm);
+    atomic_store(&testing, false);
+    vTaskDelete(NULL);
+}
+
+/******************************************************************
+ *
+ * Starts the reconnect storm test. Returns false if one's already
+ * running or the broker isn't connected to start from.
+ *
+*******************************************************************/
+bool InputLatency_StormTest(int reconnects)
+{
+    if (reconnects <= 0 || reconnects > STRESS_MAX_RECONNECTS) { reconnects = STRESS_DEFAULT_RECONNECTS; }
+    if (!NetSupervisor_WaitForMqtt(0)) {
+        ESP_LOGW(TAG, "Reconnect storm needs the broker connected to start.");
+        return false;
+    }
+    bool idle = false;
+    if (!atomic_compare_exchange_strong(&testing, &idle, true)) {
+        ESP_LOGW(TAG, "Reconnect storm already running.");
+        return false;
+    }
+    ESP_LOGI(TAG, "Reconnect storm of %d, after %d seconds of baseline.", reconnects, STRESS_BASELINE_S);
+    xTaskCreatePinnedToCore(stormTask, "stress", 3072, (void*)(intptr_t)reconnects, STRESS_TEST_PRIORITY, NULL, NETWORK_CORE);
+    return true;
+}
+
+// The storm test measures the loop at its polling rate, as well as any edges
+bool InputLatency_Testing(void)
+{
+    return atomic_load(&testing);
+}
+
+void InputLatency_Initialise(void)
+{
+    Metrics_Register(&sampleLatency);
+}
@@ -0,0 +1,40 @@
+/* MQTT Alarm Controller: Input latency
+
+   The time from an input edge to the main loop's sample of it, and a
+   reconnect storm test that checks it doesn't grow while the network
+   core is busy.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __INPUTLATENCY_H__
+#define __INPUTLATENCY_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+
+#define STRESS_BASELINE_S 20            // Quiet time measured before the storm, two system health samples
+#define STRESS_DEFAULT_RECONNECTS 20
+#define STRESS_MAX_RECONNECTS 200
+#define STRESS_BUCKETS 64               // 1 ms latency buckets, the last takes anything longer
+#define STRESS_FLAT_MARGIN_US 1000      // The storm's p99 may be this much over the baseline's and still be flat
+
+void InputLatency_Initialise(void);
+void InputLatency_Sampled(int64_t edgeUs, bool polling);
+bool InputLatency_StormTest(int reconnects);
+bool InputLatency_Testing(void);
+
+#endif // #ifndef __INPUTLATENCY_H__
@@ -18,17 +18,112 @@
 
 */
 
+#include <stdio.h>
+#include <stdatomic.h>
 #include "inttypes.h"
 #include "esp_log.h"
-#include "esp_err.h"
-#include "driver/gpio.h"
-#include "esp_timer.h"
 
+#include "hal.h"
 #include "config.h"
 #include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "trace.h"
+#include "mqttProcess.h"
+#include "sensorHealth.h"
+#include "zoneScan.h"
+#include "pulseZone.h"
+#include "peerLink.h"
+#include "localApi.h"
 
 #include "inputOutput.h"
 
+#define TRANSITIONS_HELP "Debounced input state changes"
+static Metric inputTransitions[NUM_INPUTS] = {
+    METRIC_ZONE_COUNTER_INIT("alarm_input_transitions_total", TRANSITIONS_HELP, 0),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_transitions_total", TRANSITIONS_HELP, 1),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_transitions_total", TRANSITIONS_HELP, 2),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_transitions_total", TRANSITIONS_HELP, 3),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_transitions_total", TRANSITIONS_HELP, 4),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_transitions_total", TRANSITIONS_HELP, 5),
+};
+static Metric inputGlitches = METRIC_COUNTER_INIT("alarm_input_glitches_total", "Input edges that didn't survive debouncing");
+
+#define SUPPRESSED_HELP "Input state changes coalesced rather than published"
+static Metric inputSuppressed[NUM_INPUTS] = {
+    METRIC_ZONE_COUNTER_INIT("alarm_input_suppressed_total", SUPPRESSED_HELP, 0),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_suppressed_total", SUPPRESSED_HELP, 1),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_suppressed_total", SUPPRESSED_HELP, 2),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_suppressed_total", SUPPRESSED_HELP, 3),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_suppressed_total", SUPPRESSED_HELP, 4),
+    METRIC_ZONE_COUNTER_INIT("alarm_input_suppressed_total", SUPPRESSED_HELP, 5),
+};
+
+#define CHATTER_WINDOW_US S_TO_uS(60)
+
+// Per zone publish coalescing, see processInputChanges()
+typedef struct {
+    bool published;             // State last published
+    bool previous;              // and the one before it
+    int64_t changeUs;           // Input edge of the latest change
+    bool pending;               // A state change is waiting for the publish interval
+    int64_t lastPublishUs;
+    int64_t windowStartUs;      // Chatter rate window
+    int windowChanges;
+    ZoneCondition tamper;       // Supervised zone tamper condition last published, ZONE_NORMAL if none
+    ZoneCondition tamperSeen;   // and last logged
+} ZonePublisher;
+
+static ZonePublisher publishers[NUM_INPUTS];
+
+// Republish requests from the MQTT task after it connects, see InputOutput_RequestResync()
+#define RESYNC_NONE 0
+#define RESYNC_STATES 1
+#define RESYNC_ALL 2
+static atomic_int zoneResync = RESYNC_NONE;
+static atomic_bool sirenResync = false;
+
+// The latest siren states commanded over MQTT or the local API, see InputOutput_CommandSiren(),
+// and set by the peer link, see InputOutput_PeerSiren()
+#define SIREN_NONE -1
+static atomic_int commandedSiren[2] = { SIREN_NONE, SIREN_NONE };
+static atomic_int peerSiren[2] = { SIREN_NONE, SIREN_NONE };
+
+// A siren's state for publishing
+typedef struct {
+    bool on;
+    bool previous;              // State before the last command
+    int64_t sinceUs;            // Time of the last command
+} SirenState;
+
+static SirenState externalSiren;
+static SirenState downstairsSiren;
+
+// Is the input in alarm at this level? Normally closed loops are open (high) in alarm.
+static bool isActiveLevel(int input, int level)
+{
+    if (config.inputs[input].normallyClosed) { return level != 0; }
+    return level == 0;
+}
+
+// The level for an active or inactive input
+static int levelFor(int input, bool active)
+{
+    return config.inputs[input].normallyClosed ? active : !active;
+}
+
+// The level a supervised zone's condition stands for. A cut or shorted loop reads as
+// active so a tamper can't hide an intrusion.
+static int supervisedLevel(int input)
+{
+    return levelFor(input, ZoneScan_Condition(input) != ZONE_NORMAL);
+}
+
+static ZoneCondition tamperOf(ZoneCondition condition)
+{
+    return (condition == ZONE_TAMPER_OPEN || condition == ZONE_TAMPER_SHORT) ? condition : ZONE_NORMAL;
+}
+
 /******************************************************************
  * 
  * Initial Setup
@@ -39,62 +134,59 @@
 void initialSetup()
 {
     // Enable Power to PHY - needed for Olimex ESP32-POE board
-    const gpio_num_t phy_power_pin = PHY_POWER_PIN;
-    gpio_config_t phy_power_conf = {0};
-    phy_power_conf.mode = GPIO_MODE_OUTPUT;
-    phy_power_conf.pin_bit_mask = (1ULL << phy_power_pin);
-    ESP_ERROR_CHECK(gpio_config(&phy_power_conf));
-    ESP_ERROR_CHECK(gpio_set_level(phy_power_pin, 1));
+    Hal_GpioConfigOutput(PHY_POWER_PIN);
+    Hal_GpioWrite(PHY_POWER_PIN, 1);
     
     // Config button
-    const gpio_num_t button_pin = BUTTON_PIN_IO;
-    gpio_config_t button_conf = {0};
-    button_conf.mode = GPIO_MODE_INPUT;
-    button_conf.pin_bit_mask = (1ULL << button_pin);
-    button_conf.pull_up_en = GPIO_PULLUP_DISABLE;
-    ESP_ERROR_CHECK(gpio_config(&button_conf));
+    Hal_GpioConfigInput(BUTTON_PIN_IO, false);
 
     // External Siren Output
-    //const gpio_num_t extsiren_pin = ExternalSirenPin;
-    //gpio_config_t extsiren_conf = {0};
-    //extsiren_conf.mode = GPIO_MODE_OUTPUT;
-    //extsiren_conf.pin_bit_mask = (1ULL << extsiren_pin);
-    ESP_ERROR_CHECK(gpio_set_direction(ExternalSirenPin, GPIO_MODE_OUTPUT));
-    ESP_ERROR_CHECK(gpio_set_level(ExternalSirenPin, 0));
+    Hal_GpioConfigOutput(ExternalSirenPin);
+    Hal_GpioWrite(ExternalSirenPin, 0);
 
     // Internal Siren Output
-//    const gpio_num_t intsiren_pin = DownstairsSirenPin;
-//    gpio_config_t intsiren_conf = {0};
-//    intsiren_conf.mode = GPIO_MODE_OUTPUT;
-//    intsiren_conf.pin_bit_mask = (1ULL << intsiren_pin);
-//    ESP_ERROR_CHECK(gpio_config(&intsiren_conf));
-    ESP_ERROR_CHECK(gpio_set_direction(DownstairsSirenPin, GPIO_MODE_OUTPUT));
-    ESP_ERROR_CHECK(gpio_set_level(DownstairsSirenPin, 0));
+    Hal_GpioConfigOutput(DownstairsSirenPin);
+    Hal_GpioWrite(DownstairsSirenPin, 0);
 }
 
 /******************************************************************
  * 
  * Initialise GPIO alarm inputs
  * 
- * Setup debounced alarm inputs
+ * Setup debounced alarm inputs, or supervised zones read by the ADC
+ * or pulse counting zones if they're configured
  * 
 *******************************************************************/
 void initialiseInputs(DebouncedInput inputs[], const gpio_num_t pins[], int numInputs)
 {
-    gpio_config_t inputConfigs[numInputs];
+    ZoneScan_Initialise(pins, numInputs);
     for (int i = 0; i < numInputs; i++) {
         inputs[i].gpioNumber = pins[i];
-        inputConfigs[i].intr_type = GPIO_INTR_DISABLE;
-        inputConfigs[i].mode = GPIO_MODE_INPUT;
-        inputConfigs[i].pin_bit_mask = (1ULL << inputs[i].gpioNumber);
-        inputConfigs[i].pull_down_en = GPIO_PULLDOWN_DISABLE;
-        inputConfigs[i].pull_up_en = GPIO_PULLUP_ENABLE;
-        ESP_ERROR_CHECK(gpio_config(&inputConfigs[i]));
         inputs[i].changeStart = 0;
-        inputs[i].currentState = gpio_get_level(inputs[i].gpioNumber);
+        inputs[i].eventUs = Hal_TimeUs();
+        if (ZoneScan_IsSupervised(i)) {
+            inputs[i].currentState = supervisedLevel(i);
+        } else if (i < NUM_INPUTS && PulseZone_Initialise(i, pins[i])) {
+            // Starts at rest until it sees its pulses
+            inputs[i].currentState = levelFor(i, false);
+        } else {
+            Hal_GpioConfigInput(inputs[i].gpioNumber, true);
+            Hal_GpioWakeOnEdge(inputs[i].gpioNumber);
+            inputs[i].currentState = Hal_GpioRead(inputs[i].gpioNumber);
+        }
         inputs[i].previousState = inputs[i].currentState;
         inputs[i].changed = false;
+        if (i < NUM_INPUTS) {
+            Metrics_Register(&inputTransitions[i]);
+            Metrics_Register(&inputSuppressed[i]);
+            bool state = isActiveLevel(i, inputs[i].currentState);
+            publishers[i] = (ZonePublisher){ .published = state, .previous = state, .changeUs = inputs[i].eventUs,
+                .tamper = ZONE_NORMAL, .tamperSeen = ZONE_NORMAL };
+            SensorHealth_Initialise(i, isActiveLevel(i, inputs[i].currentState));
+            LocalApi_ZoneChanged(i, state);
+        }
     }
+    Metrics_Register(&inputGlitches);
 }
 
 /******************************************************************
@@ -103,7 +195,7 @@ void initialiseInputs(DebouncedInput inputs[], const gpio_num_t pins[], int numI
  * 
 *******************************************************************/
 bool buttonPressed(void) {
-    if (gpio_get_level(BUTTON_PIN_IO) == 0) {
+    if (Hal_GpioRead(BUTTON_PIN_IO) == 0) {
         return true;
     }
     return false;
@@ -116,30 +208,272 @@ bool buttonPressed(void) {
 *******************************************************************/
 void updateInputs(DebouncedInput inputs[], int numInputs)
 {
+    TRACE_BEGIN("updateInputs");
     for (int i = 0; i < numInputs; i++) {
         inputs[i].changed = false;
-        int level = gpio_get_level(inputs[i].gpioNumber);
+        if (ZoneScan_IsSupervised(i) || PulseZone_IsEnabled(i)) {
+            // The scan has already confirmed the condition over several reads, and pulse zones
+            // trip on their count, so no debounce here
+            int level = ZoneScan_IsSupervised(i) ? supervisedLevel(i) : levelFor(i, PulseZone_Update(i));
+            if (level != inputs[i].currentState) {
+                inputs[i].previousState = inputs[i].currentState;
+                inputs[i].currentState = level;
+                inputs[i].eventUs = Hal_TimeUs();
+                FlightRecorder_Record(FR_INPUT_DEBOUNCED, i, level);
+                TRACE_INSTANT("debounced", i);
+                inputs[i].changed = true;
+                Metrics_Increment(&inputTransitions[i]);
+            }
+            continue;
+        }
+        int level = Hal_GpioRead(inputs[i].gpioNumber);
         //ESP_LOGI(TAG, "Read input %d, io %d value %d", i, inputs[i].gpioNumber, level);
         if (level != inputs[i].currentState && inputs[i].changeStart == 0) {
             if (inputs[i].changeStart == 0) { 
-                ESP_LOGD(TAG, "Input %d changed state, start debouncing.", i);
-                inputs[i].changeStart = esp_timer_get_time(); 
+                FlightRecorder_Record(FR_INPUT_EDGE, i, level);
+                TRACE_INSTANT("gpioEdge", i);
+                inputs[i].changeStart = Hal_TimeUs(); 
             }
         }
-        if (inputs[i].changeStart != 0) {
-            if (esp_timer_get_time() - inputs[i].changeStart > DEBOUNCE_TIME_US) {
-                ESP_LOGD(TAG, "Input %d debounced.", i);
-                inputs[i].changeStart = 0;
-                if (inputs[i].currentState != level) { 
-                    inputs[i].previousState = inputs[i].currentState;
-                    inputs[i].currentState = level;
-                    ESP_LOGD(TAG, "Input %d changed to %d.", i, inputs[i].currentState);
-                    inputs[i].changed = true; 
-                } else { 
-                    inputs[i].changed = false; 
-                    ESP_LOGI(TAG, "Input %d didn't change after debounce time.", i);
-                }
+        if (inputs[i].changeStart != 0 && level == inputs[i].currentState) {
+            // Back where it was before the window ran out, so a glitch. The next edge starts a new window.
+            inputs[i].changeStart = 0;
+            Metrics_Increment(&inputGlitches);
+            FlightRecorder_Record(FR_INPUT_GLITCH, i, level);
+        }
+        else if (inputs[i].changeStart != 0 && Hal_TimeUs() - inputs[i].changeStart > DEBOUNCE_TIME_US) {
+            // Held at the new level on every poll through the window
+            inputs[i].previousState = inputs[i].currentState;
+            inputs[i].currentState = level;
+            inputs[i].eventUs = inputs[i].changeStart;
+            inputs[i].changeStart = 0;
+            FlightRecorder_Record(FR_INPUT_DEBOUNCED, i, level);
+            TRACE_INSTANT("debounced", i);
+            inputs[i].changed = true;
+            if (i < NUM_INPUTS) { Metrics_Increment(&inputTransitions[i]); }
+        }
+    }
+    TRACE_END("updateInputs");
+}
+
+// Publish a chatter diagnostic the first time a zone goes over the rate in a window
+static void checkChatter(int zone, int64_t now)
+{
+    ZonePublisher* p = &publishers[zone];
+    if (now - p->windowStartUs >= CHATTER_WINDOW_US) {
+        p->windowStartUs = now;
+        p->windowChanges = 0;
+    }
+    if (++p->windowChanges == config.chatterPerMinute + 1) {
+        char payload[200];
+        int len = snprintf(payload, sizeof(payload),
+            "{\"event\":\"sensor_chatter\",\"zone\":%d,\"name\":\"%s\",\"changes\":%d,\"window_s\":%d,\"suppressed\":%" PRIi32 "}",
+            zone, config.inputs[zone].inputName, p->windowChanges, (int)uS_TO_S(CHATTER_WINDOW_US), Metrics_Get(&inputSuppressed[zone]));
+        ESP_LOGW(TAG, "Input %d (%s) is chattering, over %d changes a minute.", zone, config.inputs[zone].descriptiveName, config.chatterPerMinute);
+        if (len > 0 && len < sizeof(payload)) { SendDiagnosticEvent(payload, len); }
+    }
+}
+
+static void publishZone(int zone, bool state, int64_t now)
+{
+    ZonePublisher* p = &publishers[zone];
+    if (state != p->published) { p->previous = p->published; }
+    sendInputState(zone, state, p->previous, p->changeUs);
+    p->published = state;
+    p->pending = false;
+    p->lastPublishUs = now;
+}
+
+/******************************************************************
+ * 
+ * Publish the state of any inputs that changed in the last update.
+ * 
+ * Changes within the minimum publish interval of a zone's last
+ * publish are coalesced into one publish of its latest state at the
+ * end of the interval. A change to active from a published inactive
+ * state is always sent straight away, so a burst never delays an
+ * alarm. Call every loop so coalesced states are flushed.
+ * 
+*******************************************************************/
+void processInputChanges(DebouncedInput inputs[], int numInputs)
+{
+    int64_t now = Hal_TimeUs();
+    int64_t interval = (int64_t)config.minPublishIntervalMs * 1000;
+
+    int resync = atomic_exchange(&zoneResync, RESYNC_NONE);
+
+    for (int i = 0; i < numInputs && i < NUM_INPUTS; i++) {
+        ZonePublisher* p = &publishers[i];
+        if (ZoneScan_IsSupervised(i)) {
+            ZoneCondition tamper = tamperOf(ZoneScan_Condition(i));
+            if (resync == RESYNC_ALL) { p->tamper = (ZoneCondition)-1; }
+            if (tamper != p->tamperSeen) {
+                ESP_LOGW(TAG, "Input %d (%s) tamper: %s.", i, config.inputs[i].descriptiveName, ZoneScan_ConditionName(tamper));
+                p->tamperSeen = tamper;
             }
+            if (tamper != p->tamper && SendZoneTamper(i, tamper)) { p->tamper = tamper; }
         }
+        if (inputs[i].changed) {
+            //ESP_LOGI(TAG, "Input %d changed to %d", i, inputs[i].currentState);
+            bool state = isActiveLevel(i, inputs[i].currentState);
+            if (!config.inputs[i].active) { 
+                ESP_LOGI(TAG, "Not sending to MQTT as input %d is disabled.", i); 
+                continue;
+            }
+            SensorHealth_Update(i, state);
+            PeerLink_ZoneEvent(i, state);
+            LocalApi_ZoneChanged(i, state);
+            checkChatter(i, now);
+            p->changeUs = inputs[i].eventUs;
+            if (p->pending) {
+                // The waiting change is overtaken, so it's never published
+                Metrics_Increment(&inputSuppressed[i]);
+                p->pending = false;
+            }
+            if (state == p->published) {
+                // Back to the published state before it needed sending
+                Metrics_Increment(&inputSuppressed[i]);
+            } else if (now - p->lastPublishUs >= interval || state) {
+                publishZone(i, state, now);
+            } else {
+                p->pending = true;
+            }
+        } else if (p->pending && now - p->lastPublishUs >= interval) {
+            publishZone(i, !p->published, now);
+        }
+        if (resync != RESYNC_NONE && config.inputs[i].active) {
+            // Whatever did or didn't get through while we were disconnected, send what it is now
+            // The same state again doesn't restart the publish interval, or reconnects would hold back changes
+            bool state = isActiveLevel(i, inputs[i].currentState);
+            if (p->published != state) { publishZone(i, state, now); }
+            else if (p->lastPublishUs != now) { sendInputState(i, state, p->previous, p->changeUs); }
+        }
+    }
+}
+
+/******************************************************************
+ * 
+ * Whether a GPIO input is settling, when the main loop polls every
+ * DEBOUNCE_POLL_MS so the debounce sees the middle of its window as
+ * well as the ends.
+ * 
+*******************************************************************/
+bool InputOutput_Settling(const DebouncedInput inputs[], int numInputs)
+{
+    for (int i = 0; i < numInputs; i++) {
+        if (inputs[i].changeStart != 0) { return true; }
+    }
+    return false;
+}
+
+/******************************************************************
+ * 
+ * Whether the inputs need the main loop at its polling rate: a GPIO
+ * input settling, a pulse zone counting, or a coalesced state
+ * waiting out its publish interval. Otherwise a GPIO edge or the zone
+ * scan wakes the loop.
+ * 
+*******************************************************************/
+bool InputOutput_NeedsPolling(const DebouncedInput inputs[], int numInputs)
+{
+    for (int i = 0; i < numInputs; i++) {
+        if (inputs[i].changeStart != 0) { return true; }
+        if (i < NUM_INPUTS && (PulseZone_IsEnabled(i) || publishers[i].pending)) { return true; }
+    }
+    return false;
+}
+
+/******************************************************************
+ * 
+ * Republish the actual zone and siren states, then the availability,
+ * on the next main loop pass. Called by the MQTT task when it
+ * connects. all also republishes the tamper states, for when the
+ * broker may have lost its retained messages.
+ * 
+ * Sending the availability last means Home Assistant never shows a
+ * retained state from before the disconnect as current.
+ * 
+*******************************************************************/
+void InputOutput_RequestResync(bool all)
+{
+    atomic_store(&zoneResync, all ? RESYNC_ALL : RESYNC_STATES);
+    atomic_store(&sirenResync, true);
+    Hal_LoopWake();
+}
+
+// A commanded siren state, published with the one before it
+static void setSiren(SirenState* siren, char* sirenName, bool on)
+{
+    siren->previous = siren->on;
+    siren->on = on;
+    siren->sinceUs = Hal_TimeUs();
+    LocalApi_SirenChanged(siren == &externalSiren ? 0 : 1, on);
+    SendSirenEvent(sirenName, on, siren->previous, siren->sinceUs);
+}
+
+/******************************************************************
+ * 
+ * Sound or silence a siren for a peer's event. Called from the peer
+ * link's receive task, so the pin is driven now and the main loop
+ * publishes the new state. Not sent on to the peers.
+ * 
+*******************************************************************/
+void InputOutput_PeerSiren(int siren, bool on)
+{
+    Hal_GpioWrite(siren == 0 ? ExternalSirenPin : DownstairsSirenPin, on);
+    atomic_store(&peerSiren[siren], on);
+    Hal_LoopWake();
+}
+
+static void processPeerSiren(int siren, SirenState* state, char* sirenName)
+{
+    int on = atomic_exchange(&peerSiren[siren], SIREN_NONE);
+    if (on == SIREN_NONE || on == state->on) { return; }
+    // Again, in case a command here has since driven it the other way
+    Hal_GpioWrite(siren == 0 ? ExternalSirenPin : DownstairsSirenPin, on);
+    FlightRecorder_Record(FR_SIREN_SET, siren, on);
+    setSiren(state, sirenName, on);
+}
+
+/******************************************************************
+ * 
+ * Command a siren on or off. Called from the MQTT task and the local
+ * API. Only the latest command counts, so an OFF then an ON before
+ * the main loop gets to them leaves the siren on.
+ * 
+*******************************************************************/
+void InputOutput_CommandSiren(int siren, bool on)
+{
+    atomic_store(&commandedSiren[siren], on);
+    Hal_LoopWake();
+}
+
+static void processCommandedSiren(int siren, SirenState* state, char* sirenName)
+{
+    int on = atomic_exchange(&commandedSiren[siren], SIREN_NONE);
+    if (on == SIREN_NONE) { return; }
+    Hal_GpioWrite(siren == 0 ? ExternalSirenPin : DownstairsSirenPin, on);
+    FlightRecorder_Record(FR_SIREN_SET, siren, on);
+    TRACE_INSTANT("gpioSet", siren + 1);
+    setSiren(state, sirenName, on);
+    PeerLink_SirenEvent(siren, on);
+}
+
+/******************************************************************
+ * 
+ * Drive the sirens as requested by the host system, and publish the
+ * ones the peers have set. Commanded changes go to the peers too.
+ * 
+*******************************************************************/
+void processSirenRequests(void)
+{
+    processPeerSiren(0, &externalSiren, "ExternalSiren");
+    processPeerSiren(1, &downstairsSiren, "DownstairsSiren");
+    processCommandedSiren(0, &externalSiren, "ExternalSiren");
+    processCommandedSiren(1, &downstairsSiren, "DownstairsSiren");
+    if (atomic_exchange(&sirenResync, false)) {
+        SendSirenEvent("ExternalSiren", externalSiren.on, externalSiren.previous, externalSiren.sinceUs);
+        SendSirenEvent("DownstairsSiren", downstairsSiren.on, downstairsSiren.previous, downstairsSiren.sinceUs);
+        SendAvailability();
     }
 }
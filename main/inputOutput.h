@@ -21,13 +21,16 @@
 #ifndef __INPUTOUTPUT_H__
 #define __INPUTOUTPUT_H__
 
+#include <stdbool.h>
 #include "inttypes.h"
+#include "driver/gpio.h"
 
 typedef struct {
   gpio_num_t gpioNumber;
   int previousState;
   int currentState;
   int64_t changeStart;
+  int64_t eventUs;      // Time of the edge behind the last change
   bool changed;
 } DebouncedInput;
 
@@ -35,5 +38,12 @@ void initialSetup(void);
 void initialiseInputs(DebouncedInput inputs[], const gpio_num_t pins[], int numInputs);
 bool buttonPressed(void);
 void updateInputs(DebouncedInput inputs[], int numInputs);
+void processInputChanges(DebouncedInput inputs[], int numInputs);
+bool InputOutput_NeedsPolling(const DebouncedInput inputs[], int numInputs);
+bool InputOutput_Settling(const DebouncedInput inputs[], int numInputs);
+void processSirenRequests(void);
+void InputOutput_RequestResync(bool all);
+void InputOutput_CommandSiren(int siren, bool on);
+void InputOutput_PeerSiren(int siren, bool on);
 
 #endif // #ifndef __INPUTOUTPUT_H__
\ No newline at end of file
@@ -0,0 +1,306 @@
+/* MQTT Alarm Controller: Local status and control API
+
+   Served by the local HTTP server, so the alarm can be watched and
+   silenced on the LAN with the broker down:
+
+     GET /api/status     the state now, see LocalApi_FormatStatus()
+     /api/events         a WebSocket, an event for each zone, siren and
+                         alarm state change as it happens
+     POST /api/control   {"command": "arm" | "disarm" | "silence"}, with
+                         "Authorization: Bearer <config.httpApiToken>"
+
+   Control is off until a token is configured. The status and events
+   are open on the LAN, as /metrics is.
+
+   Everything is written straight into the caller's buffer from the
+   live state, with no cJSON and no allocation. The main loop owns the
+   state: it notes the changes here, and queues them as events while
+   the server has a WebSocket open, which the server takes on its own
+   task. Commands are requests the main loop carries out, as the MQTT
+   commands are.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "sensorHealth.h"
+#include "zoneScan.h"
+#include "timeService.h"
+#include "mqttFailover.h"
+#include "inputOutput.h"
+#include "localApi.h"
+
+// MQTT connection flag, in mqttProcess.c
+extern bool MyMqttConnected;
+
+typedef enum { EVENT_ZONE, EVENT_SIREN, EVENT_ALARM } LocalApiEventKind;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t index;
+    int8_t state;
+    uint32_t seq;
+    int64_t us;
+} LocalApiEvent;
+
+static const char* sirenNames[2] = { "ExternalSiren", "DownstairsSiren" };
+static const char* alarmNames[3] = { "armed", "disarmed", "triggered" };
+static const char* commandNames[3] = { "arm", "disarm", "silence" };
+
+static AlarmMachine* alarmMachine = NULL;
+static atomic_int zoneActive[NUM_INPUTS];
+static atomic_bool sirenOn[2];
+static atomic_int alarmState = Disarmed;
+static atomic_int alarmRequest = -1;    // From a command, for the main loop
+
+// Main loop to server, single producer and consumer
+static LocalApiEvent events[LOCAL_API_EVENTS];
+static atomic_uint eventHead = 0;
+static atomic_uint eventTail = 0;
+static atomic_uint eventSeq = 0;
+static atomic_bool eventsWanted = false;
+static LocalApiListener eventListener = NULL;
+
+static Metric apiCommands = METRIC_COUNTER_INIT("alarm_http_commands_total", "Local API commands carried out");
+static Metric apiAuthFailures = METRIC_COUNTER_INIT("alarm_http_auth_failures_total", "Local API commands refused for a missing or wrong token");
+static Metric apiEventsDropped = METRIC_COUNTER_INIT("alarm_http_events_dropped_total", "Local API events dropped with the server behind");
+
+/******************************************************************
+ *
+ * JSON writing. The length used keeps counting past the end of the
+ * buffer, so the caller can tell it didn't fit.
+ *
+*******************************************************************/
+static void append(char* buf, size_t len, size_t* used, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(*used < len ? buf + *used : NULL, *used < len ? len - *used : 0, fmt, args);
+    va_end(args);
+    if (n > 0) { *used += n; }
+}
+
+static void appendString(char* buf, size_t len, size_t* used, const char* s)
+{
+    append(buf, len, used, "\"");
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') { append(buf, len, used, "\\%c", *s); }
+        else if ((unsigned char)*s < 0x20) { append(buf, len, used, "\\u%04x", *s); }
+        else { append(buf, len, used, "%c", *s); }
+    }
+    append(buf, len, used, "\"");
+}
+
+static int finish(size_t used, size_t len)
+{
+    return used < len ? (int)used : -1;
+}
+
+/******************************************************************
+ *
+ * The status now. Returns the length, or -1 if it didn't fit.
+ *
+*******************************************************************/
+int LocalApi_FormatStatus(char* buf, size_t len)
+{
+    size_t used = 0;
+    append(buf, len, &used, "{\"name\":");
+    appendString(buf, len, &used, config.Name);
+    append(buf, len, &used, ",\"uptimeS\":%" PRIi64 ",\"timeSet\":%s,\"alarm\":\"%s\",\"mqtt\":{\"connected\":%s,\"broker\":%d}",
+        Hal_TimeUs() / 1000000, TimeService_IsSet() ? "true" : "false", alarmNames[atomic_load(&alarmState)],
+        MyMqttConnected ? "true" : "false", MqttFailover_ActiveBroker());
+    append(buf, len, &used, ",\"sirens\":{\"%s\":%s,\"%s\":%s},\"zones\":[", sirenNames[0], atomic_load(&sirenOn[0]) ? "true" : "false",
+        sirenNames[1], atomic_load(&sirenOn[1]) ? "true" : "false");
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        append(buf, len, &used, "%s{\"zone\":%d,\"name\":", i == 0 ? "" : ",", i + 1);
+        appendString(buf, len, &used, config.inputs[i].inputName);
+        append(buf, len, &used, ",\"description\":");
+        appendString(buf, len, &used, config.inputs[i].descriptiveName);
+        append(buf, len, &used, ",\"enabled\":%s,\"active\":%s,\"problems\":%u", config.inputs[i].active ? "true" : "false",
+            atomic_load(&zoneActive[i]) ? "true" : "false", SensorHealth_Problems(i));
+        if (ZoneScan_IsSupervised(i)) { append(buf, len, &used, ",\"condition\":\"%s\"", ZoneScan_ConditionName(ZoneScan_Condition(i))); }
+        append(buf, len, &used, "}");
+    }
+    append(buf, len, &used, "],\"seq\":%u}", atomic_load(&eventSeq));
+    return finish(used, len);
+}
+
+/******************************************************************
+ *
+ * Events. Only queued while the server wants them, and dropped if
+ * it's fallen behind; the sequence number shows the gap.
+ *
+*******************************************************************/
+static void queueEvent(LocalApiEventKind kind, int index, int state)
+{
+    uint32_t seq = atomic_fetch_add(&eventSeq, 1) + 1;
+    if (!atomic_load(&eventsWanted)) { return; }
+    unsigned head = atomic_load(&eventHead);
+    if (head - atomic_load(&eventTail) >= LOCAL_API_EVENTS) {
+        Metrics_Increment(&apiEventsDropped);
+        return;
+    }
+    events[head % LOCAL_API_EVENTS] = (LocalApiEvent){ kind, index, state, seq, Hal_TimeUs() };
+    atomic_store(&eventHead, head + 1);
+    if (eventListener != NULL) { eventListener(); }
+}
+
+void LocalApi_ZoneChanged(int zone, bool active)
+{
+    if (zone < 0 || zone >= NUM_INPUTS) { return; }
+    atomic_store(&zoneActive[zone], active);
+    queueEvent(EVENT_ZONE, zone, active);
+}
+
+void LocalApi_SirenChanged(int siren, bool on)
+{
+    if (siren < 0 || siren > 1) { return; }
+    atomic_store(&sirenOn[siren], on);
+    queueEvent(EVENT_SIREN, siren, on);
+}
+
+// Called on the main loop as each event is queued
+void LocalApi_SetEventListener(LocalApiListener listener)
+{
+    eventListener = listener;
+}
+
+// Start or stop queueing events
+void LocalApi_WantEvents(bool want)
+{
+    if (want && !atomic_load(&eventsWanted)) { atomic_store(&eventTail, atomic_load(&eventHead)); }
+    atomic_store(&eventsWanted, want);
+}
+
+// The next event's JSON, 0 if there isn't one. Called from the server.
+int LocalApi_NextEvent(char* buf, size_t len)
+{
+    unsigned tail = atomic_load(&eventTail);
+    if (tail == atomic_load(&eventHead)) { return 0; }
+    LocalApiEvent e = events[tail % LOCAL_API_EVENTS];
+    atomic_store(&eventTail, tail + 1);
+
+    size_t used = 0;
+    append(buf, len, &used, "{\"seq\":%" PRIu32 ",\"uptimeMs\":%" PRIi64 ",", e.seq, e.us / 1000);
+    if (e.kind == EVENT_ZONE) {
+        append(buf, len, &used, "\"zone\":%d,\"name\":", e.index + 1);
+        appendString(buf, len, &used, config.inputs[e.index].inputName);
+        append(buf, len, &used, ",\"active\":%s}", e.state ? "true" : "false");
+    } else if (e.kind == EVENT_SIREN) {
+        append(buf, len, &used, "\"siren\":\"%s\",\"on\":%s}", sirenNames[e.index], e.state ? "true" : "false");
+    } else {
+        append(buf, len, &used, "\"alarm\":\"%s\"}", alarmNames[e.state]);
+    }
+    return finish(used, len);
+}
+
+/******************************************************************
+ *
+ * A control request. authorization is the Authorization header, or
+ * NULL. The token's compared in constant time.
+ *
+*******************************************************************/
+static bool authorised(const char* authorization)
+{
+    const char* prefix = "Bearer ";
+    if (authorization == NULL || strncmp(authorization, prefix, strlen(prefix)) != 0) { return false; }
+    const char* token = authorization + strlen(prefix);
+    size_t tokenLen = strlen(config.httpApiToken);
+    if (strlen(token) != tokenLen) { return false; }
+    uint8_t diff = 0;
+    for (size_t i = 0; i < tokenLen; i++) { diff |= token[i] ^ config.httpApiToken[i]; }
+    return diff == 0;
+}
+
+// The value of "command" in a small JSON object, or -1
+static int parseCommand(const char* body, int len)
+{
+    char text[LOCAL_API_BODY_LEN + 1];
+    if (len < 0 || len > LOCAL_API_BODY_LEN) { return -1; }
+    memcpy(text, body, len);
+    text[len] = '\0';
+
+    const char* p = strstr(text, "\"command\"");
+    if (p == NULL) { return -1; }
+    p += strlen("\"command\"");
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') { p++; }
+    if (*p++ != ':') { return -1; }
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') { p++; }
+    if (*p++ != '"') { return -1; }
+    for (int i = 0; i < 3; i++) {
+        size_t n = strlen(commandNames[i]);
+        if (strncmp(p, commandNames[i], n) == 0 && p[n] == '"') { return i; }
+    }
+    return -1;
+}
+
+LocalApiResult LocalApi_Control(const char* authorization, const char* body, int len)
+{
+    if (config.httpApiToken[0] == '\0') { return LOCAL_API_DISABLED; }
+    if (!authorised(authorization)) {
+        Metrics_Increment(&apiAuthFailures);
+        ESP_LOGW(TAG, "Local API command refused, bad or missing token.");
+        return LOCAL_API_UNAUTHORISED;
+    }
+    int command = parseCommand(body, len);
+    if (command < 0) { return LOCAL_API_BAD_REQUEST; }
+
+    ESP_LOGW(TAG, "Local API command: %s.", commandNames[command]);
+    FlightRecorder_Record(FR_LOCAL_COMMAND, command, 0);
+    Metrics_Increment(&apiCommands);
+    if (command == 2) {
+        InputOutput_CommandSiren(0, false);
+        InputOutput_CommandSiren(1, false);
+    } else {
+        atomic_store(&alarmRequest, command == 0 ? Armed : Disarmed);
+    }
+    Hal_LoopWake();
+    return LOCAL_API_OK;
+}
+
+/******************************************************************
+ *
+ * Carry out arm and disarm commands. Call from the main loop.
+ *
+*******************************************************************/
+void LocalApi_Poll(void)
+{
+    int request = atomic_exchange(&alarmRequest, -1);
+    if (request < 0 || alarmMachine == NULL || (int)alarmMachine->alarmState == request) { return; }
+    AlarmMachine_SetAlarmState(alarmMachine, (AlarmStates)request);
+    atomic_store(&alarmState, request);
+    queueEvent(EVENT_ALARM, 0, request);
+}
+
+void LocalApi_Initialise(AlarmMachine* alarm)
+{
+    Metrics_Register(&apiCommands);
+    Metrics_Register(&apiAuthFailures);
+    Metrics_Register(&apiEventsDropped);
+    alarmMachine = alarm;
+    atomic_store(&alarmState, alarm->alarmState);
+    atomic_store(&alarmRequest, -1);
+}
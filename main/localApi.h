@@ -0,0 +1,58 @@
+/* MQTT Alarm Controller: Local status and control API
+
+   The controller's state as JSON, its zone, siren and alarm changes as
+   a stream of events, and arm, disarm and silence commands, for the
+   local HTTP server to serve when the broker's down.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __LOCALAPI_H__
+#define __LOCALAPI_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "inttypes.h"
+#include "AlarmMachine.h"
+
+#define LOCAL_API_EVENTS 32             // Events waiting for the server, a power of two
+#define LOCAL_API_EVENT_LEN 192         // Longest event JSON
+#define LOCAL_API_BODY_LEN 128          // Longest control request body
+
+typedef enum {
+    LOCAL_API_OK,
+    LOCAL_API_BAD_REQUEST,
+    LOCAL_API_UNAUTHORISED,
+    LOCAL_API_DISABLED,                 // No token configured
+} LocalApiResult;
+
+typedef void (*LocalApiListener)(void);
+
+void LocalApi_Initialise(AlarmMachine* alarm);
+void LocalApi_Poll(void);
+
+// State changes, from the main loop
+void LocalApi_ZoneChanged(int zone, bool active);
+void LocalApi_SirenChanged(int siren, bool on);
+
+// For the server
+int LocalApi_FormatStatus(char* buf, size_t len);
+void LocalApi_SetEventListener(LocalApiListener listener);
+void LocalApi_WantEvents(bool want);
+int LocalApi_NextEvent(char* buf, size_t len);
+LocalApiResult LocalApi_Control(const char* authorization, const char* body, int len);
+
+#endif // #ifndef __LOCALAPI_H__
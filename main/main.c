@@ -29,37 +29,46 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "driver/gpio.h"
-#include "esp_adc/adc_oneshot.h"
 #include "esp_timer.h"
 #include "esp_spiffs.h"
+#include "nvs_flash.h"
 #include "esp_system.h"
 
 #include "defines.h"
 #include "utilities.h"
+#include "hal.h"
 #include "config.h"
 #include "ethernetProcess.h"
 #include "mqttProcess.h"
+#include "mqttClient.h"
 #include "inputOutput.h"
 #include "AlarmMachine.h"
+#include "metrics.h"
+#include "httpServer.h"
+#include "systemHealth.h"
+#include "supervisor.h"
+#include "flightRecorder.h"
+#include "trace.h"
+#include "sensorHealth.h"
+#include "timeService.h"
+#include "netSupervisor.h"
+#include "mqttFailover.h"
+#include "peerLink.h"
+#include "localApi.h"
+#include "ota.h"
+#include "commandAuth.h"
+#include "inputLatency.h"
+#include "pulseZone.h"
+#include "power.h"
+#include "taskPlan.h"
 
 #include "main.h"
 
 AlarmMachine houseAlarm;
 
-// Ethernet state variables
-extern bool MyEthernetIsConnected;
-extern bool MyEthernetGotIp;
-extern bool MyEthernetHasDHCP;
-
 // MQTT State information
 extern bool MyMqttConnected;
 
-// MQTT Siren Request flags
-extern bool ExternalSirenActivationRequested;
-extern bool ExternalSirenSilenceRequested;
-extern bool DownstairsSirenActivationRequested;
-extern bool DownstairsSirenSilenceRequested;
-
 const char *TAG = "AlarmController";
 
 char s[1024];
@@ -67,12 +76,49 @@ char s[1024];
 const gpio_num_t inputPins[NUM_INPUTS] = {In1_Pin, In2_Pin, In3_Pin, In4_Pin, In5_Pin, In6_Pin};
 DebouncedInput inputs[NUM_INPUTS];
 
+static const int32_t loopTimeBounds[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000};
+static Metric loopTime = METRIC_HISTOGRAM_INIT("alarm_loop_duration_us", "Main loop processing time in microseconds", loopTimeBounds);
+static Metric adcReads = METRIC_COUNTER_INIT("alarm_adc_reads_total", "Battery and VIN ADC read cycles");
+static Metric battRaw = METRIC_GAUGE_INIT("alarm_adc_battery_raw", "Battery voltage raw ADC value");
+static Metric vinRaw = METRIC_GAUGE_INIT("alarm_adc_vin_raw", "5V rail voltage raw ADC value");
+
+/******************************************************************
+ *
+ * How long the main loop can wait for a wake up. It polls while an
+ * input is settling, a pulse zone is counting, a publish or a peer
+ * copy is waiting, or a firmware update or latency test needs its
+ * passes. Otherwise an input edge, the zone scan, a command or the
+ * heartbeat timer wakes it.
+ *
+*******************************************************************/
+static uint32_t loopWaitMs(void)
+{
+    if (InputOutput_Settling(inputs, NUM_INPUTS)) { return DEBOUNCE_POLL_MS; }
+    if (InputOutput_NeedsPolling(inputs, NUM_INPUTS) || PeerLink_Pending() || Ota_Updating() || InputLatency_Testing()) {
+        return MAIN_LOOP_PERIOD_MS;
+    }
+    return Power_BatteryMode() ? MAIN_LOOP_BATTERY_IDLE_MS : MAIN_LOOP_IDLE_MS;
+}
+
 void app_main(void)
 {
     bool configMode = false;
 
     // Initial critical IO setup
     initialSetup();
+    consoleInitialise();
+
+    // Resume the flight recorder from RTC memory
+    FlightRecorder_Initialise();
+
+    // Start the supervisor early so a watchdog reset report from the last boot is picked up
+    Supervisor_Initialise();
+
+    // Keep or roll back a new firmware image
+    Ota_Initialise();
+
+    // Frequency scaling and light sleep, before any of the tasks that hold the clock up start
+    Power_Initialise();
 
     // If the config button is pressed (or jumped to ground) go into config mode.
     if (buttonPressed()) { ESP_LOGI(TAG, "Button pressed, config mode active"); configMode = true; }
@@ -125,112 +171,150 @@ void app_main(void)
 
     //Initialise the alarm machine
     AlarmMachine_Initialise(&houseAlarm, ExternalSirenPin, DownstairsSirenPin);
+    LocalApi_Initialise(&houseAlarm);
+    CommandAuth_Initialise();
+    InputLatency_Initialise();
+
+    // NVS, where lwIP keeps the last DHCP address so DHCP can start by asking for it again
+    err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) { ESP_LOGE(TAG, "NVS init failed: %s", esp_err_to_name(err)); }
 
     // Initialise & start the ethernet interface and wait for it to get an IP address
     // If IP acquisition fails, we will continue on as it will auto-connect later if
-    // the Ethernet connect becomes available.
+    // the Ethernet connect becomes available. The network supervisor handles the
+    // link and address coming and going from here on.
+    NetSupervisor_Start();
     ethernetInitialise();
+    TimeService_Initialise();
     ESP_LOGI(TAG, "Waiting for DHCP to complete...");
-    int ipWaits = 0;
-    while (!MyEthernetGotIp && ipWaits < 40) { 
-        vTaskDelay(250 / portTICK_PERIOD_MS); 
-        ipWaits++; 
-    }
-    if (!MyEthernetGotIp) {
+    if (!NetSupervisor_WaitForIp(10000)) {
         ESP_LOGE(TAG, "Timed out waiting for DHCP. We'll continue on, it will connect later if the connection becomes available.");
     }
+
+    // Start the local HTTP server for metrics scraping and the system health sampler
+    httpServerStart();
+    SystemHealth_Start();
     
-    // Start mqtt, then wait up to 40 * 0.25 = 10 seconds for it to start. If it doesn't start we'll move on as this is
-    // an alarm system, but it should connect later if the MQTT connection becomes available.
+    // Start mqtt, then wait up to 10 seconds for it to start. If it doesn't start we'll move on as this is
+    // an alarm system, but the network supervisor will connect it later when the broker becomes available.
     ESP_LOGI(TAG, "Starting the MQTT client...");
     mqtt_app_start();
-    int mqttWaits = 0;
-    while (!MyMqttConnected && mqttWaits < 40) { vTaskDelay(250 / portTICK_PERIOD_MS); mqttWaits++; } 
-    if (MyMqttConnected) { ESP_LOGI(TAG, "MQTT client started after %f seconds.", ((float)mqttWaits) * 0.25); }
-    else { ESP_LOGI(TAG, "MQTT client didn't connect after %f seconds, but we'll solider on...", ((float)mqttWaits) * 0.25); }
+    int64_t mqttStart = esp_timer_get_time();
+    if (NetSupervisor_WaitForMqtt(10000)) { ESP_LOGI(TAG, "MQTT client started after %f seconds.", (esp_timer_get_time() - mqttStart) / 1e6); }
+    else { ESP_LOGI(TAG, "MQTT client didn't connect after 10 seconds, but we'll solider on..."); }
+
+    // Join the LAN peer group, if there is one, so the other controllers hear our zones and sirens
+    PeerLink_Start();
 
     // Initialise the inputs
     initialiseInputs(inputs, inputPins, NUM_INPUTS);
     vTaskDelay(50 / portTICK_PERIOD_MS); // Short delay for inputs to stabilise
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        if (PulseZone_IsEnabled(i)) { Power_PreventSleep(); }
+    }
 
-    //-------------ADC1 Init---------------//
-    adc_oneshot_unit_handle_t adc1_handle;
-    adc_oneshot_unit_init_cfg_t init_config1 = { .unit_id = ADC_UNIT_1, };
-    ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config1, &adc1_handle));
+    // Battery and VIN voltages, through the HAL as the ADC units are shared with the zone scan
+    Hal_AdcConfig(BATT_ADC_PIN);
+    Hal_AdcConfig(VIN_ADC_PIN);
 
-    //-------------ADC1 Config---------------//
-    adc_oneshot_chan_cfg_t adc1_config = {
-        .bitwidth = ADC_BITWIDTH_DEFAULT,
-        .atten = ADC_ATTEN_DB_11,
-    };
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, BATT_ADC_CHANNEL, &adc1_config));
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, VIN_ADC_CHANNEL, &adc1_config));
+    int batt_volts_raw = 0;
+    int vin_volts_raw = 0;
 
-//    int batt_volts_raw = 0;
-//    int vin_volts_raw = 0;
+    Metrics_Register(&loopTime);
+    Metrics_Register(&adcReads);
+    Metrics_Register(&battRaw);
+    Metrics_Register(&vinRaw);
 
     uint64_t last_ADC_Update = esp_timer_get_time();
+    uint64_t last_Diagnostics_Update = esp_timer_get_time();
+    uint64_t last_Console_Check = esp_timer_get_time();
 
     uint32_t elevel = 0;
     uint32_t ilevel = 0;
 
+    // Subscribe the main loop to the task watchdog now that the startup waits are done
+    int mainLoop = Supervisor_RegisterLoop("main", MAIN_LOOP_BUDGET_US, TWDT_TIMEOUT_MS, true);
+
+    // Run the alarm path above everything else that can land on its core, see taskPlan.h
+    vTaskPrioritySet(NULL, MAIN_LOOP_PRIORITY);
+
+    int64_t edgeUs = 0;
+    uint32_t waitMs = MAIN_LOOP_PERIOD_MS;
+
     // Main app loop
     while (true) {
+        Power_Acquire(POWER_LOOP);
+        int64_t loopStart = esp_timer_get_time();
+        Supervisor_LoopStart(mainLoop);
+
+        // Check the broker, resending unacknowledged events after a failover ahead of any new ones
+        Supervisor_Trace(mainLoop, "mqttFailover");
+        MqttFailover_Poll();
 
         // Read and process any changes to the inputs
+        Supervisor_Trace(mainLoop, "updateInputs");
         updateInputs(inputs, NUM_INPUTS);
-        for (int i = 0; i < NUM_INPUTS; i++) {
-            if (inputs[i].changed) {
-                //ESP_LOGI(TAG, "Input %d changed to %d", i, inputs[i].currentState);
-                bool state = false;
-                if (config.inputs[i].normallyClosed) { 
-                    if (inputs[i].currentState) { state = true; } else { state = false; } 
-                } else {
-                    if (inputs[i].currentState) { state = false; } else { state = true; } 
-                }
-                if (config.inputs[i].active) { 
-                    sendInputState(i, state); 
-                } else {
-                    ESP_LOGI(TAG, "Not sending to MQTT as input %d is disabled.", i); 
-                }
-            }
-        }
+        InputLatency_Sampled(edgeUs, waitMs == MAIN_LOOP_PERIOD_MS);
+        Supervisor_Trace(mainLoop, "sendInputState");
+        processInputChanges(inputs, NUM_INPUTS);
 
-        // Read battery and VIN voltages
+        // Read battery and VIN voltages, VIN deciding whether we're on the battery
+        Supervisor_Trace(mainLoop, "adc");
         uint64_t usecs = esp_timer_get_time();
-        if (usecs - last_ADC_Update > S_TO_uS(5)) {
+        bool battery = Power_BatteryMode();
+        int adcIntervalS = battery ? ADC_BATTERY_INTERVAL_S : ADC_INTERVAL_S;
+        if (usecs - last_ADC_Update > S_TO_uS(adcIntervalS)) {
             last_ADC_Update = usecs;
-            /*
-            ESP_ERROR_CHECK(adc_oneshot_read(adc1_handle, BATT_ADC_CHANNEL, &batt_volts_raw));
-            ESP_LOGI(TAG, "Battery voltage raw ADC value = %d", batt_volts_raw);
-            ESP_ERROR_CHECK(adc_oneshot_read(adc1_handle, VIN_ADC_CHANNEL, &vin_volts_raw));
-            ESP_LOGI(TAG, "5V rail voltage raw ADC value = %d", vin_volts_raw);
-            */
+            if ((batt_volts_raw = Hal_AdcRead(BATT_ADC_PIN)) >= 0) { Metrics_Set(&battRaw, batt_volts_raw); }
+            if ((vin_volts_raw = Hal_AdcRead(VIN_ADC_PIN)) >= 0) { Metrics_Set(&vinRaw, vin_volts_raw); }
+            Metrics_Increment(&adcReads);
+            Power_VinSample(vin_volts_raw);
         }
 
-        // Process commands for the sirens from the host system
-        if (ExternalSirenActivationRequested) { 
-            gpio_set_level(ExternalSirenPin, 1); 
-            ExternalSirenActivationRequested = false; 
-            SendSirenState("ExternalSiren", true);
-        }
-        if (ExternalSirenSilenceRequested) { 
-            gpio_set_level(ExternalSirenPin, 0); 
-            ExternalSirenSilenceRequested = false; 
-            SendSirenState("ExternalSiren", false);
-        }
-        if (DownstairsSirenActivationRequested) { 
-            gpio_set_level(DownstairsSirenPin, 1); 
-            DownstairsSirenActivationRequested = false; 
-            SendSirenState("DownstairsSiren", true);
+        // Publish the diagnostics metrics, not on the battery
+        if (usecs - last_Diagnostics_Update > S_TO_uS(DIAGNOSTICS_INTERVAL_S)) {
+            last_Diagnostics_Update = usecs;
+            if (!battery) { SendDiagnostics(); }
         }
-        if (DownstairsSirenSilenceRequested) { 
-            gpio_set_level(DownstairsSirenPin, 0); 
-            DownstairsSirenSilenceRequested = false;
-            SendSirenState("DownstairsSiren", false); 
+
+        // Console trace commands: t = start a capture, s = stop, d = dump
+        if (usecs - last_Console_Check > CONSOLE_CHECK_INTERVAL_US) {
+            last_Console_Check = usecs;
+            int c = consoleGetChar();
+            if (c == 't') { Trace_Start(); }
+            else if (c == 's') { Trace_Stop(); }
+            else if (c == 'd') { Trace_DumpToConsole(); }
         }
 
-        // Sleep and let other tasks run
-        vTaskDelay(25 / portTICK_PERIOD_MS);
+        // Flag stuck, chattering and dead sensors
+        Supervisor_Trace(mainLoop, "sensorHealth");
+        SensorHealth_Check();
+
+        // Process commands for the sirens from the host system and the local API
+        Supervisor_Trace(mainLoop, "sirens");
+        LocalApi_Poll();
+        processSirenRequests();
+
+        // Repeat the events sent to the peers
+        PeerLink_Poll();
+
+        // Availability heartbeat, flagged by its timer
+        SendHeartbeatIfDue();
+
+        Metrics_Observe(&loopTime, (int32_t)(esp_timer_get_time() - loopStart));
+        Supervisor_LoopEnd(mainLoop);
+        Supervisor_Check();
+
+        // A firmware update writes its next block to flash while we sleep
+        Ota_LoopDone();
+
+        // Sleep at the idle clock until there's something to do
+        waitMs = loopWaitMs();
+        Power_Release(POWER_LOOP);
+        edgeUs = Hal_LoopWait(waitMs);
     }
 }
@@ -21,6 +21,12 @@
 #define __MAIN_H__
 
 #define TWDT_TIMEOUT_MS 10000 // Watchdog timeout in milliseconds
+#define MAIN_LOOP_BUDGET_US 5000 // Execution time budget for one pass of the main loop
+#define MAIN_LOOP_PERIOD_MS 25 // Main loop polling period while inputs are settling or sends are pending
+#define MAIN_LOOP_IDLE_MS 250 // Longest the main loop waits for a wake up otherwise
+#define MAIN_LOOP_BATTERY_IDLE_MS 1000 // The same on the battery
+#define ADC_INTERVAL_S 5 // Battery and VIN reads
+#define ADC_BATTERY_INTERVAL_S 30 // The same on the battery
 
 void app_main(void);
 
@@ -0,0 +1,200 @@
+/* MQTT Alarm Controller: Runtime metrics
+
+   Static registry of counters, gauges and histograms. Each module defines
+   its metrics statically and registers them at initialisation. Updates are
+   lock-free atomics so they are safe to call from the alarm path, and the
+   exporters only read, so a scrape can never block an update.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "defines.h"
+#include "metrics.h"
+
+static Metric* _Atomic registry[METRICS_MAX];
+static atomic_int registeredCount = 0;
+
+/******************************************************************
+ *
+ * Register a statically defined metric. Called once per metric
+ * during module initialisation; registering it again is a no-op,
+ * so modules can be re-initialised.
+ *
+*******************************************************************/
+bool Metrics_Register(Metric* metric)
+{
+    int count = atomic_load(&registeredCount);
+    for (int i = 0; i < count && i < METRICS_MAX; i++) {
+        if (atomic_load_explicit(&registry[i], memory_order_acquire) == metric) { return true; }
+    }
+
+    int slot = atomic_fetch_add(&registeredCount, 1);
+    if (slot >= METRICS_MAX) {
+        atomic_fetch_sub(&registeredCount, 1);
+        ESP_LOGE(TAG, "Metrics registry full, %s not registered.", metric->name);
+        return false;
+    }
+    if (metric->type == MetricHistogram && metric->numBounds > METRICS_MAX_BUCKETS) {
+        metric->numBounds = METRICS_MAX_BUCKETS;
+    }
+    atomic_store_explicit(&registry[slot], metric, memory_order_release);
+    return true;
+}
+
+/******************************************************************
+ *
+ * Record an observation in a histogram
+ *
+*******************************************************************/
+void Metrics_Observe(Metric* metric, int32_t value)
+{
+    int bucket = 0;
+    while (bucket < metric->numBounds && value > metric->bounds[bucket]) { bucket++; }
+    atomic_fetch_add_explicit(&metric->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metric->sum, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metric->count, 1, memory_order_relaxed);
+}
+
+// Append formatted text to an output buffer, tracking the used length
+static void append(char* buf, size_t len, size_t* used, const char* fmt, ...)
+{
+    if (*used >= len) { return; }
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *used, len - *used, fmt, args);
+    va_end(args);
+    if (n < 0) { return; }
+    *used += n;
+    if (*used >= len) { *used = len; }
+}
+
+/******************************************************************
+ *
+ * Write all metrics as a compact JSON object. Zone metrics are
+ * keyed as <name>_zone<n>. Returns the length written, or -1 if
+ * the buffer was too small.
+ *
+*******************************************************************/
+int Metrics_FormatJson(char* buf, size_t len)
+{
+    size_t used = 0;
+    int count = atomic_load(&registeredCount);
+    if (count > METRICS_MAX) { count = METRICS_MAX; }
+
+    append(buf, len, &used, "{");
+    bool first = true;
+    for (int i = 0; i < count; i++) {
+        Metric* m = atomic_load_explicit(&registry[i], memory_order_acquire);
+        if (m == NULL) { continue; }
+        append(buf, len, &used, first ? "\"%s" : ",\"%s", m->name);
+        if (m->zone != METRICS_NO_ZONE) { append(buf, len, &used, "_zone%d", m->zone + 1); }
+        first = false;
+        if (m->type == MetricHistogram) {
+            append(buf, len, &used, "\":{\"count\":%" PRIu32 ",\"sum\":%" PRIi64 ",\"buckets\":[",
+                (uint32_t)atomic_load_explicit(&m->count, memory_order_relaxed),
+                (int64_t)atomic_load_explicit(&m->sum, memory_order_relaxed));
+            for (int b = 0; b <= m->numBounds; b++) {
+                append(buf, len, &used, b == 0 ? "%" PRIu32 : ",%" PRIu32,
+                    (uint32_t)atomic_load_explicit(&m->buckets[b], memory_order_relaxed));
+            }
+            append(buf, len, &used, "]}");
+        } else {
+            append(buf, len, &used, "\":%" PRIi32, Metrics_Get(m));
+        }
+    }
+    append(buf, len, &used, "}");
+
+    if (used >= len) { return -1; }
+    return (int)used;
+}
+
+int Metrics_Count(void)
+{
+    int count = atomic_load(&registeredCount);
+    return count > METRICS_MAX ? METRICS_MAX : count;
+}
+
+/******************************************************************
+ *
+ * Write one registered metric in the Prometheus text exposition
+ * format, for exporters that send each one as it's written. Returns
+ * the length written, 0 for an empty slot, or -1 if the buffer was
+ * too small.
+ *
+*******************************************************************/
+int Metrics_FormatPrometheusMetric(int index, char* buf, size_t len)
+{
+    size_t used = 0;
+    if (index < 0 || index >= Metrics_Count()) { return 0; }
+    Metric* m = atomic_load_explicit(&registry[index], memory_order_acquire);
+    if (m == NULL) { return 0; }
+
+    // Zone metrics share a name, so only write the HELP and TYPE lines once
+    bool described = false;
+    for (int j = 0; j < index && !described; j++) {
+        Metric* other = atomic_load_explicit(&registry[j], memory_order_acquire);
+        if (other != NULL && strcmp(other->name, m->name) == 0) { described = true; }
+    }
+    if (!described) {
+        const char* type = m->type == MetricCounter ? "counter" : m->type == MetricGauge ? "gauge" : "histogram";
+        append(buf, len, &used, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, type);
+    }
+
+    if (m->type == MetricHistogram) {
+        uint32_t cumulative = 0;
+        for (int b = 0; b <= m->numBounds; b++) {
+            cumulative += atomic_load_explicit(&m->buckets[b], memory_order_relaxed);
+            if (b < m->numBounds) {
+                append(buf, len, &used, "%s_bucket{le=\"%" PRIi32 "\"} %" PRIu32 "\n", m->name, m->bounds[b], cumulative);
+            } else {
+                append(buf, len, &used, "%s_bucket{le=\"+Inf\"} %" PRIu32 "\n", m->name, cumulative);
+            }
+        }
+        append(buf, len, &used, "%s_sum %" PRIi64 "\n%s_count %" PRIu32 "\n",
+            m->name, (int64_t)atomic_load_explicit(&m->sum, memory_order_relaxed),
+            m->name, (uint32_t)atomic_load_explicit(&m->count, memory_order_relaxed));
+    } else if (m->zone != METRICS_NO_ZONE) {
+        append(buf, len, &used, "%s{zone=\"%d\"} %" PRIi32 "\n", m->name, m->zone + 1, Metrics_Get(m));
+    } else {
+        append(buf, len, &used, "%s %" PRIi32 "\n", m->name, Metrics_Get(m));
+    }
+
+    if (used >= len) { return -1; }
+    return (int)used;
+}
+
+/******************************************************************
+ *
+ * Write all metrics in the Prometheus text exposition format.
+ * Returns the length written, or -1 if the buffer was too small.
+ *
+*******************************************************************/
+int Metrics_FormatPrometheus(char* buf, size_t len)
+{
+    size_t used = 0;
+    int count = Metrics_Count();
+    for (int i = 0; i < count; i++) {
+        int n = Metrics_FormatPrometheusMetric(i, buf + used, len - used);
+        if (n < 0) { return -1; }
+        used += n;
+    }
+    return (int)used;
+}
@@ -0,0 +1,90 @@
+/* MQTT Alarm Controller: Runtime metrics
+
+   Static registry of counters, gauges and histograms. Each module defines
+   its metrics statically and registers them at initialisation. Counter
+   and gauge updates are lock-free 32 bit atomics, safe from any task or
+   ISR, and the exporters only read, so a scrape can never block an
+   update. A histogram's sum is 64 bit, which the ESP32 has no atomic
+   instructions for: libatomic does it under a short critical section,
+   so Metrics_Observe() isn't lock-free. Call it from tasks, not ISRs.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "inttypes.h"
+
+#define METRICS_MAX 112             // Maximum number of registered metrics
+#define METRICS_MAX_BUCKETS 8       // Maximum number of histogram bucket bounds
+#define METRICS_NO_ZONE -1          // Metric isn't per-zone
+
+typedef enum { MetricCounter, MetricGauge, MetricHistogram } MetricType;
+
+typedef struct Metric {
+    const char* name;
+    const char* help;
+    MetricType type;
+    int zone;                                           // Zone label, or METRICS_NO_ZONE
+    atomic_int_least32_t value;                         // Counter or gauge value
+    const int32_t* bounds;                              // Histogram upper bucket bounds, ascending
+    int numBounds;
+    atomic_uint_least32_t buckets[METRICS_MAX_BUCKETS + 1]; // Last bucket is +Inf
+    atomic_int_least64_t sum;                           // 64 bit, a µs histogram's sum would pass 2^31 within minutes. Not lock-free on the ESP32.
+    atomic_uint_least32_t count;
+} Metric;
+
+// Static initialisers for metric definitions
+#define METRIC_COUNTER_INIT(n, h) { .name = (n), .help = (h), .type = MetricCounter, .zone = METRICS_NO_ZONE }
+#define METRIC_GAUGE_INIT(n, h) { .name = (n), .help = (h), .type = MetricGauge, .zone = METRICS_NO_ZONE }
+#define METRIC_ZONE_COUNTER_INIT(n, h, z) { .name = (n), .help = (h), .type = MetricCounter, .zone = (z) }
+#define METRIC_HISTOGRAM_INIT(n, h, b) { .name = (n), .help = (h), .type = MetricHistogram, .zone = METRICS_NO_ZONE, \
+                                         .bounds = (b), .numBounds = sizeof(b) / sizeof((b)[0]) }
+
+bool Metrics_Register(Metric* metric);
+
+static inline void Metrics_Increment(Metric* metric)
+{
+    atomic_fetch_add_explicit(&metric->value, 1, memory_order_relaxed);
+}
+
+static inline void Metrics_Add(Metric* metric, int32_t amount)
+{
+    atomic_fetch_add_explicit(&metric->value, amount, memory_order_relaxed);
+}
+
+static inline void Metrics_Set(Metric* metric, int32_t value)
+{
+    atomic_store_explicit(&metric->value, value, memory_order_relaxed);
+}
+
+static inline int32_t Metrics_Get(Metric* metric)
+{
+    return atomic_load_explicit(&metric->value, memory_order_relaxed);
+}
+
+void Metrics_Observe(Metric* metric, int32_t value);
+
+int Metrics_FormatJson(char* buf, size_t len);
+int Metrics_FormatPrometheus(char* buf, size_t len);
+int Metrics_Count(void);
+int Metrics_FormatPrometheusMetric(int index, char* buf, size_t len);
+
+#endif // #ifndef __METRICS_H__
@@ -0,0 +1,706 @@
+/* MQTT Alarm Controller: MQTT client
+
+   The esp-mqtt client: connection configuration, the event handler that
+   passes broker events to mqttProcess.c and the HAL MQTT transport.
+
+   With config.mqtt5 the client connects with MQTT 5, sends the state
+   topics by topic alias (see topicAlias.c) and puts a message expiry on
+   the heartbeat. A broker that refuses MQTT 5 in its CONNACK, 0x01 from
+   a 3.1.1 broker or 0x84 from a 5 one, gets 3.1.1 from the next attempt
+   on, until the next boot.
+
+   With failover brokers (see mqttFailover.c) there's a client for
+   each broker, made as it's needed, each with its own client id. Only
+   the active one's events are passed on. A failover is chosen on the
+   main loop and made on the network supervisor's task, which destroys
+   the old client, and its outbox, and starts the next. With
+   config.mqttWarmStandby the broker after the active one is kept
+   connected too, reconnecting by itself, so a failover to it only needs
+   the new session's publishes. The standby connects without the last
+   will, so its drops don't mark the alarm offline.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "esp_crt_bundle.h"
+#include "inttypes.h"
+#include "mqtt_client.h"
+#include "mqtt5_client.h"
+
+#include "utilities.h"
+#include "config.h"
+#include "metrics.h"
+#include "supervisor.h"
+#include "trace.h"
+#include "hal.h"
+#include "mqttProcess.h"
+#include "netSupervisor.h"
+#include "topicAlias.h"
+#include "mqttFailover.h"
+#include "ota.h"
+#include "power.h"
+#include "taskPlan.h"
+#include "mqttTls.h"
+#include "mqttClient.h"
+
+#define STANDBY_RECONNECT_MS 10000   // The warm standby reconnects by itself
+
+esp_mqtt_client_handle_t client;               // The active broker's
+static int mqttLoop = -1;
+static char lwTopic[100];
+
+// A client for each broker, made as it's needed, see MqttClient_SwitchBroker()
+static esp_mqtt_client_config_t brokerConfigs[MQTT_MAX_BROKERS];  // Kept to change the protocol, see fallBackTo311()
+static char clientIds[MQTT_MAX_BROKERS][48];   // The first broker's is esp-mqtt's default
+static esp_mqtt_client_handle_t clients[MQTT_MAX_BROKERS];
+static atomic_bool clientUp[MQTT_MAX_BROKERS];
+static atomic_bool clientSession[MQTT_MAX_BROKERS];   // Session present on its last connect
+static atomic_int activeBroker = 0;
+static atomic_int selectedBroker = 0;          // Chosen by the failover, made active on the network supervisor's task
+static atomic_bool activeUp = false;           // The active connection's been passed on as connected
+
+// Publishing, see Hal_MqttPublishExpiring()
+static atomic_bool protocol5 = false;          // Connecting with MQTT 5
+static atomic_bool connected5 = false;         // Connected with MQTT 5, so topic aliases can be used
+static TaskHandle_t mqttTask = NULL;           // The active client's
+static SemaphoreHandle_t publishLock = NULL;   // Held by other tasks' publishes and while the client is changed
+static SemaphoreHandle_t aliasLock = NULL;
+static atomic_int pendingAlias = 0;            // The properties another task is publishing with
+static atomic_uint pendingExpiryS = 0;
+
+// Connection cost, from MQTT_EVENT_BEFORE_CONNECT to the connect or its failure
+static int64_t connectStartUs = 0;
+static size_t connectStartFree = 0;
+
+static const int32_t connectTimeBounds[] = {50, 100, 250, 500, 1000, 2000, 4000, 8000};
+static Metric connectTime = METRIC_HISTOGRAM_INIT("alarm_mqtt_connect_duration_ms", "Broker connection time, TCP, TLS handshake and MQTT CONNECT", connectTimeBounds);
+static Metric connectHeapPeak = METRIC_GAUGE_INIT("alarm_mqtt_connect_heap_peak_bytes", "Heap taken at the peak of the last broker connection");
+static Metric connectHeapPeakMax = METRIC_GAUGE_INIT("alarm_mqtt_connect_heap_peak_max_bytes", "Largest heap peak of any broker connection");
+static Metric tlsMode = METRIC_GAUGE_INIT("alarm_mqtt_tls_mode", "Broker TLS (0 none, 1 certificate bundle, 2 pinned certificate, 3 PSK)");
+static Metric protocolLevel = METRIC_GAUGE_INIT("alarm_mqtt_protocol_level", "MQTT protocol level, 4 for 3.1.1, 5 for MQTT 5");
+static Metric lastReasonCode = METRIC_GAUGE_INIT("alarm_mqtt_last_reason_code", "Last failure reason code from a CONNACK or SUBACK");
+static Metric reasonFailures = METRIC_COUNTER_INIT("alarm_mqtt_reason_failures_total", "CONNACKs and SUBACKs with a failure reason code");
+
+/******************************************************************************************************
+ * @brief Connection cost. The heap's minimum free size is tracked from the start of each attempt, so
+ * the peak is what the TLS handshake took.
+ ******************************************************************************************************/
+static void connectStarted(void)
+{
+    connectStartUs = esp_timer_get_time();
+    connectStartFree = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    heap_caps_monitor_local_minimum_free_size_start();
+}
+
+static void connectFinished(bool connected)
+{
+    if (connectStartUs == 0) { return; }
+    int32_t peak = (int32_t)(connectStartFree - heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    heap_caps_monitor_local_minimum_free_size_stop();
+    Metrics_Set(&connectHeapPeak, peak);
+    if (peak > Metrics_Get(&connectHeapPeakMax)) { Metrics_Set(&connectHeapPeakMax, peak); }
+    if (connected) {
+        int32_t ms = (int32_t)((esp_timer_get_time() - connectStartUs) / 1000);
+        Metrics_Observe(&connectTime, ms);
+        ESP_LOGI(TAG, "Broker connected in %" PRIi32 " ms, heap peak %" PRIi32 " bytes.", ms, peak);
+    }
+    connectStartUs = 0;
+}
+
+/******************************************************************************************************
+ * @brief Failure reason codes from the broker. A refused MQTT 5 CONNECT drops back to 3.1.1, the
+ * network supervisor's next attempt uses it.
+ ******************************************************************************************************/
+static void fallBackTo311(void)
+{
+    ESP_LOGW(TAG, "Broker refused MQTT 5, using MQTT 3.1.1.");
+    atomic_store(&protocol5, false);
+    for (int i = 0; i < MQTT_MAX_BROKERS; i++) { brokerConfigs[i].session.protocol_ver = MQTT_PROTOCOL_V_3_1_1; }
+    esp_err_t err = esp_mqtt_set_config(client, &brokerConfigs[atomic_load(&activeBroker)]);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Couldn't change the MQTT protocol: %s", esp_err_to_name(err)); }
+    Metrics_Set(&protocolLevel, 4);
+}
+
+static void reasonFailure(int code)
+{
+    Metrics_Set(&lastReasonCode, code);
+    Metrics_Increment(&reasonFailures);
+}
+
+static void connectRefused(int code)
+{
+    ESP_LOGE(TAG, "Broker refused the connection, reason code 0x%02x.", code);
+    reasonFailure(code);
+    if (atomic_load(&protocol5) && (code == MQTT_CONNECTION_REFUSE_PROTOCOL || code == MQTT5_REASON_UNSUPPORTED_PROTOCOL)) {
+        fallBackTo311();
+    }
+}
+
+// The SUBACK's reason codes, one a topic, are the event data
+static void subscribeResult(const char* codes, int len)
+{
+    for (int i = 0; i < len; i++) {
+        if ((uint8_t)codes[i] >= 0x80) {
+            ESP_LOGE(TAG, "Broker refused a subscription, reason code 0x%02x.", (uint8_t)codes[i]);
+            reasonFailure((uint8_t)codes[i]);
+        }
+    }
+}
+
+/******************************************************************
+ *
+ * Publishing. Tasks other than the MQTT task take publishLock, so
+ * the client isn't changed under them by a failover and, with MQTT
+ * 5, setting the publish properties and publishing go together;
+ * esp-mqtt holds one set of properties for the next publish. The
+ * MQTT task can't take it, it holds the client's own lock while it
+ * handles an event and another task could be waiting for that with
+ * publishLock held. It doesn't need to: its client is only
+ * destroyed once its event is handled, and nothing else can call
+ * the client until then. But another task might have set its
+ * properties and not yet published, so it puts those back after
+ * its own publish.
+ *
+ * Only other tasks choose aliases. The MQTT task's publishes are
+ * the burst as a connection starts, discovery and the states, which
+ * send the topics anyway, and TopicAlias_Connected()'s republishes,
+ * which bring their own.
+ *
+*******************************************************************/
+static esp_err_t setProperties(int alias, uint32_t expiryS)
+{
+    esp_mqtt5_publish_property_config_t property = { .topic_alias = alias, .message_expiry_interval = expiryS };
+    return esp_mqtt5_client_set_publish_property(client, &property);
+}
+
+static int publishFromMqttTask(const char* topic, int alias, const char* data, int len, int qos, int retain, uint32_t expiryS)
+{
+    if (alias != 0 && setProperties(alias, expiryS) != ESP_OK) { alias = 0; }
+    if (alias == 0) { setProperties(0, expiryS); }
+    int msgId = esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+    setProperties(atomic_load(&pendingAlias), atomic_load(&pendingExpiryS));
+    return msgId;
+}
+
+// With publishLock held
+static int publishAliased(const char* topic, const char* data, int len, int qos, int retain, uint32_t expiryS)
+{
+    TopicAliasUse use = { 0, false };
+    if (atomic_load(&connected5)) {
+        xSemaphoreTake(aliasLock, portMAX_DELAY);
+        use = TopicAlias_Use(topic, len);
+        xSemaphoreGive(aliasLock);
+    }
+
+    atomic_store(&pendingAlias, use.alias);
+    atomic_store(&pendingExpiryS, expiryS);
+    if (use.alias != 0 && setProperties(use.alias, expiryS) != ESP_OK) {
+        xSemaphoreTake(aliasLock, portMAX_DELAY);
+        TopicAlias_Refused(use.alias);
+        xSemaphoreGive(aliasLock);
+        use = (TopicAliasUse){ 0, false };
+        atomic_store(&pendingAlias, 0);
+    }
+    if (use.alias == 0) { setProperties(0, expiryS); }
+    int msgId = esp_mqtt_client_publish(client, use.aliasOnly ? "" : topic, data, len, qos, retain);
+
+    xSemaphoreTake(aliasLock, portMAX_DELAY);
+    TopicAlias_Sent(topic, use, data, len, qos, retain, expiryS, msgId);
+    xSemaphoreGive(aliasLock);
+    return msgId;
+}
+
+// Republishes for TopicAlias_Connected(), on the MQTT task
+static int republishAlias(const char* topic, int alias, const char* data, int len, int qos, int retain)
+{
+    return publishFromMqttTask(topic, alias, data, len, qos, retain, 0);
+}
+
+// A new MQTT 5 connection, before anything else is published or resent on it
+static void aliasesConnected(void)
+{
+    xSemaphoreTake(aliasLock, portMAX_DELAY);
+    TopicAlias_Connected(republishAlias);
+    xSemaphoreGive(aliasLock);
+    atomic_store(&connected5, true);
+}
+
+/******************************************************************************************************
+ * @brief The active broker's connection made or lost. On its client's task, except for the loss
+ * of the old broker's in a failover, after its client is gone.
+ ******************************************************************************************************/
+static void brokerConnected(bool sessionPresent)
+{
+    Supervisor_SetMonitored(mqttLoop, true);
+    connectFinished(true);
+    atomic_store(&activeUp, true);
+    if (atomic_load(&protocol5)) { aliasesConnected(); }
+    MqttProcess_Connected(sessionPresent);
+    NetSupervisor_MqttConnected();
+    Ota_MqttConnected();
+}
+
+static void brokerDisconnected(void)
+{
+    Supervisor_SetMonitored(mqttLoop, false);
+    connectFinished(false);
+    atomic_store(&activeUp, false);
+    atomic_store(&connected5, false);
+    MqttProcess_Disconnected();
+    NetSupervisor_MqttDisconnected();
+}
+
+/******************************************************************************************************
+ * @brief Event handler registered to receive MQTT events
+ *
+ *  This function is called by the MQTT client event loop.
+ *
+ * @param handler_args The broker the client is for, an index into MqttFailover_BrokerUrl().
+ * @param base Event base for the handler(always MQTT Base in this example).
+ * @param event_id The id for the received event.
+ * @param event_data The data for the event, esp_mqtt_event_handle_t.
+ ******************************************************************************************************/
+void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+    int broker = (int)(intptr_t)handler_args;
+
+    ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 ", broker %d", base, event_id, broker);
+    if (event_id == MQTT_EVENT_CONNECTED) {
+        atomic_store(&clientSession[broker], event->session_present);
+        atomic_store(&clientUp[broker], true);
+    } else if (event_id == MQTT_EVENT_DISCONNECTED) {
+        atomic_store(&clientUp[broker], false);
+    }
+
+    // A warm standby only keeps its connection, as does the old broker once another's been selected
+    if (broker != atomic_load(&activeBroker) || broker != atomic_load(&selectedBroker)) {
+        if (event_id == MQTT_EVENT_CONNECTED) { ESP_LOGI(TAG, "Standby broker %d connected.", broker); }
+        if (event_id == MQTT_EVENT_DISCONNECTED) { ESP_LOGW(TAG, "Standby broker %d disconnected.", broker); }
+        return;
+    }
+
+    mqttTask = xTaskGetCurrentTaskHandle();
+    Power_Acquire(POWER_NETWORK);
+    Supervisor_LoopStart(mqttLoop);
+    TRACE_BEGIN("mqtt_event_handler");
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+        case MQTT_EVENT_BEFORE_CONNECT:
+            Supervisor_Trace(mqttLoop, "MQTT_EVENT_BEFORE_CONNECT");
+            ESP_LOGI(TAG, "MQTT_EVENT_BEFORE_CONNECT");
+            connectStarted();
+            break;
+        case MQTT_EVENT_CONNECTED:
+            Supervisor_Trace(mqttLoop, "MQTT_EVENT_CONNECTED");
+            brokerConnected(event->session_present);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            Supervisor_Trace(mqttLoop, "MQTT_EVENT_DISCONNECTED");
+            brokerDisconnected();
+            break;
+        case MQTT_USER_EVENT:
+            // Failed over to a warm standby, its connection is passed on here, on its own task
+            Supervisor_Trace(mqttLoop, "MQTT_USER_EVENT");
+            if (atomic_load(&clientUp[broker]) && !atomic_load(&activeUp)) {
+                brokerConnected(atomic_load(&clientSession[broker]));
+            }
+            break;
+        case MQTT_EVENT_SUBSCRIBED:
+            subscribeResult(event->data, event->data_len);
+            MqttProcess_Subscribed(event->msg_id);
+            break;
+        case MQTT_EVENT_UNSUBSCRIBED:
+            ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            if (aliasLock != NULL) {
+                xSemaphoreTake(aliasLock, portMAX_DELAY);
+                TopicAlias_Acknowledged(event->msg_id);
+                xSemaphoreGive(aliasLock);
+            }
+            MqttProcess_Published(event->msg_id);
+            break;
+        case MQTT_EVENT_DATA:
+            Supervisor_Trace(mqttLoop, "MQTT_EVENT_DATA");
+            MqttProcess_Data(event->topic, event->topic_len, event->data, event->data_len);
+            break;
+        case MQTT_EVENT_ERROR:
+            ESP_LOGE(TAG, "MQTT_EVENT_ERROR. ");
+            Supervisor_Trace(mqttLoop, "MQTT_EVENT_ERROR");
+            MqttProcess_Error(event->error_handle->error_type, event->error_handle->esp_transport_sock_errno);
+            if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+                connectRefused(event->error_handle->connect_return_code);
+            }
+            if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+                log_error_if_nonzero("reported from esp-tls", event->error_handle->esp_tls_last_esp_err);
+                log_error_if_nonzero("reported from tls stack", event->error_handle->esp_tls_stack_err);
+                log_error_if_nonzero("captured as transport's socket errno",  event->error_handle->esp_transport_sock_errno);
+                ESP_LOGI(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
+            }
+            break;
+        default:
+            ESP_LOGE(TAG, "Unhandled MQTT event. Event id = %d", event->event_id);
+            break;
+    }
+    TRACE_END("mqtt_event_handler");
+    Supervisor_LoopEnd(mqttLoop);
+    Power_Release(POWER_NETWORK);
+}
+
+/***************************************************************************************************
+ * 
+ * Broker TLS. A full handshake with certificate bundle verification costs seconds of CPU and a
+ * large heap spike on the ESP32, paid on every reconnect. A PSK (config.mqttPskIdentity and
+ * mqttPskKey) needs no certificates or public key operations at all. A pinned certificate in
+ * MQTT_PINNED_CERT_FILENAME still does the public key work, but checks one certificate instead
+ * of searching the bundle. The bundle is the default. Whichever it is, an mqtts:// broker's
+ * reconnects resume its last TLS session, see mqttTls.c.
+ * 
+ * *************************************************************************************************/
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+// The key as bytes, 0 if it isn't valid hex
+static size_t decodePsk(const char* hex, uint8_t* key)
+{
+    size_t len = strlen(hex);
+    if (len == 0 || len % 2 != 0 || len / 2 > MQTT_PSK_MAX_BYTES) { return 0; }
+    for (size_t i = 0; i < len / 2; i++) {
+        int high = hexValue(hex[2 * i]);
+        int low = hexValue(hex[2 * i + 1]);
+        if (high < 0 || low < 0) { return 0; }
+        key[i] = (uint8_t)(high << 4 | low);
+    }
+    return len / 2;
+}
+
+// Set the verification in the client config. The PSK and certificate must outlive the client.
+static MqttTlsMode configureTls(esp_mqtt_client_config_t* cfg, const char* url)
+{
+    static uint8_t pskKey[MQTT_PSK_MAX_BYTES];
+    static char* pinnedCert = NULL;
+
+    if (strncmp(url, "mqtts://", 8) != 0 && strncmp(url, "wss://", 6) != 0) {
+        return MQTT_TLS_NONE;
+    }
+
+    if (config.mqttPskIdentity[0] != '\0') {
+        size_t keySize = decodePsk(config.mqttPskKey, pskKey);
+        if (keySize > 0) {
+            psk_hint_key_t psk = { .key = pskKey, .key_size = keySize, .hint = config.mqttPskIdentity };
+            psk_hint_key_t* kept = malloc(sizeof(psk));
+            if (kept != NULL) {
+                memcpy(kept, &psk, sizeof(psk));
+                cfg->broker.verification.psk_hint_key = kept;
+                ESP_LOGI(TAG, "Broker TLS by PSK, identity %s.", config.mqttPskIdentity);
+                return MQTT_TLS_PSK;
+            }
+            ESP_LOGE(TAG, "No memory for the MQTT PSK, verifying the broker by certificate.");
+        } else {
+            ESP_LOGE(TAG, "The MQTT PSK isn't valid hex of up to %d bytes, verifying the broker by certificate.", MQTT_PSK_MAX_BYTES);
+        }
+    }
+
+    if (pinnedCert != NULL) {
+        cfg->broker.verification.certificate = pinnedCert;
+        return MQTT_TLS_PINNED;
+    }
+    pinnedCert = malloc(MQTT_PINNED_CERT_MAX_LEN);
+    if (pinnedCert == NULL) {
+        ESP_LOGE(TAG, "No memory for a pinned certificate, verifying the broker against the bundle.");
+    } else {
+        int len = Hal_StorageRead(MQTT_PINNED_CERT_FILENAME, pinnedCert, MQTT_PINNED_CERT_MAX_LEN - 1);
+        if (len > 0) {
+            pinnedCert[len] = '\0';
+            cfg->broker.verification.certificate = pinnedCert;
+            ESP_LOGI(TAG, "Broker TLS verified against the pinned certificate.");
+            return MQTT_TLS_PINNED;
+        }
+        free(pinnedCert);
+        pinnedCert = NULL;
+    }
+
+    cfg->broker.verification.crt_bundle_attach = esp_crt_bundle_attach;
+    ESP_LOGI(TAG, "Broker TLS verified against the certificate bundle.");
+    return MQTT_TLS_BUNDLE;
+}
+
+/***************************************************************************************************
+ * 
+ * A client for a broker. The active broker's is reconnected by the network supervisor, a warm
+ * standby reconnects by itself.
+ * 
+ * *************************************************************************************************/
+static esp_mqtt_client_handle_t createClient(int broker, bool standby)
+{
+    esp_mqtt_client_config_t* cfg = &brokerConfigs[broker];
+    cfg->network.disable_auto_reconnect = !standby;
+    cfg->network.reconnect_timeout_ms = standby ? STANDBY_RECONNECT_MS : 0;
+    cfg->task.priority = MQTT_TASK_PRIORITY;
+    // Each client gets its own transport, the last one went with its client
+    cfg->network.transport = NULL;
+    if (strncmp(cfg->broker.address.uri, "mqtts://", 8) == 0) {
+        cfg->network.transport = MqttTls_Transport(broker, cfg);
+        if (cfg->network.transport == NULL) { ESP_LOGW(TAG, "No memory for broker %d's TLS transport, its sessions won't be resumed.", broker); }
+    }
+    // The standby's will would mark the alarm offline as its connection drops, the active one's
+    // is set as it takes over and sent from its next connection
+    esp_mqtt_client_config_t clientCfg = *cfg;
+    if (standby) { clientCfg.session.last_will.topic = NULL; }
+    esp_mqtt_client_handle_t c = esp_mqtt_client_init(&clientCfg);
+    if (c == NULL) {
+        ESP_LOGE(TAG, "Couldn't create the MQTT client for broker %d.", broker);
+        return NULL;
+    }
+    /* The last argument is passed to the event handler, the broker the client is for */
+    esp_mqtt_client_register_event(c, ESP_EVENT_ANY_ID, mqtt_event_handler, (void*)(intptr_t)broker);
+    return c;
+}
+
+// Keep the broker after the active one connected, if it's wanted
+static void startStandby(int active)
+{
+    int standby = (active + 1) % MqttFailover_BrokerCount();
+    if (!config.mqttWarmStandby || standby == active || clients[standby] != NULL) { return; }
+    clients[standby] = createClient(standby, true);
+    if (clients[standby] == NULL) { return; }
+    esp_err_t err = esp_mqtt_client_start(clients[standby]);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Standby broker %d start error: %s", standby, esp_err_to_name(err)); }
+    else { ESP_LOGI(TAG, "Keeping broker %d, %s, connected as the standby.", standby, MqttFailover_BrokerUrl(standby)); }
+}
+
+/***************************************************************************************************
+ * 
+ * Start the MQTT processes. 
+ * 
+ * Instantiates and starts the MQTT communication system
+ * 
+ * *************************************************************************************************/
+
+void mqtt_app_start(void)
+{
+    MqttProcess_Initialise();
+    MqttTls_Initialise();
+    Metrics_Register(&connectTime);
+    Metrics_Register(&connectHeapPeak);
+    Metrics_Register(&connectHeapPeakMax);
+    Metrics_Register(&tlsMode);
+    Metrics_Register(&protocolLevel);
+    Metrics_Register(&lastReasonCode);
+    Metrics_Register(&reasonFailures);
+
+    // The MQTT task is only expected to be busy while we're connected
+    mqttLoop = Supervisor_RegisterLoop("mqtt", MQTT_HANDLER_BUDGET_US,
+        Power_BatteryMode() ? MQTT_STALL_BATTERY_TIMEOUT_MS : MQTT_STALL_TIMEOUT_MS, false);
+    Supervisor_SetMonitored(mqttLoop, false);
+
+    sprintf(lwTopic, "homeassistant/binary_sensor/%s/availability", config.Name);
+    const char* lwMessage = "offline\0";
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .network = {
+            .disable_auto_reconnect = true, // Reconnects are made by the network supervisor
+        },
+        .broker.address.uri = config.mqttBrokerUrl,
+        .credentials = { 
+            .username = config.mqttUsername, 
+            .authentication = { 
+                .password = config.mqttPassword
+            }, 
+        },
+        .session = {
+            .message_retransmit_timeout = 250,  // ms transmission retry
+            .protocol_ver = config.mqtt5 ? MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1,
+            .keepalive = 30, // 30 second keepalive timeout
+            .disable_clean_session = true, // Persistent session, see MqttProcess_Connected()
+            .last_will = {
+                .topic = lwTopic,
+                .msg = (const char*)lwMessage,
+                .msg_len = strlen(lwMessage),
+                .qos = 1,
+                .retain = 1
+            }
+        },
+    };
+    publishLock = xSemaphoreCreateMutex();
+    if (config.mqtt5) {
+        TopicAlias_Initialise();
+        aliasLock = xSemaphoreCreateMutex();
+        atomic_store(&protocol5, true);
+    }
+    Metrics_Set(&protocolLevel, config.mqtt5 ? 5 : 4);
+    for (int i = 0; i < MqttFailover_BrokerCount(); i++) {
+        brokerConfigs[i] = mqtt_cfg;
+        brokerConfigs[i].broker.address.uri = MqttFailover_BrokerUrl(i);
+        // Brokers sharing sessions, or bridged, would otherwise drop one connection for the other
+        if (i > 0) {
+            snprintf(clientIds[i], sizeof(clientIds[i]), "%s-broker%d", config.Name, i);
+            brokerConfigs[i].credentials.client_id = clientIds[i];
+        }
+        MqttTlsMode mode = configureTls(&brokerConfigs[i], MqttFailover_BrokerUrl(i));
+        if (i == 0) { Metrics_Set(&tlsMode, mode); }
+    }
+    client = clients[0] = createClient(0, false);
+    esp_err_t err = esp_mqtt_client_start(client);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "MQTT client start error: %s", esp_err_to_name(err)); }
+    else { NetSupervisor_MqttStarted(); }
+    startStandby(0);
+}
+
+/***************************************************************************************************
+ * 
+ * Try the broker again, after a failed attempt or a lost connection. Called by the network
+ * supervisor, the client doesn't retry on its own. As the client is only changed on its task too,
+ * see MqttClient_SwitchBroker(), these don't need publishLock.
+ * 
+ * *************************************************************************************************/
+void MqttClient_Reconnect(void)
+{
+    esp_err_t err = esp_mqtt_client_reconnect(client);
+    if (err != ESP_OK) { ESP_LOGD(TAG, "MQTT reconnect not started: %s", esp_err_to_name(err)); }
+}
+
+// On the battery the publishes, and so their acknowledgements, come a minute apart, see power.c
+void MqttClient_BatteryMode(bool battery)
+{
+    Supervisor_SetStallTimeout(mqttLoop, battery ? MQTT_STALL_BATTERY_TIMEOUT_MS : MQTT_STALL_TIMEOUT_MS);
+}
+
+// Drop the broker connection, for the network supervisor's reconnect storm
+void MqttClient_Disconnect(void)
+{
+    esp_err_t err = esp_mqtt_client_disconnect(client);
+    if (err != ESP_OK) { ESP_LOGD(TAG, "MQTT disconnect failed: %s", esp_err_to_name(err)); }
+}
+
+/******************************************************************
+ *
+ * HAL MQTT transport
+ *
+*******************************************************************/
+int Hal_MqttPublish(const char* topic, const char* data, int len, int qos, int retain)
+{
+    return Hal_MqttPublishExpiring(topic, data, len, qos, retain, 0);
+}
+
+int Hal_MqttPublishExpiring(const char* topic, const char* data, int len, int qos, int retain, uint32_t expiryS)
+{
+    if (publishLock == NULL) { return -1; }    // Before mqtt_app_start()
+    bool mqtt5 = atomic_load(&protocol5);
+    if (len == 0) { len = strlen(data); }
+    if (xTaskGetCurrentTaskHandle() == mqttTask) {
+        return mqtt5 ? publishFromMqttTask(topic, 0, data, len, qos, retain, expiryS)
+                     : esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+    }
+
+    xSemaphoreTake(publishLock, portMAX_DELAY);
+    int msgId = mqtt5 ? publishAliased(topic, data, len, qos, retain, expiryS)
+                      : esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+    xSemaphoreGive(publishLock);
+    return msgId;
+}
+
+int Hal_MqttSubscribe(const char* topic, int qos)
+{
+    if (publishLock == NULL) { return -1; }
+    if (xTaskGetCurrentTaskHandle() == mqttTask) { return esp_mqtt_client_subscribe(client, topic, qos); }
+    xSemaphoreTake(publishLock, portMAX_DELAY);
+    int msgId = esp_mqtt_client_subscribe(client, topic, qos);
+    xSemaphoreGive(publishLock);
+    return msgId;
+}
+
+/******************************************************************
+ *
+ * Fail over to another broker. The failover chooses it on the main
+ * loop, the network supervisor's task makes the change, as
+ * destroying a client waits for its task and can take seconds.
+ *
+*******************************************************************/
+void Hal_MqttSelectBroker(int broker)
+{
+    if (broker < 0 || broker >= MqttFailover_BrokerCount()) { return; }
+    atomic_store(&selectedBroker, broker);
+    NetSupervisor_BrokerSelected();
+}
+
+/******************************************************************
+ *
+ * Change to the selected broker, on the network supervisor's task.
+ * The client is changed with publishLock held, so other tasks'
+ * publishes go to one or the other. The old client is destroyed
+ * after, with its outbox, so nothing still queued on it is sent
+ * again later; mqttFailover.c resends the events. Its loss is
+ * passed on once its task has gone, then the new one's connection:
+ * a warm standby's through its own task, a new client's as it
+ * connects.
+ *
+*******************************************************************/
+void MqttClient_SwitchBroker(void)
+{
+    int broker = atomic_load(&selectedBroker);
+    int old = atomic_load(&activeBroker);
+    if (broker == old) { return; }
+
+    bool warm = clients[broker] != NULL;
+    if (!warm) { clients[broker] = createClient(broker, false); }
+    if (clients[broker] == NULL) { return; }
+
+    xSemaphoreTake(publishLock, portMAX_DELAY);
+    client = clients[broker];
+    mqttTask = NULL;
+    xSemaphoreGive(publishLock);
+
+    esp_mqtt_client_destroy(clients[old]);
+    clients[old] = NULL;
+    atomic_store(&clientUp[old], false);
+    if (atomic_load(&activeUp)) { brokerDisconnected(); }
+
+    // The aliases start again on the new broker, none of the old one's publishes are resent as they were
+    if (aliasLock != NULL) {
+        xSemaphoreTake(aliasLock, portMAX_DELAY);
+        TopicAlias_Initialise();
+        xSemaphoreGive(aliasLock);
+    }
+
+    atomic_store(&activeBroker, broker);
+    esp_err_t err;
+    if (warm) {
+        brokerConfigs[broker].network.disable_auto_reconnect = true;
+        esp_mqtt_set_config(client, &brokerConfigs[broker]);
+        esp_mqtt_event_t event = { .event_id = MQTT_USER_EVENT };
+        err = esp_mqtt_dispatch_custom_event(client, &event);
+    } else {
+        err = esp_mqtt_client_start(client);
+    }
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Broker %d start error: %s", broker, esp_err_to_name(err)); }
+    startStandby(broker);
+}
@@ -0,0 +1,48 @@
+/* MQTT Alarm Controller: MQTT client
+
+   The esp-mqtt client: connection configuration, the event handler that
+   passes broker events to mqttProcess.c and the HAL MQTT transport.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __MQTTCLIENT_H__
+#define __MQTTCLIENT_H__
+
+#include <stdbool.h>
+
+#define MQTT_HANDLER_BUDGET_US 100000   // Execution time budget for one MQTT event
+#define MQTT_STALL_TIMEOUT_MS 60000     // MQTT task is hung if it handles no events for this long while connected
+#define MQTT_STALL_BATTERY_TIMEOUT_MS 150000    // On the battery, over twice the 60 s heartbeat and health publishes
+#define MQTT_PINNED_CERT_FILENAME "broker.pem"  // The broker's certificate or CA, used instead of the bundle if it's there
+#define MQTT_PINNED_CERT_MAX_LEN 4096
+#define MQTT_PSK_MAX_BYTES 32
+#define MQTT5_REASON_UNSUPPORTED_PROTOCOL 0x84  // CONNACK reason code from an MQTT 5 broker that won't take the version
+
+typedef enum {
+    MQTT_TLS_NONE = 0,                  // mqtt:// or ws://
+    MQTT_TLS_BUNDLE = 1,                // Verified against the x509 certificate bundle
+    MQTT_TLS_PINNED = 2,                // Verified against MQTT_PINNED_CERT_FILENAME only
+    MQTT_TLS_PSK = 3,                   // Pre-shared key, no certificates
+} MqttTlsMode;
+
+void mqtt_app_start(void);
+void MqttClient_Reconnect(void);
+void MqttClient_Disconnect(void);
+void MqttClient_SwitchBroker(void);
+void MqttClient_BatteryMode(bool battery);
+
+#endif // #ifndef __MQTTCLIENT_H__
@@ -0,0 +1,313 @@
+/* MQTT Alarm Controller: Broker failover
+
+   With config.mqttFailoverUrls set, config.mqttBrokerUrl is the first
+   of an ordered list of brokers. The controller stays on a broker while
+   it works, and when it stops moves to the next in the list, round to
+   the first after the last. It doesn't move back on its own.
+
+   The health check is the broker's acknowledgements. Each QoS 1 state
+   event and heartbeat is tracked until it's acknowledged, and one that
+   isn't within FAILOVER_ACK_TIMEOUT_US means the broker has stopped
+   working even if the connection looks up, hung or overloaded. With a
+   heartbeat every HEARTBEAT_INTERVAL_US that finds a hang within the
+   two together, and sooner if there are events. A broker that can't be
+   reached at all is left after FAILOVER_DOWN_TIMEOUT_US.
+
+   Events the old broker didn't acknowledge are sent to the new one as
+   it connects, in the order they happened, ahead of the states sent on
+   every new session. Each notes the brokers it's been sent to, so the
+   failover never sends it to the same broker twice, and the old
+   client, with its outbox, is thrown away. The old broker may have
+   delivered an event and lost the acknowledgement; with
+   config.extendedPayloads the resend has the same sequence number, so
+   consumers can drop it.
+
+   The tracking all runs on the main loop. The MQTT transport only
+   queues acknowledgements and flags the connection, so nothing is
+   locked.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "eventPayload.h"
+#include "mqttProcess.h"
+#include "mqttFailover.h"
+
+typedef struct {
+    bool used;                          // Not yet acknowledged
+    bool event;                         // Resent on failover, heartbeats are only timed
+    int msgId;
+    uint32_t sentTo;                    // A bit for each broker it's been sent to
+    int64_t sentUs;
+    char topic[FAILOVER_TOPIC_LEN];
+    char data[EVENT_PAYLOAD_MAX_LEN];
+    int len;
+    int retain;
+} FailoverRecord;
+
+// Publishes in the order they were sent, oldest at head, allocated when there's more than one broker
+static FailoverRecord* records = NULL;
+static int head = 0;
+static int count = 0;
+
+static int activeBroker = 0;
+static int64_t downSinceUs = 0;
+static int64_t failoverStartUs = 0;     // When the broker we left stopped working, 0 once the new one's connected
+static bool wasConnected = false;
+
+// From the MQTT transport
+static atomic_bool connected = false;
+static atomic_bool resendDue = false;
+static atomic_int ackQueue[FAILOVER_ACK_QUEUE];
+static atomic_uint ackHead = 0;
+static atomic_uint ackTail = 0;
+
+static Metric failovers = METRIC_COUNTER_INIT("alarm_mqtt_failovers_total", "Moves to the next broker in the list");
+static Metric activeBrokerMetric = METRIC_GAUGE_INIT("alarm_mqtt_active_broker", "Broker in use, 0 for mqttBrokerUrl then each failover URL");
+static Metric failoverResent = METRIC_COUNTER_INIT("alarm_mqtt_failover_resent_total", "Events resent to a new broker after a failover");
+static Metric failoverTime = METRIC_GAUGE_INIT("alarm_mqtt_failover_ms", "Time from the old broker's first unacknowledged publish, or losing it, to the new broker connecting");
+
+int MqttFailover_BrokerCount(void)
+{
+    int n = 1;
+    while (n <= MQTT_MAX_FAILOVER && config.mqttFailoverUrls[n - 1][0] != '\0') { n++; }
+    return n;
+}
+
+const char* MqttFailover_BrokerUrl(int broker)
+{
+    return broker == 0 ? config.mqttBrokerUrl : config.mqttFailoverUrls[broker - 1];
+}
+
+int MqttFailover_ActiveBroker(void)
+{
+    return activeBroker;
+}
+
+static FailoverRecord* record(int i)
+{
+    return &records[(head + i) % FAILOVER_MAX_RECORDS];
+}
+
+// Drop acknowledged records from the head
+static void trimRecords(void)
+{
+    while (count > 0 && !records[head].used) {
+        head = (head + 1) % FAILOVER_MAX_RECORDS;
+        count--;
+    }
+}
+
+/******************************************************************
+ *
+ * A QoS 1 publish to track until it's acknowledged. Called from the
+ * main loop.
+ *
+*******************************************************************/
+void MqttFailover_Sent(const char* topic, const char* data, int len, int retain, int msgId, bool event)
+{
+    if (records == NULL || msgId < 0) { return; }
+    if (count == FAILOVER_MAX_RECORDS) {
+        ESP_LOGW(TAG, "Failover tracking full, dropping the oldest unacknowledged publish.");
+        records[head].used = false;
+        trimRecords();
+    }
+    FailoverRecord* r = record(count++);
+    r->used = true;
+    r->event = event && strlen(topic) < FAILOVER_TOPIC_LEN && len <= EVENT_PAYLOAD_MAX_LEN;
+    r->msgId = msgId;
+    r->sentTo = 1u << activeBroker;
+    r->sentUs = Hal_TimeUs();
+    r->len = 0;
+    if (r->event) {
+        strcpy(r->topic, topic);
+        memcpy(r->data, data, len);
+        r->len = len;
+        r->retain = retain;
+    }
+}
+
+/******************************************************************
+ *
+ * Broker events, from the MQTT transport. Acknowledgements are
+ * queued for the main loop, which may not have recorded the publish
+ * yet.
+ *
+*******************************************************************/
+void MqttFailover_Acknowledged(int msgId)
+{
+    if (records == NULL) { return; }
+    unsigned tail = atomic_load(&ackTail);
+    if (tail - atomic_load(&ackHead) >= FAILOVER_ACK_QUEUE) {
+        ESP_LOGW(TAG, "Failover acknowledgement queue full, msg_id=%d dropped.", msgId);
+        return;
+    }
+    atomic_store(&ackQueue[tail % FAILOVER_ACK_QUEUE], msgId);
+    atomic_store(&ackTail, tail + 1);
+}
+
+void MqttFailover_Connected(void)
+{
+    atomic_store(&resendDue, true);
+    atomic_store(&connected, true);
+}
+
+void MqttFailover_Disconnected(void)
+{
+    atomic_store(&connected, false);
+}
+
+static void takeAcknowledgements(void)
+{
+    unsigned tail = atomic_load(&ackTail);
+    for (unsigned i = atomic_load(&ackHead); i != tail; i++) {
+        int msgId = atomic_load(&ackQueue[i % FAILOVER_ACK_QUEUE]);
+        for (int j = 0; j < count; j++) {
+            FailoverRecord* r = record(j);
+            if (r->used && r->msgId == msgId && (r->sentTo & (1u << activeBroker))) {
+                r->used = false;
+                break;
+            }
+        }
+    }
+    atomic_store(&ackHead, tail);
+    trimRecords();
+}
+
+/******************************************************************
+ *
+ * Connected. Send the events this broker hasn't had, in order. The
+ * ones it has, after a reconnect, are resent by the client itself,
+ * so just restart their clocks. Heartbeats from another broker are
+ * dropped.
+ *
+*******************************************************************/
+static void resendEvents(int64_t now)
+{
+    uint32_t bit = 1u << activeBroker;
+    int resent = 0;
+    for (int i = 0; i < count; i++) {
+        FailoverRecord* r = record(i);
+        if (!r->used) { continue; }
+        if (r->sentTo & bit) {
+            r->sentUs = now;
+        } else if (!r->event) {
+            r->used = false;
+        } else {
+            r->msgId = SendFailoverEvent(r->topic, r->data, r->len, r->retain);
+            r->sentTo |= bit;
+            r->sentUs = now;
+            resent++;
+        }
+    }
+    trimRecords();
+    if (failoverStartUs != 0) {
+        Metrics_Set(&failoverTime, (int32_t)((now - failoverStartUs) / 1000));
+        ESP_LOGW(TAG, "Failed over to broker %d in %" PRIi64 " ms, %d events resent.", activeBroker, (now - failoverStartUs) / 1000, resent);
+        failoverStartUs = 0;
+    }
+    Metrics_Add(&failoverResent, resent);
+}
+
+/******************************************************************
+ *
+ * Move to the next broker. The old connection's end and the new
+ * one's start come through the transport as usual.
+ *
+*******************************************************************/
+static void failOver(int64_t since, const char* reason, int64_t now)
+{
+    int next = (activeBroker + 1) % MqttFailover_BrokerCount();
+    ESP_LOGE(TAG, "Broker %d %s, failing over to broker %d, %s.", activeBroker, reason, next, MqttFailover_BrokerUrl(next));
+    FlightRecorder_Record(FR_MQTT_FAILOVER, activeBroker, next);
+    Metrics_Increment(&failovers);
+    Metrics_Set(&activeBrokerMetric, next);
+    if (failoverStartUs == 0) { failoverStartUs = since; }
+
+    activeBroker = next;
+    atomic_store(&connected, false);
+    atomic_store(&resendDue, false);
+    wasConnected = false;
+    downSinceUs = now;
+    Hal_MqttSelectBroker(next);
+}
+
+/******************************************************************
+ *
+ * Health check, and the resends once connected. Call from the main
+ * loop before the inputs are processed, so resent events go ahead
+ * of the states sent on a new session.
+ *
+*******************************************************************/
+void MqttFailover_Poll(void)
+{
+    if (records == NULL) { return; }
+    int64_t now = Hal_TimeUs();
+    takeAcknowledgements();
+
+    bool up = atomic_load(&connected);
+    if (up && atomic_exchange(&resendDue, false)) { resendEvents(now); }
+    if (!up && wasConnected) { downSinceUs = now; }
+    wasConnected = up;
+
+    if (up) {
+        for (int i = 0; i < count; i++) {
+            FailoverRecord* r = record(i);
+            if (r->used && (r->sentTo & (1u << activeBroker)) && now - r->sentUs > FAILOVER_ACK_TIMEOUT_US) {
+                failOver(r->sentUs, "isn't acknowledging", now);
+                return;
+            }
+        }
+    } else if (now - downSinceUs > FAILOVER_DOWN_TIMEOUT_US) {
+        failOver(downSinceUs, "can't be reached", now);
+    }
+}
+
+/******************************************************************
+ *
+ * Start on the first broker. Nothing is tracked with only one.
+ *
+*******************************************************************/
+void MqttFailover_Initialise(void)
+{
+    Metrics_Register(&failovers);
+    Metrics_Register(&activeBrokerMetric);
+    Metrics_Register(&failoverResent);
+    Metrics_Register(&failoverTime);
+
+    activeBroker = 0;
+    Metrics_Set(&activeBrokerMetric, 0);
+    head = count = 0;
+    wasConnected = false;
+    failoverStartUs = 0;
+    downSinceUs = Hal_TimeUs();
+    atomic_store(&connected, false);
+    atomic_store(&resendDue, false);
+    atomic_store(&ackHead, atomic_load(&ackTail));
+    if (MqttFailover_BrokerCount() < 2) { return; }
+    if (records == NULL) { records = calloc(FAILOVER_MAX_RECORDS, sizeof(FailoverRecord)); }
+    if (records == NULL) { ESP_LOGE(TAG, "No memory for broker failover, staying on the first broker."); }
+}
@@ -0,0 +1,52 @@
+/* MQTT Alarm Controller: Broker failover
+
+   An ordered list of brokers, config.mqttBrokerUrl then
+   config.mqttFailoverUrls. Checks the broker in use by its
+   acknowledgements, moves to the next when it stops, and resends the
+   events it didn't acknowledge to the new one.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __MQTTFAILOVER_H__
+#define __MQTTFAILOVER_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+#include "defines.h"
+
+#define MQTT_MAX_BROKERS (MQTT_MAX_FAILOVER + 1)
+#define FAILOVER_ACK_TIMEOUT_US 5000000 // Move on when a publish is unacknowledged this long
+#define FAILOVER_DOWN_TIMEOUT_US 20000000   // or when the broker can't be reached for this long
+#define FAILOVER_MAX_RECORDS 32         // Publishes tracked until they're acknowledged
+#define FAILOVER_TOPIC_LEN 120
+#define FAILOVER_ACK_QUEUE 128          // Acknowledgements waiting for the main loop
+
+void MqttFailover_Initialise(void);
+void MqttFailover_Poll(void);
+int MqttFailover_BrokerCount(void);
+int MqttFailover_ActiveBroker(void);
+const char* MqttFailover_BrokerUrl(int broker);
+
+// Called from the main loop for each QoS 1 event or heartbeat published. Only events are resent.
+void MqttFailover_Sent(const char* topic, const char* data, int len, int retain, int msgId, bool event);
+
+// Broker events, called from the MQTT transport
+void MqttFailover_Connected(void);
+void MqttFailover_Disconnected(void);
+void MqttFailover_Acknowledged(int msgId);
+
+#endif // #ifndef __MQTTFAILOVER_H__
@@ -19,335 +19,749 @@
 
 */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "esp_log.h"
 #include "inttypes.h"
 
-#include "utilities.h"
+#include "hal.h"
 #include "config.h"
+#include "metrics.h"
+#include "systemHealth.h"
+#include "flightRecorder.h"
+#include "trace.h"
+#include "sensorHealth.h"
+#include "inputOutput.h"
+#include "eventPayload.h"
+#include "timeService.h"
+#include "mqttFailover.h"
+#include "ota.h"
+#include "inputLatency.h"
+#include "commandAuth.h"
 #include "mqttProcess.h"
 
+#define DISCOVERY_FILENAME "discovery.txt"  // Hash of the last discovery the broker acknowledged
+#define DISCOVERY_MAX_MESSAGES 32
+
 bool MyMqttConnected = false;
-bool ExternalSirenActivationRequested = false;
-bool ExternalSirenSilenceRequested = false;
-bool DownstairsSirenActivationRequested = false;
-bool DownstairsSirenSilenceRequested = false;
 
-int mqttMessagesQueued = 0;
 bool gotTime = false;
 int year = 0, month = 0, day = 0, hour = 0, minute = 0, seconds = 0;
-esp_mqtt_client_handle_t client;
+
+static Metric mqttConnects = METRIC_COUNTER_INIT("alarm_mqtt_connects_total", "MQTT broker connections");
+static Metric mqttDisconnects = METRIC_COUNTER_INIT("alarm_mqtt_disconnects_total", "MQTT broker disconnections");
+static Metric mqttErrors = METRIC_COUNTER_INIT("alarm_mqtt_errors_total", "MQTT client errors");
+static Metric mqttPublished = METRIC_COUNTER_INIT("alarm_mqtt_published_total", "MQTT messages acknowledged by the broker");
+static Metric mqttReceived = METRIC_COUNTER_INIT("alarm_mqtt_received_total", "MQTT messages received");
+static Metric mqttConnectedState = METRIC_GAUGE_INIT("alarm_mqtt_connected", "MQTT broker connection state");
+// The count itself, kept atomically as the main loop, the MQTT task and the health sampler all change it
+static Metric mqttQueued = METRIC_GAUGE_INIT("alarm_mqtt_messages_queued", "MQTT messages awaiting acknowledgement");
+static Metric mqttAnnounces = METRIC_COUNTER_INIT("alarm_mqtt_discovery_announces_total", "Home Assistant discovery announcements sent");
+static Metric mqttResumes = METRIC_COUNTER_INIT("alarm_mqtt_session_resumes_total", "MQTT connections that resumed the broker session");
+
+// Home Assistant discovery. It's retained, so it's only sent when it changes or the broker may have lost it.
+static uint32_t discoveryHash;              // Of the messages built on this connect
+static bool discoverySending;               // Publishing them rather than just hashing them
+static uint32_t announcedHash = 0;          // Of the last announcement the broker acknowledged in full
+static int discoveryMsgIds[DISCOVERY_MAX_MESSAGES];
+static int discoveryUnacked = 0;
+static bool firstConnect = true;
+static HalTimer heartbeatTimer = NULL;
+static atomic_bool heartbeatDue = false;
+static atomic_int heartbeatExpiryS = HEARTBEAT_EXPIRY_S;
+
+typedef struct {
+    const char* key;
+    const char* name;
+    const char* unit;
+    const char* value;          // Path to the value in the health sample
+    const char* attributes;     // Object in the health sample shown as its attributes, or NULL
+} HealthSensor;
+
+static const HealthSensor healthSensors[] = {
+    { "free_heap", "Free Heap", "B", "free_heap", NULL },
+    { "largest_free_block", "Largest Free Heap Block", "B", "largest_free_block", NULL },
+    { "minimum_free_heap", "Minimum Free Heap", "B", "minimum_free_heap", NULL },
+    { "minimum_stack_headroom", "Minimum Task Stack Headroom", "B", "minimum_stack_headroom", "tasks" },
+    { "estimated_current", "Estimated Current", "mA", "power.estimated_ma", "power" },
+};
 
 /******************************************************************************************************
- * @brief Event handler registered to receive MQTT events
+ * @brief Add a discovery config to the hash, and publish it if we're announcing
  *
- *  This function is called by the MQTT client event loop.
+ *  The hash is FNV-1a over every topic and payload, terminators included, in the order they're built.
+ ******************************************************************************************************/
+static void discoveryMessage(const char* topic, const char* payload)
+{
+    for (const char* s = topic; ; s++) {
+        discoveryHash = (discoveryHash ^ (uint8_t)*s) * 16777619u;
+        if (*s == '\0') { break; }
+    }
+    for (const char* s = payload; ; s++) {
+        discoveryHash = (discoveryHash ^ (uint8_t)*s) * 16777619u;
+        if (*s == '\0') { break; }
+    }
+    if (!discoverySending) { return; }
+
+    int msg_id = Hal_MqttPublish(topic, payload, 0, 1, 1);
+    Metrics_Increment(&mqttQueued);
+    if (msg_id > 0 && discoveryUnacked < DISCOVERY_MAX_MESSAGES) { discoveryMsgIds[discoveryUnacked++] = msg_id; }
+    ESP_LOGD(TAG, "Published config message %s, msg_id=%d", topic, msg_id);
+}
+
+/******************************************************************************************************
+ * @brief Send the Home Assistant discovery configs for the system health diagnostic sensors
+ ******************************************************************************************************/
+static void sendHealthDiscovery(char* topic, char* payload)
+{
+    for (int i = 0; i < sizeof(healthSensors) / sizeof(healthSensors[0]); i++) {
+        const HealthSensor* sensor = &healthSensors[i];
+        sprintf(topic, "homeassistant/sensor/%s/%s/config", config.Name, sensor->key);
+        int len = sprintf(payload, "{\"unique_id\": \"%s-%s\", \
+            \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
+            \"name\": \"%s\", \"entity_category\": \"diagnostic\", \
+            \"unit_of_measurement\": \"%s\", \"state_class\": \"measurement\", \
+            \"state_topic\": \"homeassistant/sensor/%s/health/state\", \
+            \"value_template\": \"{{ value_json.%s }}\"",
+            config.UID, sensor->key, config.DeviceID, config.Name, sensor->name, sensor->unit, config.Name, sensor->value);
+        if (sensor->attributes != NULL) {
+            len += sprintf(payload + len, ", \"json_attributes_topic\": \"homeassistant/sensor/%s/health/state\", \
+                \"json_attributes_template\": \"{{ value_json.%s | tojson }}\"", config.Name, sensor->attributes);
+        }
+        sprintf(payload + len, "}");
+        discoveryMessage(topic, payload);
+    }
+}
+
+/******************************************************************************************************
+ * @brief Is this the diagnostics command topic?
+ ******************************************************************************************************/
+static bool isDiagnosticsCommandTopic(const char* topic)
+{
+    char diagnosticsTopic[160];
+    sprintf(diagnosticsTopic, "homeassistant/sensor/%s/diagnostics/command", config.Name);
+    return strcmp(topic, diagnosticsTopic) == 0;
+}
+
+/******************************************************************************************************
+ * @brief Process a diagnostics command
  *
- * @param handler_args user data registered to the event.
- * @param base Event base for the handler(always MQTT Base in this example).
- * @param event_id The id for the received event.
- * @param event_data The data for the event, esp_mqtt_event_handle_t.
+ *  dump_recorder: publish the flight recorder contents (binary) to .../diagnostics/recorder
+ *  ota <url> <sha256> <time> <hmac>: update the firmware from the image at https url, which must
+ *      have that SHA-256; signed, see commandAuth.c
+ *  stress_reconnect <n> <time> <hmac>: measure the input latency through a storm of n broker
+ *      reconnects, 1 to STRESS_MAX_RECONNECTS; signed, see commandAuth.c
  ******************************************************************************************************/
-void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+static void processDiagnosticsCommand(const char* command)
 {
+    static uint8_t dump[sizeof(FlightRecorderDumpHeader) + sizeof(FlightRecord) * FLIGHT_RECORDER_RECORDS];
     char topic[160];
-    char payload[2000];
-    esp_mqtt_event_handle_t event = event_data;
-    esp_mqtt_client_handle_t client = event->client;
-    int msg_id;
 
-    ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 "", base, event_id);
-
-    switch ((esp_mqtt_event_id_t)event_id) {
-        case MQTT_EVENT_BEFORE_CONNECT:
-            ESP_LOGI(TAG, "MQTT_EVENT_BEFORE_CONNECT");
-            break;
-        case MQTT_EVENT_CONNECTED:
-            MyMqttConnected = true;
-            ESP_LOGD(TAG, "MQTT_EVENT_CONNECTED");
-
-            // Subscribe to the time feed
-            msg_id = esp_mqtt_client_subscribe(client, "homeassistant/CurrentTime", 0);
-            ESP_LOGD(TAG, "Subscribe sent for time feed, msg_id=%d", msg_id);
-
-            // Send the alarm sensor configurations.
-            // Use the same command and state topics so we don't have to echo commands to state
-            char id[80];
-            for (int i = 0; i < 6; i++) {
-                if (config.inputs[i].active) {
-
-                    // Make up the input sensor's unique ID string
-                    strcpy (id, config.UID);
-                    int l = strlen(config.UID);
-                    id[l] = '-'; id[l+1] = (char)(i + 0x30); id[l+2] = '\0';
-
-                    // Send the config for this sensor
-                    sprintf(topic, "homeassistant/binary_sensor/%s/%s/config", config.Name, config.inputs[i].inputName);
-                    sprintf(payload, "{\"unique_id\": \"%s\", \
-                        \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
-                        \"availability\": {\"topic\": \"homeassistant/binary_sensor/%s/availability\", \
-                        \"payload_on\": \"ON\", \"payload_off\": \"OFF\"}, \
-                        \"name\": \"%s\", \"retain\":true, \"device_class\": \"motion\", \
-                        \"state_topic\": \"homeassistant/binary_sensor/%s/%s/state\"}",
-                        id, config.DeviceID, config.Name, config.Name, config.inputs[i].descriptiveName, config.Name, config.inputs[i].inputName);
-                    msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-                    mqttMessagesQueued++;
-                    ESP_LOGD(TAG, "Published %s config message successfully, msg_id=%d", config.inputs[i].descriptiveName, msg_id);
-                }
-            }
+    if (strcmp(command, "trace_start") == 0) {
+        Trace_Start();
+    } else if (strcmp(command, "trace_stop") == 0) {
+        Trace_Stop();
+    } else if (strcmp(command, "trace_dump") == 0) {
+        // Sent in parts, the parts concatenated in order make up the text dump
+        static char part[2048];
+        int cursor = 0;
+        size_t len;
+        sprintf(topic, "homeassistant/sensor/%s/diagnostics/trace", config.Name);
+        while ((len = Trace_Format(part, sizeof(part), &cursor)) > 0) {
+            Hal_MqttPublish(topic, part, len, 1, 0);
+            Metrics_Increment(&mqttQueued);
+        }
+        ESP_LOGI(TAG, "Published trace capture to %s", topic);
+    } else if (strcmp(command, "dump_recorder") == 0) {
+        size_t len = FlightRecorder_Dump(dump, sizeof(dump));
+        sprintf(topic, "homeassistant/sensor/%s/diagnostics/recorder", config.Name);
+        int msg_id = Hal_MqttPublish(topic, (const char*)dump, len, 0, 0);
+        ESP_LOGI(TAG, "Published %d bytes of flight recorder, msg_id=%d", (int)len, msg_id);
+    } else if (strncmp(command, "stress_reconnect ", 17) == 0) {
+        char* end;
+        long reconnects = strtol(command + 17, &end, 10);
+        if (end == command + 17 || *end != ' ' || reconnects < 1 || reconnects > STRESS_MAX_RECONNECTS) {
+            ESP_LOGE(TAG, "Diagnostics command \"stress_reconnect\" needs a count of 1 to %d.", STRESS_MAX_RECONNECTS);
+        } else if (CommandAuth_Verify(command)) {
+            InputLatency_StormTest((int)reconnects);
+        }
+    } else if (strncmp(command, "ota ", 4) == 0) {
+        char url[OTA_URL_LEN];
+        char sha256[65];
+        if (sscanf(command + 4, "%255s %64s", url, sha256) == 2) {
+            if (CommandAuth_Verify(command)) { Ota_Start(url, sha256); }
+        } else {
+            ESP_LOGE(TAG, "Diagnostics command \"ota\" needs a URL and a SHA-256.");
+        }
+    } else {
+        ESP_LOGE(TAG, "Unknown diagnostics command \"%s\" received.", command);
+    }
+}
 
-            // Alarm Siren configurations
-            sprintf(topic, "homeassistant/siren/%s/ExternalSiren/config", config.Name);
-            sprintf(payload, "{\"unique_id\": \"%s-ES\", \
-                \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\", \"manufacturer\": \"Phillip Dimond\"}, \
-                \"availability\": {\"topic\": \"homeassistant/siren/%s/availability\", \
-                \"payload_on\": \"ON\", \"payload_off\": \"OFF\"}, \
-                \"name\": \"External Siren\", \"retain\":true, \"device_class\": \"siren\", \
-                \"command_topic\": \"homeassistant/siren/%s/ExternalSiren/command\", \
-                \"state_topic\": \"homeassistant/siren/%s/ExternalSiren/state\", \
-                \"payload_on\": \"ON\", \"payload_off\": \"OFF\"}",
-                id, config.DeviceID, config.Name, config.Name, config.Name, config.Name);
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-            mqttMessagesQueued++;
-            ESP_LOGD(TAG, "Published %s config message successfully, msg_id=%d", "ExternalSiren", msg_id);
-
-            sprintf(topic, "homeassistant/siren/%s/DownstairsSiren/config", config.Name);
-            sprintf(payload, "{\"unique_id\": \"%s-DS\", \
-                \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\", \"manufacturer\": \"Phillip Dimond\"}, \
-                \"availability\": {\"topic\": \"homeassistant/siren/%s/availability\", \
+/******************************************************************************************************
+ * @brief Build the Home Assistant discovery configs, publishing them if discoverySending is set
+ *
+ *  The configs and topics are all made from the configuration, so they only change when it does.
+ *  Uses the static event buffers, so only call it from the MQTT task.
+ ******************************************************************************************************/
+static char eventTopic[160];
+static char eventPayload[2000];
+
+static void buildDiscovery(void)
+{
+    discoveryHash = 2166136261u;
+
+    // Send the alarm sensor configurations.
+    // Use the same command and state topics so we don't have to echo commands to state
+    char id[80];
+    for (int i = 0; i < 6; i++) {
+        if (config.inputs[i].active) {
+
+            // Make up the input sensor's unique ID string
+            strcpy (id, config.UID);
+            int l = strlen(config.UID);
+            id[l] = '-'; id[l+1] = (char)(i + 0x30); id[l+2] = '\0';
+
+            // Send the config for this sensor
+            sprintf(eventTopic, "homeassistant/binary_sensor/%s/%s/config", config.Name, config.inputs[i].inputName);
+            sprintf(eventPayload, "{\"unique_id\": \"%s\", \
+                \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
+                \"availability\": {\"topic\": \"homeassistant/binary_sensor/%s/availability\", \
                 \"payload_on\": \"ON\", \"payload_off\": \"OFF\"}, \
-                \"name\": \"Downstairs Interior Siren\", \"retain\":true, \"device_class\": \"siren\", \
-                \"command_topic\": \"homeassistant/siren/%s/DownstairsSiren/command\", \
-                \"state_topic\": \"homeassistant/siren/%s/DownstairsSiren/state\", \
-                \"payload_on\": \"ON\", \"payload_off\": \"OFF\"}",
-                id, config.DeviceID, config.Name, config.Name, config.Name, config.Name);
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-            mqttMessagesQueued++;
-            ESP_LOGD(TAG, "Published %s config message successfully, msg_id=%d", "DownstairsSiren", msg_id);
-
-            // Send online messages
-            sprintf(topic, "homeassistant/binary_sensor/%s/availability", config.Name);
-            sprintf(payload, "online");
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-            mqttMessagesQueued++;
-            ESP_LOGD(TAG, "Published sensor online message successfully, msg_id=%d, topic=%s", msg_id, topic);
-
-            sprintf(topic, "homeassistant/siren/%s/availability", config.Name);
-            sprintf(payload, "online");
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-            mqttMessagesQueued++;
-            ESP_LOGD(TAG, "Published siren switch online message successfully, msg_id=%d, topic=%s", msg_id, topic);
-
-            // Send input initial states
-            for (int i = 0; i < NUM_INPUTS; i++) {
-                if (config.inputs[i].active) {
-                    sprintf(topic, "homeassistant/binary_sensor/%s/%s/state", config.Name, config.inputs[i].inputName);
-                    sprintf(payload, "OFF");
-                    int msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-                    mqttMessagesQueued++;
-                    ESP_LOGD(TAG, "Published state message for input %d, %s = %s successfully, msg_id=%d", i, config.inputs[i].descriptiveName, payload, msg_id);
-                }
+                \"name\": \"%s\", \"retain\":true, \"device_class\": \"motion\", \
+                \"state_topic\": \"homeassistant/binary_sensor/%s/%s/state\"%s}",
+                id, config.DeviceID, config.Name, config.Name, config.inputs[i].descriptiveName, config.Name, config.inputs[i].inputName,
+                config.extendedPayloads ? ", \"value_template\": \"{{ value_json.state }}\"" : "");
+            discoveryMessage(eventTopic, eventPayload);
+
+            // And its health problem sensor, with the statistics as attributes
+            sprintf(eventTopic, "homeassistant/binary_sensor/%s/%sHealth/config", config.Name, config.inputs[i].inputName);
+            sprintf(eventPayload, "{\"unique_id\": \"%s-health\", \
+                \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
+                \"availability\": {\"topic\": \"homeassistant/binary_sensor/%s/availability\"}, \
+                \"name\": \"%s Sensor\", \"device_class\": \"problem\", \"entity_category\": \"diagnostic\", \
+                \"state_topic\": \"homeassistant/binary_sensor/%s/%sHealth/state\", \
+                \"value_template\": \"{{ 'ON' if value_json.problem else 'OFF' }}\", \
+                \"json_attributes_topic\": \"homeassistant/binary_sensor/%s/%sHealth/state\"}",
+                id, config.DeviceID, config.Name, config.Name, config.inputs[i].descriptiveName,
+                config.Name, config.inputs[i].inputName, config.Name, config.inputs[i].inputName);
+            discoveryMessage(eventTopic, eventPayload);
+
+            // Supervised zones also get a tamper sensor
+            if (ZoneScan_IsSupervised(i)) {
+                sprintf(eventTopic, "homeassistant/binary_sensor/%s/%sTamper/config", config.Name, config.inputs[i].inputName);
+                sprintf(eventPayload, "{\"unique_id\": \"%s-tamper\", \
+                    \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
+                    \"availability\": {\"topic\": \"homeassistant/binary_sensor/%s/availability\"}, \
+                    \"name\": \"%s Tamper\", \"device_class\": \"tamper\", \
+                    \"state_topic\": \"homeassistant/binary_sensor/%s/%sTamper/state\", \
+                    \"value_template\": \"{{ 'ON' if value_json.tamper else 'OFF' }}\", \
+                    \"json_attributes_topic\": \"homeassistant/binary_sensor/%s/%sTamper/state\"}",
+                    id, config.DeviceID, config.Name, config.Name, config.inputs[i].descriptiveName,
+                    config.Name, config.inputs[i].inputName, config.Name, config.inputs[i].inputName);
+                discoveryMessage(eventTopic, eventPayload);
             }
+        }
+    }
+
+    // Alarm Siren configurations
+    sprintf(eventTopic, "homeassistant/siren/%s/ExternalSiren/config", config.Name);
+    sprintf(eventPayload, "{\"unique_id\": \"%s-ES\", \
+        \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\", \"manufacturer\": \"Phillip Dimond\"}, \
+        \"availability\": {\"topic\": \"homeassistant/siren/%s/availability\", \
+        \"payload_on\": \"ON\", \"payload_off\": \"OFF\"}, \
+        \"name\": \"External Siren\", \"retain\":true, \"device_class\": \"siren\", \
+        \"command_topic\": \"homeassistant/siren/%s/ExternalSiren/command\", \
+        \"state_topic\": \"homeassistant/siren/%s/ExternalSiren/state\", \
+        \"payload_on\": \"ON\", \"payload_off\": \"OFF\"%s}",
+        id, config.DeviceID, config.Name, config.Name, config.Name, config.Name,
+        config.extendedPayloads ? ", \"state_value_template\": \"{{ value_json.state }}\"" : "");
+    discoveryMessage(eventTopic, eventPayload);
+
+    sprintf(eventTopic, "homeassistant/siren/%s/DownstairsSiren/config", config.Name);
+    sprintf(eventPayload, "{\"unique_id\": \"%s-DS\", \
+        \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\", \"manufacturer\": \"Phillip Dimond\"}, \
+        \"availability\": {\"topic\": \"homeassistant/siren/%s/availability\", \
+        \"payload_on\": \"ON\", \"payload_off\": \"OFF\"}, \
+        \"name\": \"Downstairs Interior Siren\", \"retain\":true, \"device_class\": \"siren\", \
+        \"command_topic\": \"homeassistant/siren/%s/DownstairsSiren/command\", \
+        \"state_topic\": \"homeassistant/siren/%s/DownstairsSiren/state\", \
+        \"payload_on\": \"ON\", \"payload_off\": \"OFF\"%s}",
+        id, config.DeviceID, config.Name, config.Name, config.Name, config.Name,
+        config.extendedPayloads ? ", \"state_value_template\": \"{{ value_json.state }}\"" : "");
+    discoveryMessage(eventTopic, eventPayload);
+
+    // System health diagnostic sensor configurations
+    sendHealthDiscovery(eventTopic, eventPayload);
+}
+
+/******************************************************************************************************
+ * @brief Broker connection established
+ *
+ *  The client connects with a persistent session. If the broker still has it (sessionPresent), it
+ *  kept our subscriptions and queued any QoS 1 commands sent while we were away, and almost certainly
+ *  its retained messages too, so the discovery configs are only sent if they've changed since the
+ *  last announcement it acknowledged. A new session gets everything. Either way the main loop then
+ *  republishes what the zones and sirens actually are, followed by the availability.
+ *
+ *  This and the other MqttProcess_ functions are called by the MQTT transport, always from the one
+ *  task, so they share the static event buffers.
+ ******************************************************************************************************/
+void MqttProcess_Connected(bool sessionPresent)
+{
+    int msg_id;
+
+    MyMqttConnected = true;
+    FlightRecorder_Record(FR_MQTT_CONNECTED, sessionPresent, 0);
+    Metrics_Increment(&mqttConnects);
+    if (sessionPresent) { Metrics_Increment(&mqttResumes); }
+    Metrics_Set(&mqttConnectedState, 1);
+    ESP_LOGD(TAG, "MQTT_EVENT_CONNECTED, session present %d", sessionPresent);
+
+    discoverySending = false;
+    buildDiscovery();
+    if (!sessionPresent || discoveryHash != announcedHash) {
+        ESP_LOGI(TAG, "Announcing discovery, hash %08" PRIx32 " (last acknowledged %08" PRIx32 ")", discoveryHash, announcedHash);
+        discoverySending = true;
+        discoveryUnacked = 0;
+        buildDiscovery();
+        discoverySending = false;
+        Metrics_Increment(&mqttAnnounces);
+    }
 
-            // Send initial siren states via a command to override anything historical.
-            sprintf(topic, "homeassistant/siren/%s/ExternalSiren/command", config.Name);
-            sprintf(payload, "{\"state\":\"OFF\"}");
-            int msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-            mqttMessagesQueued++;
-            ESP_LOGD(TAG, "Published initial command message for External Siren successfully, msg_id=%d", msg_id);
-
-            sprintf(topic, "homeassistant/siren/%s/DownstairsSiren/command", config.Name);
-            sprintf(payload, "{\"state\":\"OFF\"}");
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-            mqttMessagesQueued++;
-            ESP_LOGD(TAG, "Published initial command message for Downstairs Siren successfully, msg_id=%d", msg_id);
-
-            // Subscribe to the siren state feeds. Doing this AFTER sending initial states via command 
-            // to avoid any brief activations from conflicting messages from host.
-            sprintf(topic, "homeassistant/siren/%s/ExternalSiren/command", config.Name);
-            msg_id = esp_mqtt_client_subscribe(client, topic, 0);
-            ESP_LOGD(TAG, "Subscribe sent for the external siren event feed, msg_id=%d", msg_id);
-
-            sprintf(topic, "homeassistant/siren/%s/DownstairsSiren/command", config.Name);
-            msg_id = esp_mqtt_client_subscribe(client, topic, 0);
-            ESP_LOGD(TAG, "Subscribe sent for the external siren event feed, msg_id=%d", msg_id);
-
-            break;
-        case MQTT_EVENT_DISCONNECTED:
-            MyMqttConnected = false;
-            ESP_LOGE(TAG, "MQTT_EVENT_DISCONNECTED");
-            break;
-        case MQTT_EVENT_SUBSCRIBED:
-            ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-            mqttMessagesQueued--;
-            break;
-        case MQTT_EVENT_UNSUBSCRIBED:
-            ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
-            break;
-        case MQTT_EVENT_PUBLISHED:
-            ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-            mqttMessagesQueued--;
-            break;
-        case MQTT_EVENT_DATA:
-            ESP_LOGD(TAG, "MQTT_EVENT_DATA");
-            //ESP_LOGI(TAG, "Event topic length = %d and data length = %d", event->topic_len, event->data_len);
-            strncpy(topic, event->topic, event->topic_len);
-            topic[event->topic_len] = '\0';
-            ESP_LOGD(TAG, "Received an event - topic was %s", topic);
-            if (strcmp(topic, "homeassistant/CurrentTime") == 0) {
-                // Process the time
-                ESP_LOGD(TAG, "Got the time from %s, as %.*s.", topic, event->data_len, event->data);
-                gotTime = true;
-                strncpy(payload, event->data, event->data_len);
-                payload[event->data_len] = 0;
-                sscanf(payload, "%d.%d.%d %d:%d:%d", &year, &month, &day, &hour, &minute, &seconds);
-                // Send an online every 10 seconds
-                if (seconds % 10 == 0) {
-
-                    sprintf(topic, "homeassistant/binary_sensor/%s/availability", config.Name);
-                    sprintf(payload, "online");
-                    msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-                    mqttMessagesQueued++;
-                    ESP_LOGD(TAG, "Published sensor online message successfully, msg_id=%d, topic=%s", msg_id, topic);
-
-                    sprintf(topic, "homeassistant/siren/%s/availability", config.Name);
-                    sprintf(payload, "online");
-                    msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-                    mqttMessagesQueued++;
-                    ESP_LOGD(TAG, "Published siren switch online message successfully, msg_id=%d, topic=%s", msg_id, topic);
-                    
-                }
-            } else if (strcmp(topic, "homeassistant/siren/HouseAlarm/ExternalSiren/command") == 0) {
-                strncpy(payload, event->data, event->data_len);
-                payload[event->data_len] = 0;
-                if (strstr(payload, "state") != NULL) { 
-                    ESP_LOGD(TAG, "House Alarm External Siren command with payload \"%s\" received.", payload); 
-                    if (strstr(payload, "ON") != NULL) { 
-                        ExternalSirenActivationRequested = true; 
-                    } else if (strstr(payload, "OFF") != NULL) { 
-                        ExternalSirenSilenceRequested = true; 
-                    } else {
-                        ESP_LOGE(TAG, "House Alarm External Siren request with unknown payload \"%s\" received.", payload); 
-                    }
-                }
-            } else if (strcmp(topic, "homeassistant/siren/HouseAlarm/DownstairsSiren/command") == 0) {
-                strncpy(payload, event->data, event->data_len);
-                payload[event->data_len] = 0;
-                if (strstr(payload, "state") != NULL) { 
-                    ESP_LOGD(TAG, "House Alarm Downstairs Siren command with payload \"%s\" received.", payload); 
-                    if (strstr(payload, "ON") != NULL) { 
-                        DownstairsSirenActivationRequested = true; 
-                    } else if (strstr(payload, "OFF") != NULL) { 
-                        DownstairsSirenSilenceRequested = true; 
-                    } else {
-                        ESP_LOGE(TAG, "House Alarm External Siren request with unknown payload \"%s\" received.", payload); 
-                    }
-                }
+    // Nothing else has been published since boot, so set the siren commands off to override
+    // anything historical. The sirens are off at boot.
+    if (firstConnect) {
+        sprintf(eventTopic, "homeassistant/siren/%s/ExternalSiren/command", config.Name);
+        sprintf(eventPayload, "{\"state\":\"OFF\"}");
+        msg_id = Hal_MqttPublish(eventTopic, eventPayload, 0, 1, 1); 
+        Metrics_Increment(&mqttQueued);
+        ESP_LOGD(TAG, "Published initial command message for External Siren successfully, msg_id=%d", msg_id);
+
+        sprintf(eventTopic, "homeassistant/siren/%s/DownstairsSiren/command", config.Name);
+        sprintf(eventPayload, "{\"state\":\"OFF\"}");
+        msg_id = Hal_MqttPublish(eventTopic, eventPayload, 0, 1, 1); 
+        Metrics_Increment(&mqttQueued);
+        ESP_LOGD(TAG, "Published initial command message for Downstairs Siren successfully, msg_id=%d", msg_id);
+        firstConnect = false;
+    }
+
+    // A new session: the broker has no subscriptions for us, and may have lost the retained states
+    if (!sessionPresent) {
+        SensorHealth_RequestPublish();
+
+        // Subscribe to the time feed
+        msg_id = Hal_MqttSubscribe("homeassistant/CurrentTime", 0);
+        ESP_LOGD(TAG, "Subscribe sent for time feed, msg_id=%d", msg_id);
+
+        // Subscribe to the siren state feeds. Doing this AFTER sending initial states via command 
+        // to avoid any brief activations from conflicting messages from host. QoS 1 so the broker
+        // holds commands for us while we're disconnected.
+        sprintf(eventTopic, "homeassistant/siren/%s/ExternalSiren/command", config.Name);
+        msg_id = Hal_MqttSubscribe(eventTopic, 1);
+        ESP_LOGD(TAG, "Subscribe sent for the external siren event feed, msg_id=%d", msg_id);
+
+        sprintf(eventTopic, "homeassistant/siren/%s/DownstairsSiren/command", config.Name);
+        msg_id = Hal_MqttSubscribe(eventTopic, 1);
+        ESP_LOGD(TAG, "Subscribe sent for the external siren event feed, msg_id=%d", msg_id);
+
+        // Subscribe to the diagnostics commands (flight recorder dumps, etc.)
+        sprintf(eventTopic, "homeassistant/sensor/%s/diagnostics/command", config.Name);
+        msg_id = Hal_MqttSubscribe(eventTopic, 0);
+        ESP_LOGD(TAG, "Subscribe sent for the diagnostics command feed, msg_id=%d", msg_id);
+    }
+
+    // Events the last broker didn't acknowledge, then the states and availability, are sent by the main loop
+    MqttFailover_Connected();
+    InputOutput_RequestResync(!sessionPresent);
+}
+
+/******************************************************************************************************
+ * @brief Heartbeat timer. Runs in the timer task, which mustn't block, so it only flags the
+ * heartbeat and wakes the main loop.
+ ******************************************************************************************************/
+static void heartbeatTick(void* arg)
+{
+    atomic_store(&heartbeatDue, true);
+    Hal_LoopWake();
+}
+
+/******************************************************************************************************
+ * @brief Heartbeat rate for the power source. On the battery it's slowed, with the expiry stretched
+ * to match, and one goes on the next main loop pass so the last one's expiry doesn't lapse first.
+ ******************************************************************************************************/
+void MqttProcess_BatteryMode(bool battery)
+{
+    atomic_store(&heartbeatExpiryS, battery ? HEARTBEAT_BATTERY_EXPIRY_S : HEARTBEAT_EXPIRY_S);
+    Hal_TimerStartPeriodic(heartbeatTimer, battery ? HEARTBEAT_BATTERY_INTERVAL_US : HEARTBEAT_INTERVAL_US);
+    atomic_store(&heartbeatDue, true);
+    Hal_LoopWake();
+}
+
+/******************************************************************************************************
+ * @brief Broker connection lost
+ ******************************************************************************************************/
+void MqttProcess_Disconnected(void)
+{
+    MyMqttConnected = false;
+    FlightRecorder_Record(FR_MQTT_DISCONNECTED, 0, 0);
+    Metrics_Increment(&mqttDisconnects);
+    Metrics_Set(&mqttConnectedState, 0);
+    MqttFailover_Disconnected();
+    ESP_LOGE(TAG, "MQTT_EVENT_DISCONNECTED");
+}
+
+/******************************************************************************************************
+ * @brief Subscription or QoS 1 publish acknowledged by the broker
+ ******************************************************************************************************/
+void MqttProcess_Subscribed(int msgId)
+{
+    ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", msgId);
+    Metrics_Add(&mqttQueued, -1);
+}
+
+void MqttProcess_Published(int msgId)
+{
+    ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", msgId);
+    TRACE_INSTANT("brokerAck", msgId);
+    Metrics_Add(&mqttQueued, -1);
+    Metrics_Increment(&mqttPublished);
+    MqttFailover_Acknowledged(msgId);
+
+    // Once the broker has every discovery config, remember what it has so we don't send it again
+    for (int i = 0; i < discoveryUnacked; i++) {
+        if (discoveryMsgIds[i] != msgId) { continue; }
+        discoveryMsgIds[i] = discoveryMsgIds[--discoveryUnacked];
+        if (discoveryUnacked == 0) {
+            char text[12];
+            announcedHash = discoveryHash;
+            int len = sprintf(text, "%08" PRIx32, announcedHash);
+            if (!Hal_StorageWrite(DISCOVERY_FILENAME, text, len)) { ESP_LOGE(TAG, "Couldn't save the discovery hash."); }
+            ESP_LOGI(TAG, "Discovery %08" PRIx32 " acknowledged.", announcedHash);
+        }
+        break;
+    }
+}
+
+/******************************************************************************************************
+ * @brief Message received on a subscribed topic. The topic and data aren't null terminated.
+ ******************************************************************************************************/
+void MqttProcess_Data(const char* topic, int topicLen, const char* data, int dataLen)
+{
+    ESP_LOGD(TAG, "MQTT_EVENT_DATA");
+    Metrics_Increment(&mqttReceived);
+    //ESP_LOGI(TAG, "Event topic length = %d and data length = %d", topicLen, dataLen);
+    if (topicLen >= (int)sizeof(eventTopic)) { topicLen = sizeof(eventTopic) - 1; }
+    if (dataLen >= (int)sizeof(eventPayload)) { dataLen = sizeof(eventPayload) - 1; }
+    strncpy(eventTopic, topic, topicLen);
+    eventTopic[topicLen] = '\0';
+    ESP_LOGD(TAG, "Received an event - topic was %s", eventTopic);
+    if (strcmp(eventTopic, "homeassistant/CurrentTime") == 0) {
+        // Process the time
+        ESP_LOGD(TAG, "Got the time from %s, as %.*s.", eventTopic, dataLen, data);
+        gotTime = true;
+        strncpy(eventPayload, data, dataLen);
+        eventPayload[dataLen] = 0;
+        sscanf(eventPayload, "%d.%d.%d %d:%d:%d", &year, &month, &day, &hour, &minute, &seconds);
+        TimeService_FeedTime(year, month, day, hour, minute, seconds);
+    } else if (strcmp(eventTopic, "homeassistant/siren/HouseAlarm/ExternalSiren/command") == 0) {
+        strncpy(eventPayload, data, dataLen);
+        eventPayload[dataLen] = 0;
+        if (strstr(eventPayload, "state") != NULL) { 
+            ESP_LOGD(TAG, "House Alarm External Siren command with payload \"%s\" received.", eventPayload); 
+            if (strstr(eventPayload, "ON") != NULL) { 
+                FlightRecorder_Record(FR_SIREN_COMMAND, 0, 1);
+                TRACE_INSTANT("sirenCommand", 1);
+                InputOutput_CommandSiren(0, true);
+            } else if (strstr(eventPayload, "OFF") != NULL) { 
+                FlightRecorder_Record(FR_SIREN_COMMAND, 0, 0);
+                InputOutput_CommandSiren(0, false);
             } else {
-                strncpy(payload, event->data, event->data_len);
-                payload[event->data_len] = 0;
-                ESP_LOGE(TAG, "Received unexpected message, topic=%s, payload=%s", topic, payload);
-            }            
-            break;
-        case MQTT_EVENT_ERROR:
-            ESP_LOGE(TAG, "MQTT_EVENT_ERROR. ");
-            if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
-                log_error_if_nonzero("reported from esp-tls", event->error_handle->esp_tls_last_esp_err);
-                log_error_if_nonzero("reported from tls stack", event->error_handle->esp_tls_stack_err);
-                log_error_if_nonzero("captured as transport's socket errno",  event->error_handle->esp_transport_sock_errno);
-                ESP_LOGI(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
+                ESP_LOGE(TAG, "House Alarm External Siren request with unknown payload \"%s\" received.", eventPayload); 
             }
-            break;
-        default:
-            ESP_LOGE(TAG, "Unhandled MQTT event. Event id = %d", event->event_id);
-            break;
+        }
+    } else if (strcmp(eventTopic, "homeassistant/siren/HouseAlarm/DownstairsSiren/command") == 0) {
+        strncpy(eventPayload, data, dataLen);
+        eventPayload[dataLen] = 0;
+        if (strstr(eventPayload, "state") != NULL) { 
+            ESP_LOGD(TAG, "House Alarm Downstairs Siren command with payload \"%s\" received.", eventPayload); 
+            if (strstr(eventPayload, "ON") != NULL) { 
+                FlightRecorder_Record(FR_SIREN_COMMAND, 1, 1);
+                TRACE_INSTANT("sirenCommand", 2);
+                InputOutput_CommandSiren(1, true);
+            } else if (strstr(eventPayload, "OFF") != NULL) { 
+                FlightRecorder_Record(FR_SIREN_COMMAND, 1, 0);
+                InputOutput_CommandSiren(1, false);
+            } else {
+                ESP_LOGE(TAG, "House Alarm External Siren request with unknown payload \"%s\" received.", eventPayload); 
+            }
+        }
+    } else if (isDiagnosticsCommandTopic(eventTopic)) {
+        strncpy(eventPayload, data, dataLen);
+        eventPayload[dataLen] = 0;
+        processDiagnosticsCommand(eventPayload);
+    } else {
+        strncpy(eventPayload, data, dataLen);
+        eventPayload[dataLen] = 0;
+        ESP_LOGE(TAG, "Received unexpected message, topic=%s, payload=%s", eventTopic, eventPayload);
     }
+    // Siren commands are carried out by the main loop
+    Hal_LoopWake();
+}
+
+/******************************************************************************************************
+ * @brief Transport or protocol error reported by the MQTT transport
+ ******************************************************************************************************/
+void MqttProcess_Error(int errorType, int sockErrno)
+{
+    FlightRecorder_Record(FR_MQTT_ERROR, errorType, sockErrno);
+    Metrics_Increment(&mqttErrors);
 }
 
 /***************************************************************************************************
  * 
- * Start the MQTT processes. 
- * 
- * Instantiates and starts the MQTT communication system
+ * Initialise the MQTT processing. Called by the transport before it connects.
  * 
  * *************************************************************************************************/
-
-void mqtt_app_start(void)
+void MqttProcess_Initialise(void)
 {
-    char lwTopic[100];
-    sprintf(lwTopic, "homeassistant/binary_sensor/%s/availability", config.Name);
-    const char* lwMessage = "offline\0";
-    esp_mqtt_client_config_t mqtt_cfg = {
-        .network = {
-            .reconnect_timeout_ms = 250, // Reconnect MQTT broker after this many ms
-        },
-        .broker.address.uri = config.mqttBrokerUrl,
-        .credentials = { 
-            .username = config.mqttUsername, 
-            .authentication = { 
-                .password = config.mqttPassword
-            }, 
-        },
-        .session = {
-            .message_retransmit_timeout = 250,  // ms transmission retry
-            .protocol_ver = MQTT_PROTOCOL_V_3_1_1,
-            .keepalive = 30, // 30 second keepalive timeout
-            .last_will = {
-                .topic = lwTopic,
-                .msg = (const char*)lwMessage,
-                .msg_len = strlen(lwMessage),
-                .qos = 1,
-                .retain = 1
-            }
-        },
-    };
-    client = esp_mqtt_client_init(&mqtt_cfg);
-    /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
-    esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-    esp_err_t err = esp_mqtt_client_start(client);
-    if (err != ESP_OK) { ESP_LOGE(TAG, "MQTT client start error: %s", esp_err_to_name(err)); }
+    Metrics_Register(&mqttConnects);
+    Metrics_Register(&mqttDisconnects);
+    Metrics_Register(&mqttErrors);
+    Metrics_Register(&mqttPublished);
+    Metrics_Register(&mqttReceived);
+    Metrics_Register(&mqttConnectedState);
+    Metrics_Register(&mqttQueued);
+    Metrics_Register(&mqttAnnounces);
+    Metrics_Register(&mqttResumes);
+    EventPayload_Initialise();
+    MqttFailover_Initialise();
+
+    // Availability heartbeat on its own timer, so it doesn't depend on the time feed arriving
+    heartbeatTimer = Hal_TimerCreate("heartbeat", heartbeatTick, NULL);
+    Hal_TimerStartPeriodic(heartbeatTimer, HEARTBEAT_INTERVAL_US);
+
+    char text[12];
+    int len = Hal_StorageRead(DISCOVERY_FILENAME, text, sizeof(text) - 1);
+    if (len > 0) {
+        text[len] = '\0';
+        announcedHash = (uint32_t)strtoul(text, NULL, 16);
+    }
 }
 
 /********************************************************************************************************
  * 
  * Send MQTT Alarm input state change event
  * 
- * Send an input` state change message to MQTT
+ * Send an input` state change message to MQTT. previous and eventUs, the state before and the time of
+ * the input edge, are only sent in the extended payload.
  * 
  *******************************************************************************************************/
-void sendInputState(int inputNumber, bool active)
+void sendInputState(int inputNumber, bool active, bool previous, int64_t eventUs)
 {
     char topic[200];
-    char payload[20];
+    char payload[EVENT_PAYLOAD_MAX_LEN];
+
+    TRACE_BEGIN("sendInputState");
 
     // Send a state message for the specified input
     sprintf(topic, "homeassistant/binary_sensor/%s/%s/state", config.Name, config.inputs[inputNumber].inputName);
-    if (active) { sprintf(payload, "ON"); } else { sprintf(payload, "OFF"); }
-    int msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-    mqttMessagesQueued++;
+    if (config.extendedPayloads) {
+        EventPayload_FormatState(payload, sizeof(payload), active ? "ON" : "OFF", previous ? "ON" : "OFF", eventUs);
+    } else if (active) { sprintf(payload, "ON"); } else { sprintf(payload, "OFF"); }
+    int msg_id = Hal_MqttPublish(topic, payload, 0, 1, 1); 
+    Metrics_Increment(&mqttQueued);
+    MqttFailover_Sent(topic, payload, strlen(payload), 1, msg_id, true);
+    FlightRecorder_Record(FR_INPUT_PUBLISH, inputNumber, active);
     ESP_LOGD(TAG, "Published state message for input %d, %s = %s successfully, msg_id=%d", 
         inputNumber, config.inputs[inputNumber].descriptiveName, payload, msg_id);
+    TRACE_END("sendInputState");
+}
+
+/********************************************************************************************************
+ * 
+ * Send the availability heartbeat if the timer has flagged one. Called from the main loop, so a
+ * stalled loop stops the heartbeat and Home Assistant marks the device unavailable.
+ * 
+ *******************************************************************************************************/
+void SendHeartbeatIfDue(void)
+{
+    if (!atomic_exchange(&heartbeatDue, false) || !MyMqttConnected) { return; }
+    SendAvailability();
+}
+
+/********************************************************************************************************
+ * 
+ * Send the online availability for the sensors and sirens. Under MQTT 5 it expires after
+ * HEARTBEAT_EXPIRY_S, or HEARTBEAT_BATTERY_EXPIRY_S on the battery, so a heartbeat held up by an outage
+ * isn't delivered late and a retained "online" doesn't outlive the heartbeats.
+ * 
+ *******************************************************************************************************/
+void SendAvailability(void)
+{
+    char topic[200];
+
+    sprintf(topic, "homeassistant/binary_sensor/%s/availability", config.Name);
+    int msg_id = Hal_MqttPublishExpiring(topic, "online", 0, 1, 1, atomic_load(&heartbeatExpiryS)); 
+    Metrics_Increment(&mqttQueued);
+    MqttFailover_Sent(topic, "online", 6, 1, msg_id, false);
+    ESP_LOGD(TAG, "Published sensor online message successfully, msg_id=%d, topic=%s", msg_id, topic);
+
+    sprintf(topic, "homeassistant/siren/%s/availability", config.Name);
+    msg_id = Hal_MqttPublishExpiring(topic, "online", 0, 1, 1, atomic_load(&heartbeatExpiryS)); 
+    Metrics_Increment(&mqttQueued);
+    ESP_LOGD(TAG, "Published siren switch online message successfully, msg_id=%d, topic=%s", msg_id, topic);
 }
 
 /********************************************************************************************************
  * 
  * Send MQTT Alarm siren state change event
  * 
- * Send a siren state change message to MQTT
+ * Send a siren state change message to MQTT. previous and eventUs, the state before and the time of
+ * the change, are only sent in the extended payload.
  * 
  *******************************************************************************************************/
 void SendSirenState(char* sirenName, bool state)
+{
+    SendSirenEvent(sirenName, state, !state, Hal_TimeUs());
+}
+
+void SendSirenEvent(char* sirenName, bool state, bool previous, int64_t eventUs)
 {
     char topic[200];
-    char payload[20];
+    char payload[EVENT_PAYLOAD_MAX_LEN];
+
+    TRACE_BEGIN("SendSirenState");
 
     sprintf(topic, "homeassistant/siren/%s/%s/state", config.Name, sirenName);
-    if (state == true) {
+    if (config.extendedPayloads) {
+        EventPayload_FormatState(payload, sizeof(payload), state ? "ON" : "OFF", previous ? "ON" : "OFF", eventUs);
+    } else if (state == true) {
         sprintf(payload, "{\"state\":\"ON\"}");
     } else {
         sprintf(payload, "{\"state\":\"OFF\"}");
     }
-    int msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); 
-    mqttMessagesQueued++;
+    int msg_id = Hal_MqttPublish(topic, payload, 0, 1, 1); 
+    Metrics_Increment(&mqttQueued);
+    MqttFailover_Sent(topic, payload, strlen(payload), 1, msg_id, true);
     ESP_LOGD(TAG, "Published siren state message for the %s siren as on=%d successfully, msg_id=%d", 
         sirenName, state, msg_id);
+    TRACE_END("SendSirenState");
+}
+
+/********************************************************************************************************
+ * 
+ * Resend an event the last broker didn't acknowledge to the one we've failed over to. Returns the
+ * msg_id.
+ * 
+ *******************************************************************************************************/
+int SendFailoverEvent(const char* topic, const char* payload, int len, int retain)
+{
+    int msg_id = Hal_MqttPublish(topic, payload, len, 1, retain);
+    Metrics_Increment(&mqttQueued);
+    ESP_LOGI(TAG, "Resent %s = %.*s after failover, msg_id=%d", topic, len, payload, msg_id);
+    return msg_id;
+}
+
+/********************************************************************************************************
+ * 
+ * Send the runtime metrics as a compact JSON diagnostics message
+ * 
+ *******************************************************************************************************/
+void SendDiagnostics(void)
+{
+    static char payload[6144];
+    char topic[200];
+
+    if (!MyMqttConnected) { return; }
+    int len = Metrics_FormatJson(payload, sizeof(payload));
+    if (len < 0) {
+        ESP_LOGE(TAG, "Diagnostics metrics too large for the payload buffer.");
+        return;
+    }
+    sprintf(topic, "homeassistant/sensor/%s/diagnostics/metrics", config.Name);
+    int msg_id = Hal_MqttPublish(topic, payload, len, 0, 0);
+    ESP_LOGD(TAG, "Published diagnostics metrics, msg_id=%d", msg_id);
+}
+
+/********************************************************************************************************
+ * 
+ * Send the latest system health sample. Called from the system health sampler task.
+ * 
+ *******************************************************************************************************/
+void SendSystemHealth(void)
+{
+    static char payload[2560];
+    char topic[200];
+
+    if (!MyMqttConnected) { return; }
+    int len = SystemHealth_FormatJson(payload, sizeof(payload));
+    if (len < 0) {
+        ESP_LOGE(TAG, "System health sample too large for the payload buffer.");
+        return;
+    }
+    // QoS 1 so the acknowledgement is regular traffic through the MQTT task for the supervisor
+    sprintf(topic, "homeassistant/sensor/%s/health/state", config.Name);
+    int msg_id = Hal_MqttPublish(topic, payload, len, 1, 0);
+    Metrics_Increment(&mqttQueued);
+    ESP_LOGD(TAG, "Published system health, msg_id=%d", msg_id);
+}
+
+/********************************************************************************************************
+ * 
+ * Send a zone's health for its problem sensor. Returns false if it couldn't be sent.
+ * 
+ *******************************************************************************************************/
+bool SendZoneHealth(int zone)
+{
+    char topic[200];
+    char payload[400];
+
+    if (!MyMqttConnected) { return false; }
+    int len = SensorHealth_FormatJson(zone, payload, sizeof(payload));
+    if (len < 0) { return false; }
+    sprintf(topic, "homeassistant/binary_sensor/%s/%sHealth/state", config.Name, config.inputs[zone].inputName);
+    int msg_id = Hal_MqttPublish(topic, payload, len, 1, 1);
+    Metrics_Increment(&mqttQueued);
+    ESP_LOGD(TAG, "Published health for input %d, msg_id=%d", zone, msg_id);
+    return msg_id >= 0;
+}
+
+/********************************************************************************************************
+ * 
+ * Send a supervised zone's tamper state: ZONE_NORMAL, ZONE_TAMPER_OPEN or ZONE_TAMPER_SHORT. Returns
+ * false if it couldn't be sent.
+ * 
+ *******************************************************************************************************/
+bool SendZoneTamper(int zone, ZoneCondition tamper)
+{
+    char topic[200];
+    char payload[100];
+
+    if (!MyMqttConnected) { return false; }
+    int len = snprintf(payload, sizeof(payload), "{\"tamper\":%s,\"condition\":\"%s\",\"raw\":%d}",
+        tamper != ZONE_NORMAL ? "true" : "false", ZoneScan_ConditionName(tamper), ZoneScan_LastRaw(zone));
+    sprintf(topic, "homeassistant/binary_sensor/%s/%sTamper/state", config.Name, config.inputs[zone].inputName);
+    int msg_id = Hal_MqttPublish(topic, payload, len, 1, 1);
+    Metrics_Increment(&mqttQueued);
+    ESP_LOGD(TAG, "Published tamper state for input %d, msg_id=%d", zone, msg_id);
+    return msg_id >= 0;
+}
+
+/********************************************************************************************************
+ * 
+ * Send a diagnostics event (watchdog resets, loop overruns, etc.)
+ * 
+ *******************************************************************************************************/
+void SendDiagnosticEvent(const char* payload, int len)
+{
+    char topic[200];
+
+    if (!MyMqttConnected) { return; }
+    sprintf(topic, "homeassistant/sensor/%s/diagnostics/event", config.Name);
+    int msg_id = Hal_MqttPublish(topic, payload, len, 1, 0);
+    Metrics_Increment(&mqttQueued);
+    ESP_LOGD(TAG, "Published diagnostics event %s, msg_id=%d", payload, msg_id);
 }
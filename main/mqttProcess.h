@@ -22,12 +22,31 @@
 #ifndef __MQTTPROCESS_H__
 #define __MQTTPROCESS_H__
 
+#include <stdbool.h>
 #include "inttypes.h"
-#include "mqtt_client.h"
 #include "defines.h"
+#include "zoneScan.h"
 
-void mqtt_app_start(void);
-void sendInputState(int inputNumber, bool active);
+void sendInputState(int inputNumber, bool active, bool previous, int64_t eventUs);
 void SendSirenState(char* sirenName, bool state);
+void SendSirenEvent(char* sirenName, bool state, bool previous, int64_t eventUs);
+void SendAvailability(void);
+int SendFailoverEvent(const char* topic, const char* payload, int len, int retain);
+void SendHeartbeatIfDue(void);
+void SendDiagnostics(void);
+void SendSystemHealth(void);
+void SendDiagnosticEvent(const char* payload, int len);
+bool SendZoneHealth(int zone);
+bool SendZoneTamper(int zone, ZoneCondition tamper);
+
+// Broker events, called by the MQTT transport
+void MqttProcess_Initialise(void);
+void MqttProcess_Connected(bool sessionPresent);
+void MqttProcess_Disconnected(void);
+void MqttProcess_Subscribed(int msgId);
+void MqttProcess_Published(int msgId);
+void MqttProcess_Data(const char* topic, int topicLen, const char* data, int dataLen);
+void MqttProcess_Error(int errorType, int sockErrno);
+void MqttProcess_BatteryMode(bool battery);
 
 #endif // #ifndef __MQTTPROCESS_H__
\ No newline at end of file
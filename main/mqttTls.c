@@ -0,0 +1,190 @@
+/* MQTT Alarm Controller: Broker TLS transport
+
+   esp-mqtt's own SSL transport makes a new TLS context for every
+   connection and has no way to offer a saved session, so each reconnect
+   is a full handshake: the certificate chain check or the PSK exchange,
+   and the heap spike that goes with it. This transport is the same
+   esp-tls connection with the session kept, one per broker, and offered
+   on the next connect. A broker that takes the ticket skips the public
+   key work, one that doesn't just does the full handshake, and the
+   session from whichever succeeded is kept for the next time.
+
+   Only mqtts:// brokers use it, wss:// stays on esp-mqtt's transports.
+   Each broker's session is only touched by the task of that broker's
+   client, so it isn't locked.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_tls.h"
+#include "esp_transport.h"
+#include "mqtt_client.h"
+
+#include "metrics.h"
+#include "mqttFailover.h"
+#include "mqttTls.h"
+
+#ifndef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+#error "Broker TLS session resumption needs CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS"
+#endif
+
+extern const char *TAG;
+
+typedef struct {
+    int broker;
+    esp_tls_cfg_t cfg;                  // The verification, the session and timeout are set per connect
+    esp_tls_t* tls;                     // NULL while it isn't connected
+} TlsConnection;
+
+static esp_tls_client_session_t* sessions[MQTT_MAX_BROKERS];
+
+static Metric offered = METRIC_COUNTER_INIT("alarm_mqtt_tls_sessions_offered_total", "Broker TLS connects that offered a saved session");
+static Metric saved = METRIC_COUNTER_INIT("alarm_mqtt_tls_sessions_saved_total", "Broker TLS sessions saved after a handshake");
+
+void MqttTls_Initialise(void)
+{
+    Metrics_Register(&offered);
+    Metrics_Register(&saved);
+}
+
+/******************************************************************
+ *
+ * Connect, offering the broker's last session. The new session is
+ * kept as soon as the handshake's done, a TLS 1.2 ticket has arrived
+ * by then.
+ *
+*******************************************************************/
+static int tlsConnect(esp_transport_handle_t t, const char* host, int port, int timeoutMs)
+{
+    TlsConnection* c = esp_transport_get_context_data(t);
+    esp_tls_cfg_t cfg = c->cfg;
+    cfg.timeout_ms = timeoutMs;
+    cfg.client_session = sessions[c->broker];
+
+    c->tls = esp_tls_init();
+    if (c->tls == NULL) { return -1; }
+    if (cfg.client_session != NULL) { Metrics_Increment(&offered); }
+    if (esp_tls_conn_new_sync(host, strlen(host), port, &cfg, c->tls) <= 0) {
+        ESP_LOGW(TAG, "Broker %d TLS connection to %s:%d failed.", c->broker, host, port);
+        esp_tls_conn_destroy(c->tls);
+        c->tls = NULL;
+        return -1;
+    }
+
+    esp_tls_client_session_t* session = esp_tls_get_client_session(c->tls);
+    if (session != NULL) {
+        if (sessions[c->broker] != NULL) { esp_tls_free_client_session(sessions[c->broker]); }
+        sessions[c->broker] = session;
+        Metrics_Increment(&saved);
+    }
+    return 0;
+}
+
+// 1 when it's ready, 0 on the timeout, -1 on an error
+static int tlsPoll(TlsConnection* c, int timeoutMs, bool write)
+{
+    int fd;
+    if (c->tls == NULL || esp_tls_get_conn_sockfd(c->tls, &fd) != ESP_OK || fd < 0) { return -1; }
+    if (!write && esp_tls_get_bytes_avail(c->tls) > 0) { return 1; }
+
+    fd_set ready, errors;
+    FD_ZERO(&ready);
+    FD_ZERO(&errors);
+    FD_SET(fd, &ready);
+    FD_SET(fd, &errors);
+    struct timeval tv = { .tv_sec = timeoutMs / 1000, .tv_usec = (timeoutMs % 1000) * 1000 };
+    int ret = select(fd + 1, write ? NULL : &ready, write ? &ready : NULL, &errors, timeoutMs < 0 ? NULL : &tv);
+    if (ret > 0 && FD_ISSET(fd, &errors)) { return -1; }
+    return ret;
+}
+
+static int tlsPollRead(esp_transport_handle_t t, int timeoutMs)
+{
+    return tlsPoll(esp_transport_get_context_data(t), timeoutMs, false);
+}
+
+static int tlsPollWrite(esp_transport_handle_t t, int timeoutMs)
+{
+    return tlsPoll(esp_transport_get_context_data(t), timeoutMs, true);
+}
+
+// The same results as esp-mqtt's SSL transport
+static int tlsRead(esp_transport_handle_t t, char* buffer, int len, int timeoutMs)
+{
+    TlsConnection* c = esp_transport_get_context_data(t);
+    int poll = tlsPoll(c, timeoutMs, false);
+    if (poll < 0) { return ERR_TCP_TRANSPORT_CONNECTION_FAILED; }
+    if (poll == 0) { return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT; }
+    int ret = esp_tls_conn_read(c->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) { return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT; }
+    if (ret == 0) { return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN; }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : ret;
+}
+
+static int tlsWrite(esp_transport_handle_t t, const char* buffer, int len, int timeoutMs)
+{
+    TlsConnection* c = esp_transport_get_context_data(t);
+    int poll = tlsPoll(c, timeoutMs, true);
+    if (poll <= 0) { return poll; }
+    int ret = esp_tls_conn_write(c->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_WRITE) { return 0; }
+    return ret < 0 ? -1 : ret;
+}
+
+// The session outlives the connection
+static int tlsClose(esp_transport_handle_t t)
+{
+    TlsConnection* c = esp_transport_get_context_data(t);
+    if (c->tls != NULL) {
+        esp_tls_conn_destroy(c->tls);
+        c->tls = NULL;
+    }
+    return 0;
+}
+
+static int tlsDestroy(esp_transport_handle_t t)
+{
+    tlsClose(t);
+    free(esp_transport_get_context_data(t));
+    return 0;
+}
+
+esp_transport_handle_t MqttTls_Transport(int broker, const esp_mqtt_client_config_t* cfg)
+{
+    TlsConnection* c = calloc(1, sizeof(TlsConnection));
+    if (c == NULL) { return NULL; }
+    esp_transport_handle_t t = esp_transport_init();
+    if (t == NULL) {
+        free(c);
+        return NULL;
+    }
+
+    c->broker = broker;
+    c->cfg.crt_bundle_attach = cfg->broker.verification.crt_bundle_attach;
+    c->cfg.psk_hint_key = cfg->broker.verification.psk_hint_key;
+    if (cfg->broker.verification.certificate != NULL) {
+        c->cfg.cacert_buf = (const unsigned char*)cfg->broker.verification.certificate;
+        c->cfg.cacert_bytes = strlen(cfg->broker.verification.certificate) + 1;   // PEM, with its terminator
+    }
+    esp_transport_set_context_data(t, c);
+    esp_transport_set_func(t, tlsConnect, tlsRead, tlsWrite, tlsClose, tlsPollRead, tlsPollWrite, tlsDestroy);
+    return t;
+}
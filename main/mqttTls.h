@@ -0,0 +1,35 @@
+/* MQTT Alarm Controller: Broker TLS transport
+
+   An esp_transport for mqtts:// brokers that keeps each broker's TLS
+   session, so a reconnect resumes it with a session ticket instead of
+   paying for a full handshake.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __MQTTTLS_H__
+#define __MQTTTLS_H__
+
+#include "esp_transport.h"
+#include "mqtt_client.h"
+
+void MqttTls_Initialise(void);
+
+// A transport for one client of the broker, verified as cfg->broker.verification says. The
+// client destroys it.
+esp_transport_handle_t MqttTls_Transport(int broker, const esp_mqtt_client_config_t* cfg);
+
+#endif // #ifndef __MQTTTLS_H__
@@ -0,0 +1,295 @@
+/* MQTT Alarm Controller: Network address
+
+   Three ways to an address, in order of preference:
+
+   Static, when config.staticIp is set. The address is set before the
+   driver starts, so it's there the moment the link comes up.
+
+   Cached, when there's no static address but a lease from an earlier
+   boot is in storage. DHCP is held back at link up while the address
+   is probed as RFC 5227 has it: NET_LEASE_PROBES ARP requests for it
+   from 0.0.0.0, NET_LEASE_PROBE_MS apart, which nobody may answer.
+   That's quicker than the RFC's 1 to 2 s probe spacing, as the lease
+   is the one the server gave this MAC last time. An answer drops the
+   lease. Otherwise DHCP starts in INIT-REBOOT with the cached address,
+   a single DHCPREQUEST for it, rather than the DISCOVER, OFFER,
+   REQUEST, ACK round, and the server ACKs it or NAKs it if it's moved
+   on, when lwIP falls back to DISCOVER. lwIP's own
+   LWIP_DHCP_RESTORE_LAST_IP copy of the last address normally agrees
+   with the cache; if it doesn't, or has none, the cached one is asked
+   for instead.
+
+   DHCP otherwise, and every lease it gives is saved for the next boot.
+
+   The lease is kept as text, "ip netmask gateway dns leaseSeconds", the
+   addresses in hex as lwIP holds them.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_netif_net_stack.h"
+#include "esp_timer.h"
+#include "lwip/etharp.h"
+#include "lwip/dhcp.h"
+#include "lwip/tcpip.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "netAddress.h"
+
+#define LEASE_FILENAME "lease.txt"
+
+typedef struct {
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gateway;
+    uint32_t dns;
+    uint32_t leaseS;
+} IpLease;
+
+static esp_netif_t* ethNetif = NULL;
+static NetAddressMode mode = NET_ADDRESS_DHCP;
+static IpLease lease;                       // The cached lease, or the last one saved
+static esp_timer_handle_t probeTimer = NULL;
+static bool probePending = false;           // A cached lease waiting for the first link up
+static int probesSent = 0;                  // lwIP thread only
+
+static Metric addressMode = METRIC_GAUGE_INIT("alarm_net_address_mode", "How the address was set (0 DHCP, 1 cached lease, 2 static)");
+static Metric leaseRejects = METRIC_COUNTER_INIT("alarm_net_cached_lease_rejected_total", "Cached leases dropped after an ARP probe was answered");
+
+/******************************************************************
+ *
+ * Lease storage
+ *
+*******************************************************************/
+static bool loadLease(IpLease* l)
+{
+    char text[64];
+    int len = Hal_StorageRead(LEASE_FILENAME, text, sizeof(text) - 1);
+    if (len <= 0) { return false; }
+    text[len] = '\0';
+    if (sscanf(text, "%" SCNx32 " %" SCNx32 " %" SCNx32 " %" SCNx32 " %" SCNu32,
+               &l->ip, &l->netmask, &l->gateway, &l->dns, &l->leaseS) != 5) { return false; }
+    return l->ip != 0 && l->netmask != 0;
+}
+
+// Only written when the lease changes, renewals of the same one don't wear the flash
+static void saveLease(const IpLease* l)
+{
+    char text[64];
+    if (memcmp(l, &lease, sizeof(lease)) == 0) { return; }
+    lease = *l;
+    int len = sprintf(text, "%08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %" PRIu32,
+                      l->ip, l->netmask, l->gateway, l->dns, l->leaseS);
+    if (!Hal_StorageWrite(LEASE_FILENAME, text, len)) { ESP_LOGW(TAG, "Couldn't save the DHCP lease."); }
+}
+
+/******************************************************************
+ *
+ * Switching between a set address and DHCP
+ *
+*******************************************************************/
+static void setMode(NetAddressMode m)
+{
+    mode = m;
+    Metrics_Set(&addressMode, m);
+}
+
+static void setAddress(uint32_t ip, uint32_t netmask, uint32_t gateway, uint32_t dns)
+{
+    esp_err_t err = esp_netif_dhcpc_stop(ethNetif);
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) {
+        ESP_LOGE(TAG, "Couldn't stop DHCP: %s", esp_err_to_name(err));
+    }
+    esp_netif_ip_info_t info = { .ip.addr = ip, .netmask.addr = netmask, .gw.addr = gateway };
+    ESP_ERROR_CHECK(esp_netif_set_ip_info(ethNetif, &info));
+    if (dns != 0) {
+        esp_netif_dns_info_t dnsInfo = { .ip.u_addr.ip4.addr = dns, .ip.type = ESP_IPADDR_TYPE_V4 };
+        esp_netif_set_dns_info(ethNetif, ESP_NETIF_DNS_MAIN, &dnsInfo);
+    }
+}
+
+static void startDhcp(void)
+{
+    esp_err_t err = esp_netif_dhcpc_start(ethNetif);
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED) {
+        ESP_LOGE(TAG, "Couldn't start DHCP: %s", esp_err_to_name(err));
+    }
+}
+
+/******************************************************************
+ *
+ * Cached lease probe and INIT-REBOOT. The ARP and DHCP calls have
+ * to be made on the lwIP thread, so these run there by
+ * tcpip_callback().
+ *
+*******************************************************************/
+// DHCP has started, with lwIP's restored address if it had one. Ask for the cached lease unless
+// it's already asking for that.
+static void requestCachedLease(void)
+{
+    struct netif* lwipNetif = esp_netif_get_netif_impl(ethNetif);
+    struct dhcp* dhcp = netif_dhcp_data(lwipNetif);
+    if (dhcp == NULL) { return; }
+    if (dhcp->state == DHCP_STATE_REBOOTING && ip4_addr_get_u32(&dhcp->offered_ip_addr) == lease.ip) { return; }
+    ip4_addr_set_u32(&dhcp->offered_ip_addr, lease.ip);
+    ip4_addr_set_u32(&dhcp->offered_sn_mask, lease.netmask);
+    ip4_addr_set_u32(&dhcp->offered_gw_addr, lease.gateway);
+    dhcp->state = DHCP_STATE_REBOOTING;
+    dhcp_network_changed(lwipNetif);
+}
+
+// The interface has no address yet, so the request goes out from 0.0.0.0, a probe rather than
+// an announcement. etharp_query() makes an ARP entry for the address, which an answer fills in.
+static void probeStep(void* arg)
+{
+    struct netif* lwipNetif = esp_netif_get_netif_impl(ethNetif);
+    ip4_addr_t own = { .addr = lease.ip };
+
+    if (probesSent < NET_LEASE_PROBES) {
+        etharp_query(lwipNetif, &own, NULL);
+        probesSent++;
+        esp_timer_start_once(probeTimer, NET_LEASE_PROBE_MS * 1000);
+        return;
+    }
+
+    struct eth_addr* mac;
+    const ip4_addr_t* found;
+    if (etharp_find_addr(lwipNetif, &own, &mac, &found) >= 0) {
+        ESP_LOGW(TAG, "Cached lease " IPSTR " is in use by %02x:%02x:%02x:%02x:%02x:%02x, dropped for DHCP.", IP2STR(&own),
+                 mac->addr[0], mac->addr[1], mac->addr[2], mac->addr[3], mac->addr[4], mac->addr[5]);
+        Metrics_Increment(&leaseRejects);
+        memset(&lease, 0, sizeof(lease));
+        setMode(NET_ADDRESS_DHCP);
+        startDhcp();
+        return;
+    }
+    ESP_LOGI(TAG, "Nobody answered for the cached lease " IPSTR ", asking DHCP for it again.", IP2STR(&own));
+    startDhcp();
+    requestCachedLease();
+}
+
+static void probeTimerCallback(void* arg)
+{
+    tcpip_callback(probeStep, NULL);
+}
+
+/******************************************************************
+ *
+ * The link's up. Start probing a cached lease, the first time only.
+ * Called from the Ethernet event handler.
+ *
+*******************************************************************/
+void NetAddress_LinkUp(void)
+{
+    if (!probePending) { return; }
+    probePending = false;
+    probesSent = 0;
+    if (tcpip_callback(probeStep, NULL) != 0) {
+        ESP_LOGE(TAG, "Couldn't probe the cached lease, starting DHCP.");
+        startDhcp();
+    }
+}
+
+/******************************************************************
+ *
+ * Got an address. Save a DHCP one, from a cached lease's
+ * INIT-REBOOT or otherwise. Called from the IP event handler.
+ *
+*******************************************************************/
+void NetAddress_GotIp(const esp_netif_ip_info_t* ipInfo)
+{
+    if (mode == NET_ADDRESS_CACHED && ipInfo->ip.addr != lease.ip) {
+        ESP_LOGI(TAG, "DHCP gave " IPSTR " rather than the cached lease.", IP2STR(&ipInfo->ip));
+    }
+    if (mode != NET_ADDRESS_STATIC) {
+        struct dhcp* dhcp = netif_dhcp_data((struct netif*)esp_netif_get_netif_impl(ethNetif));
+        esp_netif_dns_info_t dnsInfo = { 0 };
+        esp_netif_get_dns_info(ethNetif, ESP_NETIF_DNS_MAIN, &dnsInfo);
+        IpLease l = {
+            .ip = ipInfo->ip.addr,
+            .netmask = ipInfo->netmask.addr,
+            .gateway = ipInfo->gw.addr,
+            .dns = dnsInfo.ip.u_addr.ip4.addr,
+            .leaseS = dhcp != NULL && dhcp->offered_t0_lease != 0 ? dhcp->offered_t0_lease : NET_LEASE_DEFAULT_S,
+        };
+        saveLease(&l);
+    }
+}
+
+NetAddressMode NetAddress_Mode(void)
+{
+    return mode;
+}
+
+const char* NetAddress_ModeName(void)
+{
+    switch (mode) {
+        case NET_ADDRESS_CACHED: return "cached lease";
+        case NET_ADDRESS_STATIC: return "static";
+        default: return "DHCP";
+    }
+}
+
+/******************************************************************
+ *
+ * Set the interface up before the driver starts
+ *
+*******************************************************************/
+void NetAddress_Configure(esp_netif_t* netif)
+{
+    Metrics_Register(&addressMode);
+    Metrics_Register(&leaseRejects);
+    ethNetif = netif;
+
+    const esp_timer_create_args_t probeArgs = { .callback = probeTimerCallback, .name = "leaseProbe" };
+    ESP_ERROR_CHECK(esp_timer_create(&probeArgs, &probeTimer));
+
+    if (config.staticIp[0] != '\0') {
+        uint32_t ip = esp_ip4addr_aton(config.staticIp);
+        uint32_t netmask = esp_ip4addr_aton(config.staticNetmask);
+        if (ip != 0 && ip != IPADDR_NONE && netmask != 0) {
+            setAddress(ip, netmask, esp_ip4addr_aton(config.staticGateway),
+                       config.staticDns[0] != '\0' ? esp_ip4addr_aton(config.staticDns) : 0);
+            setMode(NET_ADDRESS_STATIC);
+            ESP_LOGI(TAG, "Static address %s.", config.staticIp);
+            return;
+        }
+        ESP_LOGE(TAG, "Static address %s/%s isn't valid, using DHCP.", config.staticIp, config.staticNetmask);
+    }
+
+    memset(&lease, 0, sizeof(lease));
+    IpLease cached;
+    if (loadLease(&cached)) {
+        // DHCP waits for the probe at link up
+        lease = cached;
+        esp_err_t err = esp_netif_dhcpc_stop(ethNetif);
+        if (err == ESP_OK || err == ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) {
+            probePending = true;
+            setMode(NET_ADDRESS_CACHED);
+            ESP_LOGI(TAG, "Cached lease " IPSTR ", probing it at link up.", IP2STR((esp_ip4_addr_t*)&lease.ip));
+            return;
+        }
+        ESP_LOGE(TAG, "Couldn't hold DHCP back for the cached lease: %s", esp_err_to_name(err));
+    }
+    setMode(NET_ADDRESS_DHCP);
+}
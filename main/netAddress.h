@@ -0,0 +1,43 @@
+/* MQTT Alarm Controller: Network address
+
+   How the Ethernet interface gets its address: a fixed address from
+   the config, DHCP asking for the lease from the last boot, or DHCP.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __NETADDRESS_H__
+#define __NETADDRESS_H__
+
+#include "esp_netif.h"
+
+#define NET_LEASE_PROBES 2              // ARP probes for a cached lease's address before asking DHCP for it
+#define NET_LEASE_PROBE_MS 150          // Between the probes, and after the last for an answer
+#define NET_LEASE_DEFAULT_S 3600        // Lease time to assume if DHCP didn't give one
+
+typedef enum {
+    NET_ADDRESS_DHCP = 0,
+    NET_ADDRESS_CACHED = 1,             // Last boot's DHCP lease, probed and then asked for by INIT-REBOOT
+    NET_ADDRESS_STATIC = 2,
+} NetAddressMode;
+
+void NetAddress_Configure(esp_netif_t* netif);
+void NetAddress_LinkUp(void);
+void NetAddress_GotIp(const esp_netif_ip_info_t* ipInfo);
+NetAddressMode NetAddress_Mode(void);
+const char* NetAddress_ModeName(void);
+
+#endif // #ifndef __NETADDRESS_H__
@@ -0,0 +1,351 @@
+/* MQTT Alarm Controller: Network supervisor
+
+   The Ethernet and MQTT event handlers report the link, the IP address
+   and the broker connection here, as bits in an event group. One task
+   waits on the group and owns the broker reconnects; the MQTT client's
+   own retry, every 250 ms whatever the network was doing, is disabled.
+
+   While the link is down or there's no address nothing is attempted,
+   the task just blocks on the group. When the link comes back or DHCP
+   gives an address, the broker is tried straight away. While the broker
+   is down the attempts back off exponentially from NET_BACKOFF_MIN_MS to
+   NET_BACKOFF_MAX_MS, each a random time between half and all of the
+   step, so a houseful of devices don't all retry at once after the
+   broker restarts.
+
+   A reconnect storm, for stress testing, drops the broker connection as
+   soon as it's made, a given number of times, reconnecting straight
+   away each time rather than backing off.
+
+   A failover to another broker, chosen on the main loop, is made here
+   too, as destroying the old client waits for its task. The alarm
+   loop's watchdog doesn't wait with it, and the client's only changed
+   on the task that reconnects it.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "inttypes.h"
+
+#include "defines.h"
+#include "hal.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "mqttClient.h"
+#include "netAddress.h"
+#include "netSupervisor.h"
+#include "power.h"
+#include "taskPlan.h"
+
+// State
+#define NET_LINK_UP_BIT         (1 << 0)
+#define NET_GOT_IP_BIT          (1 << 1)
+#define NET_MQTT_STARTED_BIT    (1 << 2)
+#define NET_MQTT_CONNECTED_BIT  (1 << 3)
+// Events for the task, cleared as it wakes
+#define NET_RETRY_NOW_BIT       (1 << 4)    // Link back or new address, try the broker now
+#define NET_MQTT_RESULT_BIT     (1 << 5)    // A connection attempt finished, or the connection was lost
+#define NET_CHANGED_BIT         (1 << 6)
+#define NET_SELECT_BROKER_BIT   (1 << 7)    // The failover chose another broker
+#define NET_WAKE_BITS (NET_RETRY_NOW_BIT | NET_MQTT_RESULT_BIT | NET_CHANGED_BIT | NET_SELECT_BROKER_BIT)
+
+static EventGroupHandle_t netEvents = NULL;
+static atomic_int stormRemaining = 0;
+
+#define BOOT_TIMING_FILENAME "bootTiming.txt"  // The last boot's timing with each address mode
+#define BOOT_TIMING_MODES 3
+
+// Boot phase times, uptime in us, 0 until they happen
+static int64_t bootLinkUpUs = 0;
+static int64_t bootGotIpUs = 0;
+static int64_t bootMqttUs = 0;
+
+static Metric netAttempts = METRIC_COUNTER_INIT("alarm_net_mqtt_attempts_total", "Broker connection attempts made by the network supervisor");
+static Metric netBackoff = METRIC_GAUGE_INIT("alarm_net_backoff_ms", "Current broker retry backoff, 0 when connected");
+static Metric bootLinkUp = METRIC_GAUGE_INIT("alarm_boot_link_up_ms", "Time from boot to the first Ethernet link up");
+static Metric bootGotIp = METRIC_GAUGE_INIT("alarm_boot_got_ip_ms", "Time from boot to the first IP address");
+static Metric bootIpAfterLink = METRIC_GAUGE_INIT("alarm_boot_ip_after_link_ms", "Time from the first link up to the first IP address");
+static Metric bootMqtt = METRIC_GAUGE_INIT("alarm_boot_mqtt_connected_ms", "Time from boot to the first broker connection");
+
+/******************************************************************
+ *
+ * The next retry delay, a random time between half and all of the
+ * exponential step
+ *
+*******************************************************************/
+static uint32_t backoffMs(int failures)
+{
+    uint32_t step = NET_BACKOFF_MAX_MS;
+    if (failures < 16) {
+        step = NET_BACKOFF_MIN_MS << failures;
+        if (step > NET_BACKOFF_MAX_MS) { step = NET_BACKOFF_MAX_MS; }
+    }
+    return step / 2 + esp_random() % (step / 2 + 1);
+}
+
+static TickType_t ticksUntil(int64_t us, int64_t now)
+{
+    return pdMS_TO_TICKS((us - now + 999) / 1000) + 1;
+}
+
+// A connection attempt's TCP, TLS and MQTT CONNECT run at full clock
+static void setAttempt(bool* attemptPending, bool pending)
+{
+    if (*attemptPending == pending) { return; }
+    *attemptPending = pending;
+    if (pending) { Power_Acquire(POWER_NETWORK); }
+    else { Power_Release(POWER_NETWORK); }
+}
+
+/******************************************************************
+ *
+ * Supervisor task. Blocks on the event group, with a timeout only
+ * while a retry or an attempt's result is due.
+ *
+*******************************************************************/
+static void netSupervisorTask(void* arg)
+{
+    int failures = 0;
+    bool started = false;
+    bool attemptPending = false;
+    int64_t nextAttemptUs = 0;
+    int64_t attemptTimeoutUs = 0;
+    bool stormDisconnecting = false;
+    TickType_t wait = portMAX_DELAY;
+
+    while (true) {
+        EventBits_t bits = xEventGroupWaitBits(netEvents, NET_WAKE_BITS, pdTRUE, pdFALSE, wait);
+        int64_t now = esp_timer_get_time();
+
+        // The old broker's loss wakes the task again as a result, the state's what it is after the change
+        if (bits & NET_SELECT_BROKER_BIT) {
+            MqttClient_SwitchBroker();
+            bits = (bits & NET_WAKE_BITS) | (xEventGroupGetBits(netEvents) & ~NET_WAKE_BITS);
+        }
+
+        // The client tries once as it starts
+        if (!started && (bits & NET_MQTT_STARTED_BIT)) {
+            started = true;
+            setAttempt(&attemptPending, true);
+            attemptTimeoutUs = now + (int64_t)NET_ATTEMPT_TIMEOUT_MS * 1000;
+        }
+        if (bits & NET_MQTT_CONNECTED_BIT) {
+            failures = 0;
+            setAttempt(&attemptPending, false);
+            Metrics_Set(&netBackoff, 0);
+        } else if ((bits & NET_MQTT_RESULT_BIT) && stormDisconnecting) {
+            stormDisconnecting = false;
+            setAttempt(&attemptPending, false);
+            nextAttemptUs = now;
+        } else if (bits & NET_MQTT_RESULT_BIT) {
+            uint32_t delay = backoffMs(failures++);
+            setAttempt(&attemptPending, false);
+            nextAttemptUs = now + (int64_t)delay * 1000;
+            Metrics_Set(&netBackoff, delay);
+            ESP_LOGI(TAG, "Broker connection failed, retrying in %" PRIu32 " ms.", delay);
+        }
+        if (bits & NET_RETRY_NOW_BIT) {
+            failures = 0;
+            nextAttemptUs = now;
+        }
+        if (attemptPending && now >= attemptTimeoutUs) {
+            ESP_LOGW(TAG, "No result from the broker connection attempt, retrying.");
+            setAttempt(&attemptPending, false);
+        }
+
+        if ((bits & NET_MQTT_CONNECTED_BIT) && !stormDisconnecting && atomic_load(&stormRemaining) > 0) {
+            atomic_fetch_sub(&stormRemaining, 1);
+            stormDisconnecting = true;
+            MqttClient_Disconnect();
+        }
+
+        // Only try the broker when there's a network to reach it over
+        wait = portMAX_DELAY;
+        bool networkUp = (bits & NET_LINK_UP_BIT) && (bits & NET_GOT_IP_BIT);
+        if (!started || (bits & NET_MQTT_CONNECTED_BIT) || !networkUp) { continue; }
+        if (attemptPending) {
+            wait = ticksUntil(attemptTimeoutUs, now);
+        } else if (now >= nextAttemptUs) {
+            Metrics_Increment(&netAttempts);
+            FlightRecorder_Record(FR_MQTT_RECONNECT, failures, 0);
+            setAttempt(&attemptPending, true);
+            MqttClient_Reconnect();
+            attemptTimeoutUs = now + (int64_t)NET_ATTEMPT_TIMEOUT_MS * 1000;
+            wait = ticksUntil(attemptTimeoutUs, now);
+        } else {
+            wait = ticksUntil(nextAttemptUs, now);
+        }
+    }
+}
+
+/******************************************************************
+ *
+ * Waits for app_main's start up
+ *
+*******************************************************************/
+bool NetSupervisor_WaitForIp(uint32_t timeoutMs)
+{
+    return xEventGroupWaitBits(netEvents, NET_GOT_IP_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeoutMs)) & NET_GOT_IP_BIT;
+}
+
+bool NetSupervisor_WaitForMqtt(uint32_t timeoutMs)
+{
+    return xEventGroupWaitBits(netEvents, NET_MQTT_CONNECTED_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeoutMs)) & NET_MQTT_CONNECTED_BIT;
+}
+
+/******************************************************************
+ *
+ * Reconnect storm, count broker disconnects each followed straight
+ * away by a reconnect. 0 stops one that's running.
+ *
+*******************************************************************/
+void NetSupervisor_ReconnectStorm(int count)
+{
+    atomic_store(&stormRemaining, count);
+    xEventGroupSetBits(netEvents, NET_CHANGED_BIT);
+}
+
+int NetSupervisor_StormRemaining(void)
+{
+    return atomic_load(&stormRemaining);
+}
+
+/******************************************************************
+ *
+ * Boot phase timing, the first of each event
+ *
+*******************************************************************/
+static void bootPhase(int64_t* phaseUs, Metric* metric)
+{
+    if (*phaseUs != 0) { return; }
+    *phaseUs = esp_timer_get_time();
+    Metrics_Set(metric, (int32_t)(*phaseUs / 1000));
+}
+
+// Logs this boot's timing and the last boot's with each address mode, so DHCP from scratch can be
+// compared with the cached lease, then saves this one for the next boot
+static void logBootTiming(void)
+{
+    int64_t afterLinkMs = bootLinkUpUs != 0 && bootGotIpUs >= bootLinkUpUs ? (bootGotIpUs - bootLinkUpUs) / 1000 : -1;
+    Metrics_Set(&bootIpAfterLink, (int32_t)afterLinkMs);
+    ESP_LOGI(TAG, "Boot timing: link up %" PRIi64 " ms, address %" PRIi64 " ms (%" PRIi64 " ms after link up, %s), broker %" PRIi64 " ms",
+             bootLinkUpUs / 1000, bootGotIpUs / 1000, afterLinkMs, NetAddress_ModeName(), bootMqttUs / 1000);
+
+    // Per mode: the address after link up and the broker connection, in ms, -1 if never seen
+    int32_t last[BOOT_TIMING_MODES][2];
+    char text[80];
+    memset(last, 0xff, sizeof(last));
+    int len = Hal_StorageRead(BOOT_TIMING_FILENAME, text, sizeof(text) - 1);
+    if (len > 0) {
+        text[len] = '\0';
+        sscanf(text, "%" SCNi32 " %" SCNi32 " %" SCNi32 " %" SCNi32 " %" SCNi32 " %" SCNi32,
+               &last[0][0], &last[0][1], &last[1][0], &last[1][1], &last[2][0], &last[2][1]);
+    }
+    ESP_LOGI(TAG, "Last boots: DHCP address %" PRIi32 " ms after link up, broker %" PRIi32 " ms; cached lease %" PRIi32
+             " ms, broker %" PRIi32 " ms; static %" PRIi32 " ms, broker %" PRIi32 " ms",
+             last[0][0], last[0][1], last[1][0], last[1][1], last[2][0], last[2][1]);
+
+    NetAddressMode mode = NetAddress_Mode();
+    last[mode][0] = (int32_t)afterLinkMs;
+    last[mode][1] = (int32_t)(bootMqttUs / 1000);
+    len = snprintf(text, sizeof(text), "%" PRIi32 " %" PRIi32 " %" PRIi32 " %" PRIi32 " %" PRIi32 " %" PRIi32,
+                   last[0][0], last[0][1], last[1][0], last[1][1], last[2][0], last[2][1]);
+    if (len > 0 && len < sizeof(text)) { Hal_StorageWrite(BOOT_TIMING_FILENAME, text, len); }
+}
+
+/******************************************************************
+ *
+ * Network events
+ *
+*******************************************************************/
+void NetSupervisor_LinkUp(void)
+{
+    bootPhase(&bootLinkUpUs, &bootLinkUp);
+    xEventGroupSetBits(netEvents, NET_LINK_UP_BIT | NET_RETRY_NOW_BIT);
+}
+
+void NetSupervisor_LinkDown(void)
+{
+    xEventGroupClearBits(netEvents, NET_LINK_UP_BIT);
+    xEventGroupSetBits(netEvents, NET_CHANGED_BIT);
+}
+
+void NetSupervisor_GotIp(void)
+{
+    bootPhase(&bootGotIpUs, &bootGotIp);
+    xEventGroupSetBits(netEvents, NET_GOT_IP_BIT | NET_RETRY_NOW_BIT);
+}
+
+void NetSupervisor_LostIp(void)
+{
+    xEventGroupClearBits(netEvents, NET_GOT_IP_BIT);
+    xEventGroupSetBits(netEvents, NET_CHANGED_BIT);
+}
+
+void NetSupervisor_MqttStarted(void)
+{
+    xEventGroupSetBits(netEvents, NET_MQTT_STARTED_BIT | NET_CHANGED_BIT);
+}
+
+void NetSupervisor_MqttConnected(void)
+{
+    if (bootMqttUs == 0) {
+        bootPhase(&bootMqttUs, &bootMqtt);
+        logBootTiming();
+    }
+    xEventGroupSetBits(netEvents, NET_MQTT_CONNECTED_BIT | NET_MQTT_RESULT_BIT);
+}
+
+// A failed attempt as well as a lost connection, the client reports both as a disconnect
+void NetSupervisor_MqttDisconnected(void)
+{
+    xEventGroupClearBits(netEvents, NET_MQTT_CONNECTED_BIT);
+    xEventGroupSetBits(netEvents, NET_MQTT_RESULT_BIT);
+}
+
+// From the main loop, see MqttClient_SwitchBroker()
+void NetSupervisor_BrokerSelected(void)
+{
+    xEventGroupSetBits(netEvents, NET_SELECT_BROKER_BIT);
+}
+
+/******************************************************************
+ *
+ * Start the supervisor. Call before the Ethernet and MQTT start, so
+ * it sees all their events.
+ *
+*******************************************************************/
+void NetSupervisor_Start(void)
+{
+    Metrics_Register(&netAttempts);
+    Metrics_Register(&netBackoff);
+    Metrics_Register(&bootLinkUp);
+    Metrics_Register(&bootGotIp);
+    Metrics_Register(&bootIpAfterLink);
+    Metrics_Register(&bootMqtt);
+
+    netEvents = xEventGroupCreate();
+    xTaskCreatePinnedToCore(netSupervisorTask, "netSupervisor", 4096, NULL, NET_SUPERVISOR_PRIORITY, NULL, NETWORK_CORE);
+}
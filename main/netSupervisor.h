@@ -0,0 +1,49 @@
+/* MQTT Alarm Controller: Network supervisor
+
+   Tracks the Ethernet link, the IP address and the broker connection in
+   an event group, decides when the MQTT client tries to connect and
+   makes the failovers to another broker.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __NETSUPERVISOR_H__
+#define __NETSUPERVISOR_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+
+#define NET_BACKOFF_MIN_MS 1000         // First retry after a failed broker connection
+#define NET_BACKOFF_MAX_MS 60000        // Retries back off to this at most
+#define NET_ATTEMPT_TIMEOUT_MS 30000    // Give up waiting for the result of a connection attempt after this
+
+void NetSupervisor_Start(void);
+bool NetSupervisor_WaitForIp(uint32_t timeoutMs);
+bool NetSupervisor_WaitForMqtt(uint32_t timeoutMs);
+void NetSupervisor_ReconnectStorm(int count);
+int NetSupervisor_StormRemaining(void);
+
+// Network events, called by the Ethernet and MQTT event handlers
+void NetSupervisor_LinkUp(void);
+void NetSupervisor_LinkDown(void);
+void NetSupervisor_GotIp(void);
+void NetSupervisor_LostIp(void);
+void NetSupervisor_MqttStarted(void);
+void NetSupervisor_MqttConnected(void);
+void NetSupervisor_MqttDisconnected(void);
+void NetSupervisor_BrokerSelected(void);
+
+#endif // #ifndef __NETSUPERVISOR_H__
@@ -0,0 +1,431 @@
+/* MQTT Alarm Controller: Firmware updates
+
+   The flash holds two app slots, ota_0 and ota_1. An update streams the
+   new image over HTTPS into whichever slot isn't running, a sector at
+   a time, so nothing bigger than a few blocks is ever held in RAM.
+
+   Two tasks, on the network core. The download task reads the
+   image into OTA_BLOCK_LEN blocks, hashing as it goes, and queues them
+   for the writer task, which erases and writes them while the next ones
+   are downloading. Flash erases and writes stall the caches and with
+   them the main loop, so the writer takes at most one block per main
+   loop pass, started as the pass ends, and the stall mostly lands in the
+   loop's sleep. The longest write is kept as a metric to check that
+   against the loop budget.
+
+   Once the whole image is written its SHA-256 must match the one given
+   with the command, and the image itself must pass the ESP-IDF checks,
+   before the new slot is made the boot slot and the controller restarts.
+
+   The bootloader starts a new image as pending verification. If it
+   doesn't reach the broker within OTA_VALIDATE_TIMEOUT_S, or it resets
+   before it does, the bootloader goes back to the previous image.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "inttypes.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "mbedtls/sha256.h"
+
+#include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "mqttProcess.h"
+#include "ota.h"
+#include "power.h"
+#include "taskPlan.h"
+
+extern const char *TAG;
+
+typedef struct {
+    int len;                            // 0 marks the end of the image
+    uint8_t data[OTA_BLOCK_LEN];
+} OtaBlock;
+
+// Flight recorder stages, arg0 of FR_OTA
+#define OTA_FR_STARTED 0
+#define OTA_FR_WRITTEN 1                // arg1: bytes
+#define OTA_FR_FAILED 2
+#define OTA_FR_VALIDATED 3
+#define OTA_FR_ROLLING_BACK 4
+#define OTA_FR_ROLLED_BACK 5
+
+static atomic_bool updating = false;
+static atomic_bool pendingVerify = false;
+static char otaUrl[OTA_URL_LEN];
+static uint8_t expectedHash[32];
+
+static QueueHandle_t freeBlocks = NULL;
+static QueueHandle_t fullBlocks = NULL;
+static SemaphoreHandle_t loopDone = NULL;
+static SemaphoreHandle_t writerDone = NULL;
+static esp_timer_handle_t validateTimer = NULL;
+
+// Writer state, the writer task's until it gives writerDone
+static esp_ota_handle_t otaHandle;
+static esp_err_t writeError;
+static int32_t bytesWritten;
+static int32_t writeMaxUs;
+static int64_t flashUs;
+
+static Metric otaState = METRIC_GAUGE_INIT("alarm_ota_state", "Firmware update state, 0 idle, 1 downloading, 2 rebooting, 3 failed, 4 pending verification");
+static Metric otaBytes = METRIC_GAUGE_INIT("alarm_ota_bytes", "Bytes of the firmware update written to flash");
+static Metric otaThroughput = METRIC_GAUGE_INIT("alarm_ota_throughput_bytes_per_second", "Firmware update rate, download to flash");
+static Metric otaDuration = METRIC_GAUGE_INIT("alarm_ota_duration_ms", "Duration of the last firmware update");
+static Metric otaWriteMax = METRIC_GAUGE_INIT("alarm_ota_write_max_us", "Longest single flash erase and write of the last firmware update");
+static Metric otaFailures = METRIC_COUNTER_INIT("alarm_ota_failures_total", "Firmware updates that failed");
+
+/******************************************************************
+ *
+ * Publishes the result of an update
+ *
+*******************************************************************/
+static void publishResult(const char* result, int64_t durationMs)
+{
+    char payload[256];
+    int32_t rate = durationMs > 0 ? (int32_t)((int64_t)bytesWritten * 1000 / durationMs) : 0;
+
+    int len = snprintf(payload, sizeof(payload),
+        "{\"event\":\"ota\",\"result\":\"%s\",\"bytes\":%" PRIi32 ",\"duration_ms\":%" PRIi64 ",\"bytes_per_s\":%" PRIi32
+        ",\"flash_ms\":%" PRIi64 ",\"write_max_us\":%" PRIi32 "}",
+        result, bytesWritten, durationMs, rate, flashUs / 1000, writeMaxUs);
+    if (len > 0 && len < sizeof(payload)) { SendDiagnosticEvent(payload, len); }
+    ESP_LOGI(TAG, "Firmware update %s: %" PRIi32 " bytes in %" PRIi64 " ms, %" PRIi32 " bytes/s, %" PRIi64 " ms writing flash, longest write %" PRIi32 " us",
+             result, bytesWritten, durationMs, rate, flashUs / 1000, writeMaxUs);
+}
+
+/******************************************************************
+ *
+ * Writes the downloaded blocks to flash, one per main loop pass. Waits
+ * for the end of a pass, rather than taking a give left over from an
+ * earlier one, so the stall starts as the loop goes to sleep.
+ *
+*******************************************************************/
+static void otaWriterTask(void* arg)
+{
+    OtaBlock* block;
+
+    for (;;) {
+        xQueueReceive(fullBlocks, &block, portMAX_DELAY);
+        if (block->len == 0) { break; }
+        if (writeError == ESP_OK) {
+            xSemaphoreTake(loopDone, 0);
+            xSemaphoreTake(loopDone, pdMS_TO_TICKS(OTA_LOOP_WAIT_MS));
+            int64_t start = esp_timer_get_time();
+            writeError = esp_ota_write(otaHandle, block->data, block->len);
+            int32_t us = (int32_t)(esp_timer_get_time() - start);
+            flashUs += us;
+            if (us > writeMaxUs) { writeMaxUs = us; Metrics_Set(&otaWriteMax, us); }
+            if (writeError == ESP_OK) { bytesWritten += block->len; Metrics_Set(&otaBytes, bytesWritten); }
+        }
+        xQueueSend(freeBlocks, &block, portMAX_DELAY);
+    }
+    xQueueSend(freeBlocks, &block, portMAX_DELAY);
+    xSemaphoreGive(writerDone);
+    vTaskDelete(NULL);
+}
+
+/******************************************************************
+ *
+ * Reads the image into blocks for the writer, hashing it on the way.
+ * Always finishes with the end marker, so the writer stops. Returns
+ * NULL, or why the download failed.
+ *
+*******************************************************************/
+static const char* streamImage(esp_http_client_handle_t client, mbedtls_sha256_context* sha, int64_t start)
+{
+    const char* failure = NULL;
+    OtaBlock* block;
+
+    for (;;) {
+        xQueueReceive(freeBlocks, &block, portMAX_DELAY);
+        block->len = 0;
+        if (writeError != ESP_OK) { failure = "flash write failed"; break; }
+        while (block->len < OTA_BLOCK_LEN) {
+            int n = esp_http_client_read(client, (char*)block->data + block->len, OTA_BLOCK_LEN - block->len);
+            if (n < 0) { failure = "download failed"; break; }
+            if (n == 0) { break; }
+            block->len += n;
+        }
+        if (failure != NULL || block->len == 0) { break; }
+        mbedtls_sha256_update(sha, block->data, block->len);
+        xQueueSend(fullBlocks, &block, portMAX_DELAY);
+
+        int64_t ms = (esp_timer_get_time() - start) / 1000;
+        if (ms > 0) { Metrics_Set(&otaThroughput, (int32_t)((int64_t)bytesWritten * 1000 / ms)); }
+    }
+    block->len = 0;
+    xQueueSend(fullBlocks, &block, portMAX_DELAY);
+    return failure;
+}
+
+/******************************************************************
+ *
+ * Downloads the image into the next slot and checks it. Returns NULL
+ * with the slot ready to boot, or why the update failed.
+ *
+*******************************************************************/
+static const char* runUpdate(int64_t start)
+{
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL) { return "no update partition"; }
+
+    esp_http_client_config_t httpConfig = {
+        .url = otaUrl,
+        .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&httpConfig);
+    if (client == NULL) { return "HTTP client failed"; }
+    if (esp_http_client_open(client, 0) != ESP_OK) { esp_http_client_cleanup(client); return "connect failed"; }
+    int64_t contentLength = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+    if (status != 200) {
+        ESP_LOGE(TAG, "Firmware download returned HTTP %d", status);
+        esp_http_client_cleanup(client);
+        return "HTTP error";
+    }
+    if (contentLength > partition->size) { esp_http_client_cleanup(client); return "image too big"; }
+
+    // Erased a sector at a time as it's written, not all up front
+    esp_err_t err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &otaHandle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed, %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        return "begin failed";
+    }
+    ESP_LOGI(TAG, "Firmware update to %s, %" PRIi64 " bytes from %s", partition->label, contentLength, otaUrl);
+
+    mbedtls_sha256_context sha;
+    uint8_t hash[32];
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    writeError = ESP_OK;
+    xTaskCreatePinnedToCore(otaWriterTask, "otaWriter", 3072, NULL, OTA_PRIORITY, NULL, NETWORK_CORE);
+    const char* failure = streamImage(client, &sha, start);
+    xSemaphoreTake(writerDone, portMAX_DELAY);
+    esp_http_client_cleanup(client);
+    mbedtls_sha256_finish(&sha, hash);
+    mbedtls_sha256_free(&sha);
+
+    if (failure == NULL && writeError != ESP_OK) { failure = "flash write failed"; }
+    if (failure == NULL && contentLength > 0 && bytesWritten != contentLength) { failure = "image truncated"; }
+    if (failure == NULL && memcmp(hash, expectedHash, sizeof(hash)) != 0) { failure = "SHA-256 mismatch"; }
+    if (failure != NULL) {
+        if (writeError != ESP_OK) { ESP_LOGE(TAG, "esp_ota_write failed, %s", esp_err_to_name(writeError)); }
+        esp_ota_abort(otaHandle);
+        return failure;
+    }
+
+    err = esp_ota_end(otaHandle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_end failed, %s", esp_err_to_name(err));
+        return "image invalid";
+    }
+    err = esp_ota_set_boot_partition(partition);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed, %s", esp_err_to_name(err));
+        return "set boot failed";
+    }
+    return NULL;
+}
+
+static void otaTask(void* arg)
+{
+    OtaBlock* blocks = malloc(sizeof(OtaBlock) * OTA_BLOCKS);
+    int64_t start = esp_timer_get_time();
+    const char* failure = "out of memory";
+
+    // Full clock for the download, the hash and the flash writes, until the restart
+    Power_Acquire(POWER_NETWORK);
+    bytesWritten = 0;
+    writeMaxUs = 0;
+    flashUs = 0;
+    Metrics_Set(&otaBytes, 0);
+    Metrics_Set(&otaWriteMax, 0);
+    Metrics_Set(&otaThroughput, 0);
+    if (blocks != NULL) {
+        xQueueReset(freeBlocks);
+        xQueueReset(fullBlocks);
+        for (int i = 0; i < OTA_BLOCKS; i++) {
+            OtaBlock* block = &blocks[i];
+            xQueueSend(freeBlocks, &block, 0);
+        }
+        failure = runUpdate(start);
+        free(blocks);
+    }
+
+    int64_t durationMs = (esp_timer_get_time() - start) / 1000;
+    Metrics_Set(&otaDuration, (int32_t)durationMs);
+    if (durationMs > 0) { Metrics_Set(&otaThroughput, (int32_t)((int64_t)bytesWritten * 1000 / durationMs)); }
+
+    if (failure != NULL) {
+        ESP_LOGE(TAG, "Firmware update failed, %s", failure);
+        FlightRecorder_Record(FR_OTA, OTA_FR_FAILED, bytesWritten);
+        Metrics_Increment(&otaFailures);
+        Metrics_Set(&otaState, OTA_FAILED);
+        publishResult(failure, durationMs);
+        Power_Release(POWER_NETWORK);
+        atomic_store(&updating, false);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    FlightRecorder_Record(FR_OTA, OTA_FR_WRITTEN, bytesWritten);
+    Metrics_Set(&otaState, OTA_REBOOTING);
+    publishResult("ok", durationMs);
+    vTaskDelay(pdMS_TO_TICKS(1000)); // Let the result get to the broker
+    esp_restart();
+}
+
+/******************************************************************
+ *
+ * Starts an update from url, an http or https URL of the app image,
+ * which must have the SHA-256 given as 64 hex digits. Returns false if
+ * it couldn't be started.
+ *
+*******************************************************************/
+bool Ota_Start(const char* url, const char* sha256Hex)
+{
+    if (loopDone == NULL) { return false; }
+    if (atomic_load(&pendingVerify)) {
+        ESP_LOGE(TAG, "Firmware update refused, this image hasn't been validated yet.");
+        return false;
+    }
+    if (strlen(url) >= sizeof(otaUrl) || strncmp(url, "https://", 8) != 0) {
+        ESP_LOGE(TAG, "Firmware update refused, the URL must be https.");
+        return false;
+    }
+    if (strlen(sha256Hex) != 2 * sizeof(expectedHash)) {
+        ESP_LOGE(TAG, "Firmware update refused, the SHA-256 must be %d hex digits.", 2 * (int)sizeof(expectedHash));
+        return false;
+    }
+    uint8_t hash[sizeof(expectedHash)];
+    for (int i = 0; i < sizeof(hash); i++) {
+        unsigned int byte;
+        if (sscanf(sha256Hex + 2 * i, "%2x", &byte) != 1) {
+            ESP_LOGE(TAG, "Firmware update refused, the SHA-256 isn't hex.");
+            return false;
+        }
+        hash[i] = (uint8_t)byte;
+    }
+
+    bool idle = false;
+    if (!atomic_compare_exchange_strong(&updating, &idle, true)) {
+        ESP_LOGW(TAG, "Firmware update already running.");
+        return false;
+    }
+    strcpy(otaUrl, url);
+    memcpy(expectedHash, hash, sizeof(hash));
+    Metrics_Set(&otaState, OTA_DOWNLOADING);
+    FlightRecorder_Record(FR_OTA, OTA_FR_STARTED, 0);
+    xTaskCreatePinnedToCore(otaTask, "ota", 6144, NULL, OTA_PRIORITY, NULL, NETWORK_CORE);
+    return true;
+}
+
+/******************************************************************
+ *
+ * End of a main loop pass, the writer's cue
+ *
+*******************************************************************/
+void Ota_LoopDone(void)
+{
+    if (atomic_load(&updating)) { xSemaphoreGive(loopDone); }
+}
+
+// An update's running, and needs the main loop's passes for its flash writes
+bool Ota_Updating(void)
+{
+    return atomic_load(&updating);
+}
+
+/******************************************************************
+ *
+ * New image validation. Called from the MQTT task when the broker
+ * connects; rollback is by the timer, on the timer task.
+ *
+*******************************************************************/
+void Ota_MqttConnected(void)
+{
+    bool pending = true;
+    if (!atomic_compare_exchange_strong(&pendingVerify, &pending, false)) { return; }
+    esp_timer_stop(validateTimer);
+    esp_ota_mark_app_valid_cancel_rollback();
+    FlightRecorder_Record(FR_OTA, OTA_FR_VALIDATED, 0);
+    Metrics_Set(&otaState, OTA_IDLE);
+    ESP_LOGI(TAG, "New firmware reached the broker, it's kept.");
+}
+
+static void validateTimeout(void* arg)
+{
+    if (!atomic_load(&pendingVerify)) { return; }
+    ESP_LOGE(TAG, "New firmware didn't reach the broker in %d seconds, rolling back.", OTA_VALIDATE_TIMEOUT_S);
+    FlightRecorder_Record(FR_OTA, OTA_FR_ROLLING_BACK, OTA_VALIDATE_TIMEOUT_S);
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+/******************************************************************
+ *
+ * At boot, before the network is started. Notes a rollback of the last
+ * update, and if this image is new starts the clock on it.
+ *
+*******************************************************************/
+void Ota_Initialise(void)
+{
+    Metrics_Register(&otaState);
+    Metrics_Register(&otaBytes);
+    Metrics_Register(&otaThroughput);
+    Metrics_Register(&otaDuration);
+    Metrics_Register(&otaWriteMax);
+    Metrics_Register(&otaFailures);
+
+    freeBlocks = xQueueCreate(OTA_BLOCKS, sizeof(OtaBlock*));
+    fullBlocks = xQueueCreate(OTA_BLOCKS, sizeof(OtaBlock*));
+    loopDone = xSemaphoreCreateBinary();
+    writerDone = xSemaphoreCreateBinary();
+
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    const esp_partition_t* invalid = esp_ota_get_last_invalid_partition();
+    if (invalid != NULL) {
+        ESP_LOGW(TAG, "Firmware in %s was rolled back, running %s", invalid->label, running->label);
+        FlightRecorder_Record(FR_OTA, OTA_FR_ROLLED_BACK, 0);
+    }
+
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY) { return; }
+    ESP_LOGI(TAG, "New firmware in %s, it must reach the broker within %d seconds.", running->label, OTA_VALIDATE_TIMEOUT_S);
+    atomic_store(&pendingVerify, true);
+    Metrics_Set(&otaState, OTA_PENDING_VERIFY);
+    const esp_timer_create_args_t timerArgs = { .callback = validateTimeout, .name = "otaValidate" };
+    esp_timer_create(&timerArgs, &validateTimer);
+    esp_timer_start_once(validateTimer, (uint64_t)OTA_VALIDATE_TIMEOUT_S * 1000000);
+}
@@ -0,0 +1,49 @@
+/* MQTT Alarm Controller: Firmware updates
+
+   A new image streamed over HTTP into the other of the two app slots,
+   checked against its SHA-256 and booted, then kept only if it gets as
+   far as connecting to the broker.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __OTA_H__
+#define __OTA_H__
+
+#include <stdbool.h>
+
+#define OTA_URL_LEN 256
+#define OTA_BLOCK_LEN 4096              // One flash sector, erased and written in one go
+#define OTA_BLOCKS 3                    // Blocks in flight between the download and the flash writer
+#define OTA_HTTP_TIMEOUT_MS 10000
+#define OTA_LOOP_WAIT_MS 100            // Longest a flash write waits for the main loop to finish a pass
+#define OTA_VALIDATE_TIMEOUT_S 300      // A new image that hasn't reached the broker by now is rolled back
+
+typedef enum {
+    OTA_IDLE = 0,
+    OTA_DOWNLOADING = 1,
+    OTA_REBOOTING = 2,
+    OTA_FAILED = 3,
+    OTA_PENDING_VERIFY = 4,             // Running a new image that hasn't reached the broker yet
+} OtaState;
+
+void Ota_Initialise(void);
+bool Ota_Start(const char* url, const char* sha256Hex);
+void Ota_MqttConnected(void);
+void Ota_LoopDone(void);
+bool Ota_Updating(void);
+
+#endif // #ifndef __OTA_H__
@@ -0,0 +1,341 @@
+/* MQTT Alarm Controller: LAN peer link
+
+   With config.peerGroup set, each zone change and commanded siren change
+   is multicast to the group as a 28 byte packet, and the packets from the
+   other controllers in the group are acted on as they arrive:
+   config.peerTripSirens sounds the external siren when a peer's zone
+   trips, config.peerFollowSirens sounds and silences the sirens with a
+   peer's. A siren driven by a peer isn't sent on, so the controllers
+   can't set each other off in a loop.
+
+   The packet is
+
+     0  'A' 'P', version 1, type (PeerEventType)
+     4  sender, FNV-1a of config.UID
+     8  epoch, random at each boot
+    12  sequence number, from 1 at each boot
+    16  index, state, 2 bytes of 0
+    20  SipHash-2-4 of bytes 0 to 19 under config.peerKey
+
+   all little endian. A packet without the right MAC is dropped, so only
+   controllers with the key can sound the sirens. Multicast isn't
+   acknowledged, so each event is sent PEER_COPIES times, a main loop
+   pass apart, and the copies, and any other repeat of a sequence number
+   within PEER_WINDOW of the sender's latest, are dropped as duplicates.
+   A new epoch starts the sender's sequence again, so a peer that reboots
+   is heard at once; the cost is that a recording of a packet from an
+   earlier boot of a sender would be taken again, if whoever replays it
+   doesn't care that it's old.
+
+   Events are sent from the main loop and received on the HAL's own
+   task, which drives the siren pins itself, see InputOutput_PeerSiren(),
+   so a peer's siren sounds without waiting for a main loop pass.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <string.h>
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "inputOutput.h"
+#include "peerLink.h"
+
+#define PEER_VERSION 1
+#define PEER_MAC_OFFSET 20
+
+typedef struct {
+    uint32_t sender;
+    uint32_t epoch;
+    uint32_t latest;                    // Highest sequence number seen
+    uint64_t seen;                      // Bit n: latest - n has been seen
+    int64_t heardUs;
+} PeerState;
+
+typedef struct {
+    uint8_t packet[PEER_PACKET_LEN];
+    int copiesLeft;
+} PeerRepeat;
+
+static bool started = false;
+static uint8_t key[PEER_KEY_LEN];
+static uint32_t selfId = 0;
+static uint32_t epoch = 0;
+static uint32_t nextSeq = 1;
+static PeerState peers[PEER_MAX_PEERS];     // Only touched by the receive side
+static PeerRepeat repeats[PEER_MAX_REPEATS];
+
+static Metric peerSent = METRIC_COUNTER_INIT("alarm_peer_sent_total", "Peer link events sent, each sent PEER_COPIES times");
+static Metric peerReceived = METRIC_COUNTER_INIT("alarm_peer_received_total", "Peer link events received from other controllers");
+static Metric peerDuplicates = METRIC_COUNTER_INIT("alarm_peer_duplicates_total", "Peer link packets dropped as copies or repeats");
+static Metric peerRejected = METRIC_COUNTER_INIT("alarm_peer_rejected_total", "Peer link packets dropped as malformed or with the wrong MAC");
+static Metric peerActions = METRIC_COUNTER_INIT("alarm_peer_actions_total", "Sirens sounded or silenced for a peer's event");
+
+/******************************************************************
+ *
+ * SipHash-2-4, a 64 bit MAC
+ *
+*******************************************************************/
+static uint64_t read64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) { v = (v << 8) | p[i]; }
+    return v;
+}
+
+static uint64_t rotl(uint64_t x, int b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND do { \
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+} while (0)
+
+uint64_t PeerLink_SipHash(const uint8_t k[PEER_KEY_LEN], const uint8_t* data, int len)
+{
+    uint64_t k0 = read64(k), k1 = read64(k + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    int whole = len - len % 8;
+    for (int i = 0; i < whole; i += 8) {
+        uint64_t m = read64(data + i);
+        v3 ^= m;
+        SIPROUND; SIPROUND;
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t)len << 56;
+    for (int i = len % 8 - 1; i >= 0; i--) { b |= (uint64_t)data[whole + i] << (8 * i); }
+    v3 ^= b;
+    SIPROUND; SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) { p[i] = (uint8_t)(v >> (8 * i)); }
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/******************************************************************
+ *
+ * Sending. The first copy goes now, PeerLink_Poll() sends the rest.
+ *
+*******************************************************************/
+static void sendEvent(PeerEventType type, int index, bool state)
+{
+    if (!started) { return; }
+    uint8_t packet[PEER_PACKET_LEN] = { 'A', 'P', PEER_VERSION, (uint8_t)type };
+    put32(packet + 4, selfId);
+    put32(packet + 8, epoch);
+    put32(packet + 12, nextSeq++);
+    packet[16] = (uint8_t)index;
+    packet[17] = state;
+    uint64_t mac = PeerLink_SipHash(key, packet, PEER_MAC_OFFSET);
+    for (int i = 0; i < 8; i++) { packet[PEER_MAC_OFFSET + i] = (uint8_t)(mac >> (8 * i)); }
+
+    if (!Hal_PeerSend(packet, sizeof(packet))) { ESP_LOGW(TAG, "Peer link send failed, the copies may still get through."); }
+    Metrics_Increment(&peerSent);
+    for (int i = 0; i < PEER_MAX_REPEATS; i++) {
+        if (repeats[i].copiesLeft > 0) { continue; }
+        memcpy(repeats[i].packet, packet, sizeof(packet));
+        repeats[i].copiesLeft = PEER_COPIES - 1;
+        return;
+    }
+    ESP_LOGW(TAG, "Peer link repeats full, event %d/%d sent once.", type, index);
+}
+
+void PeerLink_ZoneEvent(int zone, bool active)
+{
+    sendEvent(PEER_ZONE, zone, active);
+}
+
+void PeerLink_SirenEvent(int siren, bool on)
+{
+    sendEvent(PEER_SIREN, siren, on);
+}
+
+// Send the next copy of each event. Call every main loop pass.
+void PeerLink_Poll(void)
+{
+    if (!started) { return; }
+    for (int i = 0; i < PEER_MAX_REPEATS; i++) {
+        if (repeats[i].copiesLeft == 0) { continue; }
+        Hal_PeerSend(repeats[i].packet, PEER_PACKET_LEN);
+        repeats[i].copiesLeft--;
+    }
+}
+
+// Copies still to go out, which need the main loop at its polling rate
+bool PeerLink_Pending(void)
+{
+    for (int i = 0; i < PEER_MAX_REPEATS; i++) {
+        if (repeats[i].copiesLeft > 0) { return true; }
+    }
+    return false;
+}
+
+/******************************************************************
+ *
+ * Duplicates. Returns true the first time a sender's sequence number
+ * is seen.
+ *
+*******************************************************************/
+static bool firstSeen(uint32_t sender, uint32_t senderEpoch, uint32_t seq)
+{
+    PeerState* p = NULL;
+    PeerState* oldest = &peers[0];
+    for (int i = 0; i < PEER_MAX_PEERS; i++) {
+        if (peers[i].sender == sender && peers[i].heardUs != 0) { p = &peers[i]; break; }
+        if (peers[i].heardUs < oldest->heardUs) { oldest = &peers[i]; }
+    }
+    int64_t now = Hal_TimeUs();
+    if (p == NULL || p->epoch != senderEpoch) {
+        if (p == NULL) { p = oldest; }
+        *p = (PeerState){ sender, senderEpoch, seq, 1, now };
+        return true;
+    }
+    p->heardUs = now;
+    if (seq > p->latest) {
+        uint32_t shift = seq - p->latest;
+        p->seen = shift >= PEER_WINDOW ? 1 : (p->seen << shift) | 1;
+        p->latest = seq;
+        return true;
+    }
+    uint32_t behind = p->latest - seq;
+    if (behind >= PEER_WINDOW || (p->seen & (1ULL << behind))) { return false; }
+    p->seen |= 1ULL << behind;
+    return true;
+}
+
+/******************************************************************
+ *
+ * A datagram from the group. Called by the HAL, on its own task on
+ * the device.
+ *
+*******************************************************************/
+void PeerLink_Receive(const uint8_t* data, int len)
+{
+    if (!started) { return; }
+    if (len != PEER_PACKET_LEN || data[0] != 'A' || data[1] != 'P' || data[2] != PEER_VERSION) {
+        Metrics_Increment(&peerRejected);
+        return;
+    }
+    uint64_t mac = PeerLink_SipHash(key, data, PEER_MAC_OFFSET);
+    uint8_t diff = 0;
+    for (int i = 0; i < 8; i++) { diff |= data[PEER_MAC_OFFSET + i] ^ (uint8_t)(mac >> (8 * i)); }
+    if (diff != 0) {
+        Metrics_Increment(&peerRejected);
+        ESP_LOGW(TAG, "Peer link packet with the wrong MAC dropped.");
+        return;
+    }
+
+    uint32_t sender = get32(data + 4);
+    if (sender == selfId) { return; }   // Our own, looped back
+    if (!firstSeen(sender, get32(data + 8), get32(data + 12))) {
+        Metrics_Increment(&peerDuplicates);
+        return;
+    }
+    Metrics_Increment(&peerReceived);
+
+    int index = data[16];
+    bool state = data[17] != 0;
+    int siren = -1;
+    if (data[3] == PEER_ZONE && state && config.peerTripSirens) {
+        siren = 0;
+    } else if (data[3] == PEER_SIREN && index < 2 && config.peerFollowSirens) {
+        siren = index;
+    }
+    if (siren < 0) { return; }
+    ESP_LOGI(TAG, "Peer %08" PRIx32 " %s %d %s, %s siren %d.", sender, data[3] == PEER_ZONE ? "zone" : "siren", index,
+        state ? "on" : "off", state ? "sounding" : "silencing", siren);
+    FlightRecorder_Record(FR_PEER_SIREN, siren, state);
+    Metrics_Increment(&peerActions);
+    InputOutput_PeerSiren(siren, state);
+}
+
+/******************************************************************
+ *
+ * Join the group, if there is one. Returns false if the link isn't
+ * configured or couldn't be started.
+ *
+*******************************************************************/
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+bool PeerLink_Start(void)
+{
+    Metrics_Register(&peerSent);
+    Metrics_Register(&peerReceived);
+    Metrics_Register(&peerDuplicates);
+    Metrics_Register(&peerRejected);
+    Metrics_Register(&peerActions);
+
+    started = false;
+    if (config.peerGroup[0] == '\0') { return false; }
+    if (strlen(config.peerKey) != 2 * PEER_KEY_LEN) {
+        ESP_LOGE(TAG, "The peer link key must be %d hex digits, the peer link is off.", 2 * PEER_KEY_LEN);
+        return false;
+    }
+    for (int i = 0; i < PEER_KEY_LEN; i++) {
+        int high = hexValue(config.peerKey[2 * i]);
+        int low = hexValue(config.peerKey[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            ESP_LOGE(TAG, "The peer link key isn't hex, the peer link is off.");
+            return false;
+        }
+        key[i] = (uint8_t)(high << 4 | low);
+    }
+
+    selfId = 2166136261u;
+    for (const char* s = config.UID; *s != '\0'; s++) { selfId = (selfId ^ (uint8_t)*s) * 16777619u; }
+    do { epoch = Hal_Random(); } while (epoch == 0);
+    nextSeq = 1;
+    memset(peers, 0, sizeof(peers));
+    memset(repeats, 0, sizeof(repeats));
+
+    // Receiving can start as soon as the group's joined
+    started = true;
+    if (!Hal_PeerStart(config.peerGroup, config.peerPort, PeerLink_Receive)) {
+        started = false;
+        ESP_LOGE(TAG, "Couldn't join peer group %s:%d.", config.peerGroup, config.peerPort);
+        return false;
+    }
+    ESP_LOGI(TAG, "Peer link on %s:%d as %08" PRIx32 ".", config.peerGroup, config.peerPort, selfId);
+    return true;
+}
@@ -0,0 +1,49 @@
+/* MQTT Alarm Controller: LAN peer link
+
+   Zone and siren events multicast straight to the other controllers on
+   the LAN, so they can act on them without a round trip through the
+   broker and Home Assistant.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __PEERLINK_H__
+#define __PEERLINK_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+
+#define PEER_PACKET_LEN 28
+#define PEER_KEY_LEN 16                 // SipHash-2-4 key
+#define PEER_MAX_PEERS 16               // Senders tracked for duplicates
+#define PEER_WINDOW 64                  // Sequence numbers behind the latest still checked for duplicates
+#define PEER_COPIES 3                   // Each event is sent this many times, a main loop pass apart
+#define PEER_MAX_REPEATS 16             // Events waiting for their copies to be sent
+
+typedef enum {
+    PEER_ZONE = 1,                      // index: input, state: active
+    PEER_SIREN = 2,                     // index: 0 external, 1 downstairs, state: on
+} PeerEventType;
+
+bool PeerLink_Start(void);
+void PeerLink_Poll(void);
+bool PeerLink_Pending(void);
+void PeerLink_ZoneEvent(int zone, bool active);
+void PeerLink_SirenEvent(int siren, bool on);
+void PeerLink_Receive(const uint8_t* data, int len);
+uint64_t PeerLink_SipHash(const uint8_t key[PEER_KEY_LEN], const uint8_t* data, int len);
+
+#endif // #ifndef __PEERLINK_H__
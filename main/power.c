@@ -0,0 +1,258 @@
+/* MQTT Alarm Controller: Power management
+
+   ESP-IDF power management scales the CPU clock between the full clock
+   and the crystal, and lets the chip light sleep when nothing needs it
+   awake. Two locks hold the full clock: the main loop's, held while it
+   processes a pass and released while it waits for a wake up, and the
+   network's, held through broker connection attempts, MQTT events and
+   firmware downloads. Time is counted in three states, the main loop at
+   full clock, the network alone at full clock, and idle, and each
+   system health sample publishes the last period's share of each with
+   an estimate of the current drawn.
+
+   The EMAC driver holds its own APB clock lock while Ethernet runs, so
+   idle is 80 MHz rather than the crystal and there's no light sleep
+   while it's up. The PM configuration doesn't change for that, so the
+   chip gets both as soon as the lock's released.
+
+   Battery mode follows VIN, the mains supply's 5V rail, with hysteresis.
+   On the battery the diagnostics, the heartbeat, the ADC reads, the
+   system health samples and the main loop's idle wake ups are all made
+   less frequent, and the MQTT task's stall timeout is stretched to
+   match.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "inttypes.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "mqttProcess.h"
+#include "mqttClient.h"
+#include "power.h"
+
+extern const char *TAG;
+
+static const char* lockNames[POWER_LOCKS] = { "loop", "network" };
+static const char* stateNames[POWER_STATES] = { "loop", "network", "idle" };
+
+static esp_pm_lock_handle_t pmLocks[POWER_LOCKS] = { NULL, NULL };
+static esp_pm_lock_handle_t noSleepLock = NULL;
+
+// State accounting, under powerMutex
+static SemaphoreHandle_t powerMutex = NULL;
+static int held[POWER_LOCKS];
+static int64_t stateSinceUs = 0;
+static int64_t periodUs[POWER_STATES];      // Time in each state since the last sample
+
+static int64_t totalUs[POWER_STATES];       // Sampler task only
+static atomic_bool batteryMode = false;
+static int vinReads = 0;                    // Main loop only, reads in a row past the threshold
+
+static Metric stateShare[POWER_STATES] = {
+    METRIC_GAUGE_INIT("alarm_power_loop_permille", "Share of the last sample period at full clock for the main loop, in 0.1%"),
+    METRIC_GAUGE_INIT("alarm_power_network_permille", "Share of the last sample period at full clock for the network alone, in 0.1%"),
+    METRIC_GAUGE_INIT("alarm_power_idle_permille", "Share of the last sample period at the idle clock or in light sleep, in 0.1%"),
+};
+static Metric estimatedCurrent = METRIC_GAUGE_INIT("alarm_power_estimated_ma", "Estimated board current over the last sample period in mA");
+static Metric batteryGauge = METRIC_GAUGE_INIT("alarm_power_battery_mode", "Running on the battery with the mains lost");
+static Metric modeChanges = METRIC_COUNTER_INIT("alarm_power_mode_changes_total", "Changes between the mains and the battery");
+
+/******************************************************************
+ *
+ * Adds the time since the last change to the state the locks were
+ * in. Call with powerMutex held.
+ *
+*******************************************************************/
+static void account(void)
+{
+    int64_t now = esp_timer_get_time();
+    PowerState state = held[POWER_LOOP] > 0 ? POWER_STATE_LOOP : held[POWER_NETWORK] > 0 ? POWER_STATE_NETWORK : POWER_STATE_IDLE;
+    periodUs[state] += now - stateSinceUs;
+    stateSinceUs = now;
+}
+
+/******************************************************************
+ *
+ * Full clock locks. They count, so each acquire needs its release.
+ *
+*******************************************************************/
+void Power_Acquire(PowerLock lock)
+{
+    if (powerMutex == NULL) { return; }
+    if (pmLocks[lock] != NULL) { esp_pm_lock_acquire(pmLocks[lock]); }
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    account();
+    held[lock]++;
+    xSemaphoreGive(powerMutex);
+}
+
+void Power_Release(PowerLock lock)
+{
+    if (powerMutex == NULL) { return; }
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    account();
+    bool wasHeld = held[lock] > 0;
+    if (wasHeld) { held[lock]--; }
+    xSemaphoreGive(powerMutex);
+    if (wasHeld && pmLocks[lock] != NULL) { esp_pm_lock_release(pmLocks[lock]); }
+}
+
+/******************************************************************
+ *
+ * Keeps the chip out of light sleep for good, for the pulse counters,
+ * which stop while it sleeps.
+ *
+*******************************************************************/
+void Power_PreventSleep(void)
+{
+    if (noSleepLock != NULL) { return; }
+    if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "pulseZones", &noSleepLock) == ESP_OK) {
+        esp_pm_lock_acquire(noSleepLock);
+        ESP_LOGI(TAG, "Light sleep disabled for the pulse counting zones.");
+    }
+}
+
+/******************************************************************
+ *
+ * Mains or battery, from a VIN read. Called from the main loop.
+ *
+*******************************************************************/
+static void publishMode(bool battery, int raw)
+{
+    char payload[128];
+    int len = snprintf(payload, sizeof(payload), "{\"event\":\"power_mode\",\"battery\":%s,\"vin_raw\":%d}",
+        battery ? "true" : "false", raw);
+    if (len > 0 && len < sizeof(payload)) { SendDiagnosticEvent(payload, len); }
+}
+
+void Power_VinSample(int raw)
+{
+    bool battery = atomic_load(&batteryMode);
+    bool crossed = battery ? raw > POWER_VIN_RESTORED_RAW : raw < POWER_VIN_LOST_RAW;
+    if (raw < 0 || !crossed) {
+        vinReads = 0;
+        return;
+    }
+    if (++vinReads < POWER_VIN_SAMPLES) { return; }
+    vinReads = 0;
+
+    battery = !battery;
+    atomic_store(&batteryMode, battery);
+    Metrics_Set(&batteryGauge, battery);
+    Metrics_Increment(&modeChanges);
+    FlightRecorder_Record(FR_POWER_MODE, battery, raw);
+    if (battery) { ESP_LOGW(TAG, "Mains lost (VIN %d), running on the battery.", raw); }
+    else { ESP_LOGI(TAG, "Mains restored (VIN %d).", raw); }
+    MqttProcess_BatteryMode(battery);
+    MqttClient_BatteryMode(battery);
+    publishMode(battery, raw);
+}
+
+bool Power_BatteryMode(void)
+{
+    return atomic_load(&batteryMode);
+}
+
+/******************************************************************
+ *
+ * Publish the last period's state shares and current estimate.
+ * Called from the system health sampler task.
+ *
+*******************************************************************/
+void Power_Sample(void)
+{
+    int64_t us[POWER_STATES];
+
+    if (powerMutex == NULL) { return; }
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    account();
+    memcpy(us, periodUs, sizeof(us));
+    memset(periodUs, 0, sizeof(periodUs));
+    xSemaphoreGive(powerMutex);
+
+    int64_t period = 0;
+    for (int s = 0; s < POWER_STATES; s++) {
+        period += us[s];
+        totalUs[s] += us[s];
+    }
+    if (period <= 0) { return; }
+    for (int s = 0; s < POWER_STATES; s++) { Metrics_Set(&stateShare[s], (int32_t)(us[s] * 1000 / period)); }
+    int64_t fullUs = us[POWER_STATE_LOOP] + us[POWER_STATE_NETWORK];
+    Metrics_Set(&estimatedCurrent, POWER_BOARD_MA + (int32_t)((fullUs * POWER_CPU_MAX_MA + us[POWER_STATE_IDLE] * POWER_CPU_IDLE_MA) / period));
+}
+
+/******************************************************************
+ *
+ * The latest sample as a JSON object, shares in %, totals in
+ * seconds. Only call this from the sampler task.
+ *
+*******************************************************************/
+int Power_FormatJson(char* buf, size_t len)
+{
+    int used = snprintf(buf, len, "{\"battery\":%s,\"estimated_ma\":%" PRIi32,
+        Metrics_Get(&batteryGauge) ? "true" : "false", Metrics_Get(&estimatedCurrent));
+    for (int s = 0; s < POWER_STATES && used < len; s++) {
+        int32_t share = Metrics_Get(&stateShare[s]);
+        used += snprintf(buf + used, len - used, ",\"%s\":%" PRIi32 ".%" PRIi32 ",\"%s_s\":%" PRIi64,
+            stateNames[s], share / 10, share % 10, stateNames[s], totalUs[s] / 1000000);
+    }
+    if (used < len) { used += snprintf(buf + used, len - used, "}"); }
+    if (used >= len) { return -1; }
+    return used;
+}
+
+/******************************************************************
+ *
+ * Configure DFS and light sleep, and make the locks. Call before any
+ * task that takes them starts.
+ *
+*******************************************************************/
+void Power_Initialise(void)
+{
+    for (int s = 0; s < POWER_STATES; s++) { Metrics_Register(&stateShare[s]); }
+    Metrics_Register(&estimatedCurrent);
+    Metrics_Register(&batteryGauge);
+    Metrics_Register(&modeChanges);
+
+    powerMutex = xSemaphoreCreateMutex();
+    stateSinceUs = esp_timer_get_time();
+
+    esp_pm_config_t pm = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+        .light_sleep_enable = true,
+    };
+    esp_err_t err = esp_pm_configure(&pm);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Power management not configured, %s. Running at full clock.", esp_err_to_name(err));
+        return;
+    }
+    for (int l = 0; l < POWER_LOCKS; l++) {
+        if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, lockNames[l], &pmLocks[l]) != ESP_OK) { pmLocks[l] = NULL; }
+    }
+    ESP_LOGI(TAG, "Power management: %d to %d MHz, light sleep when idle.", CONFIG_XTAL_FREQ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+}
@@ -0,0 +1,64 @@
+/* MQTT Alarm Controller: Power management
+
+   Dynamic frequency scaling with automatic light sleep, the CPU held at
+   full clock only while the main loop is processing or the network is
+   busy, and a battery mode that sheds work while the mains is out.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __POWER_H__
+#define __POWER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// VIN, the 5V rail from the mains supply, in raw ADC counts. Mains is lost below the first
+// and back above the second, each for POWER_VIN_SAMPLES reads in a row.
+#define POWER_VIN_LOST_RAW 1000
+#define POWER_VIN_RESTORED_RAW 1500
+#define POWER_VIN_SAMPLES 2
+
+// Estimated current draw, from the ESP32 datasheet and the board's PHY and regulator, in mA.
+// Idle is at 80 MHz, the lowest the EMAC's APB clock lock allows while Ethernet is running,
+// which also keeps the chip out of light sleep, so light sleep isn't credited.
+#define POWER_BOARD_MA 45               // LAN8720 PHY, regulator and LEDs, always on
+#define POWER_CPU_MAX_MA 44             // Both cores at the full clock, 160 MHz
+#define POWER_CPU_IDLE_MA 31            // Both cores at 80 MHz
+
+typedef enum {
+    POWER_LOOP = 0,                     // The main loop is processing
+    POWER_NETWORK = 1,                  // A broker connection attempt, an MQTT event or a firmware download
+    POWER_LOCKS,
+} PowerLock;
+
+typedef enum {
+    POWER_STATE_LOOP = 0,               // Full clock for the main loop
+    POWER_STATE_NETWORK = 1,            // Full clock for the network only
+    POWER_STATE_IDLE = 2,               // Minimum clock, or light sleep when nothing holds the APB clock
+    POWER_STATES,
+} PowerState;
+
+void Power_Initialise(void);
+void Power_PreventSleep(void);
+void Power_Acquire(PowerLock lock);
+void Power_Release(PowerLock lock);
+void Power_VinSample(int raw);
+bool Power_BatteryMode(void);
+void Power_Sample(void);
+int Power_FormatJson(char* buf, size_t len);
+
+#endif // #ifndef __POWER_H__
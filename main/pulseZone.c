@@ -0,0 +1,162 @@
+/* MQTT Alarm Controller: Pulse counting zones
+
+   Zones for PIRs that signal with short pulses. Edges are counted by
+   the pulse counter behind the HAL, with no CPU per pulse, and the zone
+   trips when it sees its configured number of pulses within its window.
+
+   The main loop reads each zone's count once a pass and stamps any new
+   pulses with the time of the read, so the window is only as fine as
+   the loop period, but no pulse is lost however short it is. A zone
+   trips on the read that completes the count, without the level
+   debounce, and clears once a window has passed with no pulse and the
+   line is back at rest. A line held at the active level for a whole
+   window also trips, so a sensor that latches rather than pulses is
+   never ignored.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "pulseZone.h"
+
+typedef struct {
+    bool enabled;
+    gpio_num_t pin;
+    int activeLevel;
+    PulseWindow window;
+    int32_t lastCount;                  // Counter at the last read
+    int64_t levelSinceUs;               // When the line went to its active level, 0 if it's at rest
+    bool active;
+} PulseZone;
+
+static PulseZone zones[NUM_INPUTS];
+
+static Metric pulsesCounted = METRIC_COUNTER_INIT("alarm_pulse_zone_pulses_total", "Pulses counted on pulse counting zones");
+static Metric pulseTrips = METRIC_COUNTER_INIT("alarm_pulse_zone_trips_total", "Pulse counting zones tripping");
+
+/******************************************************************
+ *
+ * Pulse window: the times of the last count pulses, in a ring
+ *
+*******************************************************************/
+void PulseWindow_Initialise(PulseWindow* window, int count, int windowMs)
+{
+    window->head = 0;
+    window->stored = 0;
+    window->count = count < 1 ? 1 : (count > PULSE_ZONE_MAX_COUNT ? PULSE_ZONE_MAX_COUNT : count);
+    window->windowUs = (int64_t)windowMs * 1000;
+}
+
+// Add the pulses seen at nowUs. Returns true if the last count pulses are all within the window.
+bool PulseWindow_Add(PulseWindow* window, int64_t nowUs, uint32_t pulses)
+{
+    if (pulses > PULSE_ZONE_MAX_COUNT) { pulses = PULSE_ZONE_MAX_COUNT; }
+    for (uint32_t k = 0; k < pulses; k++) {
+        window->pulseUs[window->head] = nowUs;
+        window->head = (window->head + 1) % PULSE_ZONE_MAX_COUNT;
+        if (window->stored < PULSE_ZONE_MAX_COUNT) { window->stored++; }
+    }
+    if (window->stored < window->count) { return false; }
+    int oldest = (window->head + PULSE_ZONE_MAX_COUNT - window->count) % PULSE_ZONE_MAX_COUNT;
+    return nowUs - window->pulseUs[oldest] <= window->windowUs;
+}
+
+// Time of the latest pulse, 0 if there hasn't been one
+int64_t PulseWindow_LastUs(const PulseWindow* window)
+{
+    if (window->stored == 0) { return 0; }
+    return window->pulseUs[(window->head + PULSE_ZONE_MAX_COUNT - 1) % PULSE_ZONE_MAX_COUNT];
+}
+
+/******************************************************************
+ *
+ * Set up a zone for pulse counting if it's configured for it.
+ * Returns true if it is.
+ *
+*******************************************************************/
+bool PulseZone_Initialise(int zone, gpio_num_t pin)
+{
+    if (zone < 0 || zone >= NUM_INPUTS) { return false; }
+    PulseZone* z = &zones[zone];
+    z->enabled = false;
+    if (!config.inputs[zone].active || config.inputs[zone].pulseCount <= 0) { return false; }
+
+    // Normally closed loops are open (high) in alarm
+    z->activeLevel = config.inputs[zone].normallyClosed ? 1 : 0;
+    Hal_GpioConfigInput(pin, true);
+    if (!Hal_PulseCounterConfig(pin, z->activeLevel)) {
+        ESP_LOGE(TAG, "Input %d (%s) pulse counter setup failed, using the level instead.", zone, config.inputs[zone].descriptiveName);
+        return false;
+    }
+    z->pin = pin;
+    PulseWindow_Initialise(&z->window, config.inputs[zone].pulseCount, config.inputs[zone].pulseWindowMs);
+    z->lastCount = Hal_PulseCounterRead(pin);
+    z->levelSinceUs = Hal_GpioRead(pin) == z->activeLevel ? Hal_TimeUs() : 0;
+    z->active = false;
+    z->enabled = true;
+    Metrics_Register(&pulsesCounted);
+    Metrics_Register(&pulseTrips);
+    ESP_LOGI(TAG, "Input %d (%s) trips on %d pulses in %d ms.", zone, config.inputs[zone].descriptiveName,
+        z->window.count, config.inputs[zone].pulseWindowMs);
+    return true;
+}
+
+bool PulseZone_IsEnabled(int zone)
+{
+    return zone >= 0 && zone < NUM_INPUTS && zones[zone].enabled;
+}
+
+/******************************************************************
+ *
+ * Take in the pulses since the last read and return whether the zone
+ * is active. Called every main loop pass.
+ *
+*******************************************************************/
+bool PulseZone_Update(int zone)
+{
+    if (!PulseZone_IsEnabled(zone)) { return false; }
+    PulseZone* z = &zones[zone];
+    int64_t now = Hal_TimeUs();
+
+    int32_t count = Hal_PulseCounterRead(z->pin);
+    uint32_t pulses = (uint32_t)(count - z->lastCount);
+    z->lastCount = count;
+    bool trip = false;
+    if (pulses > 0) {
+        Metrics_Add(&pulsesCounted, (int32_t)pulses);
+        FlightRecorder_Record(FR_INPUT_PULSES, zone, (int32_t)pulses);
+        trip = PulseWindow_Add(&z->window, now, pulses);
+    }
+
+    bool atActiveLevel = Hal_GpioRead(z->pin) == z->activeLevel;
+    if (!atActiveLevel) { z->levelSinceUs = 0; }
+    else if (z->levelSinceUs == 0) { z->levelSinceUs = now; }
+    if (atActiveLevel && now - z->levelSinceUs >= z->window.windowUs) { trip = true; }
+
+    if (trip && !z->active) {
+        z->active = true;
+        Metrics_Increment(&pulseTrips);
+    } else if (z->active && !atActiveLevel && now - PulseWindow_LastUs(&z->window) > z->window.windowUs) {
+        z->active = false;
+    }
+    return z->active;
+}
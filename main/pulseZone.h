@@ -0,0 +1,49 @@
+/* MQTT Alarm Controller: Pulse counting zones
+
+   Zones for PIRs that signal with short pulses. Edges are counted by
+   the pulse counter behind the HAL, with no CPU per pulse, and the zone
+   trips when it sees its configured number of pulses within its window.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __PULSEZONE_H__
+#define __PULSEZONE_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+#include "driver/gpio.h"
+
+#define PULSE_ZONE_MAX_COUNT 8          // Most pulses a zone can be set to need
+
+// The times of a zone's most recent pulses
+typedef struct {
+    int64_t pulseUs[PULSE_ZONE_MAX_COUNT];
+    int head;                           // Next slot to write
+    int stored;
+    int count;                          // Pulses needed
+    int64_t windowUs;                   // within this long
+} PulseWindow;
+
+void PulseWindow_Initialise(PulseWindow* window, int count, int windowMs);
+bool PulseWindow_Add(PulseWindow* window, int64_t nowUs, uint32_t pulses);
+int64_t PulseWindow_LastUs(const PulseWindow* window);
+
+bool PulseZone_Initialise(int zone, gpio_num_t pin);
+bool PulseZone_IsEnabled(int zone);
+bool PulseZone_Update(int zone);
+
+#endif // #ifndef __PULSEZONE_H__
@@ -0,0 +1,258 @@
+/* MQTT Alarm Controller: Sensor health analytics
+
+   Keeps fixed size statistics for each zone and flags zones that are
+   stuck active, chattering, or have been quiet far longer than they
+   normally are (e.g. a PIR stuck closed, which never changes). Each zone
+   has a Home Assistant problem binary_sensor with the statistics as its
+   attributes.
+
+   Updates are O(1) with no allocation: activations and transitions are
+   counted in hourly buckets over the last day, with running totals, and
+   the longest quiet period ended each day is kept for the last week as
+   the zone's learned baseline. Everything runs in the main loop.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "mqttProcess.h"
+#include "sensorHealth.h"
+
+#define HOUR_US ((int64_t)3600 * 1000000)
+#define DAY_US (HOUR_US * 24)
+
+typedef struct {
+    int64_t lastChangeUs;                           // Last transition either way
+    int64_t activeSinceUs;                          // Start of the current active period, 0 if inactive
+    int64_t longestActiveUs;
+    int32_t hour;                                   // Hour number of the current bucket
+    int32_t day;                                    // Day number of the current quiet bucket
+    uint16_t activations[SENSOR_HEALTH_HOURS];
+    uint16_t transitions[SENSOR_HEALTH_HOURS];
+    uint32_t activationsDay;                        // Totals of the hourly buckets
+    uint32_t transitionsDay;
+    uint32_t quietMaxS[SENSOR_HEALTH_DAYS];         // Longest quiet period ended each day
+    uint32_t totalActivations;
+    uint16_t daysSeen;
+    uint8_t problems;
+    uint8_t published;                              // Problems last published
+} ZoneHealth;
+
+static ZoneHealth zones[NUM_INPUTS];
+static int64_t lastCheckUs = 0;
+static int64_t lastPublishUs = 0;
+
+static Metric sensorProblems = METRIC_GAUGE_INIT("alarm_sensor_problems", "Zones flagged stuck, chattering or dead");
+
+/******************************************************************
+ *
+ * Move the zone's history on to the current hour and day, clearing
+ * the buckets that were skipped. At most a day's and a week's
+ * buckets are touched, however long it's been.
+ *
+*******************************************************************/
+static void advance(ZoneHealth* z, int64_t now)
+{
+    int32_t hour = (int32_t)(now / HOUR_US);
+    if (hour != z->hour) {
+        int32_t n = hour - z->hour;
+        if (n > SENSOR_HEALTH_HOURS) { n = SENSOR_HEALTH_HOURS; }
+        for (int32_t k = 1; k <= n; k++) {
+            int i = (z->hour + k) % SENSOR_HEALTH_HOURS;
+            z->activationsDay -= z->activations[i];
+            z->transitionsDay -= z->transitions[i];
+            z->activations[i] = 0;
+            z->transitions[i] = 0;
+        }
+        z->hour = hour;
+    }
+
+    int32_t day = (int32_t)(now / DAY_US);
+    if (day != z->day) {
+        int32_t n = day - z->day;
+        z->daysSeen = z->daysSeen + n > UINT16_MAX ? UINT16_MAX : z->daysSeen + n;
+        if (n > SENSOR_HEALTH_DAYS) { n = SENSOR_HEALTH_DAYS; }
+        for (int32_t k = 1; k <= n; k++) { z->quietMaxS[(z->day + k) % SENSOR_HEALTH_DAYS] = 0; }
+        z->day = day;
+    }
+}
+
+// Longest quiet period over the last week
+static uint32_t baselineQuietS(const ZoneHealth* z)
+{
+    uint32_t longest = 0;
+    for (int i = 0; i < SENSOR_HEALTH_DAYS; i++) {
+        if (z->quietMaxS[i] > longest) { longest = z->quietMaxS[i]; }
+    }
+    return longest;
+}
+
+/******************************************************************
+ *
+ * Start tracking a zone from its state at boot
+ *
+*******************************************************************/
+void SensorHealth_Initialise(int zone, bool active)
+{
+    if (zone < 0 || zone >= NUM_INPUTS) { return; }
+    int64_t now = Hal_TimeUs();
+    ZoneHealth* z = &zones[zone];
+    memset(z, 0, sizeof(*z));
+    z->hour = (int32_t)(now / HOUR_US);
+    z->day = (int32_t)(now / DAY_US);
+    z->lastChangeUs = now;
+    z->activeSinceUs = active ? now : 0;
+    lastCheckUs = now;
+    Metrics_Register(&sensorProblems);
+}
+
+/******************************************************************
+ *
+ * Record a debounced change of a zone's state
+ *
+*******************************************************************/
+void SensorHealth_Update(int zone, bool active)
+{
+    if (zone < 0 || zone >= NUM_INPUTS) { return; }
+    int64_t now = Hal_TimeUs();
+    ZoneHealth* z = &zones[zone];
+    advance(z, now);
+
+    int h = z->hour % SENSOR_HEALTH_HOURS;
+    if (z->transitions[h] < UINT16_MAX) { z->transitions[h]++; z->transitionsDay++; }
+    if (active && z->activeSinceUs == 0) {
+        uint32_t quietS = (uint32_t)((now - z->lastChangeUs) / 1000000);
+        uint32_t* quietMax = &z->quietMaxS[z->day % SENSOR_HEALTH_DAYS];
+        if (quietS > *quietMax) { *quietMax = quietS; }
+        if (z->activations[h] < UINT16_MAX) { z->activations[h]++; z->activationsDay++; }
+        z->totalActivations++;
+        z->activeSinceUs = now;
+    } else if (!active && z->activeSinceUs != 0) {
+        if (now - z->activeSinceUs > z->longestActiveUs) { z->longestActiveUs = now - z->activeSinceUs; }
+        z->activeSinceUs = 0;
+    }
+    z->lastChangeUs = now;
+}
+
+// Work out which problems a zone has now
+static uint8_t evaluate(ZoneHealth* z, int64_t now)
+{
+    uint8_t problems = 0;
+    if (z->activeSinceUs != 0 && now - z->activeSinceUs > S_TO_uS((int64_t)SENSOR_HEALTH_STUCK_ACTIVE_S)) {
+        problems |= SENSOR_HEALTH_STUCK;
+    }
+
+    // This hour or the last one
+    int h = z->hour % SENSOR_HEALTH_HOURS;
+    int previous = (h + SENSOR_HEALTH_HOURS - 1) % SENSOR_HEALTH_HOURS;
+    if (z->transitions[h] > SENSOR_HEALTH_CHATTER_PER_HOUR || z->transitions[previous] > SENSOR_HEALTH_CHATTER_PER_HOUR) {
+        problems |= SENSOR_HEALTH_CHATTER;
+    }
+
+    if (z->activeSinceUs == 0 && z->daysSeen >= SENSOR_HEALTH_LEARN_DAYS &&
+        z->totalActivations >= SENSOR_HEALTH_LEARN_ACTIVATIONS) {
+        int64_t limitS = (int64_t)baselineQuietS(z) * SENSOR_HEALTH_DEAD_FACTOR;
+        if (limitS < SENSOR_HEALTH_DEAD_MIN_S) { limitS = SENSOR_HEALTH_DEAD_MIN_S; }
+        if (now - z->lastChangeUs > S_TO_uS(limitS)) { problems |= SENSOR_HEALTH_DEAD; }
+    }
+    return problems;
+}
+
+/******************************************************************
+ *
+ * Periodic check, called from the main loop. Flags problems that
+ * show up without an input change (stuck and dead zones), publishes
+ * zones whose problems changed straight away and all zones every
+ * publish interval.
+ *
+*******************************************************************/
+void SensorHealth_Check(void)
+{
+    int64_t now = Hal_TimeUs();
+    if (now - lastCheckUs < SENSOR_HEALTH_CHECK_INTERVAL_US) { return; }
+    lastCheckUs = now;
+    bool publishAll = now - lastPublishUs >= SENSOR_HEALTH_PUBLISH_INTERVAL_US;
+    if (publishAll) { lastPublishUs = now; }
+
+    int count = 0;
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        if (!config.inputs[i].active) { continue; }
+        ZoneHealth* z = &zones[i];
+        advance(z, now);
+        z->problems = evaluate(z, now);
+        if (z->problems != 0) { count++; }
+        if (z->problems != z->published) {
+            ESP_LOGW(TAG, "Input %d (%s) health changed to stuck=%d chattering=%d dead=%d.", i, config.inputs[i].descriptiveName,
+                (z->problems & SENSOR_HEALTH_STUCK) != 0, (z->problems & SENSOR_HEALTH_CHATTER) != 0, (z->problems & SENSOR_HEALTH_DEAD) != 0);
+        }
+        if (z->problems != z->published || publishAll) {
+            if (SendZoneHealth(i)) { z->published = z->problems; }
+        }
+    }
+    Metrics_Set(&sensorProblems, count);
+}
+
+/******************************************************************
+ *
+ * Publish every zone at the next check, e.g. after reconnecting
+ *
+*******************************************************************/
+void SensorHealth_RequestPublish(void)
+{
+    lastPublishUs = Hal_TimeUs() - SENSOR_HEALTH_PUBLISH_INTERVAL_US;
+    lastCheckUs = Hal_TimeUs() - SENSOR_HEALTH_CHECK_INTERVAL_US;
+}
+
+uint8_t SensorHealth_Problems(int zone)
+{
+    if (zone < 0 || zone >= NUM_INPUTS) { return 0; }
+    return zones[zone].problems;
+}
+
+/******************************************************************
+ *
+ * Format a zone's health as the problem sensor's JSON state and
+ * attributes. Returns the length, or -1 if it didn't fit.
+ *
+*******************************************************************/
+int SensorHealth_FormatJson(int zone, char* buf, size_t len)
+{
+    if (zone < 0 || zone >= NUM_INPUTS) { return -1; }
+    const ZoneHealth* z = &zones[zone];
+    int64_t now = Hal_TimeUs();
+    int64_t longestActiveUs = z->longestActiveUs;
+    if (z->activeSinceUs != 0 && now - z->activeSinceUs > longestActiveUs) { longestActiveUs = now - z->activeSinceUs; }
+
+    int n = snprintf(buf, len,
+        "{\"problem\":%s,\"stuck\":%s,\"chattering\":%s,\"dead\":%s,"
+        "\"activations_per_hour\":%.1f,\"transitions_per_hour\":%.1f,\"seconds_since_activity\":%lld,"
+        "\"longest_active_s\":%lld,\"baseline_quiet_s\":%" PRIu32 ",\"activations\":%" PRIu32 "}",
+        z->problems ? "true" : "false",
+        (z->problems & SENSOR_HEALTH_STUCK) ? "true" : "false",
+        (z->problems & SENSOR_HEALTH_CHATTER) ? "true" : "false",
+        (z->problems & SENSOR_HEALTH_DEAD) ? "true" : "false",
+        z->activationsDay / (double)SENSOR_HEALTH_HOURS, z->transitionsDay / (double)SENSOR_HEALTH_HOURS,
+        (long long)((now - z->lastChangeUs) / 1000000), (long long)(longestActiveUs / 1000000),
+        baselineQuietS(z), z->totalActivations);
+    return (n > 0 && n < len) ? n : -1;
+}
@@ -0,0 +1,55 @@
+/* MQTT Alarm Controller: Sensor health analytics
+
+   Keeps fixed size statistics for each zone and flags zones that are
+   stuck active, chattering, or have been quiet far longer than they
+   normally are (e.g. a PIR stuck closed, which never changes). Each zone
+   has a Home Assistant problem binary_sensor with the statistics as its
+   attributes.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __SENSORHEALTH_H__
+#define __SENSORHEALTH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "inttypes.h"
+
+#define SENSOR_HEALTH_HOURS 24                  // Hourly activation and transition history
+#define SENSOR_HEALTH_DAYS 7                    // Daily longest quiet period history
+#define SENSOR_HEALTH_CHECK_INTERVAL_US 10000000
+#define SENSOR_HEALTH_PUBLISH_INTERVAL_US 300000000
+#define SENSOR_HEALTH_STUCK_ACTIVE_S 3600       // Active this long is stuck
+#define SENSOR_HEALTH_CHATTER_PER_HOUR 600      // More transitions than this in an hour is chattering
+#define SENSOR_HEALTH_LEARN_DAYS 2              // History needed before a zone can be flagged dead
+#define SENSOR_HEALTH_LEARN_ACTIVATIONS 20
+#define SENSOR_HEALTH_DEAD_FACTOR 3             // Quiet this many times the longest recent quiet period is dead
+#define SENSOR_HEALTH_DEAD_MIN_S 43200          // but never less than this
+
+// Problem flags
+#define SENSOR_HEALTH_STUCK 0x01
+#define SENSOR_HEALTH_CHATTER 0x02
+#define SENSOR_HEALTH_DEAD 0x04
+
+void SensorHealth_Initialise(int zone, bool active);
+void SensorHealth_Update(int zone, bool active);
+void SensorHealth_Check(void);
+void SensorHealth_RequestPublish(void);
+uint8_t SensorHealth_Problems(int zone);
+int SensorHealth_FormatJson(int zone, char* buf, size_t len);
+
+#endif // #ifndef __SENSORHEALTH_H__
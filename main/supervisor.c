@@ -0,0 +1,312 @@
+/* MQTT Alarm Controller: Task supervisor
+
+   Subscribes the critical loops to the task watchdog, times each pass of
+   a loop against its budget and reports overruns. When the watchdog fires
+   the offending loop and its last trace point are saved to RTC memory so
+   the next boot can report why it restarted.
+
+   Loops that own their task (the main loop) feed the watchdog directly at
+   the end of each pass. Event driven loops (the MQTT task) just check in,
+   and Supervisor_Check() feeds their watchdog user entry on their behalf
+   while their check-ins are recent enough.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_task_wdt.h"
+
+#include "defines.h"
+#include "main.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "mqttProcess.h"
+#include "supervisor.h"
+
+#define RESET_RECORD_MAGIC 0x57445452  // "WDTR"
+
+extern bool MyMqttConnected;
+
+typedef struct {
+    const char* name;
+    uint32_t budgetUs;              // Execution time budget for one pass of the loop
+    volatile uint32_t stallTimeoutMs;   // Time without a check-in before the loop is considered hung
+    bool ownTask;                   // Loop runs on the task that registered it and feeds the TWDT directly
+    esp_task_wdt_user_handle_t wdtUser;
+    volatile bool monitored;
+    volatile bool inLoop;
+    const char* volatile trace;     // Last trace point, must point at a string constant
+    volatile int64_t lastStartUs;
+    volatile int64_t lastCheckinUs;
+    volatile int64_t lastFeedUs;
+    uint32_t lastExecUs;
+    uint32_t maxExecUs;
+    uint32_t overruns;
+    uint32_t overrunsReported;
+    int64_t lastEventUs;
+} SupervisedLoop;
+
+// Survives a soft reset so the next boot can report what hung
+typedef struct {
+    uint32_t magic;
+    char loopName[SUPERVISOR_NAME_LEN];
+    char trace[SUPERVISOR_TRACE_LEN];
+    uint32_t sinceFeedMs;
+    bool inLoop;
+} ResetRecord;
+
+static RTC_NOINIT_ATTR ResetRecord resetRecord;
+static bool resetReportPending = false;
+
+static DRAM_ATTR SupervisedLoop loops[SUPERVISOR_MAX_LOOPS];
+static int numLoops = 0;
+
+static Metric loopOverruns = METRIC_COUNTER_INIT("alarm_loop_overruns_total", "Supervised loop passes over their time budget");
+static Metric watchdogResets = METRIC_GAUGE_INIT("alarm_last_reset_watchdog", "Last reset was caused by the task watchdog");
+
+/******************************************************************
+ *
+ * Initialise the supervisor. Picks up any record left by a
+ * watchdog reset and reconfigures the task watchdog to panic
+ * (and so reset) when it fires.
+ *
+*******************************************************************/
+void Supervisor_Initialise(void)
+{
+    Metrics_Register(&loopOverruns);
+    Metrics_Register(&watchdogResets);
+
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (resetRecord.magic == RESET_RECORD_MAGIC && reason == ESP_RST_TASK_WDT) {
+        resetRecord.loopName[SUPERVISOR_NAME_LEN - 1] = '\0';
+        resetRecord.trace[SUPERVISOR_TRACE_LEN - 1] = '\0';
+        ESP_LOGE(TAG, "Restarted by the task watchdog: loop %s, last trace %s, %" PRIu32 " ms since last feed%s.",
+            resetRecord.loopName, resetRecord.trace, resetRecord.sinceFeedMs, resetRecord.inLoop ? " (inside loop)" : "");
+        resetReportPending = true;
+        Metrics_Set(&watchdogResets, 1);
+    } else {
+        resetRecord.magic = 0;
+    }
+
+    esp_task_wdt_config_t twdtConfig = {
+        .timeout_ms = TWDT_TIMEOUT_MS,
+        .idle_core_mask = (1 << portNUM_PROCESSORS) - 1,
+        .trigger_panic = true,
+    };
+    esp_err_t err = esp_task_wdt_reconfigure(&twdtConfig);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Task watchdog reconfigure error: %s", esp_err_to_name(err)); }
+}
+
+/******************************************************************
+ *
+ * Register a loop for supervision and subscribe it to the task
+ * watchdog. Returns the loop id, or -1 on failure.
+ *
+*******************************************************************/
+int Supervisor_RegisterLoop(const char* name, uint32_t budgetUs, uint32_t stallTimeoutMs, bool ownTask)
+{
+    if (numLoops >= SUPERVISOR_MAX_LOOPS) {
+        ESP_LOGE(TAG, "Too many supervised loops, %s not registered.", name);
+        return -1;
+    }
+    SupervisedLoop* l = &loops[numLoops];
+    memset(l, 0, sizeof(SupervisedLoop));
+    l->name = name;
+    l->budgetUs = budgetUs;
+    l->stallTimeoutMs = stallTimeoutMs;
+    l->ownTask = ownTask;
+    l->trace = "registered";
+    l->monitored = true;
+    l->lastCheckinUs = l->lastFeedUs = esp_timer_get_time();
+
+    // Event driven loops are subscribed by the first Supervisor_Check(), as that's what feeds them
+    if (ownTask) {
+        esp_err_t err = esp_task_wdt_add(NULL);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Task watchdog subscribe error for %s: %s", name, esp_err_to_name(err));
+            return -1;
+        }
+    }
+    return numLoops++;
+}
+
+/******************************************************************
+ *
+ * Mark the start and end of one pass of a loop. The end of the
+ * pass checks the execution time against the budget and, for
+ * loops that own their task, feeds the watchdog.
+ *
+*******************************************************************/
+void Supervisor_LoopStart(int loop)
+{
+    if (loop < 0) { return; }
+    SupervisedLoop* l = &loops[loop];
+    l->lastStartUs = esp_timer_get_time();
+    l->inLoop = true;
+}
+
+void Supervisor_LoopEnd(int loop)
+{
+    if (loop < 0) { return; }
+    SupervisedLoop* l = &loops[loop];
+    int64_t now = esp_timer_get_time();
+    l->inLoop = false;
+    l->lastCheckinUs = now;
+    l->lastExecUs = (uint32_t)(now - l->lastStartUs);
+    if (l->lastExecUs > l->maxExecUs) { l->maxExecUs = l->lastExecUs; }
+    if (l->lastExecUs > l->budgetUs) {
+        l->overruns++;
+        Metrics_Increment(&loopOverruns);
+        FlightRecorder_Record(FR_LOOP_OVERRUN, l->lastExecUs, l->budgetUs);
+    }
+    if (l->ownTask) {
+        esp_task_wdt_reset();
+        l->lastFeedUs = now;
+    }
+}
+
+void Supervisor_Trace(int loop, const char* point)
+{
+    if (loop < 0) { return; }
+    loops[loop].trace = point;
+}
+
+/******************************************************************
+ *
+ * Loops that are legitimately idle (e.g. MQTT while the broker is
+ * down) can be taken out of monitoring; they keep being fed.
+ *
+*******************************************************************/
+void Supervisor_SetMonitored(int loop, bool monitored)
+{
+    if (loop < 0) { return; }
+    loops[loop].lastCheckinUs = esp_timer_get_time();
+    loops[loop].monitored = monitored;
+}
+
+/******************************************************************
+ *
+ * Change a loop's stall timeout, e.g. for a loop whose work comes
+ * less often on the battery.
+ *
+*******************************************************************/
+void Supervisor_SetStallTimeout(int loop, uint32_t stallTimeoutMs)
+{
+    if (loop < 0) { return; }
+    loops[loop].stallTimeoutMs = stallTimeoutMs;
+}
+
+// Publish an overrun or reset event to the diagnostics event topic
+static void sendEvent(const char* event, const char* loopName, const char* trace, uint32_t a, uint32_t b, uint32_t c)
+{
+    char payload[200];
+    int len = snprintf(payload, sizeof(payload),
+        "{\"event\":\"%s\",\"loop\":\"%s\",\"trace\":\"%s\",\"exec_us\":%" PRIu32 ",\"budget_us\":%" PRIu32 ",\"count\":%" PRIu32 "}",
+        event, loopName, trace, a, b, c);
+    if (len > 0 && len < sizeof(payload)) { SendDiagnosticEvent(payload, len); }
+}
+
+/******************************************************************
+ *
+ * Periodic supervisor work, called from the main loop. Feeds the
+ * watchdog for event driven loops that have checked in recently
+ * and publishes any pending overrun or reset events.
+ *
+*******************************************************************/
+void Supervisor_Check(void)
+{
+    int64_t now = esp_timer_get_time();
+
+    for (int i = 0; i < numLoops; i++) {
+        SupervisedLoop* l = &loops[i];
+        if (!l->ownTask) {
+            if (l->wdtUser == NULL) {
+                esp_err_t err = esp_task_wdt_add_user(l->name, &l->wdtUser);
+                if (err != ESP_OK) { ESP_LOGE(TAG, "Task watchdog subscribe error for %s: %s", l->name, esp_err_to_name(err)); }
+                l->lastCheckinUs = now;
+            }
+            bool stalled = l->monitored && (now - l->lastCheckinUs) > (int64_t)l->stallTimeoutMs * 1000;
+            if (!stalled && l->wdtUser != NULL) {
+                esp_task_wdt_reset_user(l->wdtUser);
+                l->lastFeedUs = now;
+            }
+        }
+
+        if (l->overruns != l->overrunsReported && now - l->lastEventUs > SUPERVISOR_EVENT_INTERVAL_US && MyMqttConnected) {
+            sendEvent("overrun", l->name, l->trace, l->lastExecUs, l->budgetUs, l->overruns);
+            ESP_LOGW(TAG, "Loop %s overran its %" PRIu32 " us budget, %" PRIu32 " us (%" PRIu32 " overruns).",
+                l->name, l->budgetUs, l->lastExecUs, l->overruns);
+            l->overrunsReported = l->overruns;
+            l->lastEventUs = now;
+        }
+    }
+
+    if (resetReportPending && MyMqttConnected) {
+        resetReportPending = false;
+        sendEvent("watchdog_reset", resetRecord.loopName, resetRecord.trace, resetRecord.sinceFeedMs, 0, 1);
+        resetRecord.magic = 0;
+    }
+}
+
+// Copy a string in the watchdog ISR without relying on library code
+static IRAM_ATTR void copyName(char* dest, const char* src, int len)
+{
+    int i = 0;
+    if (src != NULL) {
+        for (; i < len - 1 && src[i] != '\0'; i++) { dest[i] = src[i]; }
+    }
+    dest[i] = '\0';
+}
+
+/******************************************************************
+ *
+ * Called by the task watchdog ISR before it panics. Records the
+ * loop that has gone longest without feeding the watchdog. If
+ * every loop has fed it recently then the idle tasks were starved.
+ *
+*******************************************************************/
+void IRAM_ATTR esp_task_wdt_isr_user_handler(void)
+{
+    int64_t now = esp_timer_get_time();
+    int culprit = -1;
+    int64_t oldestFeed = now;
+
+    for (int i = 0; i < numLoops; i++) {
+        if (loops[i].lastFeedUs < oldestFeed) {
+            oldestFeed = loops[i].lastFeedUs;
+            culprit = i;
+        }
+    }
+
+    if (culprit >= 0 && (now - oldestFeed) >= (int64_t)TWDT_TIMEOUT_MS * 1000) {
+        copyName(resetRecord.loopName, loops[culprit].name, SUPERVISOR_NAME_LEN);
+        copyName(resetRecord.trace, loops[culprit].trace, SUPERVISOR_TRACE_LEN);
+        resetRecord.sinceFeedMs = (uint32_t)((now - oldestFeed) / 1000);
+        resetRecord.inLoop = loops[culprit].inLoop;
+    } else {
+        copyName(resetRecord.loopName, DRAM_STR("IDLE"), SUPERVISOR_NAME_LEN);
+        copyName(resetRecord.trace, DRAM_STR("cpu starved"), SUPERVISOR_TRACE_LEN);
+        resetRecord.sinceFeedMs = 0;
+        resetRecord.inLoop = false;
+    }
+    resetRecord.magic = RESET_RECORD_MAGIC;
+}
@@ -0,0 +1,44 @@
+/* MQTT Alarm Controller: Task supervisor
+
+   Subscribes the critical loops to the task watchdog, times each pass of
+   a loop against its budget and reports overruns. When the watchdog fires
+   the offending loop and its last trace point are saved to RTC memory so
+   the next boot can report why it restarted.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __SUPERVISOR_H__
+#define __SUPERVISOR_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+
+#define SUPERVISOR_MAX_LOOPS 4
+#define SUPERVISOR_NAME_LEN 16
+#define SUPERVISOR_TRACE_LEN 32
+#define SUPERVISOR_EVENT_INTERVAL_US 1000000   // Minimum time between overrun events per loop
+
+void Supervisor_Initialise(void);
+int Supervisor_RegisterLoop(const char* name, uint32_t budgetUs, uint32_t stallTimeoutMs, bool ownTask);
+void Supervisor_LoopStart(int loop);
+void Supervisor_LoopEnd(int loop);
+void Supervisor_SetMonitored(int loop, bool monitored);
+void Supervisor_SetStallTimeout(int loop, uint32_t stallTimeoutMs);
+void Supervisor_Trace(int loop, const char* point);
+void Supervisor_Check(void);
+
+#endif // #ifndef __SUPERVISOR_H__
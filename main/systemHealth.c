@@ -0,0 +1,209 @@
+/* MQTT Alarm Controller: System health sampling
+
+   Periodically samples per-task CPU load and stack high-water marks along
+   with each core's load and heap statistics, warns when a task's stack headroom gets low and
+   publishes the results as Home Assistant diagnostic sensors.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "defines.h"
+#include "metrics.h"
+#include "mqttProcess.h"
+#include "power.h"
+#include "systemHealth.h"
+#include "taskPlan.h"
+
+#ifndef configRUN_TIME_COUNTER_TYPE
+#define configRUN_TIME_COUNTER_TYPE uint32_t
+#endif
+
+typedef struct {
+    char name[configMAX_TASK_NAME_LEN];
+    UBaseType_t taskNumber;
+    uint32_t runTime;           // Run time counter at the last sample
+    uint32_t cpuPermille;       // Share of total CPU time since the last sample, in 0.1%
+    int core;                   // Core the task is pinned to, -1 if it isn't
+    uint32_t stackHeadroom;     // Stack high-water mark in bytes
+    uint32_t lowestWarned;      // Lowest headroom we've already warned about
+} TaskSample;
+
+// All of the sampling state is only touched by the sampler task
+static TaskStatus_t statusBuffer[SYSTEM_HEALTH_MAX_TASKS];
+static TaskSample samples[SYSTEM_HEALTH_MAX_TASKS];
+static int numSamples = 0;
+static uint32_t lastTotalRunTime = 0;
+
+static Metric freeHeap = METRIC_GAUGE_INIT("alarm_heap_free_bytes", "Free heap");
+static Metric largestFreeBlock = METRIC_GAUGE_INIT("alarm_heap_largest_free_block_bytes", "Largest free heap block");
+static Metric minimumFreeHeap = METRIC_GAUGE_INIT("alarm_heap_minimum_free_bytes", "Minimum free heap since boot");
+static Metric minimumStackHeadroom = METRIC_GAUGE_INIT("alarm_task_minimum_stack_headroom_bytes", "Lowest stack headroom of any task");
+static Metric stackWarnings = METRIC_COUNTER_INIT("alarm_task_stack_warnings_total", "Task stack headroom warnings");
+static Metric coreBusy[portNUM_PROCESSORS] = {
+    METRIC_GAUGE_INIT("alarm_cpu_core0_busy_permille", "Core 0 (network) busy time since the last sample, in 0.1%"),
+    METRIC_GAUGE_INIT("alarm_cpu_core1_busy_permille", "Core 1 (alarm) busy time since the last sample, in 0.1%"),
+};
+
+// Find the previous sample for a task, or -1 if it's a new task
+static int findSample(UBaseType_t taskNumber)
+{
+    for (int i = 0; i < numSamples; i++) {
+        if (samples[i].taskNumber == taskNumber) { return i; }
+    }
+    return -1;
+}
+
+/******************************************************************
+ *
+ * Take a sample of the task and heap statistics
+ *
+*******************************************************************/
+static void sample(void)
+{
+    configRUN_TIME_COUNTER_TYPE totalRunTime = 0;
+    UBaseType_t count = uxTaskGetSystemState(statusBuffer, SYSTEM_HEALTH_MAX_TASKS, &totalRunTime);
+    if (count == 0) {
+        ESP_LOGE(TAG, "System health: more than %d tasks, increase SYSTEM_HEALTH_MAX_TASKS.", SYSTEM_HEALTH_MAX_TASKS);
+        return;
+    }
+
+    // Run time is counted per core, so the total available is elapsed time times the number of cores
+    uint32_t elapsed = ((uint32_t)totalRunTime - lastTotalRunTime) * portNUM_PROCESSORS;
+    lastTotalRunTime = (uint32_t)totalRunTime;
+
+    static TaskSample current[SYSTEM_HEALTH_MAX_TASKS];
+    uint32_t lowestHeadroom = UINT32_MAX;
+    uint32_t coreIdle[portNUM_PROCESSORS] = { 0 };
+    for (int i = 0; i < count; i++) {
+        TaskStatus_t* status = &statusBuffer[i];
+        TaskSample* s = &current[i];
+        int previous = findSample(status->xTaskNumber);
+
+        strlcpy(s->name, status->pcTaskName, sizeof(s->name));
+        s->taskNumber = status->xTaskNumber;
+        s->runTime = (uint32_t)status->ulRunTimeCounter;
+        s->stackHeadroom = status->usStackHighWaterMark;
+        BaseType_t core = xTaskGetCoreID(status->xHandle);
+        s->core = core == tskNO_AFFINITY ? -1 : (int)core;
+        s->lowestWarned = previous >= 0 ? samples[previous].lowestWarned : UINT32_MAX;
+        s->cpuPermille = 0;
+        if (previous >= 0 && elapsed > 0) {
+            s->cpuPermille = (uint32_t)(((uint64_t)(s->runTime - samples[previous].runTime) * 1000) / elapsed);
+        }
+
+        // A core's idle task runs whenever nothing else there can
+        for (int c = 0; c < portNUM_PROCESSORS; c++) {
+            if (previous >= 0 && status->xHandle == xTaskGetIdleTaskHandleForCore(c)) { coreIdle[c] = s->runTime - samples[previous].runTime; }
+        }
+
+        if (s->stackHeadroom < lowestHeadroom) { lowestHeadroom = s->stackHeadroom; }
+
+        // Only warn when the headroom reaches a new low below the margin
+        if (s->stackHeadroom < STACK_WARN_MARGIN_BYTES && s->stackHeadroom < s->lowestWarned) {
+            s->lowestWarned = s->stackHeadroom;
+            Metrics_Increment(&stackWarnings);
+            ESP_LOGW(TAG, "Task %s stack headroom is down to %" PRIu32 " bytes.", s->name, s->stackHeadroom);
+        }
+    }
+    memcpy(samples, current, sizeof(TaskSample) * count);
+    numSamples = count;
+
+    uint32_t coreElapsed = elapsed / portNUM_PROCESSORS;
+    for (int c = 0; c < portNUM_PROCESSORS && coreElapsed > 0; c++) {
+        uint32_t idlePermille = (uint32_t)(((uint64_t)coreIdle[c] * 1000) / coreElapsed);
+        Metrics_Set(&coreBusy[c], idlePermille < 1000 ? 1000 - idlePermille : 0);
+    }
+
+    Metrics_Set(&freeHeap, heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+    Metrics_Set(&largestFreeBlock, heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+    Metrics_Set(&minimumFreeHeap, heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    Metrics_Set(&minimumStackHeadroom, lowestHeadroom);
+    Power_Sample();
+}
+
+/******************************************************************
+ *
+ * Format the latest sample as JSON. The task details are an
+ * object keyed by task name so Home Assistant can show them as
+ * attributes. Only call this from the sampler task.
+ *
+*******************************************************************/
+int SystemHealth_FormatJson(char* buf, size_t len)
+{
+    int used = snprintf(buf, len, "{\"free_heap\":%" PRIi32 ",\"largest_free_block\":%" PRIi32
+        ",\"minimum_free_heap\":%" PRIi32 ",\"minimum_stack_headroom\":%" PRIi32 ",\"cores\":[",
+        Metrics_Get(&freeHeap), Metrics_Get(&largestFreeBlock), Metrics_Get(&minimumFreeHeap), Metrics_Get(&minimumStackHeadroom));
+    for (int c = 0; c < portNUM_PROCESSORS && used < len; c++) {
+        int32_t busy = Metrics_Get(&coreBusy[c]);
+        used += snprintf(buf + used, len - used, "%s%" PRIi32 ".%" PRIi32, c == 0 ? "" : ",", busy / 10, busy % 10);
+    }
+    if (used < len) { used += snprintf(buf + used, len - used, "],\"tasks\":{"); }
+    for (int i = 0; i < numSamples && used < len; i++) {
+        used += snprintf(buf + used, len - used, "%s\"%s\":{\"cpu\":%" PRIu32 ".%" PRIu32 ",\"stack\":%" PRIu32 ",\"core\":%d}",
+            i == 0 ? "" : ",", samples[i].name, samples[i].cpuPermille / 10, samples[i].cpuPermille % 10, samples[i].stackHeadroom, samples[i].core);
+    }
+    if (used < len) { used += snprintf(buf + used, len - used, "},\"power\":"); }
+    if (used < len) {
+        int power = Power_FormatJson(buf + used, len - used);
+        used = power < 0 ? len : used + power;
+    }
+    if (used < len) { used += snprintf(buf + used, len - used, "}"); }
+    if (used >= len) { return -1; }
+    return used;
+}
+
+// A core's load at the last sample, in 0.1%, from any task
+int32_t SystemHealth_CoreBusy(int core)
+{
+    if (core < 0 || core >= portNUM_PROCESSORS) { return 0; }
+    return Metrics_Get(&coreBusy[core]);
+}
+
+/******************************************************************
+ *
+ * Sampler task. Runs at low priority; a sample is a single pass
+ * over the task list, so it's cheap enough to leave running. It
+ * samples less often on the battery.
+ *
+*******************************************************************/
+static void systemHealthTask(void *arg)
+{
+    while (true) {
+        sample();
+        SendSystemHealth();
+        int intervalS = Power_BatteryMode() ? SYSTEM_HEALTH_BATTERY_INTERVAL_S : SYSTEM_HEALTH_INTERVAL_S;
+        vTaskDelay(pdMS_TO_TICKS(intervalS * 1000));
+    }
+}
+
+void SystemHealth_Start(void)
+{
+    Metrics_Register(&freeHeap);
+    Metrics_Register(&largestFreeBlock);
+    Metrics_Register(&minimumFreeHeap);
+    Metrics_Register(&minimumStackHeadroom);
+    Metrics_Register(&stackWarnings);
+    for (int c = 0; c < portNUM_PROCESSORS; c++) { Metrics_Register(&coreBusy[c]); }
+
+    xTaskCreatePinnedToCore(systemHealthTask, "sysHealth", 3072, NULL, SYSTEM_HEALTH_PRIORITY, NULL, NETWORK_CORE);
+}
@@ -0,0 +1,38 @@
+/* MQTT Alarm Controller: System health sampling
+
+   Periodically samples per-task CPU load and stack high-water marks along
+   with heap statistics, warns when a task's stack headroom gets low and
+   publishes the results as Home Assistant diagnostic sensors.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __SYSTEMHEALTH_H__
+#define __SYSTEMHEALTH_H__
+
+#include <stddef.h>
+#include "inttypes.h"
+
+#define SYSTEM_HEALTH_INTERVAL_S 10         // Sampling period
+#define SYSTEM_HEALTH_BATTERY_INTERVAL_S 60 // Sampling period on the battery
+#define SYSTEM_HEALTH_MAX_TASKS 24          // Maximum number of tasks sampled
+#define STACK_WARN_MARGIN_BYTES 512         // Warn when a task's stack headroom drops below this
+
+void SystemHealth_Start(void);
+int SystemHealth_FormatJson(char* buf, size_t len);
+int32_t SystemHealth_CoreBusy(int core);
+
+#endif // #ifndef __SYSTEMHEALTH_H__
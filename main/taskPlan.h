@@ -0,0 +1,75 @@
+/* MQTT Alarm Controller: Task plan
+
+   Which core each task runs on, and at what priority, in one place.
+   The alarm path has core 1 (the APP CPU) to itself, so TLS handshakes,
+   discovery bursts and HTTP clients on core 0 (the PRO CPU) can't hold
+   up the inputs.
+
+   Core 1, the alarm
+     main loop     16  inputs, alarm machine, sirens, MAIN_LOOP_PRIORITY
+   Core 0, the network
+     esp_timer     22  zone scans, heartbeat tick, lease and OTA timers
+     sys_evt       20  Ethernet and IP events
+     tiT           18  lwIP
+     peerLink       7  peer link receive, above MQTT so a handshake can't hold up a peer's siren
+     mqtt_task      5  MQTT client
+     netSupervisor  2  broker reconnects
+     httpd          1  metrics, status and local API
+     sysHealth      1  task, core and heap sampling
+     ota, otaWriter 1  firmware download and flash writes
+     stress         1  reconnect storm test
+   Either core
+     emac_rx       15  Ethernet receive, below the main loop when it lands on core 1
+
+   esp_timer is left on core 0, at 22 it's above all of the network
+   tasks anyway, so the zone scans aren't delayed by them. The ESP-IDF
+   tasks are placed by sdkconfig, the checks below keep it in step.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __TASKPLAN_H__
+#define __TASKPLAN_H__
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+
+#define ALARM_CORE 1
+#define NETWORK_CORE 0
+
+#define MAIN_LOOP_PRIORITY (tskIDLE_PRIORITY + 16)
+#define PEER_TASK_PRIORITY (tskIDLE_PRIORITY + 7)
+#define MQTT_TASK_PRIORITY (tskIDLE_PRIORITY + 5)
+#define NET_SUPERVISOR_PRIORITY (tskIDLE_PRIORITY + 2)
+#define HTTP_SERVER_PRIORITY (tskIDLE_PRIORITY + 1)
+#define SYSTEM_HEALTH_PRIORITY (tskIDLE_PRIORITY + 1)
+#define OTA_PRIORITY (tskIDLE_PRIORITY + 1)
+#define STRESS_TEST_PRIORITY (tskIDLE_PRIORITY + 1)
+
+#if CONFIG_ESP_MAIN_TASK_AFFINITY != ALARM_CORE
+#error "sdkconfig: the main task must be on ALARM_CORE (CONFIG_ESP_MAIN_TASK_AFFINITY)"
+#endif
+#if CONFIG_LWIP_TCPIP_TASK_AFFINITY != NETWORK_CORE
+#error "sdkconfig: lwIP must be on NETWORK_CORE (CONFIG_LWIP_TCPIP_TASK_AFFINITY)"
+#endif
+#if CONFIG_ESP_TIMER_TASK_AFFINITY != NETWORK_CORE
+#error "sdkconfig: esp_timer must be on NETWORK_CORE (CONFIG_ESP_TIMER_TASK_AFFINITY)"
+#endif
+#if !defined(CONFIG_MQTT_TASK_CORE_SELECTION_ENABLED) || !defined(CONFIG_MQTT_USE_CORE_0)
+#error "sdkconfig: the MQTT task must be on NETWORK_CORE (CONFIG_MQTT_USE_CORE_0)"
+#endif
+
+#endif // #ifndef __TASKPLAN_H__
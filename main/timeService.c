@@ -0,0 +1,277 @@
+/* MQTT Alarm Controller: Time service
+
+   Keeps a mapping from the uptime (esp_timer) to Unix time: an anchor
+   pair of times and the rate the wall clock runs at against the uptime,
+   in parts per billion. TimeService_NowUs() is a couple of loads and a
+   multiply, so it's cheap enough for every event.
+
+   Two sources feed the mapping:
+
+   SNTP, against config.sntpServer, normally hourly. Each sync is taken
+   as exact and becomes the new anchor. Comparing a sync with what the
+   mapping predicted for it, over at least TIME_SNTP_DRIFT_SPAN_US since
+   the last one, measures the crystal's drift, which goes into the rate.
+
+   The Home Assistant time feed (homeassistant/CurrentTime), whole
+   seconds of local time once a second, is the fallback when SNTP isn't
+   configured or hasn't synced for TIME_SNTP_VALID_US. Each message is
+   taken as TIME_FEED_DELAY_US into its second. A message more than
+   TIME_FEED_STEP_US out steps the clock; otherwise the mapping is slewed
+   a fraction of the way to it, which averages out the delivery jitter.
+   The slews are summed for TIME_FEED_DRIFT_SPAN_US and the total, being
+   what the drift cost over that time, goes into the rate.
+
+   With the drift learned, the clock holds its time when both sources
+   are lost, rather than drifting at the crystal's error.
+
+   Samples arrive from the SNTP callback and the MQTT task. An update
+   is made by whichever holds the update flag, and a sample that finds
+   it taken is dropped, the next one isn't far behind. Readers see the
+   mapping through a double buffer and a version count, so they never
+   wait and never see half an update.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "timeService.h"
+
+typedef struct {
+    int64_t uptimeUs;           // At this uptime
+    int64_t unixUs;             // it was this Unix time,
+    int32_t ratePpb;            // and the wall clock runs this much faster than the uptime
+    TimeSource source;
+} TimeMapping;
+
+static TimeMapping mappings[2];
+static atomic_uint version = 0;             // mappings[version & 1] is current
+static atomic_flag updating = ATOMIC_FLAG_INIT;
+
+// Only touched while holding updating
+static int64_t sntpSyncUs = 0;              // Uptime of the last SNTP sync
+static int64_t feedSpanStartUs = 0;         // Time feed drift measurement
+static int64_t feedSlewUs = 0;
+
+static Metric timeSource = METRIC_GAUGE_INIT("alarm_time_source", "Wall clock source (0 none, 1 time feed, 2 SNTP)");
+static Metric timeDrift = METRIC_GAUGE_INIT("alarm_time_drift_ppb", "Measured wall clock rate against the uptime, ppb");
+static Metric timeSntpSyncs = METRIC_COUNTER_INIT("alarm_time_sntp_syncs_total", "SNTP syncs");
+static Metric timeSteps = METRIC_COUNTER_INIT("alarm_time_steps_total", "Wall clock steps rather than slews");
+
+/******************************************************************
+ *
+ * The mapping
+ *
+*******************************************************************/
+static int64_t mapTime(const TimeMapping* m, int64_t uptimeUs)
+{
+    int64_t elapsed = uptimeUs - m->uptimeUs;
+    return m->unixUs + elapsed + elapsed * m->ratePpb / 1000000000;
+}
+
+static void currentMapping(TimeMapping* m)
+{
+    unsigned v;
+    do {
+        v = atomic_load(&version);
+        *m = mappings[v & 1];
+    } while (atomic_load(&version) != v);
+}
+
+// Only while holding updating
+static void setMapping(const TimeMapping* m)
+{
+    unsigned v = atomic_load(&version);
+    mappings[(v + 1) & 1] = *m;
+    atomic_store(&version, v + 1);
+    Metrics_Set(&timeSource, m->source);
+    Metrics_Set(&timeDrift, m->ratePpb);
+}
+
+// The rate corrected by a measurement, unless the result is implausible
+static int32_t correctedRate(int32_t ratePpb, int64_t errorUs, int64_t spanUs)
+{
+    int64_t rate = ratePpb + errorUs * 1000000000 / spanUs;
+    if (llabs(rate) > TIME_MAX_DRIFT_PPB) {
+        ESP_LOGW(TAG, "Clock drift measurement of %" PRIi64 " ppb ignored.", rate);
+        return ratePpb;
+    }
+    return (int32_t)rate;
+}
+
+// Days from 1970-01-01 to a date in the proleptic Gregorian calendar
+static int64_t daysFromCivil(int year, int month, int day)
+{
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+/******************************************************************
+ *
+ * SNTP synced. Called by the HAL from the SNTP task.
+ *
+*******************************************************************/
+static void sntpSynced(int64_t unixUs)
+{
+    int64_t uptime = Hal_TimeUs();
+    if (atomic_flag_test_and_set(&updating)) { return; }
+
+    TimeMapping m;
+    currentMapping(&m);
+    TimeMapping next = { uptime, unixUs, m.ratePpb, TIME_SOURCE_SNTP };
+    if (m.source != TIME_SOURCE_NONE) {
+        int64_t error = unixUs - mapTime(&m, uptime);
+        int64_t span = uptime - m.uptimeUs;
+        if (llabs(error) > TIME_FEED_STEP_US) {
+            Metrics_Increment(&timeSteps);
+        } else if (m.source == TIME_SOURCE_SNTP && span >= TIME_SNTP_DRIFT_SPAN_US) {
+            next.ratePpb = correctedRate(m.ratePpb, error, span);
+        }
+        ESP_LOGD(TAG, "SNTP sync, clock was out by %" PRIi64 " us, drift %" PRIi32 " ppb.", error, next.ratePpb);
+    } else {
+        ESP_LOGI(TAG, "Clock set by SNTP.");
+    }
+    setMapping(&next);
+    sntpSyncUs = uptime;
+    Metrics_Increment(&timeSntpSyncs);
+    atomic_flag_clear(&updating);
+}
+
+/******************************************************************
+ *
+ * A time feed message, in Home Assistant's local time. Called from
+ * the MQTT task as it arrives.
+ *
+*******************************************************************/
+void TimeService_FeedTime(int year, int month, int day, int hour, int minute, int second)
+{
+    int64_t uptime = Hal_TimeUs();
+    if (year < 2000 || month < 1 || month > 12 || day < 1 || day > 31) { return; }
+    int64_t unixS = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - config.timeFeedUtcOffsetMin * 60LL;
+    int64_t unixUs = S_TO_uS(unixS) + TIME_FEED_DELAY_US;
+    if (atomic_flag_test_and_set(&updating)) { return; }
+
+    TimeMapping m;
+    currentMapping(&m);
+    if (m.source == TIME_SOURCE_SNTP && uptime - sntpSyncUs < TIME_SNTP_VALID_US) {
+        atomic_flag_clear(&updating);
+        return;
+    }
+
+    TimeMapping next = { uptime, unixUs, m.ratePpb, TIME_SOURCE_FEED };
+    int64_t error = m.source == TIME_SOURCE_NONE ? 0 : unixUs - mapTime(&m, uptime);
+    if (m.source == TIME_SOURCE_NONE || llabs(error) > TIME_FEED_STEP_US) {
+        if (m.source == TIME_SOURCE_NONE) { ESP_LOGI(TAG, "Clock set by the time feed."); }
+        else {
+            Metrics_Increment(&timeSteps);
+            ESP_LOGW(TAG, "Clock stepped %" PRIi64 " ms to the time feed.", error / 1000);
+        }
+        feedSpanStartUs = uptime;
+        feedSlewUs = 0;
+    } else {
+        // Coming off SNTP, start measuring the drift afresh
+        if (m.source != TIME_SOURCE_FEED) {
+            feedSpanStartUs = uptime;
+            feedSlewUs = 0;
+        }
+        int64_t slew = error / TIME_FEED_SLEW_DIVISOR;
+        next.unixUs = mapTime(&m, uptime) + slew;
+        feedSlewUs += slew;
+        int64_t span = uptime - feedSpanStartUs;
+        if (span >= TIME_FEED_DRIFT_SPAN_US) {
+            next.ratePpb = correctedRate(m.ratePpb, feedSlewUs, span);
+            ESP_LOGD(TAG, "Time feed drift %" PRIi32 " ppb.", next.ratePpb);
+            feedSpanStartUs = uptime;
+            feedSlewUs = 0;
+        }
+    }
+    setMapping(&next);
+    atomic_flag_clear(&updating);
+}
+
+/******************************************************************
+ *
+ * Reading the clock
+ *
+*******************************************************************/
+bool TimeService_IsSet(void)
+{
+    return TimeService_Source() != TIME_SOURCE_NONE;
+}
+
+TimeSource TimeService_Source(void)
+{
+    TimeMapping m;
+    currentMapping(&m);
+    return m.source;
+}
+
+int32_t TimeService_DriftPpb(void)
+{
+    TimeMapping m;
+    currentMapping(&m);
+    return m.ratePpb;
+}
+
+// Unix time in us at an uptime, 0 if the clock isn't set
+int64_t TimeService_ToUnixUs(int64_t uptimeUs)
+{
+    TimeMapping m;
+    currentMapping(&m);
+    if (m.source == TIME_SOURCE_NONE) { return 0; }
+    return mapTime(&m, uptimeUs);
+}
+
+// Unix time in us now, 0 if the clock isn't set
+int64_t TimeService_NowUs(void)
+{
+    return TimeService_ToUnixUs(Hal_TimeUs());
+}
+
+/******************************************************************
+ *
+ * Start SNTP if there's a server configured. The time feed is
+ * always taken.
+ *
+*******************************************************************/
+void TimeService_Initialise(void)
+{
+    Metrics_Register(&timeSource);
+    Metrics_Register(&timeDrift);
+    Metrics_Register(&timeSntpSyncs);
+    Metrics_Register(&timeSteps);
+
+    // Start with the clock unset
+    mappings[0] = mappings[1] = (TimeMapping){ .source = TIME_SOURCE_NONE };
+    sntpSyncUs = 0;
+    if (config.sntpServer[0] == '\0') {
+        ESP_LOGI(TAG, "No SNTP server, the clock is set by the time feed.");
+        return;
+    }
+    if (!Hal_SntpStart(config.sntpServer, sntpSynced)) {
+        ESP_LOGE(TAG, "SNTP didn't start, the clock is set by the time feed.");
+    }
+}
@@ -0,0 +1,52 @@
+/* MQTT Alarm Controller: Time service
+
+   Wall clock time from SNTP, falling back to the Home Assistant time
+   feed over MQTT, kept as a mapping from the uptime so reading it is
+   cheap.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __TIMESERVICE_H__
+#define __TIMESERVICE_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+#include "defines.h"
+
+#define TIME_SNTP_VALID_US S_TO_uS(3 * 3600LL)     // SNTP is used over the time feed for this long after a sync
+#define TIME_SNTP_DRIFT_SPAN_US S_TO_uS(600LL)     // Shortest time between SNTP syncs to measure the drift over
+#define TIME_FEED_DELAY_US 50000                    // Time feed messages arrive this long after their second starts
+#define TIME_FEED_STEP_US 2000000                   // A time feed further out than this is stepped to, not slewed
+#define TIME_FEED_SLEW_DIVISOR 8                    // Each time feed message corrects this fraction of the error
+#define TIME_FEED_DRIFT_SPAN_US S_TO_uS(3600LL)    // Time feed corrections are summed this long to measure the drift
+#define TIME_MAX_DRIFT_PPB 500000                   // Far beyond any crystal, a measurement past this is bad
+
+typedef enum {
+    TIME_SOURCE_NONE = 0,
+    TIME_SOURCE_FEED = 1,
+    TIME_SOURCE_SNTP = 2,
+} TimeSource;
+
+void TimeService_Initialise(void);
+void TimeService_FeedTime(int year, int month, int day, int hour, int minute, int second);
+bool TimeService_IsSet(void);
+int64_t TimeService_NowUs(void);
+int64_t TimeService_ToUnixUs(int64_t uptimeUs);
+TimeSource TimeService_Source(void);
+int32_t TimeService_DriftPpb(void);
+
+#endif // #ifndef __TIMESERVICE_H__
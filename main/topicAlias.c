@@ -0,0 +1,215 @@
+/* MQTT Alarm Controller: MQTT 5 topic aliases
+
+   Under MQTT 5 a PUBLISH can carry a topic alias, a number standing in
+   for the topic. The first publish on a connection sends the topic and
+   the alias and the broker keeps the pair, later ones send the alias
+   with an empty topic. The state topics, published on every event, are
+   the ones worth it: "homeassistant/binary_sensor/<Name>/<Input>/state"
+   is 40 to 60 bytes, the alias property is 3.
+
+   Aliases are numbered from 1 as state topics are first published and
+   kept for the life of the program, but the broker forgets them when
+   the connection closes, so every connection starts with none
+   announced. A broker takes as many as its CONNACK allows, 0 if it
+   doesn't do aliases; esp-mqtt refuses an alias over that, and
+   TopicAlias_Refused() stops using that alias and the ones after it
+   for the rest of the connection.
+
+   A QoS 1 publish that's still unacknowledged when the connection drops
+   is resent, as it was, on the next one, where its alias means nothing
+   and the broker would drop the connection. So the last payload of each
+   aliased topic is kept, and TopicAlias_Connected() publishes it with
+   the topic and alias again before anything is resent. The resends then
+   arrive behind it, and the broker's retained state ends up where it
+   was. Payloads too long to keep always carry the topic.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "defines.h"
+#include "metrics.h"
+#include "topicAlias.h"
+
+typedef struct {
+    char topic[TOPIC_ALIAS_TOPIC_LEN];
+    bool announced;                     // The broker has this alias on this connection
+    int unackedMsgId;                   // Latest alias only QoS 1 publish not yet acknowledged, 0 if none
+    bool kept;                          // data holds the last payload published
+    char data[TOPIC_ALIAS_PAYLOAD_LEN];
+    int len;
+    int qos;
+    int retain;
+} TopicAliasEntry;
+
+static TopicAliasEntry* aliases = NULL; // aliases[i] is alias i + 1, allocated by TopicAlias_Initialise()
+static int numAliases = 0;
+static int aliasLimit = TOPIC_ALIAS_MAX;
+
+static Metric aliasPublishes = METRIC_COUNTER_INIT("alarm_mqtt5_alias_publishes_total", "Publishes sent with a topic alias");
+static Metric aliasBytesSaved = METRIC_COUNTER_INIT("alarm_mqtt5_alias_bytes_saved_total", "Bytes saved by topic aliases against the same publishes under MQTT 3.1.1");
+static Metric aliasLastSaving = METRIC_GAUGE_INIT("alarm_mqtt5_alias_last_saving_bytes", "Bytes saved by the last aliased publish, negative when it announced the alias");
+
+static bool isStateTopic(const char* topic)
+{
+    size_t len = strlen(topic);
+    return len > 6 && strcmp(topic + len - 6, "/state") == 0;
+}
+
+static int findAlias(const char* topic)
+{
+    for (int i = 0; i < numAliases; i++) {
+        if (strcmp(aliases[i].topic, topic) == 0) { return i; }
+    }
+    return -1;
+}
+
+/******************************************************************
+ *
+ * Wire size of a PUBLISH, fixed header included
+ *
+*******************************************************************/
+static int varIntSize(int value)
+{
+    if (value < 128) { return 1; }
+    if (value < 16384) { return 2; }
+    if (value < 2097152) { return 3; }
+    return 4;
+}
+
+int TopicAlias_PublishSize(bool mqtt5, int topicLen, int alias, uint32_t expiryS, int payloadLen, int qos)
+{
+    int remaining = 2 + topicLen + (qos > 0 ? 2 : 0) + payloadLen;
+    if (mqtt5) {
+        int properties = (alias > 0 ? 3 : 0) + (expiryS > 0 ? 5 : 0);
+        remaining += varIntSize(properties) + properties;
+    }
+    return 1 + varIntSize(remaining) + remaining;
+}
+
+/******************************************************************
+ *
+ * Choose the alias for a publish. Returns no alias for topics that
+ * aren't state topics, once all the aliases are taken and past the
+ * broker's limit.
+ *
+*******************************************************************/
+TopicAliasUse TopicAlias_Use(const char* topic, int len)
+{
+    TopicAliasUse use = { 0, false };
+    if (aliases == NULL || !isStateTopic(topic)) { return use; }
+
+    int i = findAlias(topic);
+    if (i < 0) {
+        if (numAliases >= TOPIC_ALIAS_MAX || strlen(topic) >= TOPIC_ALIAS_TOPIC_LEN) { return use; }
+        i = numAliases++;
+        memset(&aliases[i], 0, sizeof(aliases[i]));
+        strcpy(aliases[i].topic, topic);
+    }
+    if (i >= aliasLimit) { return use; }
+    use.alias = i + 1;
+    use.aliasOnly = aliases[i].announced && len <= TOPIC_ALIAS_PAYLOAD_LEN;
+    return use;
+}
+
+/******************************************************************
+ *
+ * Record a publish made with TopicAlias_Use()'s choice. msgId is
+ * what the client returned, negative if it wasn't sent.
+ *
+*******************************************************************/
+void TopicAlias_Sent(const char* topic, TopicAliasUse use, const char* data, int len, int qos, int retain, uint32_t expiryS, int msgId)
+{
+    if (use.alias == 0 || msgId < 0) { return; }
+    TopicAliasEntry* a = &aliases[use.alias - 1];
+    a->announced = true;
+    if (use.aliasOnly && qos > 0) { a->unackedMsgId = msgId; }
+    a->kept = len <= TOPIC_ALIAS_PAYLOAD_LEN;
+    if (a->kept) {
+        memcpy(a->data, data, len);
+        a->len = len;
+        a->qos = qos;
+        a->retain = retain;
+    }
+
+    int topicLen = strlen(topic);
+    int saving = TopicAlias_PublishSize(false, topicLen, 0, 0, len, qos)
+               - TopicAlias_PublishSize(true, use.aliasOnly ? 0 : topicLen, use.alias, expiryS, len, qos);
+    Metrics_Increment(&aliasPublishes);
+    Metrics_Add(&aliasBytesSaved, saving);
+    Metrics_Set(&aliasLastSaving, saving);
+    ESP_LOGD(TAG, "Topic alias %d for %s, %s, %d bytes saved", use.alias, topic, use.aliasOnly ? "alias only" : "announced", saving);
+}
+
+void TopicAlias_Acknowledged(int msgId)
+{
+    for (int i = 0; i < numAliases; i++) {
+        if (aliases[i].unackedMsgId == msgId) { aliases[i].unackedMsgId = 0; }
+    }
+}
+
+// The client refused the alias, it's over the broker's limit
+void TopicAlias_Refused(int alias)
+{
+    if (alias - 1 >= aliasLimit) { return; }
+    aliasLimit = alias - 1;
+    ESP_LOGW(TAG, "Broker takes %d topic aliases, later topics are sent in full.", aliasLimit);
+}
+
+/******************************************************************
+ *
+ * A new connection, with no aliases announced. Call before anything
+ * else is published or resent on it. Topics with an alias only
+ * publish in flight on the last connection are published in full
+ * again by republish.
+ *
+*******************************************************************/
+void TopicAlias_Connected(TopicAliasRepublish republish)
+{
+    if (aliases == NULL) { return; }
+    aliasLimit = TOPIC_ALIAS_MAX;
+    for (int i = 0; i < numAliases; i++) { aliases[i].announced = false; }
+    for (int i = 0; i < numAliases; i++) {
+        TopicAliasEntry* a = &aliases[i];
+        if (a->unackedMsgId == 0) { continue; }
+        a->unackedMsgId = 0;
+        if (!a->kept) {
+            ESP_LOGW(TAG, "Alias %d for %s was in flight without its payload kept, the resend may be refused.", i + 1, a->topic);
+            continue;
+        }
+        if (republish(a->topic, i + 1, a->data, a->len, a->qos, a->retain) >= 0) { a->announced = true; }
+    }
+}
+
+/******************************************************************
+ *
+ * Start with no aliases assigned
+ *
+*******************************************************************/
+void TopicAlias_Initialise(void)
+{
+    Metrics_Register(&aliasPublishes);
+    Metrics_Register(&aliasBytesSaved);
+    Metrics_Register(&aliasLastSaving);
+
+    if (aliases == NULL) { aliases = calloc(TOPIC_ALIAS_MAX, sizeof(TopicAliasEntry)); }
+    if (aliases == NULL) { ESP_LOGE(TAG, "No memory for the topic alias table, topics are sent in full."); }
+    numAliases = 0;
+    aliasLimit = TOPIC_ALIAS_MAX;
+}
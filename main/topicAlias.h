@@ -0,0 +1,50 @@
+/* MQTT Alarm Controller: MQTT 5 topic aliases
+
+   Which publishes can go by topic alias instead of the full topic, and
+   the wire size of a publish under MQTT 3.1.1 and 5 for the savings.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __TOPICALIAS_H__
+#define __TOPICALIAS_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+#include "eventPayload.h"
+
+#define TOPIC_ALIAS_MAX 24              // Aliases we'll assign, enough for every input and siren state
+#define TOPIC_ALIAS_TOPIC_LEN 120
+#define TOPIC_ALIAS_PAYLOAD_LEN EVENT_PAYLOAD_MAX_LEN   // Longer payloads always carry the topic, see topicAlias.c
+
+// How to send one publish: the alias to put in it, 0 for none, and whether the topic can be left out
+typedef struct {
+    int alias;
+    bool aliasOnly;
+} TopicAliasUse;
+
+// Publishes the topic with its alias again on a new connection, see TopicAlias_Connected()
+typedef int (*TopicAliasRepublish)(const char* topic, int alias, const char* data, int len, int qos, int retain);
+
+void TopicAlias_Initialise(void);
+void TopicAlias_Connected(TopicAliasRepublish republish);
+TopicAliasUse TopicAlias_Use(const char* topic, int len);
+void TopicAlias_Sent(const char* topic, TopicAliasUse use, const char* data, int len, int qos, int retain, uint32_t expiryS, int msgId);
+void TopicAlias_Acknowledged(int msgId);
+void TopicAlias_Refused(int alias);
+int TopicAlias_PublishSize(bool mqtt5, int topicLen, int alias, uint32_t expiryS, int payloadLen, int qos);
+
+#endif // #ifndef __TOPICALIAS_H__
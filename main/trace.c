@@ -0,0 +1,155 @@
+/* MQTT Alarm Controller: Timeline tracing
+
+   Records begin/end spans and instant events with the task, core and a
+   microsecond timestamp into a bounded buffer. A capture is started and
+   dumped over MQTT or the console, and tools/trace_to_chrome.py converts
+   the dump into Chrome/Perfetto trace JSON.
+
+   The dump is text, one record per line:
+     # alarmtrace v1 <events>
+     T,<task number>,<task name>
+     <B|E|i>,<us since start>,<task number>,<core>,<name>,<arg>
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "defines.h"
+#include "trace.h"
+
+typedef struct {
+    uint32_t timestampUs;       // Microseconds since the capture started
+    const char* name;
+    uint16_t task;              // FreeRTOS task number
+    uint8_t type;
+    uint8_t core;
+    int32_t arg;
+} TraceEvent;
+
+#define TRACE_MAX_TASKS 24
+
+atomic_bool traceEnabled = false;
+static TraceEvent events[TRACE_BUFFER_EVENTS];
+static atomic_uint nextEvent = 0;
+static int64_t startUs = 0;
+static TaskStatus_t taskTable[TRACE_MAX_TASKS];
+static int numTasks = 0;
+
+/******************************************************************
+ *
+ * Start a new capture, discarding the previous one. The capture
+ * stops by itself when the buffer is full.
+ *
+*******************************************************************/
+void Trace_Start(void)
+{
+    atomic_store(&traceEnabled, false);
+    atomic_store(&nextEvent, 0);
+    startUs = esp_timer_get_time();
+    atomic_store(&traceEnabled, true);
+    ESP_LOGI(TAG, "Trace capture started, %d events.", TRACE_BUFFER_EVENTS);
+}
+
+void Trace_Stop(void)
+{
+    atomic_store(&traceEnabled, false);
+}
+
+/******************************************************************
+ *
+ * Record an event. Use the TRACE_ macros rather than calling this
+ * directly so there's no call when tracing is off.
+ *
+*******************************************************************/
+void Trace_Record(TraceType type, const char* name, int32_t arg)
+{
+    unsigned i = atomic_fetch_add_explicit(&nextEvent, 1, memory_order_relaxed);
+    if (i >= TRACE_BUFFER_EVENTS) {
+        atomic_store(&traceEnabled, false);
+        return;
+    }
+    TraceEvent* e = &events[i];
+    e->timestampUs = (uint32_t)(esp_timer_get_time() - startUs);
+    e->name = name;
+    e->task = (uint16_t)uxTaskGetTaskNumber(xTaskGetCurrentTaskHandle());
+    e->type = (uint8_t)type;
+    e->core = (uint8_t)xPortGetCoreID();
+    e->arg = arg;
+}
+
+/******************************************************************
+ *
+ * Format the capture as text, a buffer at a time. Start with the
+ * cursor at 0 and keep calling until it returns 0. Only whole lines
+ * are written. Stops the capture.
+ *
+*******************************************************************/
+size_t Trace_Format(char* buf, size_t len, int* cursor)
+{
+    atomic_store(&traceEnabled, false);
+    unsigned count = atomic_load(&nextEvent);
+    if (count > TRACE_BUFFER_EVENTS) { count = TRACE_BUFFER_EVENTS; }
+
+    // Snapshot the task table with the header so the host can name the threads
+    if (*cursor == 0) { numTasks = uxTaskGetSystemState(taskTable, TRACE_MAX_TASKS, NULL); }
+
+    size_t used = 0;
+    char line[96];
+    while (true) {
+        int n;
+        int item = *cursor;
+        if (item == 0) {
+            n = snprintf(line, sizeof(line), "# alarmtrace v1 %u\n", count);
+        } else if (item - 1 < numTasks) {
+            TaskStatus_t* t = &taskTable[item - 1];
+            n = snprintf(line, sizeof(line), "T,%u,%s\n", (unsigned)t->xTaskNumber, t->pcTaskName);
+        } else if (item - 1 - numTasks < count) {
+            TraceEvent* e = &events[item - 1 - numTasks];
+            n = snprintf(line, sizeof(line), "%c,%" PRIu32 ",%u,%u,%s,%" PRIi32 "\n",
+                e->type, e->timestampUs, e->task, e->core, e->name, e->arg);
+        } else {
+            break;
+        }
+        if (n >= sizeof(line)) { n = sizeof(line) - 1; line[n - 1] = '\n'; }
+        if (used + n > len) { break; }
+        memcpy(buf + used, line, n);
+        used += n;
+        (*cursor)++;
+    }
+    return used;
+}
+
+/******************************************************************
+ *
+ * Print the capture on the console
+ *
+*******************************************************************/
+void Trace_DumpToConsole(void)
+{
+    static char buf[512];
+    int cursor = 0;
+    size_t n;
+    while ((n = Trace_Format(buf, sizeof(buf), &cursor)) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,49 @@
+/* MQTT Alarm Controller: Timeline tracing
+
+   Records begin/end spans and instant events with the task, core and a
+   microsecond timestamp into a bounded buffer. A capture is started and
+   dumped over MQTT or the console, and tools/trace_to_chrome.py converts
+   the dump into Chrome/Perfetto trace JSON.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "inttypes.h"
+
+#define TRACE_BUFFER_EVENTS 1024
+
+typedef enum { TraceBegin = 'B', TraceEnd = 'E', TraceInstant = 'i' } TraceType;
+
+extern atomic_bool traceEnabled;
+
+void Trace_Start(void);
+void Trace_Stop(void);
+void Trace_Record(TraceType type, const char* name, int32_t arg);
+size_t Trace_Format(char* buf, size_t len, int* cursor);
+void Trace_DumpToConsole(void);
+
+// Names must be string constants, only the pointer is stored
+#define TRACE_BEGIN(name) do { if (atomic_load_explicit(&traceEnabled, memory_order_relaxed)) { Trace_Record(TraceBegin, (name), 0); } } while (0)
+#define TRACE_END(name) do { if (atomic_load_explicit(&traceEnabled, memory_order_relaxed)) { Trace_Record(TraceEnd, (name), 0); } } while (0)
+#define TRACE_INSTANT(name, arg) do { if (atomic_load_explicit(&traceEnabled, memory_order_relaxed)) { Trace_Record(TraceInstant, (name), (arg)); } } while (0)
+
+#endif // #ifndef __TRACE_H__
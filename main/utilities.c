@@ -25,6 +25,9 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include "portmacro.h"
+#include "sdkconfig.h"
+#include "driver/uart.h"
+#include "esp_vfs_dev.h"
 
 #include "defines.h"
 #include "utilities.h"
@@ -39,6 +42,39 @@ void log_error_if_nonzero(const char *message, int error_code)
     }
 }
 
+static bool consoleDriver = false;
+
+// -------------------------------------------------------------------
+// Put the console UART under the driver, so the main loop can poll it
+// with a zero timeout. stdin reads through the driver's buffer too.
+// -------------------------------------------------------------------
+void consoleInitialise(void)
+{
+    esp_err_t err = uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, CONSOLE_RX_BUFFER_SIZE, 0, 0, NULL, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Console UART driver not installed, %s.", esp_err_to_name(err));
+        return;
+    }
+    esp_vfs_dev_uart_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
+    consoleDriver = true;
+}
+
+// -------------------------------------------------------------------
+// The next console character, or -1 if there isn't one waiting.
+// Doesn't block. Without the driver stdin's EOF is cleared, or every
+// later getchar() would return EOF without reading.
+// -------------------------------------------------------------------
+int consoleGetChar(void)
+{
+    if (consoleDriver) {
+        uint8_t c;
+        return uart_read_bytes(CONFIG_ESP_CONSOLE_UART_NUM, &c, 1, 0) == 1 ? c : -1;
+    }
+    int c = getchar();
+    if (c == EOF) { clearerr(stdin); }
+    return c;
+}
+
 /*
     Read in a line of text from the console
 
@@ -5,5 +5,7 @@
 
 void log_error_if_nonzero(const char *message, int error_code);
 int getLineInput(char buf[], size_t len);
+void consoleInitialise(void);
+int consoleGetChar(void);
 
 #endif
\ No newline at end of file
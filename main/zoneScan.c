@@ -0,0 +1,208 @@
+/* MQTT Alarm Controller: Supervised zones
+
+   Optional end of line (EOL) resistor supervision. Each supervised zone
+   is read by the ADC on a fixed scan schedule instead of as a digital
+   input, and its voltage is classified as normal, alarm, tamper open
+   (cut wire) or tamper short.
+
+   The zone terminal is pulled up to 3.3V by an external resistor (the
+   internal pull-ups are too loose to measure against) and the loop to
+   ground is double EOL: eolOhms in series with alarmOhms, with the
+   sensor contact across alarmOhms. So the loop reads one of two known
+   resistances depending on the contact, near 0V if it's shorted and
+   near full scale if it's cut. The voltage is ratiometric to the supply,
+   so the bands are fixed ADC counts worked out once from the resistor
+   values.
+
+   The scan runs from a HAL timer and reads every supervised zone through
+   the ADC's input multiplexer each tick. Classifying a read is three
+   compares and a table lookup with no allocation, so a full scan is
+   dominated by the ADC conversions. A condition has to be read
+   ZONE_SCAN_CONFIRM times in a row before it's accepted, which does the
+   job of the digital input debounce.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdatomic.h>
+#include "esp_log.h"
+
+#include "hal.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include "flightRecorder.h"
+#include "zoneScan.h"
+
+typedef struct {
+    bool supervised;
+    gpio_num_t pin;
+    EolTable table;
+    uint8_t candidate;          // Condition being confirmed
+    uint8_t count;              // Consecutive reads of the candidate
+    atomic_int condition;       // Accepted condition, read by the main loop
+    atomic_int lastRaw;
+} SupervisedZone;
+
+static SupervisedZone zones[NUM_INPUTS];
+static HalTimer scanTimer = NULL;
+
+static Metric zoneScans = METRIC_COUNTER_INIT("alarm_zone_scans_total", "Supervised zone ADC scans");
+static Metric zoneAdcErrors = METRIC_COUNTER_INIT("alarm_zone_adc_errors_total", "Supervised zone ADC reads that failed");
+static Metric zoneTampers = METRIC_COUNTER_INIT("alarm_zone_tampers_total", "Supervised zones going to tamper open or short");
+
+static const char* conditionNames[] = { "normal", "alarm", "tamper_open", "tamper_short" };
+
+// ADC counts for a loop resistance against the pull-up
+static uint16_t countsFor(double loopOhms, int pullUpOhms)
+{
+    return (uint16_t)(ZONE_ADC_FULL_SCALE * loopOhms / (loopOhms + pullUpOhms) + 0.5);
+}
+
+/******************************************************************
+ *
+ * Work out a zone's classification bands from its resistors. The
+ * thresholds are half way between the expected readings.
+ *
+*******************************************************************/
+void ZoneScan_BuildTable(EolTable* table, int pullUpOhms, int eolOhms, int alarmOhms, bool normallyClosed)
+{
+    uint16_t low = countsFor(eolOhms, pullUpOhms);
+    uint16_t high = countsFor(eolOhms + alarmOhms, pullUpOhms);
+    table->threshold[0] = low / 2;
+    table->threshold[1] = (low + high) / 2;
+    table->threshold[2] = (high + ZONE_ADC_FULL_SCALE) / 2;
+
+    // A normally closed contact shorts out the alarm resistor until it trips, a normally open one when it trips
+    table->condition[0] = ZONE_TAMPER_SHORT;
+    table->condition[1] = normallyClosed ? ZONE_NORMAL : ZONE_ALARM;
+    table->condition[2] = normallyClosed ? ZONE_ALARM : ZONE_NORMAL;
+    table->condition[3] = ZONE_TAMPER_OPEN;
+}
+
+ZoneCondition ZoneScan_Classify(const EolTable* table, int raw)
+{
+    int band = (raw >= table->threshold[0]) + (raw >= table->threshold[1]) + (raw >= table->threshold[2]);
+    return (ZoneCondition)table->condition[band];
+}
+
+const char* ZoneScan_ConditionName(ZoneCondition condition)
+{
+    return (condition >= ZONE_NORMAL && condition <= ZONE_TAMPER_SHORT) ? conditionNames[condition] : "unknown";
+}
+
+/******************************************************************
+ *
+ * Read and classify every supervised zone once. Called by the scan
+ * timer.
+ *
+*******************************************************************/
+void ZoneScan_Scan(void)
+{
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        SupervisedZone* z = &zones[i];
+        if (!z->supervised) { continue; }
+        int raw = Hal_AdcRead(z->pin);
+        if (raw < 0) {
+            Metrics_Increment(&zoneAdcErrors);
+            continue;
+        }
+        atomic_store(&z->lastRaw, raw);
+
+        uint8_t c = (uint8_t)ZoneScan_Classify(&z->table, raw);
+        if (c == atomic_load(&z->condition)) {
+            z->count = 0;
+        } else if (c == z->candidate && z->count > 0) {
+            if (++z->count >= ZONE_SCAN_CONFIRM) {
+                atomic_store(&z->condition, c);
+                z->count = 0;
+                FlightRecorder_Record(FR_ZONE_CONDITION, i, c);
+                if (c == ZONE_TAMPER_OPEN || c == ZONE_TAMPER_SHORT) { Metrics_Increment(&zoneTampers); }
+                Hal_LoopWake();
+            }
+        } else {
+            z->candidate = c;
+            z->count = 1;
+        }
+    }
+    Metrics_Increment(&zoneScans);
+}
+
+static void scanTimerCallback(void* arg)
+{
+    ZoneScan_Scan();
+}
+
+/******************************************************************
+ *
+ * Set up the supervised zones and start the scan if there are any.
+ * Zones on pins without an ADC channel stay digital. Returns true if
+ * any zone is supervised.
+ *
+*******************************************************************/
+bool ZoneScan_Initialise(const gpio_num_t pins[], int numZones)
+{
+    bool any = false;
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        SupervisedZone* z = &zones[i];
+        z->supervised = false;
+        if (!config.supervisedZones || i >= numZones || !config.inputs[i].active) { continue; }
+        if (!Hal_AdcConfig(pins[i])) {
+            ESP_LOGW(TAG, "Input %d (%s) is on GPIO %d which has no ADC channel, it won't be supervised.",
+                i, config.inputs[i].descriptiveName, pins[i]);
+            continue;
+        }
+        z->pin = pins[i];
+        ZoneScan_BuildTable(&z->table, config.eolPullUpOhms, config.eolOhms, config.eolAlarmOhms, config.inputs[i].normallyClosed);
+
+        // Start from the current reading rather than confirming it
+        int raw = Hal_AdcRead(z->pin);
+        ZoneCondition c = raw < 0 ? ZONE_NORMAL : ZoneScan_Classify(&z->table, raw);
+        atomic_store(&z->condition, c);
+        atomic_store(&z->lastRaw, raw);
+        z->candidate = c;
+        z->count = 0;
+        z->supervised = true;
+        any = true;
+        ESP_LOGI(TAG, "Input %d (%s) supervised, bands %d/%d/%d, reading %d (%s).", i, config.inputs[i].descriptiveName,
+            z->table.threshold[0], z->table.threshold[1], z->table.threshold[2], raw, ZoneScan_ConditionName(c));
+    }
+    if (!any) { return false; }
+
+    Metrics_Register(&zoneScans);
+    Metrics_Register(&zoneAdcErrors);
+    Metrics_Register(&zoneTampers);
+    scanTimer = Hal_TimerCreate("zoneScan", scanTimerCallback, NULL);
+    if (scanTimer != NULL) { Hal_TimerStartPeriodic(scanTimer, ZONE_SCAN_PERIOD_US); }
+    return true;
+}
+
+bool ZoneScan_IsSupervised(int zone)
+{
+    return zone >= 0 && zone < NUM_INPUTS && zones[zone].supervised;
+}
+
+ZoneCondition ZoneScan_Condition(int zone)
+{
+    if (!ZoneScan_IsSupervised(zone)) { return ZONE_NORMAL; }
+    return (ZoneCondition)atomic_load(&zones[zone].condition);
+}
+
+int ZoneScan_LastRaw(int zone)
+{
+    if (!ZoneScan_IsSupervised(zone)) { return -1; }
+    return atomic_load(&zones[zone].lastRaw);
+}
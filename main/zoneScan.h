@@ -0,0 +1,59 @@
+/* MQTT Alarm Controller: Supervised zones
+
+   Optional end of line (EOL) resistor supervision. Each supervised zone
+   is read by the ADC on a fixed scan schedule instead of as a digital
+   input, and its voltage is classified as normal, alarm, tamper open
+   (cut wire) or tamper short.
+
+   Copyright 2024 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#ifndef __ZONESCAN_H__
+#define __ZONESCAN_H__
+
+#include <stdbool.h>
+#include "inttypes.h"
+#include "driver/gpio.h"
+
+#define ZONE_SCAN_PERIOD_US 5000        // Every supervised zone is read at 200 Hz
+#define ZONE_SCAN_CONFIRM 4             // Consecutive matching reads before a condition is accepted
+#define ZONE_ADC_FULL_SCALE 4095        // 12 bit reads
+
+typedef enum {
+    ZONE_NORMAL = 0,
+    ZONE_ALARM = 1,
+    ZONE_TAMPER_OPEN = 2,
+    ZONE_TAMPER_SHORT = 3,
+} ZoneCondition;
+
+// Classification bands for one zone. A reading below threshold[0] is
+// band 0, at or above threshold[2] is band 3; condition[] maps each band.
+typedef struct {
+    uint16_t threshold[3];
+    uint8_t condition[4];
+} EolTable;
+
+void ZoneScan_BuildTable(EolTable* table, int pullUpOhms, int eolOhms, int alarmOhms, bool normallyClosed);
+ZoneCondition ZoneScan_Classify(const EolTable* table, int raw);
+const char* ZoneScan_ConditionName(ZoneCondition condition);
+
+bool ZoneScan_Initialise(const gpio_num_t pins[], int numZones);
+void ZoneScan_Scan(void);
+bool ZoneScan_IsSupervised(int zone);
+ZoneCondition ZoneScan_Condition(int zone);
+int ZoneScan_LastRaw(int zone);
+
+#endif // #ifndef __ZONESCAN_H__
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""Decode an AlarmController flight recorder dump.
+
+The dump is fetched from the device either over HTTP:
+
+    curl -o recorder.bin http://<controller>/recorder
+
+or over MQTT by publishing "dump_recorder" to
+homeassistant/sensor/<Name>/diagnostics/command and saving the binary
+payload published to homeassistant/sensor/<Name>/diagnostics/recorder.
+
+Event names and argument descriptions are read from the FlightRecorderEvent
+enum in main/flightRecorder.h, so the decoder never gets out of step with the
+firmware.
+"""
+
+import argparse
+import os
+import re
+import socket
+import struct
+import sys
+
+HEADER = struct.Struct("<IHHII")
+RECORD = struct.Struct("<IHBBii")
+MAGIC = 0x46524543
+
+DEFAULT_HEADER = os.path.join(os.path.dirname(__file__), "..", "main", "flightRecorder.h")
+
+
+def load_events(header_path):
+    """Return {id: (name, comment)} parsed from the FlightRecorderEvent enum."""
+    with open(header_path) as f:
+        text = f.read()
+    body = re.search(r"typedef enum \{(.*?)\} FlightRecorderEvent;", text, re.S).group(1)
+    events = {}
+    for m in re.finditer(r"(FR_\w+)\s*=\s*(\d+),?[ \t]*(?://\s*(.*))?", body):
+        events[int(m.group(2))] = (m.group(1), (m.group(3) or "").strip())
+    return events
+
+
+def format_args(name, arg0, arg1):
+    if name == "FR_ETH_GOT_IP":
+        return socket.inet_ntoa(struct.pack("<i", arg0))
+    return "arg0=%d arg1=%d" % (arg0, arg1)
+
+
+def decode(data, events):
+    magic, version, record_size, count, boot_count = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise SystemExit("Not a flight recorder dump (bad magic 0x%08x)" % magic)
+    if record_size != RECORD.size:
+        raise SystemExit("Unsupported record size %d (version %d)" % (record_size, version))
+    print("Flight recorder dump v%d, boot count %d, %d records" % (version, boot_count, count))
+
+    # Timestamps are the low 32 bits of esp_timer_get_time(), unwrap them within each boot
+    last_boot, last_raw, epoch = None, 0, 0
+    for i in range(count):
+        ts, event, boot, _, arg0, arg1 = RECORD.unpack_from(data, HEADER.size + i * RECORD.size)
+        if event == 0:
+            continue
+        if boot != last_boot:
+            last_boot, last_raw, epoch = boot, ts, 0
+        elif ts < last_raw:
+            epoch += 1 << 32
+        last_raw = ts
+        name, comment = events.get(event, ("FR_UNKNOWN_%d" % event, ""))
+        line = "boot %3d %14.6f  %-22s %s" % (boot, (epoch + ts) / 1e6, name, format_args(name, arg0, arg1))
+        if comment:
+            line += "    (%s)" % comment
+        print(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("dump", help="binary dump file, or - for stdin")
+    parser.add_argument("--header", default=DEFAULT_HEADER, help="path to flightRecorder.h")
+    args = parser.parse_args()
+
+    data = sys.stdin.buffer.read() if args.dump == "-" else open(args.dump, "rb").read()
+    decode(data, load_events(args.header))
+
+
+if __name__ == "__main__":
+    main()
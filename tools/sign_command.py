@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+"""Sign an AlarmController diagnostics command.
+
+The commands that can reflash the controller or drop its broker
+connection, "ota" and "stress_reconnect", are only carried out with the
+time and an HMAC-SHA256 keyed with the controller's httpApiToken
+appended. Sign one and publish it to
+homeassistant/sensor/<Name>/diagnostics/command:
+
+    mosquitto_pub -h <broker> -t 'homeassistant/sensor/<Name>/diagnostics/command' \\
+        -m "$(tools/sign_command.py -k <token> ota https://host/alarm.bin <sha256>)"
+
+A signed command is only taken within five minutes of its time, by the
+controller's clock, and only once.
+"""
+
+import argparse
+import hashlib
+import hmac
+import time
+
+
+def sign(token, command, now=None):
+    """Return command with its time and HMAC appended."""
+    signed = "%s %d" % (command, int(time.time() if now is None else now))
+    mac = hmac.new(token.encode(), signed.encode(), hashlib.sha256).hexdigest()
+    return "%s %s" % (signed, mac)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-k", "--token", required=True, help="the controller's httpApiToken")
+    parser.add_argument("command", nargs="+", help="the command and its arguments")
+    args = parser.parse_args()
+    print(sign(args.token, " ".join(args.command)))
+
+
+if __name__ == "__main__":
+    main()
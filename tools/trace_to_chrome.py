@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Convert an AlarmController trace capture to Chrome/Perfetto trace JSON.
+
+Start a capture by publishing "trace_start" to
+homeassistant/sensor/<Name>/diagnostics/command (or typing "t" on the
+console), exercise the controller, then publish "trace_dump" (or type "d").
+Save the parts published to homeassistant/sensor/<Name>/diagnostics/trace in
+order, or the serial console log, and convert it:
+
+    mosquitto_sub -h <broker> -t 'homeassistant/sensor/<Name>/diagnostics/trace' -C <parts> > trace.txt
+    tools/trace_to_chrome.py trace.txt -o trace.json
+
+Open trace.json in chrome://tracing or https://ui.perfetto.dev. Each
+FreeRTOS task is a thread, and the core each event ran on is in its args
+(unpinned tasks can begin a span on one core and end it on the other).
+"""
+
+import argparse
+import json
+import re
+import sys
+
+EVENT = re.compile(r"([BEi]),(\d+),(\d+),(\d+),([^,]+),(-?\d+)\s*$")
+TASK = re.compile(r"T,(\d+),(.*?)\s*$")
+HEADER = re.compile(r"# alarmtrace v(\d+) (\d+)")
+
+
+def convert(lines):
+    """Return the trace event list for the last capture found in lines."""
+    tasks, events = {}, []
+    for line in lines:
+        # Console lines may carry a log prefix, so match anywhere in the line
+        m = HEADER.search(line)
+        if m:
+            if m.group(1) != "1":
+                raise SystemExit("Unsupported trace version %s" % m.group(1))
+            tasks, events = {}, []
+            continue
+        m = EVENT.search(line)
+        if m:
+            ph, ts, task, core, name, arg = m.groups()
+            e = {"ph": ph, "ts": int(ts), "pid": 1, "tid": int(task), "name": name, "args": {"core": int(core)}}
+            if ph == "i":
+                e["s"] = "t"
+                e["args"]["arg"] = int(arg)
+            events.append(e)
+            continue
+        m = TASK.search(line)
+        if m:
+            tasks[int(m.group(1))] = m.group(2)
+
+    meta = [{"ph": "M", "name": "process_name", "pid": 1, "args": {"name": "AlarmController"}}]
+    for tid in sorted({e["tid"] for e in events}):
+        name = tasks.get(tid, "task %d" % tid)
+        meta.append({"ph": "M", "name": "thread_name", "pid": 1, "tid": tid, "args": {"name": name}})
+    return meta + events
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("capture", nargs="?", help="trace text or console log (default stdin)")
+    parser.add_argument("-o", "--output", help="output JSON file (default stdout)")
+    args = parser.parse_args()
+
+    src = open(args.capture) if args.capture else sys.stdin
+    with src:
+        trace = {"traceEvents": convert(src), "displayTimeUnit": "ms"}
+    if not trace["traceEvents"]:
+        raise SystemExit("No trace events found")
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()